@@ -0,0 +1,172 @@
+/*!
+**************************************************************************************
+ * \file BatchScheduler.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "BatchScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+BatchScheduler::BatchScheduler(int workers, int cores)
+: m_workers(default_workers(workers)), m_budget(cores, m_workers)
+{
+	m_next = 0;
+
+	m_threading_policy.set_core_budget(&m_budget, max(1, m_budget.cores() / m_workers));
+}
+
+int BatchScheduler::default_workers(int workers)
+{
+	return (workers > 0) ? workers : max(1, int(thread::hardware_concurrency()) / 4);
+}
+
+size_t BatchScheduler::add_job(string pth_input_media, string pth_output_media)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	st_job_status job;
+	job.m_input_path      = pth_input_media;
+	job.m_output_path     = pth_output_media;
+	job.m_state           = JOB_PENDING;
+	job.m_duration        = 0.0;
+	job.m_elapsed_seconds = 0.0;
+
+	m_v_jobs.push_back(job);
+	return m_v_jobs.size() - 1;
+}
+
+void BatchScheduler::set_configuration(const function<void(VideoTranscoder&)>& configure)
+{
+	m_configure = configure;
+}
+
+void BatchScheduler::set_threading_policy(const ThreadingPolicy& policy)
+{
+	m_threading_policy = policy;
+	m_threading_policy.set_core_budget(&m_budget, max(1, m_budget.cores() / m_workers));
+}
+
+void BatchScheduler::run()
+{
+	probe_jobs();
+
+	vector<thread> v_workers;
+	for(int w=0; w<m_workers; w++)
+		v_workers.push_back(thread(&BatchScheduler::worker, this));
+
+	for(size_t w=0; w<v_workers.size(); w++)
+		v_workers[w].join();
+}
+
+vector<BatchScheduler::st_job_status> BatchScheduler::status() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_v_jobs;
+}
+
+void BatchScheduler::probe_jobs()
+{
+	VideoTranscoder prober;
+	vector<pair<double, size_t> > v_durations;
+
+	size_t numof_jobs;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		numof_jobs = m_v_jobs.size();
+	}
+
+	for(size_t j=0; j<numof_jobs; j++)
+	{
+		string pth_input_media;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			if(m_v_jobs[j].m_state != JOB_PENDING) continue;
+			pth_input_media = m_v_jobs[j].m_input_path;
+		}
+
+		double duration = 0.0;
+		string error;
+
+		try
+		{
+			duration = prober.probe_duration(pth_input_media);
+		}
+		catch(exception& e)
+		{
+			error = e.what();
+		}
+
+		lock_guard<mutex> lock(m_mutex);
+		m_v_jobs[j].m_duration = duration;
+
+		if(error.empty())
+		{
+			v_durations.push_back(make_pair(duration, j));
+		}
+		else
+		{
+			m_v_jobs[j].m_state = JOB_FAILED;
+			m_v_jobs[j].m_error = error;
+		}
+	}
+
+	// Longest processing time first, ties keep the order the jobs were added in.
+	stable_sort(v_durations.begin(), v_durations.end(),
+				[](const pair<double, size_t>& a, const pair<double, size_t>& b) { return a.first > b.first; });
+
+	lock_guard<mutex> lock(m_mutex);
+	m_v_order.clear();
+	for(size_t j=0; j<v_durations.size(); j++)
+		m_v_order.push_back(v_durations[j].second);
+
+	m_next = 0;
+}
+
+void BatchScheduler::worker()
+{
+	VideoTranscoder transcoder;
+
+	while(true)
+	{
+		size_t j;
+		string pth_input_media, pth_output_media;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			if(m_next >= m_v_order.size()) return;
+
+			j = m_v_order[m_next++];
+			m_v_jobs[j].m_state = JOB_RUNNING;
+			pth_input_media     = m_v_jobs[j].m_input_path;
+			pth_output_media    = m_v_jobs[j].m_output_path;
+		}
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		string error;
+
+		try
+		{
+			transcoder.set_threading_policy(m_threading_policy);
+			if(m_configure) m_configure(transcoder);
+
+			transcoder.transcode(pth_input_media, pth_output_media);
+		}
+		catch(exception& e)
+		{
+			error = e.what();
+		}
+
+		// Close the output right away instead of when the worker's next job starts.
+		transcoder.reset();
+
+		lock_guard<mutex> lock(m_mutex);
+		m_v_jobs[j].m_elapsed_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		m_v_jobs[j].m_state           = error.empty() ? JOB_DONE : JOB_FAILED;
+		m_v_jobs[j].m_error           = error;
+	}
+}
@@ -0,0 +1,80 @@
+/*!
+**************************************************************************************
+ * \file BatchScheduler.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ThreadingPolicy.h"
+#include "VideoTranscoder.h"
+
+/*!
+ * Runs a queue of input to output jobs on a fixed number of workers. Every worker keeps one
+ * VideoTranscoder which is reset between its jobs. Jobs are started longest first, by the duration
+ * probed from each input, so a long job doesn't end up alone at the tail of the batch. All workers
+ * take their codec threads from one core budget which covers the whole machine.
+ *
+ * status() may be called from another thread while run() is in progress.
+ */
+
+class BatchScheduler
+{
+public:
+
+	enum e_job_state
+	{
+		JOB_PENDING,
+		JOB_RUNNING,
+		JOB_DONE,
+		JOB_FAILED
+	};
+
+	struct st_job_status
+	{
+		string m_input_path;
+		string m_output_path;
+		e_job_state m_state;
+		double m_duration;           // Probed media duration in seconds.
+		double m_elapsed_seconds;    // Wall clock time of the transcode.
+		string m_error;
+	};
+
+	explicit BatchScheduler(int workers = 0, int cores = 0);
+
+	size_t add_job(string pth_input_media, string pth_output_media);
+
+	//! Called on every worker's transcoder before each of its jobs, e.g. to choose an execution mode.
+	void set_configuration(const function<void(VideoTranscoder&)>& configure);
+	void set_threading_policy(const ThreadingPolicy& policy);
+
+	void run();
+
+	vector<st_job_status> status() const;
+
+private:
+
+	void probe_jobs();
+	void worker();
+
+	static int default_workers(int workers);
+
+	int m_workers;
+	CoreBudget m_budget;
+	ThreadingPolicy m_threading_policy;
+	function<void(VideoTranscoder&)> m_configure;
+
+	vector<st_job_status> m_v_jobs;
+	vector<size_t> m_v_order;
+	size_t m_next;
+
+	mutable mutex m_mutex;
+};
@@ -0,0 +1,108 @@
+/*!
+**************************************************************************************
+ * \file BoundedQueue.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/*!
+ * Fixed capacity single-producer/single-consumer ring buffer which connects two stages of the
+ * transcoding pipeline. Producer and consumer only synchronize through the head and tail indices,
+ * so no lock is taken on the hot path. push() waits while the ring is full, which is the backpressure
+ * that keeps a fast stage from running away from a slow one, and pop() waits while it is empty.
+ * abort() wakes both sides up and makes every further call fail.
+ */
+
+template <typename T>
+class BoundedQueue
+{
+public:
+
+	explicit BoundedQueue(size_t capacity)
+	: m_v_ring(capacity + 1), m_head(0), m_tail(0), m_aborted(false) {}
+
+	bool push(const T& item)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		size_t next = advance(tail);
+
+		unsigned int spins = 0;
+		while(next == m_head.load(std::memory_order_acquire))
+		{
+			if(m_aborted.load(std::memory_order_acquire)) return false;
+			backoff(spins);
+		}
+
+		m_v_ring[tail] = item;
+		m_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T& item)
+	{
+		unsigned int spins = 0;
+		while(not try_pop(item))
+		{
+			if(m_aborted.load(std::memory_order_acquire)) return false;
+			backoff(spins);
+		}
+
+		return true;
+	}
+
+	bool try_pop(T& item)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if(head == m_tail.load(std::memory_order_acquire)) return false;
+
+		item = m_v_ring[head];
+		m_head.store(advance(head), std::memory_order_release);
+		return true;
+	}
+
+	void abort() { m_aborted.store(true, std::memory_order_release); }
+	bool aborted() const { return m_aborted.load(std::memory_order_acquire); }
+
+	size_t capacity() const { return m_v_ring.size() - 1; }
+
+	size_t size() const
+	{
+		size_t head = m_head.load(std::memory_order_acquire);
+		size_t tail = m_tail.load(std::memory_order_acquire);
+		return (tail + m_v_ring.size() - head) % m_v_ring.size();
+	}
+
+private:
+
+	size_t advance(size_t index) const { return (index + 1) % m_v_ring.size(); }
+
+	static void backoff(unsigned int& spins)
+	{
+		// Spin shortly, then give the core away. Stages are long running so a sleeping waiter is
+		// cheaper than a burning one once the queue stays full or empty for a while.
+		spins++;
+		if(spins < 64)        return;
+		else if(spins < 1024) std::this_thread::yield();
+		else                  std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+
+	std::vector<T> m_v_ring;
+
+	// Producer and consumer indices are kept on separate cache lines.
+	char m_head_padding[64];
+	std::atomic<size_t> m_head;
+	char m_tail_padding[64];
+	std::atomic<size_t> m_tail;
+	char m_abort_padding[64];
+	std::atomic<bool> m_aborted;
+};
@@ -0,0 +1,623 @@
+/*!
+**************************************************************************************
+ * \file FrameKernels.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "FrameKernels.h"
+
+extern "C"
+{
+#include "libavutil/cpu.h"
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FRAME_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*blend_row_fn)(uint8_t* dst, const uint8_t* color, const uint8_t* alpha, int n);
+typedef void (*affine_row_fn)(uint8_t* data, int n, int32_t gain, int32_t offset);
+typedef void (*block_means_fn)(const uint8_t* data, int stride, int numof_blocks, uint8_t* means);
+typedef int (*max_difference_fn)(const uint8_t* a, const uint8_t* b, int n);
+
+/**********************/
+/* Scalar row kernels */
+/**********************/
+
+// (dst * (255 - alpha) + color * alpha) / 255, rounded, without a division.
+static inline uint8_t blend_pixel(uint8_t dst, uint8_t color, uint8_t alpha)
+{
+	unsigned int t = dst * (255u - alpha) + color * unsigned(alpha) + 128;
+	return uint8_t((t + (t >> 8)) >> 8);
+}
+
+// (value * gain + offset) / 256, clamped to a byte. gain and offset are in 1/256 units.
+static inline uint8_t affine_pixel(uint8_t value, int32_t gain, int32_t offset)
+{
+	int32_t t = (value * gain + offset) >> 8;
+	return uint8_t(std::min(255, std::max(0, t)));
+}
+
+static void blend_row_scalar(uint8_t* dst, const uint8_t* color, const uint8_t* alpha, int n)
+{
+	for(int i=0; i<n; i++)
+		dst[i] = blend_pixel(dst[i], color[i], alpha[i]);
+}
+
+static void affine_row_scalar(uint8_t* data, int n, int32_t gain, int32_t offset)
+{
+	for(int i=0; i<n; i++)
+		data[i] = affine_pixel(data[i], gain, offset);
+}
+
+// Rounded means of numof_blocks 8x8 blocks side by side.
+static void block_means_scalar(const uint8_t* data, int stride, int numof_blocks, uint8_t* means)
+{
+	for(int b=0; b<numof_blocks; b++)
+	{
+		unsigned int sum = 0;
+		for(int r=0; r<8; r++)
+			for(int i=0; i<8; i++)
+				sum += data[r * stride + 8 * b + i];
+
+		means[b] = uint8_t((sum + 32) >> 6);
+	}
+}
+
+static int max_difference_scalar(const uint8_t* a, const uint8_t* b, int n)
+{
+	int difference = 0;
+	for(int i=0; i<n; i++)
+		difference = std::max(difference, std::abs(int(a[i]) - int(b[i])));
+
+	return difference;
+}
+
+#ifdef FRAME_KERNELS_X86
+
+/**********************/
+/* SSE4.1 row kernels */
+/**********************/
+
+__attribute__((target("sse4.1")))
+static inline __m128i blend_words_sse4(__m128i dst, __m128i color, __m128i alpha)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(dst, _mm_sub_epi16(_mm_set1_epi16(255), alpha)), _mm_mullo_epi16(color, alpha));
+	t = _mm_add_epi16(t, _mm_set1_epi16(128));
+
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse4.1")))
+static void blend_row_sse4(uint8_t* dst, const uint8_t* color, const uint8_t* alpha, int n)
+{
+	int i = 0;
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i c = _mm_loadu_si128((const __m128i*)(color + i));
+		__m128i a = _mm_loadu_si128((const __m128i*)(alpha + i));
+
+		__m128i lo = blend_words_sse4(_mm_cvtepu8_epi16(d), _mm_cvtepu8_epi16(c), _mm_cvtepu8_epi16(a));
+		__m128i hi = blend_words_sse4(_mm_cvtepu8_epi16(_mm_srli_si128(d, 8)), _mm_cvtepu8_epi16(_mm_srli_si128(c, 8)),
+									  _mm_cvtepu8_epi16(_mm_srli_si128(a, 8)));
+
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	blend_row_scalar(dst + i, color + i, alpha + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i affine_dwords_sse4(__m128i value, __m128i gain, __m128i offset)
+{
+	return _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(value, gain), offset), 8);
+}
+
+__attribute__((target("sse4.1")))
+static void affine_row_sse4(uint8_t* data, int n, int32_t gain, int32_t offset)
+{
+	const __m128i v_gain   = _mm_set1_epi32(gain);
+	const __m128i v_offset = _mm_set1_epi32(offset);
+
+	int i = 0;
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+
+		__m128i a0 = affine_dwords_sse4(_mm_cvtepu8_epi32(v), v_gain, v_offset);
+		__m128i a1 = affine_dwords_sse4(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), v_gain, v_offset);
+		__m128i a2 = affine_dwords_sse4(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8)), v_gain, v_offset);
+		__m128i a3 = affine_dwords_sse4(_mm_cvtepu8_epi32(_mm_srli_si128(v, 12)), v_gain, v_offset);
+
+		// Signed saturation to words, then unsigned saturation to bytes, clamps to 0-255.
+		__m128i w0 = _mm_packs_epi32(a0, a1);
+		__m128i w1 = _mm_packs_epi32(a2, a3);
+		_mm_storeu_si128((__m128i*)(data + i), _mm_packus_epi16(w0, w1));
+	}
+
+	affine_row_scalar(data + i, n - i, gain, offset);
+}
+
+__attribute__((target("sse4.1")))
+static void block_means_sse4(const uint8_t* data, int stride, int numof_blocks, uint8_t* means)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	int b = 0;
+	for(; b + 2 <= numof_blocks; b += 2)
+	{
+		// Each half of the SAD against zero sums the eight pixels of one block row.
+		__m128i sum = zero;
+		for(int r=0; r<8; r++)
+			sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(data + r * stride + 8 * b)), zero));
+
+		means[b]     = uint8_t((_mm_extract_epi32(sum, 0) + 32) >> 6);
+		means[b + 1] = uint8_t((_mm_extract_epi32(sum, 2) + 32) >> 6);
+	}
+
+	block_means_scalar(data + 8 * b, stride, numof_blocks - b, means + b);
+}
+
+__attribute__((target("sse4.1")))
+static int max_difference_sse4(const uint8_t* a, const uint8_t* b, int n)
+{
+	__m128i m = _mm_setzero_si128();
+
+	int i = 0;
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		m = _mm_max_epu8(m, _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va)));
+	}
+
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 8));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 4));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 2));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 1));
+
+	return std::max(_mm_cvtsi128_si32(m) & 0xff, max_difference_scalar(a + i, b + i, n - i));
+}
+
+/********************/
+/* AVX2 row kernels */
+/********************/
+
+__attribute__((target("avx2")))
+static inline __m256i blend_words_avx2(__m256i dst, __m256i color, __m256i alpha)
+{
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(dst, _mm256_sub_epi16(_mm256_set1_epi16(255), alpha)),
+								 _mm256_mullo_epi16(color, alpha));
+	t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void blend_row_avx2(uint8_t* dst, const uint8_t* color, const uint8_t* alpha, int n)
+{
+	int i = 0;
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(color + i));
+		__m256i a = _mm256_loadu_si256((const __m256i*)(alpha + i));
+
+		__m256i lo = blend_words_avx2(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(d)),
+									  _mm256_cvtepu8_epi16(_mm256_castsi256_si128(c)),
+									  _mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)));
+		__m256i hi = blend_words_avx2(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(d, 1)),
+									  _mm256_cvtepu8_epi16(_mm256_extracti128_si256(c, 1)),
+									  _mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)));
+
+		// Packing works per 128-bit lane, the permute puts the quarters back in order.
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+		_mm256_storeu_si256((__m256i*)(dst + i), packed);
+	}
+
+	blend_row_scalar(dst + i, color + i, alpha + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i affine_dwords_avx2(const uint8_t* data, __m256i gain, __m256i offset)
+{
+	__m256i value = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)data));
+	return _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(value, gain), offset), 8);
+}
+
+__attribute__((target("avx2")))
+static void affine_row_avx2(uint8_t* data, int n, int32_t gain, int32_t offset)
+{
+	const __m256i v_gain   = _mm256_set1_epi32(gain);
+	const __m256i v_offset = _mm256_set1_epi32(offset);
+	const __m256i v_order  = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	int i = 0;
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i a0 = affine_dwords_avx2(data + i,      v_gain, v_offset);
+		__m256i a1 = affine_dwords_avx2(data + i + 8,  v_gain, v_offset);
+		__m256i a2 = affine_dwords_avx2(data + i + 16, v_gain, v_offset);
+		__m256i a3 = affine_dwords_avx2(data + i + 24, v_gain, v_offset);
+
+		__m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(a0, a1), _mm256_packs_epi32(a2, a3));
+		_mm256_storeu_si256((__m256i*)(data + i), _mm256_permutevar8x32_epi32(packed, v_order));
+	}
+
+	affine_row_scalar(data + i, n - i, gain, offset);
+}
+
+__attribute__((target("avx2")))
+static void block_means_avx2(const uint8_t* data, int stride, int numof_blocks, uint8_t* means)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	int b = 0;
+	for(; b + 4 <= numof_blocks; b += 4)
+	{
+		__m256i sum = zero;
+		for(int r=0; r<8; r++)
+			sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(data + r * stride + 8 * b)), zero));
+
+		means[b]     = uint8_t((_mm256_extract_epi32(sum, 0) + 32) >> 6);
+		means[b + 1] = uint8_t((_mm256_extract_epi32(sum, 2) + 32) >> 6);
+		means[b + 2] = uint8_t((_mm256_extract_epi32(sum, 4) + 32) >> 6);
+		means[b + 3] = uint8_t((_mm256_extract_epi32(sum, 6) + 32) >> 6);
+	}
+
+	block_means_scalar(data + 8 * b, stride, numof_blocks - b, means + b);
+}
+
+__attribute__((target("avx2")))
+static int max_difference_avx2(const uint8_t* a, const uint8_t* b, int n)
+{
+	__m256i m = _mm256_setzero_si256();
+
+	int i = 0;
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		m = _mm256_max_epu8(m, _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va)));
+	}
+
+	__m128i h = _mm_max_epu8(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+	h = _mm_max_epu8(h, _mm_srli_si128(h, 8));
+	h = _mm_max_epu8(h, _mm_srli_si128(h, 4));
+	h = _mm_max_epu8(h, _mm_srli_si128(h, 2));
+	h = _mm_max_epu8(h, _mm_srli_si128(h, 1));
+
+	return std::max(_mm_cvtsi128_si32(h) & 0xff, max_difference_scalar(a + i, b + i, n - i));
+}
+
+#endif
+
+static blend_row_fn blend_row()
+{
+	static const blend_row_fn kernel = []() -> blend_row_fn
+	{
+#ifdef FRAME_KERNELS_X86
+		int flags = av_get_cpu_flags();
+		if(flags & AV_CPU_FLAG_AVX2) return blend_row_avx2;
+		if(flags & AV_CPU_FLAG_SSE4) return blend_row_sse4;
+#endif
+		return blend_row_scalar;
+	}();
+
+	return kernel;
+}
+
+static affine_row_fn affine_row()
+{
+	static const affine_row_fn kernel = []() -> affine_row_fn
+	{
+#ifdef FRAME_KERNELS_X86
+		int flags = av_get_cpu_flags();
+		if(flags & AV_CPU_FLAG_AVX2) return affine_row_avx2;
+		if(flags & AV_CPU_FLAG_SSE4) return affine_row_sse4;
+#endif
+		return affine_row_scalar;
+	}();
+
+	return kernel;
+}
+
+static block_means_fn block_means()
+{
+	static const block_means_fn kernel = []() -> block_means_fn
+	{
+#ifdef FRAME_KERNELS_X86
+		int flags = av_get_cpu_flags();
+		if(flags & AV_CPU_FLAG_AVX2) return block_means_avx2;
+		if(flags & AV_CPU_FLAG_SSE4) return block_means_sse4;
+#endif
+		return block_means_scalar;
+	}();
+
+	return kernel;
+}
+
+static max_difference_fn max_difference()
+{
+	static const max_difference_fn kernel = []() -> max_difference_fn
+	{
+#ifdef FRAME_KERNELS_X86
+		int flags = av_get_cpu_flags();
+		if(flags & AV_CPU_FLAG_AVX2) return max_difference_avx2;
+		if(flags & AV_CPU_FLAG_SSE4) return max_difference_sse4;
+#endif
+		return max_difference_scalar;
+	}();
+
+	return kernel;
+}
+
+/************************/
+/* Frame format helpers */
+/************************/
+
+static bool planar_yuv8(AVPixelFormat format)
+{
+	switch(format)
+	{
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+	case AV_PIX_FMT_YUV422P:
+	case AV_PIX_FMT_YUVJ422P:
+	case AV_PIX_FMT_YUV444P:
+	case AV_PIX_FMT_YUVJ444P:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool full_range(AVPixelFormat format)
+{
+	return format == AV_PIX_FMT_YUVJ420P or format == AV_PIX_FMT_YUVJ422P or format == AV_PIX_FMT_YUVJ444P;
+}
+
+// Chroma rows below the luma rows [first_row, last_row) of a band.
+static void chroma_rows(const st_frame_view& frame, int first_row, int last_row, int& first_chroma_row, int& last_chroma_row)
+{
+	int step = 1 << frame.m_log2_chroma_h;
+
+	first_chroma_row = first_row >> frame.m_log2_chroma_h;
+	last_chroma_row  = std::min(frame.m_planes[1].m_height, (last_row + step - 1) >> frame.m_log2_chroma_h);
+}
+
+static uint8_t clamp_byte(double value)
+{
+	return uint8_t(std::min(255.0, std::max(0.0, floor(value + 0.5))));
+}
+
+/******************/
+/* WatermarkBlend */
+/******************/
+
+WatermarkBlend::WatermarkBlend(const uint8_t* rgba, int width, int height, int stride, int x, int y, double opacity)
+{
+	opacity = std::min(1.0, std::max(0.0, opacity));
+
+	convert(rgba, width, height, stride, x, y, opacity, false);
+	convert(rgba, width, height, stride, x, y, opacity, true);
+}
+
+bool WatermarkBlend::supports(AVPixelFormat format) const
+{
+	return planar_yuv8(format);
+}
+
+void WatermarkBlend::convert(const uint8_t* rgba, int width, int height, int stride, int x, int y, double opacity, bool full)
+{
+	int n = width * height;
+	std::vector<double> v_y(n), v_u(n), v_v(n), v_a(n);
+
+	for(int j=0; j<height; j++)
+	{
+		for(int i=0; i<width; i++)
+		{
+			const uint8_t* pixel = rgba + j * stride + 4 * i;
+			double r = pixel[0], g = pixel[1], b = pixel[2];
+			int k = j * width + i;
+
+			// BT.601, in the range the frame's pixel format uses.
+			if(full)
+			{
+				v_y[k] =         0.299    * r + 0.587    * g + 0.114    * b;
+				v_u[k] = 128.0 - 0.168736 * r - 0.331264 * g + 0.5      * b;
+				v_v[k] = 128.0 + 0.5      * r - 0.418688 * g - 0.081312 * b;
+			}
+			else
+			{
+				v_y[k] =  16.0 + ( 65.481 * r + 128.553 * g +  24.966 * b) / 255.0;
+				v_u[k] = 128.0 + (-37.797 * r -  74.203 * g + 112.0   * b) / 255.0;
+				v_v[k] = 128.0 + (112.0   * r -  93.786 * g -  18.214 * b) / 255.0;
+			}
+
+			v_a[k] = pixel[3] * opacity;
+		}
+	}
+
+	st_layer& luma = m_luma[full];
+	luma.m_x      = x;
+	luma.m_y      = y;
+	luma.m_width  = width;
+	luma.m_height = height;
+	luma.m_v_color.resize(n);
+	luma.m_v_alpha.resize(n);
+
+	for(int k=0; k<n; k++)
+	{
+		luma.m_v_color[k] = clamp_byte(v_y[k]);
+		luma.m_v_alpha[k] = clamp_byte(v_a[k]);
+	}
+
+	static const int shifts[3][2] = {{0, 0}, {1, 0}, {1, 1}};
+
+	for(int s=0; s<3; s++)
+	{
+		int shift_w = shifts[s][0];
+		int shift_h = shifts[s][1];
+		int chroma_width  = (width  + (1 << shift_w) - 1) >> shift_w;
+		int chroma_height = (height + (1 << shift_h) - 1) >> shift_h;
+
+		for(int p=0; p<2; p++)
+		{
+			st_layer& layer = m_chroma[full][s][p];
+			layer.m_x      = x >> shift_w;
+			layer.m_y      = y >> shift_h;
+			layer.m_width  = chroma_width;
+			layer.m_height = chroma_height;
+			layer.m_v_color.resize(chroma_width * chroma_height);
+			layer.m_v_alpha.resize(chroma_width * chroma_height);
+		}
+
+		for(int j=0; j<chroma_height; j++)
+		{
+			for(int i=0; i<chroma_width; i++)
+			{
+				double sum_a = 0.0, sum_u = 0.0, sum_v = 0.0;
+				int count = 0;
+
+				for(int jj=j << shift_h; jj<std::min(height, (j + 1) << shift_h); jj++)
+				{
+					for(int ii=i << shift_w; ii<std::min(width, (i + 1) << shift_w); ii++)
+					{
+						int k = jj * width + ii;
+						sum_a += v_a[k];
+						sum_u += v_u[k] * v_a[k];
+						sum_v += v_v[k] * v_a[k];
+						count++;
+					}
+				}
+
+				int c = j * chroma_width + i;
+				uint8_t alpha = clamp_byte(sum_a / count);
+
+				m_chroma[full][s][0].m_v_alpha[c] = alpha;
+				m_chroma[full][s][1].m_v_alpha[c] = alpha;
+				m_chroma[full][s][0].m_v_color[c] = (sum_a > 0.0) ? clamp_byte(sum_u / sum_a) : 128;
+				m_chroma[full][s][1].m_v_color[c] = (sum_a > 0.0) ? clamp_byte(sum_v / sum_a) : 128;
+			}
+		}
+	}
+}
+
+void WatermarkBlend::process(const st_frame_view& frame, int first_row, int last_row) const
+{
+	bool full = full_range(frame.m_format);
+	int subsampling = frame.m_log2_chroma_h ? 2 : (frame.m_log2_chroma_w ? 1 : 0);
+
+	blend_plane(frame.m_planes[0], m_luma[full], first_row, last_row);
+
+	int first_chroma_row, last_chroma_row;
+	chroma_rows(frame, first_row, last_row, first_chroma_row, last_chroma_row);
+
+	blend_plane(frame.m_planes[1], m_chroma[full][subsampling][0], first_chroma_row, last_chroma_row);
+	blend_plane(frame.m_planes[2], m_chroma[full][subsampling][1], first_chroma_row, last_chroma_row);
+}
+
+void WatermarkBlend::blend_plane(const st_frame_view::st_plane& plane, const st_layer& layer, int first_row, int last_row) const
+{
+	int row_begin = std::max(first_row, std::max(0, layer.m_y));
+	int row_end   = std::min(std::min(last_row, plane.m_height), layer.m_y + layer.m_height);
+	int col_begin = std::max(0, layer.m_x);
+	int col_end   = std::min(plane.m_width, layer.m_x + layer.m_width);
+
+	if(row_begin >= row_end or col_begin >= col_end) return;
+
+	blend_row_fn kernel = blend_row();
+
+	for(int r=row_begin; r<row_end; r++)
+	{
+		int k = (r - layer.m_y) * layer.m_width + (col_begin - layer.m_x);
+		kernel(plane.m_data + r * plane.m_stride + col_begin, &layer.m_v_color[k], &layer.m_v_alpha[k], col_end - col_begin);
+	}
+}
+
+/***************/
+/* ColorAdjust */
+/***************/
+
+ColorAdjust::ColorAdjust(double brightness, double contrast, double saturation)
+{
+	brightness = std::min(1.0, std::max(-1.0, brightness));
+	contrast   = std::min(8.0, std::max(0.0, contrast));
+	saturation = std::min(8.0, std::max(0.0, saturation));
+
+	// out = (in - 128) * gain + 128 + shift, with 128 added to round the final shift by 8 bits.
+	m_luma_gain     = int32_t(floor(contrast * 256.0 + 0.5));
+	m_luma_offset   = int32_t(floor((128.0 * (1.0 - contrast) + brightness * 255.0) * 256.0 + 0.5)) + 128;
+	m_chroma_gain   = int32_t(floor(saturation * 256.0 + 0.5));
+	m_chroma_offset = int32_t(floor(128.0 * (1.0 - saturation) * 256.0 + 0.5)) + 128;
+}
+
+bool ColorAdjust::supports(AVPixelFormat format) const
+{
+	return planar_yuv8(format);
+}
+
+void ColorAdjust::process(const st_frame_view& frame, int first_row, int last_row) const
+{
+	affine_row_fn kernel = affine_row();
+
+	const st_frame_view::st_plane& luma = frame.m_planes[0];
+	for(int r=first_row; r<std::min(last_row, luma.m_height); r++)
+		kernel(luma.m_data + r * luma.m_stride, luma.m_width, m_luma_gain, m_luma_offset);
+
+	int first_chroma_row, last_chroma_row;
+	chroma_rows(frame, first_row, last_row, first_chroma_row, last_chroma_row);
+
+	for(int p=1; p<3; p++)
+	{
+		const st_frame_view::st_plane& chroma = frame.m_planes[p];
+		for(int r=first_chroma_row; r<last_chroma_row; r++)
+			kernel(chroma.m_data + r * chroma.m_stride, chroma.m_width, m_chroma_gain, m_chroma_offset);
+	}
+}
+
+/*****************/
+/* LumaSignature */
+/*****************/
+
+bool LumaSignature::supports(AVPixelFormat format)
+{
+	return planar_yuv8(format) or format == AV_PIX_FMT_GRAY8;
+}
+
+void LumaSignature::compute(const AVFrame* frame)
+{
+	m_columns = frame->width / 8;
+	m_rows    = frame->height / 8;
+	m_v_means.resize(size_t(m_columns) * m_rows);
+
+	block_means_fn kernel = block_means();
+
+	for(int r=0; r<m_rows; r++)
+		kernel(frame->data[0] + 8 * r * frame->linesize[0], frame->linesize[0], m_columns, &m_v_means[size_t(r) * m_columns]);
+}
+
+void LumaSignature::clear()
+{
+	m_columns = 0;
+	m_rows    = 0;
+	m_v_means.clear();
+}
+
+int LumaSignature::max_difference(const LumaSignature& other) const
+{
+	if(m_v_means.empty() or m_columns != other.m_columns or m_rows != other.m_rows)
+		return -1;
+
+	return ::max_difference()(&m_v_means[0], &other.m_v_means[0], int(m_v_means.size()));
+}
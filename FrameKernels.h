@@ -0,0 +1,104 @@
+/*!
+**************************************************************************************
+ * \file FrameKernels.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+#include "FrameProcessor.h"
+
+#include <vector>
+
+/*!
+ * Reference frame processors for 8-bit planar YUV (4:2:0, 4:2:2 and 4:4:4, limited and full
+ * range). Their inner loops have SSE4.1 and AVX2 versions which are picked at run time from the
+ * CPU flags, and a scalar version which gives the same results bit for bit.
+ */
+
+/*!
+ * Alpha-blends a straight (not premultiplied) RGBA image onto every frame with its top left corner
+ * at x, y. opacity scales the image's alpha. Chroma of subsampled formats is blended with the
+ * alpha-weighted average of the covered pixels, so the image should sit on even coordinates.
+ */
+class WatermarkBlend : public FrameProcessor
+{
+public:
+
+	WatermarkBlend(const uint8_t* rgba, int width, int height, int stride, int x, int y, double opacity = 1.0);
+
+	e_access access() const { return ACCESS_EXCLUSIVE; }
+	bool supports(AVPixelFormat format) const;
+	void process(const st_frame_view& frame, int first_row, int last_row) const;
+
+private:
+
+	struct st_layer
+	{
+		int m_x;
+		int m_y;
+		int m_width;
+		int m_height;
+		std::vector<uint8_t> m_v_color;
+		std::vector<uint8_t> m_v_alpha;
+	};
+
+	void convert(const uint8_t* rgba, int width, int height, int stride, int x, int y, double opacity, bool full_range);
+	void blend_plane(const st_frame_view::st_plane& plane, const st_layer& layer, int first_row, int last_row) const;
+
+	// Indexed by range (limited, full), then by chroma subsampling (4:4:4, 4:2:2, 4:2:0) and plane.
+	st_layer m_luma[2];
+	st_layer m_chroma[2][3][2];
+};
+
+/*!
+ * Mean luma of every whole 8x8 block of a frame, a signature which two frames of the same size can
+ * be compared by cheaply. Block sums come from SAD instructions against zero. A change that stays
+ * within a few levels in every block is compression noise rather than a new picture.
+ */
+class LumaSignature
+{
+public:
+
+	LumaSignature() : m_columns(0), m_rows(0) {}
+
+	static bool supports(AVPixelFormat format);
+
+	void compute(const AVFrame* frame);
+	void clear();
+
+	//! Largest change of a block's mean, -1 if the signatures are of different sizes or empty.
+	int max_difference(const LumaSignature& other) const;
+
+private:
+
+	int m_columns;
+	int m_rows;
+	std::vector<uint8_t> m_v_means;
+};
+
+/*!
+ * Adjusts brightness, contrast and saturation. brightness is an offset in parts of the full
+ * range (-1 to 1), contrast scales luma around mid grey and saturation scales chroma around
+ * neutral; gains are limited to 0 to 8 and a gain of 1 with no offset leaves the frame alone.
+ */
+class ColorAdjust : public FrameProcessor
+{
+public:
+
+	ColorAdjust(double brightness, double contrast, double saturation);
+
+	e_access access() const { return ACCESS_EXCLUSIVE; }
+	bool supports(AVPixelFormat format) const;
+	void process(const st_frame_view& frame, int first_row, int last_row) const;
+
+private:
+
+	int32_t m_luma_gain;
+	int32_t m_luma_offset;
+	int32_t m_chroma_gain;
+	int32_t m_chroma_offset;
+};
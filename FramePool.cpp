@@ -0,0 +1,351 @@
+/*!
+**************************************************************************************
+ * \file FramePool.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "FramePool.h"
+
+extern "C"
+{
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/samplefmt.h"
+}
+
+#include <algorithm>
+#include <cstring>
+
+// Shells beyond this many idle ones are given back to the allocator.
+static const size_t MAX_IDLE_SHELLS = 64;
+
+// Same padding and alignment libavcodec's own buffer pool uses.
+static const int BUFFER_PADDING = 16 + 64 - 1;
+
+bool FramePool::st_buffer_key::operator<(const st_buffer_key& other) const
+{
+	if(m_format != other.m_format) return m_format < other.m_format;
+	if(m_width  != other.m_width)  return m_width  < other.m_width;
+	if(m_height != other.m_height) return m_height < other.m_height;
+	return m_size < other.m_size;
+}
+
+FramePool::FramePool()
+{
+	m_state = new st_shared_state();
+	memset(&m_state->m_statistics, 0, sizeof(m_state->m_statistics));
+	m_state->m_references = 1;
+	m_state->m_closed     = false;
+}
+
+FramePool::~FramePool()
+{
+	bool last_reference = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_state->m_mutex);
+
+		for(size_t i=0; i<m_v_free_frames.size(); i++)
+			av_frame_free(&m_v_free_frames[i]);
+
+		for(size_t i=0; i<m_v_free_packets.size(); i++)
+			delete m_v_free_packets[i];
+
+		std::map<st_buffer_key, std::vector<st_buffer_block*> >::iterator it;
+		for(it = m_state->m_free_blocks.begin(); it != m_state->m_free_blocks.end(); it++)
+		{
+			for(size_t i=0; i<it->second.size(); i++)
+				free_block(it->second[i]);
+		}
+		m_state->m_free_blocks.clear();
+
+		m_state->m_closed = true;
+		last_reference = (--m_state->m_references == 0);
+	}
+
+	if(last_reference) delete m_state;
+}
+
+AVFrame* FramePool::acquire_frame()
+{
+	std::lock_guard<std::mutex> lock(m_state->m_mutex);
+	st_statistics& statistics = m_state->m_statistics;
+
+	AVFrame* frame = NULL;
+	if(not m_v_free_frames.empty())
+	{
+		frame = m_v_free_frames.back();
+		m_v_free_frames.pop_back();
+	}
+	else
+	{
+		frame = av_frame_alloc();
+		if(not frame) return NULL;
+		statistics.m_frames_allocated++;
+	}
+
+	statistics.m_frames_in_use++;
+	statistics.m_frames_high_water_mark = std::max(statistics.m_frames_high_water_mark, statistics.m_frames_in_use);
+
+	return frame;
+}
+
+void FramePool::release_frame(AVFrame*& frame)
+{
+	if(not frame) return;
+
+	av_frame_unref(frame);
+
+	std::lock_guard<std::mutex> lock(m_state->m_mutex);
+	if(m_state->m_statistics.m_frames_in_use > 0) m_state->m_statistics.m_frames_in_use--;
+
+	if(m_v_free_frames.size() < MAX_IDLE_SHELLS) m_v_free_frames.push_back(frame);
+	else                                         av_frame_free(&frame);
+
+	frame = NULL;
+}
+
+AVPacket* FramePool::acquire_packet()
+{
+	AVPacket* packet = NULL;
+
+	{
+		std::lock_guard<std::mutex> lock(m_state->m_mutex);
+		st_statistics& statistics = m_state->m_statistics;
+
+		if(not m_v_free_packets.empty())
+		{
+			packet = m_v_free_packets.back();
+			m_v_free_packets.pop_back();
+		}
+		else
+		{
+			packet = new AVPacket();
+			statistics.m_packets_allocated++;
+		}
+
+		statistics.m_packets_in_use++;
+		statistics.m_packets_high_water_mark = std::max(statistics.m_packets_high_water_mark, statistics.m_packets_in_use);
+	}
+
+	av_init_packet(packet);
+	packet->data = NULL;
+	packet->size = 0;
+
+	return packet;
+}
+
+void FramePool::release_packet(AVPacket*& packet)
+{
+	if(not packet) return;
+
+	av_free_packet(packet);
+
+	std::lock_guard<std::mutex> lock(m_state->m_mutex);
+	if(m_state->m_statistics.m_packets_in_use > 0) m_state->m_statistics.m_packets_in_use--;
+
+	if(m_v_free_packets.size() < MAX_IDLE_SHELLS) m_v_free_packets.push_back(packet);
+	else                                          delete packet;
+
+	packet = NULL;
+}
+
+int FramePool::get_buffer2(AVCodecContext* ctx, AVFrame* frame, int flags)
+{
+	FramePool* pool = (FramePool*)ctx->opaque;
+
+	// Decoders without direct rendering support must use the default allocator.
+	if(not pool or not ctx->codec or not (ctx->codec->capabilities & CODEC_CAP_DR1))
+		return avcodec_default_get_buffer2(ctx, frame, flags);
+
+	if(ctx->codec_type == AVMEDIA_TYPE_VIDEO) return pool->get_video_buffer(ctx, frame, flags);
+	if(ctx->codec_type == AVMEDIA_TYPE_AUDIO) return pool->get_audio_buffer(ctx, frame, flags);
+
+	return avcodec_default_get_buffer2(ctx, frame, flags);
+}
+
+int FramePool::get_video_buffer(AVCodecContext* ctx, AVFrame* frame, int flags)
+{
+	enum AVPixelFormat format = (enum AVPixelFormat)frame->format;
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+
+	if(not desc or (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL | AV_PIX_FMT_FLAG_HWACCEL)))
+		return avcodec_default_get_buffer2(ctx, frame, flags);
+
+	int width  = frame->width;
+	int height = frame->height;
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	avcodec_align_dimensions2(ctx, &width, &height, linesize_align);
+
+	// Grow the width until every line meets the decoder's alignment, like libavcodec does.
+	int linesize[4];
+	int unaligned;
+	do
+	{
+		if(av_image_fill_linesizes(linesize, format, width) < 0)
+			return AVERROR(EINVAL);
+
+		width += width & ~(width - 1);
+
+		unaligned = 0;
+		for(int i=0; i<4; i++)
+		{
+			if(linesize_align[i] > 0)
+				unaligned |= linesize[i] % linesize_align[i];
+		}
+	}
+	while(unaligned);
+
+	uint8_t* data[4] = {NULL, NULL, NULL, NULL};
+	int total_size = av_image_fill_pointers(data, format, height, NULL, linesize);
+	if(total_size < 0)
+		return total_size;
+
+	memset(frame->data, 0, sizeof(frame->data));
+	memset(frame->buf, 0, sizeof(frame->buf));
+
+	for(int i=0; i<4 and linesize[i]; i++)
+	{
+		int plane_size = (i < 3 and data[i + 1]) ? int(data[i + 1] - data[i]) : total_size - int(data[i] - data[0]);
+
+		st_buffer_key key;
+		key.m_format = frame->format;
+		key.m_width  = frame->width;
+		key.m_height = frame->height;
+		key.m_size   = plane_size + BUFFER_PADDING;
+
+		frame->buf[i] = acquire_buffer(key);
+		if(not frame->buf[i])
+		{
+			av_frame_unref(frame);
+			return AVERROR(ENOMEM);
+		}
+
+		frame->data[i]     = frame->buf[i]->data;
+		frame->linesize[i] = linesize[i];
+	}
+
+	frame->extended_data = frame->data;
+	return 0;
+}
+
+int FramePool::get_audio_buffer(AVCodecContext* ctx, AVFrame* frame, int flags)
+{
+	enum AVSampleFormat format = (enum AVSampleFormat)frame->format;
+	int channels = av_get_channel_layout_nb_channels(frame->channel_layout);
+	if(channels <= 0) channels = ctx->channels;
+
+	int planes = av_sample_fmt_is_planar(format) ? channels : 1;
+
+	// Very wide layouts need extended buffers, leave those to libavcodec.
+	if(planes > AV_NUM_DATA_POINTERS)
+		return avcodec_default_get_buffer2(ctx, frame, flags);
+
+	int linesize = 0;
+	if(av_samples_get_buffer_size(&linesize, channels, frame->nb_samples, format, 0) < 0)
+		return AVERROR(EINVAL);
+
+	memset(frame->data, 0, sizeof(frame->data));
+	memset(frame->buf, 0, sizeof(frame->buf));
+
+	for(int i=0; i<planes; i++)
+	{
+		st_buffer_key key;
+		key.m_format = frame->format;
+		key.m_width  = frame->nb_samples;
+		key.m_height = channels;
+		key.m_size   = linesize + BUFFER_PADDING;
+
+		frame->buf[i] = acquire_buffer(key);
+		if(not frame->buf[i])
+		{
+			av_frame_unref(frame);
+			return AVERROR(ENOMEM);
+		}
+
+		frame->data[i] = frame->buf[i]->data;
+	}
+
+	frame->linesize[0]   = linesize;
+	frame->extended_data = frame->data;
+	return 0;
+}
+
+FramePool::st_statistics FramePool::statistics() const
+{
+	std::lock_guard<std::mutex> lock(m_state->m_mutex);
+	return m_state->m_statistics;
+}
+
+AVBufferRef* FramePool::acquire_buffer(const st_buffer_key& key)
+{
+	st_buffer_block* block = NULL;
+
+	{
+		std::lock_guard<std::mutex> lock(m_state->m_mutex);
+		st_statistics& statistics = m_state->m_statistics;
+		std::vector<st_buffer_block*>& v_free = m_state->m_free_blocks[key];
+
+		if(not v_free.empty())
+		{
+			block = v_free.back();
+			v_free.pop_back();
+			statistics.m_buffers_reused++;
+		}
+		else
+		{
+			uint8_t* data = (uint8_t*)av_malloc(key.m_size);
+			if(not data) return NULL;
+
+			block = new st_buffer_block();
+			block->m_state = m_state;
+			block->m_key   = key;
+			block->m_data  = data;
+
+			statistics.m_buffers_allocated++;
+			statistics.m_buffer_bytes_allocated += key.m_size;
+		}
+
+		m_state->m_references++;
+		statistics.m_buffers_in_use++;
+		statistics.m_buffer_bytes_in_use += key.m_size;
+		statistics.m_buffers_high_water_mark      = std::max(statistics.m_buffers_high_water_mark, statistics.m_buffers_in_use);
+		statistics.m_buffer_bytes_high_water_mark = std::max(statistics.m_buffer_bytes_high_water_mark, statistics.m_buffer_bytes_in_use);
+	}
+
+	AVBufferRef* buffer = av_buffer_create(block->m_data, key.m_size, release_buffer, block, 0);
+	if(not buffer) release_buffer(block, block->m_data);
+
+	return buffer;
+}
+
+void FramePool::release_buffer(void* opaque, uint8_t* data)
+{
+	st_buffer_block* block = (st_buffer_block*)opaque;
+	st_shared_state* state = block->m_state;
+	bool last_reference = false;
+
+	{
+		std::lock_guard<std::mutex> lock(state->m_mutex);
+		st_statistics& statistics = state->m_statistics;
+
+		statistics.m_buffers_in_use--;
+		statistics.m_buffer_bytes_in_use -= block->m_key.m_size;
+
+		if(state->m_closed) free_block(block);
+		else                state->m_free_blocks[block->m_key].push_back(block);
+
+		last_reference = (--state->m_references == 0);
+	}
+
+	if(last_reference) delete state;
+}
+
+void FramePool::free_block(st_buffer_block* block)
+{
+	av_free(block->m_data);
+	delete block;
+}
@@ -0,0 +1,116 @@
+/*!
+**************************************************************************************
+ * \file FramePool.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavutil/frame.h"
+}
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/*!
+ * Recycles the objects which the transcoding loop used to allocate for every packet: AVFrame and
+ * AVPacket shells as well as the data buffers of decoded frames. Data buffers are kept in free lists
+ * keyed by media format and frame geometry, so a stream with a fixed resolution (or audio frame size)
+ * settles down to a constant set of buffers after its first few frames.
+ *
+ * Decoders use the pool by installing get_buffer2() with the pool as their opaque pointer. Buffers
+ * handed out stay valid after the pool is destroyed; they are released when their last reference
+ * goes away.
+ */
+
+class FramePool
+{
+public:
+
+	struct st_statistics
+	{
+		size_t m_frames_allocated;
+		size_t m_frames_in_use;
+		size_t m_frames_high_water_mark;
+
+		size_t m_packets_allocated;
+		size_t m_packets_in_use;
+		size_t m_packets_high_water_mark;
+
+		size_t m_buffers_allocated;
+		size_t m_buffers_reused;
+		size_t m_buffers_in_use;
+		size_t m_buffers_high_water_mark;
+		size_t m_buffer_bytes_allocated;
+		size_t m_buffer_bytes_in_use;
+		size_t m_buffer_bytes_high_water_mark;
+	};
+
+	FramePool();
+	virtual ~FramePool();
+
+	AVFrame* acquire_frame();
+	void release_frame(AVFrame*& frame);
+
+	AVPacket* acquire_packet();
+	void release_packet(AVPacket*& packet);
+
+	int get_video_buffer(AVCodecContext* ctx, AVFrame* frame, int flags);
+	int get_audio_buffer(AVCodecContext* ctx, AVFrame* frame, int flags);
+
+	st_statistics statistics() const;
+
+	//! get_buffer2 callback, expects the FramePool in AVCodecContext.opaque.
+	static int get_buffer2(AVCodecContext* ctx, AVFrame* frame, int flags);
+
+private:
+
+	struct st_buffer_key
+	{
+		int m_format;
+		int m_width;    // Samples per channel for audio.
+		int m_height;   // Channels for audio.
+		int m_size;
+
+		bool operator<(const st_buffer_key& other) const;
+	};
+
+	struct st_shared_state;
+
+	struct st_buffer_block
+	{
+		st_shared_state* m_state;
+		st_buffer_key m_key;
+		uint8_t* m_data;
+	};
+
+	/*!
+	 * Free lists and counters live in a reference counted state object, since buffers may still be
+	 * referenced by a muxer or filter graph when the pool itself is destroyed.
+	 */
+	struct st_shared_state
+	{
+		std::mutex m_mutex;
+		std::map<st_buffer_key, std::vector<st_buffer_block*> > m_free_blocks;
+		st_statistics m_statistics;
+		size_t m_references;
+		bool m_closed;
+	};
+
+	AVBufferRef* acquire_buffer(const st_buffer_key& key);
+	static void release_buffer(void* opaque, uint8_t* data);
+	static void free_block(st_buffer_block* block);
+
+	st_shared_state* m_state;
+
+	std::vector<AVFrame*> m_v_free_frames;
+	std::vector<AVPacket*> m_v_free_packets;
+};
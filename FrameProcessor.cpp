@@ -0,0 +1,224 @@
+/*!
+**************************************************************************************
+ * \file FrameProcessor.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "FrameProcessor.h"
+
+#include <algorithm>
+
+// Bands are at least this many rows high, so that a band is worth handing to another thread.
+static const int MIN_BAND_ROWS = 16;
+
+// Bands per thread, a few more than one evens out threads which get descheduled.
+static const int BANDS_PER_THREAD = 4;
+
+RowBandPool::RowBandPool(int numof_threads)
+{
+	if(numof_threads <= 0) numof_threads = std::max(1, int(std::thread::hardware_concurrency()));
+
+	m_task         = NULL;
+	m_numof_bands  = 0;
+	m_busy_workers = 0;
+	m_generation   = 0;
+	m_stopping     = false;
+	m_next_band.store(0);
+
+	for(int t=1; t<numof_threads; t++)
+		m_v_workers.push_back(std::thread(&RowBandPool::worker, this));
+}
+
+RowBandPool::~RowBandPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_start_cond.notify_all();
+
+	for(size_t t=0; t<m_v_workers.size(); t++)
+		m_v_workers[t].join();
+}
+
+void RowBandPool::run(int numof_bands, const std::function<void(int)>& task)
+{
+	std::unique_lock<std::mutex> run_lock(m_run_mutex, std::try_to_lock);
+
+	if(not run_lock.owns_lock() or m_v_workers.empty() or numof_bands < 2)
+	{
+		for(int b=0; b<numof_bands; b++) task(b);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_task         = &task;
+		m_numof_bands  = numof_bands;
+		m_busy_workers = int(m_v_workers.size());
+		m_next_band.store(0);
+		m_generation++;
+	}
+	m_start_cond.notify_all();
+
+	run_bands();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while(m_busy_workers > 0) m_done_cond.wait(lock);
+	m_task = NULL;
+}
+
+void RowBandPool::worker()
+{
+	unsigned int generation = 0;
+
+	while(true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while(not m_stopping and m_generation == generation) m_start_cond.wait(lock);
+
+			if(m_stopping) return;
+			generation = m_generation;
+		}
+
+		run_bands();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_busy_workers--;
+		}
+		m_done_cond.notify_one();
+	}
+}
+
+void RowBandPool::run_bands()
+{
+	int band;
+	while((band = m_next_band.fetch_add(1)) < m_numof_bands)
+		(*m_task)(band);
+}
+
+FrameProcessorChain::FrameProcessorChain()
+{
+	m_numof_threads = 0;
+	m_core_limit    = 0;
+}
+
+void FrameProcessorChain::add(std::shared_ptr<FrameProcessor> processor)
+{
+	if(not processor) return;
+
+	m_v_processors.push_back(processor);
+	if(not m_pool) resize_pool();
+}
+
+void FrameProcessorChain::clear()
+{
+	m_v_processors.clear();
+	m_pool.reset();
+}
+
+void FrameProcessorChain::set_threads(int numof_threads)
+{
+	m_numof_threads = numof_threads;
+
+	m_pool.reset();
+	if(not m_v_processors.empty()) resize_pool();
+}
+
+void FrameProcessorChain::set_core_limit(int cores)
+{
+	m_core_limit = cores;
+	if(not m_v_processors.empty()) resize_pool();
+}
+
+void FrameProcessorChain::resize_pool()
+{
+	int numof_threads = (m_numof_threads > 0) ? m_numof_threads : m_core_limit;
+	if(numof_threads <= 0) numof_threads = std::max(1, int(std::thread::hardware_concurrency()));
+
+	// A pool which already fits keeps its threads, and stays shared with copies of the chain.
+	if(not m_pool or m_pool->threads() != numof_threads)
+		m_pool = std::make_shared<RowBandPool>(numof_threads);
+}
+
+int FrameProcessorChain::process(AVFrame* frame, int stream_index)
+{
+	if(m_v_processors.empty() or not frame) return 0;
+
+	std::vector<FrameProcessor*> v_active;
+	bool exclusive = false;
+
+	for(size_t p=0; p<m_v_processors.size(); p++)
+	{
+		if(not m_v_processors[p]->supports(AVPixelFormat(frame->format))) continue;
+
+		v_active.push_back(m_v_processors[p].get());
+		exclusive = exclusive or (m_v_processors[p]->access() == FrameProcessor::ACCESS_EXCLUSIVE);
+	}
+
+	if(v_active.empty()) return 0;
+
+	// Decoders keep referencing the frames they predict from, those must be copied before writing.
+	if(exclusive)
+	{
+		int ret = av_frame_make_writable(frame);
+		if(ret < 0) return ret;
+	}
+
+	st_frame_view view;
+	if(not frame_view(frame, stream_index, view)) return 0;
+
+	int alignment   = 1 << view.m_log2_chroma_h;
+	int band_rows   = (view.m_height + m_pool->threads() * BANDS_PER_THREAD - 1) / (m_pool->threads() * BANDS_PER_THREAD);
+	band_rows       = std::max(band_rows, MIN_BAND_ROWS);
+	band_rows       = (band_rows + alignment - 1) / alignment * alignment;
+	int numof_bands = (view.m_height + band_rows - 1) / band_rows;
+
+	m_pool->run(numof_bands, [&](int band)
+	{
+		int first_row = band * band_rows;
+		int last_row  = std::min(view.m_height, first_row + band_rows);
+
+		for(size_t p=0; p<v_active.size(); p++)
+			v_active[p]->process(view, first_row, last_row);
+	});
+
+	return 0;
+}
+
+bool FrameProcessorChain::frame_view(AVFrame* frame, int stream_index, st_frame_view& view)
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+	if(not desc or (desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+		return false;
+
+	view.m_format        = AVPixelFormat(frame->format);
+	view.m_stream_index  = stream_index;
+	view.m_pts           = frame->pts;
+	view.m_width         = frame->width;
+	view.m_height        = frame->height;
+	view.m_log2_chroma_w = desc->log2_chroma_w;
+	view.m_log2_chroma_h = desc->log2_chroma_h;
+	view.m_numof_planes  = 0;
+
+	for(int i=0; i<4 and frame->data[i]; i++)
+	{
+		// Planes 1 and 2 carry chroma; alpha, like luma, has the full size.
+		bool chroma = (i == 1 or i == 2);
+
+		st_frame_view::st_plane& plane = view.m_planes[i];
+		plane.m_data   = frame->data[i];
+		plane.m_stride = frame->linesize[i];
+		plane.m_width  = chroma ? -((-frame->width)  >> desc->log2_chroma_w) : frame->width;
+		plane.m_height = chroma ? -((-frame->height) >> desc->log2_chroma_h) : frame->height;
+
+		view.m_numof_planes++;
+	}
+
+	return view.m_numof_planes > 0;
+}
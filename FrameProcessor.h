@@ -0,0 +1,141 @@
+/*!
+**************************************************************************************
+ * \file FrameProcessor.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+extern "C"
+{
+#include "libavutil/frame.h"
+#include "libavutil/pixdesc.h"
+}
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+ * Plane pointers and geometry of a decoded video frame, as handed to frame processors. Plane 0 is
+ * luma (or the only plane); chroma planes are smaller by the format's chroma shifts.
+ */
+struct st_frame_view
+{
+	struct st_plane
+	{
+		uint8_t* m_data;
+		int m_stride;
+		int m_width;
+		int m_height;
+	};
+
+	AVPixelFormat m_format;
+	int m_stream_index;
+	int64_t m_pts;
+	int m_width;
+	int m_height;
+	int m_log2_chroma_w;
+	int m_log2_chroma_h;
+	int m_numof_planes;
+	st_plane m_planes[4];
+};
+
+/*!
+ * A per-frame operation on decoded video. process() is given a band of luma rows, [first_row,
+ * last_row), and must only touch those rows and the chroma rows below them; bands of one frame
+ * are processed in parallel, and one processor may see frames of several streams or transcoders
+ * at once. ACCESS_EXCLUSIVE processors write into the frame, which is made writable first, while
+ * ACCESS_SHARED ones only read it and never cause a copy.
+ */
+class FrameProcessor
+{
+public:
+
+	enum e_access
+	{
+		ACCESS_SHARED,
+		ACCESS_EXCLUSIVE
+	};
+
+	virtual ~FrameProcessor() {}
+
+	virtual e_access access() const = 0;
+	virtual bool supports(AVPixelFormat format) const = 0;
+	virtual void process(const st_frame_view& frame, int first_row, int last_row) const = 0;
+};
+
+/*!
+ * Persistent worker threads which run the bands of a frame. The calling thread takes part in
+ * the work, and a caller which finds the pool busy with another frame runs its bands on its own
+ * instead of waiting.
+ */
+class RowBandPool
+{
+public:
+
+	explicit RowBandPool(int numof_threads = 0);
+	virtual ~RowBandPool();
+
+	int threads() const { return int(m_v_workers.size()) + 1; }
+	void run(int numof_bands, const std::function<void(int)>& task);
+
+private:
+
+	void worker();
+	void run_bands();
+
+	std::vector<std::thread> m_v_workers;
+
+	std::mutex m_run_mutex;
+	std::mutex m_mutex;
+	std::condition_variable m_start_cond;
+	std::condition_variable m_done_cond;
+
+	const std::function<void(int)>* m_task;
+	int m_numof_bands;
+	std::atomic<int> m_next_band;
+	int m_busy_workers;
+	unsigned int m_generation;
+	bool m_stopping;
+};
+
+/*!
+ * The registered processors, run in registration order on every decoded video frame. All of
+ * them handle one band before the next band is started, so a band stays in cache across the
+ * whole chain.
+ */
+class FrameProcessorChain
+{
+public:
+
+	FrameProcessorChain();
+
+	void add(std::shared_ptr<FrameProcessor> processor);
+	void clear();
+	bool empty() const { return m_v_processors.empty(); }
+
+	//! Zero threads use the core limit, or every core without one. Copies of a chain share its
+	//! processors and its pool.
+	void set_threads(int numof_threads);
+	void set_core_limit(int cores);
+
+	int process(AVFrame* frame, int stream_index);
+
+private:
+
+	static bool frame_view(AVFrame* frame, int stream_index, st_frame_view& view);
+	void resize_pool();
+
+	std::vector<std::shared_ptr<FrameProcessor> > m_v_processors;
+	std::shared_ptr<RowBandPool> m_pool;
+	int m_numof_threads;
+	int m_core_limit;
+};
@@ -0,0 +1,411 @@
+/*!
+**************************************************************************************
+ * \file IndexCache.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "IndexCache.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+// The last byte is the format version, a different version is treated like a stale cache.
+static const uint8_t CACHE_MAGIC[8] = {'V', 'T', 'I', 'D', 'X', 0, 0, 1};
+
+/*************************/
+/* Varint Serialization */
+/*************************/
+
+static void write_varint(std::vector<uint8_t>& v_buffer, uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		v_buffer.push_back(uint8_t(value | 0x80));
+		value >>= 7;
+	}
+
+	v_buffer.push_back(uint8_t(value));
+}
+
+static void write_signed(std::vector<uint8_t>& v_buffer, int64_t value)
+{
+	write_varint(v_buffer, (uint64_t(value) << 1) ^ uint64_t(value >> 63));
+}
+
+static void write_rational(std::vector<uint8_t>& v_buffer, AVRational value)
+{
+	write_signed(v_buffer, value.num);
+	write_signed(v_buffer, value.den);
+}
+
+struct st_reader
+{
+	const uint8_t* m_data;
+	const uint8_t* m_end;
+	bool m_failed;
+
+	uint64_t varint()
+	{
+		uint64_t value = 0;
+		for(int shift=0; shift<64; shift+=7)
+		{
+			if(m_data >= m_end)
+			{
+				m_failed = true;
+				return 0;
+			}
+
+			uint8_t byte = *m_data++;
+			value |= uint64_t(byte & 0x7f) << shift;
+			if(not (byte & 0x80)) return value;
+		}
+
+		m_failed = true;
+		return 0;
+	}
+
+	int64_t signed_varint()
+	{
+		uint64_t value = varint();
+		return int64_t(value >> 1) ^ -int64_t(value & 1);
+	}
+
+	AVRational rational()
+	{
+		AVRational value;
+		value.num = int(signed_varint());
+		value.den = int(signed_varint());
+		return value;
+	}
+};
+
+/*********************/
+/* IndexCache Class */
+/*********************/
+
+IndexCache::IndexCache(const std::string& pth_media, const std::string& directory)
+{
+	m_media_path = pth_media;
+
+	if(directory.empty())
+	{
+		m_cache_path = pth_media + ".vtidx";
+	}
+	else
+	{
+		size_t slash = pth_media.find_last_of('/');
+		std::string name = (slash == std::string::npos) ? pth_media : pth_media.substr(slash + 1);
+		m_cache_path = directory + "/" + name + ".vtidx";
+	}
+}
+
+bool IndexCache::identify(st_file_identity& identity) const
+{
+	struct stat status;
+	if(stat(m_media_path.c_str(), &status) != 0)
+		return false;
+
+	identity.m_size       = uint64_t(status.st_size);
+	identity.m_mtime_sec  = uint64_t(status.st_mtim.tv_sec);
+	identity.m_mtime_nsec = uint64_t(status.st_mtim.tv_nsec);
+	identity.m_inode      = uint64_t(status.st_ino);
+	identity.m_device     = uint64_t(status.st_dev);
+
+	return true;
+}
+
+bool IndexCache::load(AVFormatContext* ctx) const
+{
+	st_file_identity identity;
+	if(not identify(identity))
+		return false;
+
+	std::ifstream file(m_cache_path.c_str(), std::ios::binary);
+	if(not file)
+		return false;
+
+	std::vector<uint8_t> v_buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if(v_buffer.size() < sizeof(CACHE_MAGIC) or memcmp(&v_buffer[0], CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0)
+		return false;
+
+	st_reader reader = {&v_buffer[0] + sizeof(CACHE_MAGIC), &v_buffer[0] + v_buffer.size(), false};
+
+	if(reader.varint() != identity.m_size or reader.varint() != identity.m_mtime_sec or
+	   reader.varint() != identity.m_mtime_nsec or reader.varint() != identity.m_inode or
+	   reader.varint() != identity.m_device)
+		return false;
+
+	int64_t duration   = reader.signed_varint();
+	int64_t start_time = reader.signed_varint();
+	int bit_rate       = int(reader.varint());
+
+	if(reader.varint() != ctx->nb_streams or reader.m_failed)
+		return false;
+
+	// Everything is checked before the context is touched, so a broken cache leaves it as it was.
+	struct st_stream_cache
+	{
+		AVRational m_time_base, m_avg_frame_rate, m_r_frame_rate;
+		int64_t m_start_time, m_duration, m_nb_frames;
+		AVCodecContext m_codec;
+		std::vector<uint8_t> m_v_extradata;
+		std::vector<AVIndexEntry> m_v_entries;
+	};
+
+	std::vector<st_stream_cache> v_streams(ctx->nb_streams);
+	for(unsigned int s=0; s<ctx->nb_streams and not reader.m_failed; s++)
+	{
+		st_stream_cache& stream = v_streams[s];
+		AVCodecContext& codec   = stream.m_codec;
+		memset(&codec, 0, sizeof(codec));
+
+		stream.m_time_base      = reader.rational();
+		stream.m_start_time     = reader.signed_varint();
+		stream.m_duration       = reader.signed_varint();
+		stream.m_nb_frames      = reader.signed_varint();
+		stream.m_avg_frame_rate = reader.rational();
+		stream.m_r_frame_rate   = reader.rational();
+
+		codec.codec_type          = AVMediaType(reader.signed_varint());
+		codec.codec_id            = AVCodecID(reader.varint());
+		codec.codec_tag           = (unsigned int)(reader.varint());
+		codec.bit_rate            = int(reader.varint());
+		codec.width               = int(reader.varint());
+		codec.height              = int(reader.varint());
+		codec.pix_fmt             = AVPixelFormat(reader.signed_varint());
+		codec.sample_aspect_ratio = reader.rational();
+		codec.time_base           = reader.rational();
+		codec.ticks_per_frame     = int(reader.varint());
+		codec.has_b_frames        = int(reader.varint());
+		codec.profile             = int(reader.signed_varint());
+		codec.level               = int(reader.signed_varint());
+		codec.sample_rate         = int(reader.varint());
+		codec.channels            = int(reader.varint());
+		codec.channel_layout      = reader.varint();
+		codec.sample_fmt          = AVSampleFormat(reader.signed_varint());
+		codec.frame_size          = int(reader.varint());
+		codec.block_align         = int(reader.varint());
+
+		size_t extradata_size = size_t(reader.varint());
+		if(extradata_size > size_t(reader.m_end - reader.m_data))
+			return false;
+
+		stream.m_v_extradata.assign(reader.m_data, reader.m_data + extradata_size);
+		reader.m_data += extradata_size;
+
+		AVStream* av_stream = ctx->streams[s];
+		if(codec.codec_type != av_stream->codec->codec_type or
+		   (av_stream->codec->codec_id != AV_CODEC_ID_NONE and codec.codec_id != av_stream->codec->codec_id) or
+		   av_cmp_q(stream.m_time_base, av_stream->time_base) != 0)
+			return false;
+
+		size_t numof_entries = size_t(reader.varint());
+		if(numof_entries > size_t(reader.m_end - reader.m_data))
+			return false;
+
+		int64_t timestamp = 0;
+		int64_t pos       = 0;
+		stream.m_v_entries.resize(numof_entries);
+		for(size_t e=0; e<numof_entries; e++)
+		{
+			timestamp += reader.signed_varint();
+			pos       += reader.signed_varint();
+
+			AVIndexEntry& entry = stream.m_v_entries[e];
+			entry.timestamp    = timestamp;
+			entry.pos          = pos;
+			entry.size         = int(reader.varint());
+			entry.flags        = int(reader.varint());
+			entry.min_distance = int(reader.varint());
+		}
+	}
+
+	if(reader.m_failed)
+		return false;
+
+	ctx->duration   = duration;
+	ctx->start_time = start_time;
+	ctx->bit_rate   = bit_rate;
+
+	for(unsigned int s=0; s<ctx->nb_streams; s++)
+	{
+		st_stream_cache& stream = v_streams[s];
+		AVStream* av_stream     = ctx->streams[s];
+		AVCodecContext* codec   = av_stream->codec;
+
+		av_stream->start_time     = stream.m_start_time;
+		av_stream->duration       = stream.m_duration;
+		av_stream->nb_frames      = stream.m_nb_frames;
+		av_stream->avg_frame_rate = stream.m_avg_frame_rate;
+		av_stream->r_frame_rate   = stream.m_r_frame_rate;
+
+		codec->codec_id            = stream.m_codec.codec_id;
+		codec->codec_tag           = stream.m_codec.codec_tag;
+		codec->bit_rate            = stream.m_codec.bit_rate;
+		codec->width               = stream.m_codec.width;
+		codec->height              = stream.m_codec.height;
+		codec->pix_fmt             = stream.m_codec.pix_fmt;
+		codec->sample_aspect_ratio = stream.m_codec.sample_aspect_ratio;
+		codec->time_base           = stream.m_codec.time_base;
+		codec->ticks_per_frame     = stream.m_codec.ticks_per_frame;
+		codec->has_b_frames        = stream.m_codec.has_b_frames;
+		codec->profile             = stream.m_codec.profile;
+		codec->level               = stream.m_codec.level;
+		codec->sample_rate         = stream.m_codec.sample_rate;
+		codec->channels            = stream.m_codec.channels;
+		codec->channel_layout      = stream.m_codec.channel_layout;
+		codec->sample_fmt          = stream.m_codec.sample_fmt;
+		codec->frame_size          = stream.m_codec.frame_size;
+		codec->block_align         = stream.m_codec.block_align;
+
+		if(not codec->extradata and not stream.m_v_extradata.empty())
+		{
+			codec->extradata = (uint8_t*)av_mallocz(stream.m_v_extradata.size() + FF_INPUT_BUFFER_PADDING_SIZE);
+			if(not codec->extradata)
+				return false;
+
+			memcpy(codec->extradata, &stream.m_v_extradata[0], stream.m_v_extradata.size());
+			codec->extradata_size = int(stream.m_v_extradata.size());
+		}
+
+		// Demuxers with an index in their header (mp4, avi) already built it while opening.
+		if(av_stream->nb_index_entries == 0)
+		{
+			for(size_t e=0; e<stream.m_v_entries.size(); e++)
+			{
+				const AVIndexEntry& entry = stream.m_v_entries[e];
+				av_add_index_entry(av_stream, entry.pos, entry.timestamp, entry.size, entry.min_distance,
+								   (entry.flags & AVINDEX_KEYFRAME) ? AVINDEX_KEYFRAME : 0);
+			}
+		}
+	}
+
+	return true;
+}
+
+bool IndexCache::save(AVFormatContext* ctx) const
+{
+	st_file_identity identity;
+	if(not identify(identity))
+		return false;
+
+	std::vector<uint8_t> v_buffer(CACHE_MAGIC, CACHE_MAGIC + sizeof(CACHE_MAGIC));
+
+	write_varint(v_buffer, identity.m_size);
+	write_varint(v_buffer, identity.m_mtime_sec);
+	write_varint(v_buffer, identity.m_mtime_nsec);
+	write_varint(v_buffer, identity.m_inode);
+	write_varint(v_buffer, identity.m_device);
+
+	write_signed(v_buffer, ctx->duration);
+	write_signed(v_buffer, ctx->start_time);
+	write_varint(v_buffer, uint64_t(ctx->bit_rate));
+	write_varint(v_buffer, ctx->nb_streams);
+
+	for(unsigned int s=0; s<ctx->nb_streams; s++)
+	{
+		AVStream* stream      = ctx->streams[s];
+		AVCodecContext* codec = stream->codec;
+
+		write_rational(v_buffer, stream->time_base);
+		write_signed(v_buffer, stream->start_time);
+		write_signed(v_buffer, stream->duration);
+		write_signed(v_buffer, stream->nb_frames);
+		write_rational(v_buffer, stream->avg_frame_rate);
+		write_rational(v_buffer, stream->r_frame_rate);
+
+		write_signed(v_buffer, codec->codec_type);
+		write_varint(v_buffer, uint64_t(codec->codec_id));
+		write_varint(v_buffer, codec->codec_tag);
+		write_varint(v_buffer, uint64_t(codec->bit_rate));
+		write_varint(v_buffer, uint64_t(codec->width));
+		write_varint(v_buffer, uint64_t(codec->height));
+		write_signed(v_buffer, codec->pix_fmt);
+		write_rational(v_buffer, codec->sample_aspect_ratio);
+		write_rational(v_buffer, codec->time_base);
+		write_varint(v_buffer, uint64_t(codec->ticks_per_frame));
+		write_varint(v_buffer, uint64_t(codec->has_b_frames));
+		write_signed(v_buffer, codec->profile);
+		write_signed(v_buffer, codec->level);
+		write_varint(v_buffer, uint64_t(codec->sample_rate));
+		write_varint(v_buffer, uint64_t(codec->channels));
+		write_varint(v_buffer, codec->channel_layout);
+		write_signed(v_buffer, codec->sample_fmt);
+		write_varint(v_buffer, uint64_t(codec->frame_size));
+		write_varint(v_buffer, uint64_t(codec->block_align));
+
+		int extradata_size = (codec->extradata and codec->extradata_size > 0) ? codec->extradata_size : 0;
+		write_varint(v_buffer, uint64_t(extradata_size));
+		v_buffer.insert(v_buffer.end(), codec->extradata, codec->extradata + extradata_size);
+
+		write_varint(v_buffer, uint64_t(stream->nb_index_entries));
+
+		int64_t timestamp = 0;
+		int64_t pos       = 0;
+		for(int e=0; e<stream->nb_index_entries; e++)
+		{
+			const AVIndexEntry& entry = stream->index_entries[e];
+
+			write_signed(v_buffer, entry.timestamp - timestamp);
+			write_signed(v_buffer, entry.pos - pos);
+			write_varint(v_buffer, uint64_t(entry.size));
+			write_varint(v_buffer, uint64_t(entry.flags));
+			write_varint(v_buffer, uint64_t(entry.min_distance));
+
+			timestamp = entry.timestamp;
+			pos       = entry.pos;
+		}
+	}
+
+	// Written aside and renamed, so a concurrent open never sees a half written cache. Every save
+	// gets a temporary file of its own, jobs saving the same media at once don't mix their writes.
+	std::vector<char> v_temporary(m_cache_path.begin(), m_cache_path.end());
+	const char suffix[] = ".XXXXXX";
+	v_temporary.insert(v_temporary.end(), suffix, suffix + sizeof(suffix));
+
+	int fd = mkstemp(&v_temporary[0]);
+	if(fd < 0)
+		return false;
+
+	std::string pth_temporary(&v_temporary[0]);
+	fchmod(fd, 0644);
+
+	const uint8_t* data = &v_buffer[0];
+	size_t remaining    = v_buffer.size();
+	while(remaining > 0)
+	{
+		ssize_t written = write(fd, data, remaining);
+		if(written <= 0)
+		{
+			close(fd);
+			remove(pth_temporary.c_str());
+			return false;
+		}
+
+		data      += written;
+		remaining -= size_t(written);
+	}
+
+	if(close(fd) != 0)
+	{
+		remove(pth_temporary.c_str());
+		return false;
+	}
+
+	if(rename(pth_temporary.c_str(), m_cache_path.c_str()) != 0)
+	{
+		remove(pth_temporary.c_str());
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,59 @@
+/*!
+**************************************************************************************
+ * \file IndexCache.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+}
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*!
+ * Sidecar file which keeps what avformat_find_stream_info() found out about a media, i.e. stream
+ * and codec parameters, together with the stream indexes. A later open restores them instead of
+ * probing again. Index timestamps and byte offsets are stored as zigzag varint deltas, which
+ * takes a few bytes per entry.
+ *
+ * A cache belongs to one file: size, modification time, inode and device are stored with it, and
+ * a file which changed in any of these is probed again and its cache is rewritten.
+ */
+
+class IndexCache
+{
+public:
+
+	//! An empty directory puts the cache next to the media as "<media>.vtidx".
+	IndexCache(const std::string& pth_media, const std::string& directory = "");
+
+	//! Applies the cache to a context opened with avformat_open_input() but not probed yet.
+	bool load(AVFormatContext* ctx) const;
+	bool save(AVFormatContext* ctx) const;
+
+	const std::string& path() const { return m_cache_path; }
+
+private:
+
+	struct st_file_identity
+	{
+		uint64_t m_size;
+		uint64_t m_mtime_sec;
+		uint64_t m_mtime_nsec;
+		uint64_t m_inode;
+		uint64_t m_device;
+	};
+
+	bool identify(st_file_identity& identity) const;
+
+	std::string m_media_path;
+	std::string m_cache_path;
+};
@@ -0,0 +1,428 @@
+/*!
+**************************************************************************************
+ * \file MediaIO.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "MediaIO.h"
+
+extern "C"
+{
+#include "libavutil/mem.h"
+}
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Size of the buffer libavformat itself reads into and writes from.
+static const int AVIO_BUFFER_SIZE = 256 * 1024;
+
+static const size_t DEFAULT_READAHEAD     = 8 * 1024 * 1024;
+static const size_t DEFAULT_BUFFER_SIZE   = 4 * 1024 * 1024;
+static const size_t DEFAULT_NUMOF_BUFFERS = 4;
+static const uint64_t DEFAULT_FSYNC_INTERVAL = 64 * 1024 * 1024;
+
+static const size_t PAGE_ALIGNMENT = 4096;
+
+/**********************/
+/* MappedInput Class */
+/**********************/
+
+MappedInput::MappedInput()
+{
+	m_fd            = -1;
+	m_data          = NULL;
+	m_size          = 0;
+	m_position      = 0;
+	m_readahead     = DEFAULT_READAHEAD;
+	m_advised_begin = 0;
+	m_advised_end   = 0;
+	m_avio          = NULL;
+}
+
+MappedInput::~MappedInput()
+{
+	close();
+}
+
+int MappedInput::open(const std::string& pth_media, size_t readahead)
+{
+	close();
+
+	m_fd = ::open(pth_media.c_str(), O_RDONLY);
+	if(m_fd < 0)
+		return AVERROR(errno);
+
+	struct stat status;
+	if(fstat(m_fd, &status) != 0)
+	{
+		int ret = AVERROR(errno);
+		close();
+		return ret;
+	}
+
+	m_size      = size_t(status.st_size);
+	m_position  = 0;
+	m_readahead = readahead > 0 ? readahead : DEFAULT_READAHEAD;
+
+	// An empty file can't be mapped, reads just report the end of file then.
+	if(m_size > 0)
+	{
+		void* data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+		if(data == MAP_FAILED)
+		{
+			int ret = AVERROR(errno);
+			close();
+			return ret;
+		}
+
+		m_data = (uint8_t*)data;
+		madvise(m_data, m_size, MADV_SEQUENTIAL);
+		advise(0);
+	}
+
+	uint8_t* buffer = (uint8_t*)av_malloc(AVIO_BUFFER_SIZE);
+	if(buffer)
+		m_avio = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, this, read_packet, NULL, seek);
+
+	if(not m_avio)
+	{
+		av_free(buffer);
+		close();
+		return AVERROR(ENOMEM);
+	}
+
+	return 0;
+}
+
+void MappedInput::close()
+{
+	if(m_avio)
+	{
+		av_freep(&m_avio->buffer);
+		av_freep(&m_avio);
+	}
+
+	if(m_data) munmap(m_data, m_size);
+	if(m_fd >= 0) ::close(m_fd);
+
+	m_fd   = -1;
+	m_data = NULL;
+	m_size = 0;
+}
+
+int MappedInput::read_packet(void* opaque, uint8_t* buffer, int size)
+{
+	MappedInput* input = (MappedInput*)opaque;
+
+	size_t length = std::min(size_t(std::max(size, 0)), input->m_size - input->m_position);
+	if(length == 0)
+		return AVERROR_EOF;
+
+	memcpy(buffer, input->m_data + input->m_position, length);
+	input->m_position += length;
+
+	// Keep the kernel half a window ahead of the reader.
+	if(input->m_position + input->m_readahead / 2 > input->m_advised_end)
+		input->advise(input->m_position);
+
+	return int(length);
+}
+
+int64_t MappedInput::seek(void* opaque, int64_t offset, int whence)
+{
+	MappedInput* input = (MappedInput*)opaque;
+	int64_t position;
+
+	switch(whence & ~AVSEEK_FORCE)
+	{
+	case AVSEEK_SIZE: return int64_t(input->m_size);
+	case SEEK_SET:    position = offset; break;
+	case SEEK_CUR:    position = int64_t(input->m_position) + offset; break;
+	case SEEK_END:    position = int64_t(input->m_size) + offset; break;
+	default:          return AVERROR(EINVAL);
+	}
+
+	if(position < 0 or position > int64_t(input->m_size))
+		return AVERROR(EINVAL);
+
+	input->m_position = size_t(position);
+
+	if(input->m_position < input->m_advised_begin or input->m_position >= input->m_advised_end)
+		input->advise(input->m_position);
+
+	return position;
+}
+
+void MappedInput::advise(size_t position)
+{
+	if(not m_data or position >= m_size) return;
+
+	size_t begin = position - position % PAGE_ALIGNMENT;
+	size_t end   = std::min(m_size, position + m_readahead);
+
+	madvise(m_data + begin, end - begin, MADV_WILLNEED);
+
+	m_advised_begin = begin;
+	m_advised_end   = end;
+}
+
+/****************************/
+/* WriteBehindOutput Class */
+/****************************/
+
+WriteBehindOutput::WriteBehindOutput()
+{
+	m_fd             = -1;
+	m_avio           = NULL;
+	m_buffer_size    = DEFAULT_BUFFER_SIZE;
+	m_fsync_policy   = FSYNC_ON_CLOSE;
+	m_fsync_interval = DEFAULT_FSYNC_INTERVAL;
+	m_unsynced       = 0;
+	m_position       = 0;
+	m_file_size      = 0;
+	m_closing        = false;
+	m_error          = 0;
+
+	m_current.m_data   = NULL;
+	m_current.m_size   = 0;
+	m_current.m_offset = 0;
+}
+
+WriteBehindOutput::~WriteBehindOutput()
+{
+	close();
+}
+
+int WriteBehindOutput::open(const std::string& pth_media, size_t buffer_size, size_t numof_buffers,
+							e_fsync_policy fsync_policy, uint64_t fsync_interval)
+{
+	close();
+
+	m_fd = ::open(pth_media.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(m_fd < 0)
+		return AVERROR(errno);
+
+	m_buffer_size    = buffer_size > 0 ? buffer_size : DEFAULT_BUFFER_SIZE;
+	m_buffer_size    = (m_buffer_size + PAGE_ALIGNMENT - 1) / PAGE_ALIGNMENT * PAGE_ALIGNMENT;
+	m_fsync_policy   = fsync_policy;
+	m_fsync_interval = fsync_interval > 0 ? fsync_interval : DEFAULT_FSYNC_INTERVAL;
+	m_unsynced       = 0;
+	m_position       = 0;
+	m_file_size      = 0;
+	m_closing        = false;
+	m_error          = 0;
+
+	numof_buffers = std::max(size_t(2), numof_buffers > 0 ? numof_buffers : DEFAULT_NUMOF_BUFFERS);
+	for(size_t b=0; b<numof_buffers; b++)
+	{
+		void* data = NULL;
+		if(posix_memalign(&data, PAGE_ALIGNMENT, m_buffer_size) != 0)
+		{
+			close();
+			return AVERROR(ENOMEM);
+		}
+
+		m_v_buffers.push_back((uint8_t*)data);
+		m_v_free.push_back((uint8_t*)data);
+	}
+
+	uint8_t* buffer = (uint8_t*)av_malloc(AVIO_BUFFER_SIZE);
+	if(buffer)
+		m_avio = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, this, NULL, write_packet, seek);
+
+	if(not m_avio)
+	{
+		av_free(buffer);
+		close();
+		return AVERROR(ENOMEM);
+	}
+
+	m_thread = std::thread(&WriteBehindOutput::writer, this);
+	return 0;
+}
+
+int WriteBehindOutput::close()
+{
+	if(m_avio)
+	{
+		avio_flush(m_avio);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			submit_current();
+			m_closing = true;
+		}
+		m_cond.notify_all();
+	}
+
+	if(m_thread.joinable())
+		m_thread.join();
+
+	if(m_fd >= 0)
+	{
+		if(m_fsync_policy != FSYNC_NEVER and fdatasync(m_fd) != 0 and m_error == 0)
+			m_error = AVERROR(errno);
+
+		if(::close(m_fd) != 0 and m_error == 0)
+			m_error = AVERROR(errno);
+	}
+
+	if(m_avio)
+	{
+		av_freep(&m_avio->buffer);
+		av_freep(&m_avio);
+	}
+
+	for(size_t b=0; b<m_v_buffers.size(); b++)
+		free(m_v_buffers[b]);
+
+	m_v_buffers.clear();
+	m_v_free.clear();
+	m_pending.clear();
+	m_current.m_data = NULL;
+	m_fd = -1;
+
+	int ret = m_error;
+	m_error = 0;
+	return ret;
+}
+
+int WriteBehindOutput::write_packet(void* opaque, uint8_t* buffer, int size)
+{
+	WriteBehindOutput* output = (WriteBehindOutput*)opaque;
+
+	int ret = output->append(buffer, size_t(std::max(size, 0)));
+	return (ret < 0) ? ret : size;
+}
+
+int64_t WriteBehindOutput::seek(void* opaque, int64_t offset, int whence)
+{
+	WriteBehindOutput* output = (WriteBehindOutput*)opaque;
+	std::lock_guard<std::mutex> lock(output->m_mutex);
+	int64_t position;
+
+	switch(whence & ~AVSEEK_FORCE)
+	{
+	case AVSEEK_SIZE: return output->m_file_size;
+	case SEEK_SET:    position = offset; break;
+	case SEEK_CUR:    position = output->m_position + offset; break;
+	case SEEK_END:    position = output->m_file_size + offset; break;
+	default:          return AVERROR(EINVAL);
+	}
+
+	if(position < 0)
+		return AVERROR(EINVAL);
+
+	// The buffer being filled is handed over by the next write if it doesn't continue it.
+	output->m_position = position;
+	return position;
+}
+
+int WriteBehindOutput::append(const uint8_t* data, size_t size)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while(size > 0)
+	{
+		if(m_error < 0)
+			return m_error;
+
+		if(m_current.m_data and m_current.m_offset + int64_t(m_current.m_size) != m_position)
+			submit_current();
+
+		if(not m_current.m_data)
+		{
+			while(m_v_free.empty() and m_error == 0)
+				m_cond.wait(lock);
+
+			if(m_error < 0)
+				return m_error;
+
+			m_current.m_data   = m_v_free.back();
+			m_current.m_size   = 0;
+			m_current.m_offset = m_position;
+			m_v_free.pop_back();
+		}
+
+		size_t length = std::min(size, m_buffer_size - m_current.m_size);
+		memcpy(m_current.m_data + m_current.m_size, data, length);
+
+		m_current.m_size += length;
+		m_position       += int64_t(length);
+		m_file_size       = std::max(m_file_size, m_position);
+		data             += length;
+		size             -= length;
+
+		if(m_current.m_size == m_buffer_size)
+			submit_current();
+	}
+
+	return 0;
+}
+
+void WriteBehindOutput::submit_current()
+{
+	if(not m_current.m_data) return;
+
+	m_pending.push_back(m_current);
+	m_current.m_data = NULL;
+	m_cond.notify_all();
+}
+
+void WriteBehindOutput::writer()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while(true)
+	{
+		while(m_pending.empty() and not m_closing)
+			m_cond.wait(lock);
+
+		if(m_pending.empty())
+			return;
+
+		st_buffer buffer = m_pending.front();
+		m_pending.pop_front();
+		lock.unlock();
+
+		// Buffers are written in the order they were filled, so rewritten headers land last.
+		int error = 0;
+		size_t written = 0;
+		while(written < buffer.m_size)
+		{
+			ssize_t ret = pwrite(m_fd, buffer.m_data + written, buffer.m_size - written, buffer.m_offset + int64_t(written));
+			if(ret < 0 and errno == EINTR) continue;
+			if(ret <= 0)
+			{
+				error = AVERROR(ret < 0 ? errno : EIO);
+				break;
+			}
+
+			written += size_t(ret);
+		}
+
+		m_unsynced += written;
+		if(error == 0 and m_fsync_policy == FSYNC_PERIODIC and m_unsynced >= m_fsync_interval)
+		{
+			if(fdatasync(m_fd) != 0) error = AVERROR(errno);
+			m_unsynced = 0;
+		}
+
+		lock.lock();
+		if(error < 0 and m_error == 0) m_error = error;
+		m_v_free.push_back(buffer.m_data);
+		m_cond.notify_all();
+	}
+}
@@ -0,0 +1,130 @@
+/*!
+**************************************************************************************
+ * \file MediaIO.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+extern "C"
+{
+#include "libavformat/avio.h"
+}
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * Input AVIOContext on top of a memory mapping of the whole file. Reads are served from the
+ * mapping without any syscall; the window ahead of the read position is announced to the kernel
+ * with MADV_WILLNEED as reading proceeds and after every seek, on top of MADV_SEQUENTIAL for the
+ * whole mapping. libavformat owns and may reallocate its I/O buffer, so the data is still copied
+ * once from the mapping into that buffer.
+ */
+
+class MappedInput
+{
+public:
+
+	MappedInput();
+	virtual ~MappedInput();
+
+	int open(const std::string& pth_media, size_t readahead = 0);
+	void close();
+
+	bool is_open() const { return m_avio != NULL; }
+	AVIOContext* context() const { return m_avio; }
+
+private:
+
+	static int read_packet(void* opaque, uint8_t* buffer, int size);
+	static int64_t seek(void* opaque, int64_t offset, int whence);
+
+	void advise(size_t position);
+
+	int m_fd;
+	uint8_t* m_data;
+	size_t m_size;
+	size_t m_position;
+	size_t m_readahead;
+	size_t m_advised_begin;
+	size_t m_advised_end;
+	AVIOContext* m_avio;
+};
+
+/*!
+ * Output AVIOContext which hands the muxer's data to a writer thread. Data is gathered in a few
+ * large, page aligned buffers and each full buffer is written with a single pwrite() at its file
+ * offset, so the seeks muxers do to patch headers work as usual. The muxer only waits when all
+ * buffers are queued for writing. Write errors are reported by the next write and by close().
+ *
+ * FSYNC_ON_CLOSE syncs once when the output is closed, FSYNC_PERIODIC additionally syncs after
+ * every fsync_interval bytes.
+ */
+
+class WriteBehindOutput
+{
+public:
+
+	enum e_fsync_policy
+	{
+		FSYNC_NEVER,
+		FSYNC_ON_CLOSE,
+		FSYNC_PERIODIC
+	};
+
+	WriteBehindOutput();
+	virtual ~WriteBehindOutput();
+
+	int open(const std::string& pth_media, size_t buffer_size = 0, size_t numof_buffers = 0,
+			 e_fsync_policy fsync_policy = FSYNC_ON_CLOSE, uint64_t fsync_interval = 0);
+	int close();
+
+	bool is_open() const { return m_avio != NULL; }
+	AVIOContext* context() const { return m_avio; }
+
+private:
+
+	struct st_buffer
+	{
+		uint8_t* m_data;
+		size_t m_size;
+		int64_t m_offset;
+	};
+
+	static int write_packet(void* opaque, uint8_t* buffer, int size);
+	static int64_t seek(void* opaque, int64_t offset, int whence);
+
+	int append(const uint8_t* data, size_t size);
+	void submit_current();
+	void writer();
+
+	int m_fd;
+	AVIOContext* m_avio;
+	size_t m_buffer_size;
+	e_fsync_policy m_fsync_policy;
+	uint64_t m_fsync_interval;
+	uint64_t m_unsynced;
+
+	int64_t m_position;
+	int64_t m_file_size;
+	st_buffer m_current;
+
+	std::vector<uint8_t*> m_v_buffers;
+	std::vector<uint8_t*> m_v_free;
+	std::deque<st_buffer> m_pending;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::thread m_thread;
+	bool m_closing;
+	int m_error;
+};
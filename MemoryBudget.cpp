@@ -0,0 +1,127 @@
+/*!
+**************************************************************************************
+ * \file MemoryBudget.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+MemoryBudget::MemoryBudget(size_t limit)
+{
+	memset(&m_usage, 0, sizeof(m_usage));
+	m_usage.m_limit = limit;
+	m_aborted       = false;
+}
+
+void MemoryBudget::set_limit(size_t limit)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_usage.m_limit = limit;
+	}
+	m_released_cond.notify_all();
+}
+
+size_t MemoryBudget::limit() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_usage.m_limit;
+}
+
+void MemoryBudget::begin()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	size_t limit = m_usage.m_limit;
+	memset(&m_usage, 0, sizeof(m_usage));
+	m_usage.m_limit = limit;
+	m_aborted       = false;
+}
+
+bool MemoryBudget::acquire(e_stage stage, size_t bytes)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	if(m_usage.m_limit > 0 and m_usage.m_bytes[stage] > 0 and m_usage.m_total_bytes + bytes > m_usage.m_limit and not m_aborted)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		m_usage.m_numof_waits++;
+
+		while(m_usage.m_limit > 0 and m_usage.m_bytes[stage] > 0 and m_usage.m_total_bytes + bytes > m_usage.m_limit and not m_aborted)
+			m_released_cond.wait(lock);
+
+		m_usage.m_wait_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	if(m_aborted) return false;
+
+	add(stage, bytes);
+	return true;
+}
+
+void MemoryBudget::charge(e_stage stage, size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	add(stage, bytes);
+}
+
+void MemoryBudget::release(e_stage stage, size_t bytes)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// Counters start over with begin(), a late release of the last job must not wrap them.
+		bytes = std::min(bytes, m_usage.m_bytes[stage]);
+		m_usage.m_bytes[stage] -= bytes;
+		m_usage.m_total_bytes  -= bytes;
+	}
+	m_released_cond.notify_all();
+}
+
+bool MemoryBudget::over_limit() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_usage.m_limit > 0 and m_usage.m_total_bytes > m_usage.m_limit;
+}
+
+size_t MemoryBudget::stage_share() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_usage.m_limit / NUMOF_STAGES;
+}
+
+void MemoryBudget::count_mux_flush()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_usage.m_numof_mux_flushes++;
+}
+
+void MemoryBudget::abort()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_aborted = true;
+	}
+	m_released_cond.notify_all();
+}
+
+MemoryBudget::st_usage MemoryBudget::usage() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_usage;
+}
+
+void MemoryBudget::add(e_stage stage, size_t bytes)
+{
+	m_usage.m_bytes[stage]     += bytes;
+	m_usage.m_total_bytes      += bytes;
+	m_usage.m_peak_bytes[stage] = std::max(m_usage.m_peak_bytes[stage], m_usage.m_bytes[stage]);
+	m_usage.m_peak_total_bytes  = std::max(m_usage.m_peak_total_bytes, m_usage.m_total_bytes);
+}
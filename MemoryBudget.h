@@ -0,0 +1,81 @@
+/*!
+**************************************************************************************
+ * \file MemoryBudget.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+
+/*!
+ * Byte accounting for the places where a transcode holds media data beyond the frame being worked
+ * on: decoded frames queued between pipeline stages, frames buffered inside filter graphs and
+ * packets the muxer holds back for interleaving. The stages share one limit. A producer which
+ * acquire()s memory waits while the limit would be exceeded, as long as its own stage still holds
+ * something that the consumer will release; a stage holding nothing always gets through, so the
+ * budget slows a transcode down but never deadlocks it. A zero limit only counts.
+ */
+
+class MemoryBudget
+{
+public:
+
+	enum e_stage
+	{
+		STAGE_FRAME_QUEUES,
+		STAGE_FILTERS,
+		STAGE_MUX_INTERLEAVE,
+		NUMOF_STAGES
+	};
+
+	struct st_usage
+	{
+		size_t m_limit;
+		size_t m_bytes[NUMOF_STAGES];
+		size_t m_peak_bytes[NUMOF_STAGES];
+		size_t m_total_bytes;
+		size_t m_peak_total_bytes;
+		size_t m_numof_waits;            // Producers held back by the limit.
+		double m_wait_seconds;
+		size_t m_numof_mux_flushes;      // Interleaving queues written out early to get under the limit.
+	};
+
+	explicit MemoryBudget(size_t limit = 0);
+
+	void set_limit(size_t limit);
+	size_t limit() const;
+
+	//! Zeroes the counters for a new job.
+	void begin();
+
+	//! False once abort() was called, the bytes aren't charged then.
+	bool acquire(e_stage stage, size_t bytes);
+	void charge(e_stage stage, size_t bytes);
+	void release(e_stage stage, size_t bytes);
+
+	bool over_limit() const;
+
+	//! An even part of the limit per stage, what a stage may hold before it has to give memory back.
+	size_t stage_share() const;
+	void count_mux_flush();
+
+	//! Wakes up every waiting producer and lets further acquire() calls fail.
+	void abort();
+
+	st_usage usage() const;
+
+private:
+
+	void add(e_stage stage, size_t bytes);
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_released_cond;
+	st_usage m_usage;
+	bool m_aborted;
+};
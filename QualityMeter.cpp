@@ -0,0 +1,519 @@
+/*!
+**************************************************************************************
+ * \file QualityMeter.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "QualityMeter.h"
+
+extern "C"
+{
+#include "libavutil/cpu.h"
+#include "libavutil/pixdesc.h"
+}
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUALITY_METER_X86
+#include <immintrin.h>
+#endif
+
+typedef uint64_t (*sq_error_row_fn)(const uint8_t* a, const uint8_t* b, int n);
+typedef void (*block_sums_row_fn)(const uint8_t* a, int stride_a, const uint8_t* b, int stride_b, int numof_blocks, int32_t* sums);
+
+/**********************/
+/* Scalar row kernels */
+/**********************/
+
+static uint64_t sq_error_row_scalar(const uint8_t* a, const uint8_t* b, int n)
+{
+	uint64_t sum = 0;
+	for(int i=0; i<n; i++)
+	{
+		int d = int(a[i]) - int(b[i]);
+		sum += unsigned(d * d);
+	}
+
+	return sum;
+}
+
+// Sums of a, b, a*a + b*b and a*b over numof_blocks 4x4 blocks side by side. sums holds the four
+// rows of numof_blocks values one after another.
+static void block_sums_row_scalar(const uint8_t* a, int stride_a, const uint8_t* b, int stride_b, int numof_blocks, int32_t* sums)
+{
+	for(int k=0; k<numof_blocks; k++)
+	{
+		int32_t s1 = 0, s2 = 0, ss = 0, s12 = 0;
+		for(int r=0; r<4; r++)
+		{
+			for(int i=0; i<4; i++)
+			{
+				int x = a[r * stride_a + 4 * k + i];
+				int y = b[r * stride_b + 4 * k + i];
+				s1  += x;
+				s2  += y;
+				ss  += x * x + y * y;
+				s12 += x * y;
+			}
+		}
+
+		sums[k]                    = s1;
+		sums[numof_blocks + k]     = s2;
+		sums[2 * numof_blocks + k] = ss;
+		sums[3 * numof_blocks + k] = s12;
+	}
+}
+
+#ifdef QUALITY_METER_X86
+
+/**********************/
+/* SSE4.1 row kernels */
+/**********************/
+
+__attribute__((target("sse4.1")))
+static uint64_t sq_error_row_sse4(const uint8_t* a, const uint8_t* b, int n)
+{
+	__m128i sum = _mm_setzero_si128();
+
+	int i = 0;
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		__m128i d0 = _mm_sub_epi16(_mm_cvtepu8_epi16(va), _mm_cvtepu8_epi16(vb));
+		__m128i d1 = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(va, 8)), _mm_cvtepu8_epi16(_mm_srli_si128(vb, 8)));
+
+		// Each lane gains at most 4 * 255^2 a step, rows of up to 130000 pixels fit.
+		sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(d0, d0), _mm_madd_epi16(d1, d1)));
+	}
+
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i*)lanes, sum);
+
+	return uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3] + sq_error_row_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void block_sums_row_sse4(const uint8_t* a, int stride_a, const uint8_t* b, int stride_b, int numof_blocks, int32_t* sums)
+{
+	const __m128i ones = _mm_set1_epi16(1);
+
+	int k = 0;
+	for(; k + 4 <= numof_blocks; k += 4)
+	{
+		__m128i s1 = _mm_setzero_si128(), s2 = s1, ss = s1, s12 = s1;
+
+		for(int r=0; r<4; r++)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + r * stride_a + 4 * k));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + r * stride_b + 4 * k));
+			__m128i a0 = _mm_cvtepu8_epi16(va), a1 = _mm_cvtepu8_epi16(_mm_srli_si128(va, 8));
+			__m128i b0 = _mm_cvtepu8_epi16(vb), b1 = _mm_cvtepu8_epi16(_mm_srli_si128(vb, 8));
+
+			// madd leaves sums of pixel pairs, hadd joins them into one sum per block.
+			s1  = _mm_add_epi32(s1,  _mm_hadd_epi32(_mm_madd_epi16(a0, ones), _mm_madd_epi16(a1, ones)));
+			s2  = _mm_add_epi32(s2,  _mm_hadd_epi32(_mm_madd_epi16(b0, ones), _mm_madd_epi16(b1, ones)));
+			ss  = _mm_add_epi32(ss,  _mm_hadd_epi32(_mm_add_epi32(_mm_madd_epi16(a0, a0), _mm_madd_epi16(b0, b0)),
+													_mm_add_epi32(_mm_madd_epi16(a1, a1), _mm_madd_epi16(b1, b1))));
+			s12 = _mm_add_epi32(s12, _mm_hadd_epi32(_mm_madd_epi16(a0, b0), _mm_madd_epi16(a1, b1)));
+		}
+
+		_mm_storeu_si128((__m128i*)(sums + k), s1);
+		_mm_storeu_si128((__m128i*)(sums + numof_blocks + k), s2);
+		_mm_storeu_si128((__m128i*)(sums + 2 * numof_blocks + k), ss);
+		_mm_storeu_si128((__m128i*)(sums + 3 * numof_blocks + k), s12);
+	}
+
+	if(k < numof_blocks)
+	{
+		int32_t tail[4 * 3];
+		int n = numof_blocks - k;
+		block_sums_row_scalar(a + 4 * k, stride_a, b + 4 * k, stride_b, n, tail);
+
+		for(int c=0; c<4; c++)
+			std::copy(tail + c * n, tail + (c + 1) * n, sums + c * numof_blocks + k);
+	}
+}
+
+/********************/
+/* AVX2 row kernels */
+/********************/
+
+__attribute__((target("avx2")))
+static uint64_t sq_error_row_avx2(const uint8_t* a, const uint8_t* b, int n)
+{
+	__m256i sum = _mm256_setzero_si256();
+
+	int i = 0;
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		__m256i d0 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(va)), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(vb)));
+		__m256i d1 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1)), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(vb, 1)));
+
+		sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_madd_epi16(d0, d0), _mm256_madd_epi16(d1, d1)));
+	}
+
+	uint32_t lanes[8];
+	_mm256_storeu_si256((__m256i*)lanes, sum);
+
+	uint64_t total = sq_error_row_scalar(a + i, b + i, n - i);
+	for(int l=0; l<8; l++)
+		total += lanes[l];
+
+	return total;
+}
+
+__attribute__((target("avx2")))
+static void block_sums_row_avx2(const uint8_t* a, int stride_a, const uint8_t* b, int stride_b, int numof_blocks, int32_t* sums)
+{
+	const __m256i ones = _mm256_set1_epi16(1);
+
+	int k = 0;
+	for(; k + 8 <= numof_blocks; k += 8)
+	{
+		__m256i s1 = _mm256_setzero_si256(), s2 = s1, ss = s1, s12 = s1;
+
+		for(int r=0; r<4; r++)
+		{
+			__m256i va = _mm256_loadu_si256((const __m256i*)(a + r * stride_a + 4 * k));
+			__m256i vb = _mm256_loadu_si256((const __m256i*)(b + r * stride_b + 4 * k));
+			__m256i a0 = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(va)), a1 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1));
+			__m256i b0 = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(vb)), b1 = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(vb, 1));
+
+			s1  = _mm256_add_epi32(s1,  _mm256_hadd_epi32(_mm256_madd_epi16(a0, ones), _mm256_madd_epi16(a1, ones)));
+			s2  = _mm256_add_epi32(s2,  _mm256_hadd_epi32(_mm256_madd_epi16(b0, ones), _mm256_madd_epi16(b1, ones)));
+			ss  = _mm256_add_epi32(ss,  _mm256_hadd_epi32(_mm256_add_epi32(_mm256_madd_epi16(a0, a0), _mm256_madd_epi16(b0, b0)),
+														  _mm256_add_epi32(_mm256_madd_epi16(a1, a1), _mm256_madd_epi16(b1, b1))));
+			s12 = _mm256_add_epi32(s12, _mm256_hadd_epi32(_mm256_madd_epi16(a0, b0), _mm256_madd_epi16(a1, b1)));
+		}
+
+		// hadd works within 128-bit lanes and leaves blocks 0 1 4 5 2 3 6 7.
+		_mm256_storeu_si256((__m256i*)(sums + k), _mm256_permute4x64_epi64(s1, 0xd8));
+		_mm256_storeu_si256((__m256i*)(sums + numof_blocks + k), _mm256_permute4x64_epi64(s2, 0xd8));
+		_mm256_storeu_si256((__m256i*)(sums + 2 * numof_blocks + k), _mm256_permute4x64_epi64(ss, 0xd8));
+		_mm256_storeu_si256((__m256i*)(sums + 3 * numof_blocks + k), _mm256_permute4x64_epi64(s12, 0xd8));
+	}
+
+	if(k < numof_blocks)
+	{
+		int32_t tail[4 * 7];
+		int n = numof_blocks - k;
+		block_sums_row_scalar(a + 4 * k, stride_a, b + 4 * k, stride_b, n, tail);
+
+		for(int c=0; c<4; c++)
+			std::copy(tail + c * n, tail + (c + 1) * n, sums + c * numof_blocks + k);
+	}
+}
+
+#endif
+
+static sq_error_row_fn sq_error_row()
+{
+	static const sq_error_row_fn kernel = []() -> sq_error_row_fn
+	{
+#ifdef QUALITY_METER_X86
+		int flags = av_get_cpu_flags();
+		if(flags & AV_CPU_FLAG_AVX2) return sq_error_row_avx2;
+		if(flags & AV_CPU_FLAG_SSE4) return sq_error_row_sse4;
+#endif
+		return sq_error_row_scalar;
+	}();
+
+	return kernel;
+}
+
+static block_sums_row_fn block_sums_row()
+{
+	static const block_sums_row_fn kernel = []() -> block_sums_row_fn
+	{
+#ifdef QUALITY_METER_X86
+		int flags = av_get_cpu_flags();
+		if(flags & AV_CPU_FLAG_AVX2) return block_sums_row_avx2;
+		if(flags & AV_CPU_FLAG_SSE4) return block_sums_row_sse4;
+#endif
+		return block_sums_row_scalar;
+	}();
+
+	return kernel;
+}
+
+/*****************/
+/* Plane metrics */
+/*****************/
+
+static double psnr(double mse)
+{
+	return (mse > 0.0) ? std::min(100.0, 10.0 * log10(255.0 * 255.0 / mse)) : 100.0;
+}
+
+static uint64_t plane_sq_error(const uint8_t* a, int stride_a, const uint8_t* b, int stride_b, int width, int height)
+{
+	sq_error_row_fn kernel = sq_error_row();
+
+	uint64_t sum = 0;
+	for(int r=0; r<height; r++)
+		sum += kernel(a + r * stride_a, b + r * stride_b, width);
+
+	return sum;
+}
+
+// SSIM of the 8x8 window made of the 2x2 blocks at column c of two block rows.
+static double window_ssim(const int32_t* top, const int32_t* bottom, int c, int columns)
+{
+	// Constants as x264 scales them for 64 pixel windows.
+	static const double c1 = .01 * .01 * 255 * 255 * 64;
+	static const double c2 = .03 * .03 * 255 * 255 * 64 * 63;
+
+	int64_t s[4];
+	for(int k=0; k<4; k++)
+		s[k] = int64_t(top[k * columns + c]) + top[k * columns + c + 1] + bottom[k * columns + c] + bottom[k * columns + c + 1];
+
+	double vars  = double(s[2] * 64 - s[0] * s[0] - s[1] * s[1]);
+	double covar = double(s[3] * 64 - s[0] * s[1]);
+
+	return (2.0 * s[0] * s[1] + c1) * (2.0 * covar + c2) / ((double(s[0] * s[0] + s[1] * s[1]) + c1) * (vars + c2));
+}
+
+static double plane_ssim(const uint8_t* a, int stride_a, const uint8_t* b, int stride_b, int width, int height, std::vector<int32_t>& v_sums)
+{
+	int columns = width / 4;
+	int rows    = height / 4;
+	if(columns < 2 or rows < 2)
+		return 1.0;
+
+	block_sums_row_fn kernel = block_sums_row();
+
+	v_sums.resize(8 * columns);
+	int32_t* top    = &v_sums[0];
+	int32_t* bottom = &v_sums[4 * columns];
+
+	kernel(a, stride_a, b, stride_b, columns, top);
+
+	double sum = 0.0;
+	for(int r=1; r<rows; r++)
+	{
+		kernel(a + 4 * r * stride_a, stride_a, b + 4 * r * stride_b, stride_b, columns, bottom);
+
+		for(int c=0; c+1<columns; c++)
+			sum += window_ssim(top, bottom, c, columns);
+
+		std::swap(top, bottom);
+	}
+
+	return sum / (double(rows - 1) * (columns - 1));
+}
+
+/****************/
+/* QualityMeter */
+/****************/
+
+QualityMeter::QualityMeter(size_t queue_depth)
+{
+	m_queue_depth = std::max(queue_depth, size_t(1));
+	m_running     = false;
+	m_stopping    = false;
+}
+
+QualityMeter::~QualityMeter()
+{
+	finish();
+}
+
+bool QualityMeter::supports(AVPixelFormat format)
+{
+	switch(format)
+	{
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+	case AV_PIX_FMT_YUV422P:
+	case AV_PIX_FMT_YUVJ422P:
+	case AV_PIX_FMT_YUV444P:
+	case AV_PIX_FMT_YUVJ444P:
+	case AV_PIX_FMT_GRAY8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void QualityMeter::begin(const frame_callback& on_frame)
+{
+	finish();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_totals.clear();
+	m_on_frame = on_frame;
+	m_running  = true;
+	m_stopping = false;
+	m_thread   = std::thread(&QualityMeter::run, this);
+}
+
+void QualityMeter::push(const AVFrame* reference, const AVFrame* encoded, int stream_index, int64_t pts)
+{
+	if(not supports(AVPixelFormat(reference->format)) or reference->format != encoded->format
+	   or reference->width != encoded->width or reference->height != encoded->height)
+		return;
+
+	st_pair pair;
+	pair.m_reference    = av_frame_clone(reference);
+	pair.m_encoded      = av_frame_clone(encoded);
+	pair.m_stream_index = stream_index;
+	pair.m_pts          = pts;
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while(m_running and not m_stopping and m_queue.size() >= m_queue_depth)
+			m_taken_cond.wait(lock);
+
+		if(m_running and not m_stopping and pair.m_reference and pair.m_encoded)
+		{
+			m_queue.push_back(pair);
+			pair.m_reference = pair.m_encoded = NULL;
+		}
+	}
+	m_queued_cond.notify_one();
+
+	av_frame_free(&pair.m_reference);
+	av_frame_free(&pair.m_encoded);
+}
+
+void QualityMeter::finish()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(not m_running)
+			return;
+
+		m_stopping = true;
+	}
+	m_queued_cond.notify_all();
+	m_taken_cond.notify_all();
+
+	m_thread.join();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_running = false;
+}
+
+std::vector<QualityMeter::st_summary> QualityMeter::summary() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::vector<st_summary> v_summary;
+	for(std::map<int, st_totals>::const_iterator it = m_totals.begin(); it != m_totals.end(); ++it)
+	{
+		const st_totals& totals = it->second;
+
+		st_summary summary;
+		summary.m_stream_index = it->first;
+		summary.m_numof_frames = totals.m_numof_frames;
+		summary.m_mean_psnr    = totals.m_sum_psnr / totals.m_numof_frames;
+		summary.m_min_psnr     = totals.m_min_psnr;
+		summary.m_overall_psnr = psnr(totals.m_sum_sq_error / totals.m_numof_samples);
+		summary.m_mean_ssim    = totals.m_sum_ssim / totals.m_numof_frames;
+		summary.m_min_ssim     = totals.m_min_ssim;
+		v_summary.push_back(summary);
+	}
+
+	return v_summary;
+}
+
+void QualityMeter::run()
+{
+	std::vector<int32_t> v_sums;
+
+	while(true)
+	{
+		st_pair pair;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			while(m_queue.empty() and not m_stopping)
+				m_queued_cond.wait(lock);
+
+			// Stopping still scores everything queued before.
+			if(m_queue.empty())
+				break;
+
+			pair = m_queue.front();
+			m_queue.pop_front();
+		}
+		m_taken_cond.notify_one();
+
+		measure(pair, v_sums);
+
+		av_frame_free(&pair.m_reference);
+		av_frame_free(&pair.m_encoded);
+	}
+}
+
+void QualityMeter::measure(const st_pair& pair, std::vector<int32_t>& v_sums)
+{
+	const AVFrame* a = pair.m_reference;
+	const AVFrame* b = pair.m_encoded;
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(a->format));
+	int numof_planes = (a->format == AV_PIX_FMT_GRAY8) ? 1 : 3;
+
+	double v_psnr[3], v_ssim[3];
+	double sq_error = 0.0, numof_samples = 0.0, weighted_ssim = 0.0;
+
+	for(int p=0; p<numof_planes; p++)
+	{
+		int width  = p ? -((-a->width)  >> desc->log2_chroma_w) : a->width;
+		int height = p ? -((-a->height) >> desc->log2_chroma_h) : a->height;
+		double n   = double(width) * height;
+
+		double error = double(plane_sq_error(a->data[p], a->linesize[p], b->data[p], b->linesize[p], width, height));
+		v_psnr[p] = psnr(error / n);
+		v_ssim[p] = plane_ssim(a->data[p], a->linesize[p], b->data[p], b->linesize[p], width, height, v_sums);
+
+		sq_error      += error;
+		numof_samples += n;
+		weighted_ssim += v_ssim[p] * n;
+	}
+
+	// Grey frames report their luma score for the chroma planes.
+	for(int p=numof_planes; p<3; p++)
+		v_psnr[p] = v_psnr[0];
+
+	st_frame_quality quality;
+	quality.m_stream_index = pair.m_stream_index;
+	quality.m_pts          = pair.m_pts;
+	quality.m_psnr_y       = v_psnr[0];
+	quality.m_psnr_u       = v_psnr[1];
+	quality.m_psnr_v       = v_psnr[2];
+	quality.m_psnr         = psnr(sq_error / numof_samples);
+	quality.m_ssim_y       = v_ssim[0];
+	quality.m_ssim         = weighted_ssim / numof_samples;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		std::map<int, st_totals>::iterator it = m_totals.find(pair.m_stream_index);
+		if(it == m_totals.end())
+		{
+			st_totals totals = {0, 0.0, quality.m_psnr, 0.0, 0.0, 0.0, quality.m_ssim};
+			it = m_totals.insert(std::make_pair(pair.m_stream_index, totals)).first;
+		}
+
+		st_totals& totals = it->second;
+		totals.m_numof_frames++;
+		totals.m_sum_psnr      += quality.m_psnr;
+		totals.m_min_psnr       = std::min(totals.m_min_psnr, quality.m_psnr);
+		totals.m_sum_sq_error  += sq_error;
+		totals.m_numof_samples += numof_samples;
+		totals.m_sum_ssim      += quality.m_ssim;
+		totals.m_min_ssim       = std::min(totals.m_min_ssim, quality.m_ssim);
+	}
+
+	if(m_on_frame)
+		m_on_frame(quality);
+}
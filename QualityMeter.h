@@ -0,0 +1,120 @@
+/*!
+**************************************************************************************
+ * \file QualityMeter.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+extern "C"
+{
+#include "libavutil/frame.h"
+}
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+ * Scores encoded pictures against the pictures the encoder was given, on a thread of its own so
+ * the transcode only pays for queueing references. PSNR is computed per plane from the summed
+ * squared error; SSIM follows x264 and libavfilter, with 8x8 windows on a 4 pixel grid built
+ * from 4x4 block sums. Both have SSE4.1 and AVX2 versions picked at run time. Planes that match
+ * exactly score 100 dB. Only 8-bit planar YUV and grey frames of equal size are compared.
+ */
+
+class QualityMeter
+{
+public:
+
+	struct st_frame_quality
+	{
+		int m_stream_index;
+		int64_t m_pts;        // In the encoder's time base.
+		double m_psnr_y;
+		double m_psnr_u;
+		double m_psnr_v;
+		double m_psnr;        // From the squared error of all planes together.
+		double m_ssim_y;
+		double m_ssim;        // Plane scores weighted by their number of samples.
+	};
+
+	struct st_summary
+	{
+		int m_stream_index;
+		size_t m_numof_frames;
+		double m_mean_psnr;
+		double m_min_psnr;
+		double m_overall_psnr; // From the squared error of every frame, which low scoring frames pull down harder.
+		double m_mean_ssim;
+		double m_min_ssim;
+	};
+
+	//! Called on the meter's thread for every scored frame.
+	typedef std::function<void(const st_frame_quality&)> frame_callback;
+
+	//! Producers wait in push() while queue_depth pairs are waiting to be scored.
+	explicit QualityMeter(size_t queue_depth = 8);
+	~QualityMeter();
+
+	static bool supports(AVPixelFormat format);
+
+	//! Clears the scores of the last job and starts the thread.
+	void begin(const frame_callback& on_frame = frame_callback());
+
+	//! Queues references to both frames. Frames of different sizes or formats are skipped, and so
+	//! is everything pushed while the meter isn't running.
+	void push(const AVFrame* reference, const AVFrame* encoded, int stream_index, int64_t pts);
+
+	//! Scores what's still queued and stops the thread.
+	void finish();
+
+	std::vector<st_summary> summary() const;
+
+private:
+
+	struct st_pair
+	{
+		AVFrame* m_reference;
+		AVFrame* m_encoded;
+		int m_stream_index;
+		int64_t m_pts;
+	};
+
+	struct st_totals
+	{
+		size_t m_numof_frames;
+		double m_sum_psnr;
+		double m_min_psnr;
+		double m_sum_sq_error;
+		double m_numof_samples;
+		double m_sum_ssim;
+		double m_min_ssim;
+	};
+
+	QualityMeter(const QualityMeter&);
+	QualityMeter& operator=(const QualityMeter&);
+
+	void run();
+	void measure(const st_pair& pair, std::vector<int32_t>& v_sums);
+
+	size_t m_queue_depth;
+	frame_callback m_on_frame;
+	std::thread m_thread;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_queued_cond;
+	std::condition_variable m_taken_cond;
+	std::deque<st_pair> m_queue;
+	bool m_running;
+	bool m_stopping;
+
+	std::map<int, st_totals> m_totals;
+};
@@ -0,0 +1,234 @@
+/*!
+**************************************************************************************
+ * \file SpriteSheet.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "SpriteSheet.h"
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+static std::string vtt_time(double seconds)
+{
+	int64_t milliseconds = llround(std::max(seconds, 0.0) * 1000.0);
+
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%02d:%02d:%02d.%03d", int(milliseconds / 3600000), int(milliseconds / 60000 % 60),
+			 int(milliseconds / 1000 % 60), int(milliseconds % 1000));
+	return buffer;
+}
+
+SpriteSheet::SpriteSheet(const std::string& path_pattern, AVCodecID codec_id, int columns, int rows, int quality)
+{
+	m_path_pattern      = path_pattern;
+	m_codec_id          = codec_id;
+	m_columns           = std::max(columns, 1);
+	m_rows              = std::max(rows, 1);
+	m_quality           = quality;
+	m_tile_width        = 0;
+	m_tile_height       = 0;
+	m_encoder           = NULL;
+	m_sheet             = NULL;
+	m_numof_sheets      = 0;
+	m_numof_sheet_tiles = 0;
+}
+
+SpriteSheet::~SpriteSheet()
+{
+	if(m_encoder)
+	{
+		avcodec_close(m_encoder);
+		av_freep(&m_encoder);
+	}
+
+	av_frame_free(&m_sheet);
+}
+
+int SpriteSheet::open(int tile_width, int tile_height)
+{
+	AVCodec* encoder = avcodec_find_encoder(m_codec_id);
+	if(not encoder or not encoder->pix_fmts)
+		return AVERROR_ENCODER_NOT_FOUND;
+
+	m_encoder = avcodec_alloc_context3(encoder);
+	if(not m_encoder)
+		return AVERROR(ENOMEM);
+
+	m_tile_width  = tile_width;
+	m_tile_height = tile_height;
+
+	// MJPEG lists its full range formats first, which is what JPEG viewers expect.
+	m_encoder->pix_fmt   = encoder->pix_fmts[0];
+	m_encoder->width     = m_columns * m_tile_width;
+	m_encoder->height    = m_rows * m_tile_height;
+	m_encoder->time_base = av_make_q(1, 1);
+
+	if(m_codec_id == AV_CODEC_ID_MJPEG)
+	{
+		m_encoder->flags         |= CODEC_FLAG_QSCALE;
+		m_encoder->global_quality = FF_QP2LAMBDA * m_quality;
+	}
+
+	int ret = avcodec_open2(m_encoder, encoder, NULL);
+	if(ret < 0)
+		return ret;
+
+	m_sheet = av_frame_alloc();
+	if(not m_sheet)
+		return AVERROR(ENOMEM);
+
+	m_sheet->format = m_encoder->pix_fmt;
+	m_sheet->width  = m_encoder->width;
+	m_sheet->height = m_encoder->height;
+
+	if((ret = av_frame_get_buffer(m_sheet, 32)) < 0)
+		return ret;
+
+	clear_sheet();
+	return 0;
+}
+
+int SpriteSheet::add_tile(const AVFrame* tile, double start_time, double end_time)
+{
+	int ret;
+	if(m_numof_sheet_tiles == m_columns * m_rows and (ret = write_sheet()) < 0)
+		return ret;
+
+	AVPixelFormat pix_fmt          = m_encoder->pix_fmt;
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pix_fmt);
+
+	st_cue cue;
+	cue.m_start_time = start_time;
+	cue.m_end_time   = end_time;
+	cue.m_sheet      = m_numof_sheets;
+	cue.m_x          = (m_numof_sheet_tiles % m_columns) * m_tile_width;
+	cue.m_y          = (m_numof_sheet_tiles / m_columns) * m_tile_height;
+
+	// Byte widths of the left margin and of the tile in every plane.
+	int v_offsets[4], v_widths[4];
+	av_image_fill_linesizes(v_offsets, pix_fmt, cue.m_x);
+	av_image_fill_linesizes(v_widths, pix_fmt, std::min(tile->width, m_tile_width));
+
+	int height = std::min(tile->height, m_tile_height);
+	for(int p=0; p<av_pix_fmt_count_planes(pix_fmt); p++)
+	{
+		int shift = (p == 1 or p == 2) ? desc->log2_chroma_h : 0;
+
+		av_image_copy_plane(m_sheet->data[p] + (cue.m_y >> shift) * m_sheet->linesize[p] + v_offsets[p], m_sheet->linesize[p],
+							tile->data[p], tile->linesize[p], v_widths[p], -((-height) >> shift));
+	}
+
+	m_v_cues.push_back(cue);
+	m_numof_sheet_tiles++;
+	return 0;
+}
+
+void SpriteSheet::extend_tile(double end_time)
+{
+	if(not m_v_cues.empty())
+		m_v_cues.back().m_end_time = std::max(m_v_cues.back().m_end_time, end_time);
+}
+
+int SpriteSheet::finish()
+{
+	return (m_numof_sheet_tiles > 0) ? write_sheet() : 0;
+}
+
+bool SpriteSheet::numbered_path() const
+{
+	char path[4096];
+	return av_get_frame_filename(path, sizeof(path), m_path_pattern.c_str(), 1) >= 0;
+}
+
+std::string SpriteSheet::sheet_path(int sheet) const
+{
+	char path[4096];
+	if(av_get_frame_filename(path, sizeof(path), m_path_pattern.c_str(), sheet + 1) < 0)
+		return m_path_pattern;
+
+	return path;
+}
+
+bool SpriteSheet::write_vtt(const std::string& path) const
+{
+	std::ofstream file(path.c_str(), std::ios::trunc);
+	if(not file)
+		return false;
+
+	file << "WEBVTT\n";
+
+	// Sheets are referred to by file name, so the index belongs next to them.
+	for(size_t c=0; c<m_v_cues.size(); c++)
+	{
+		const st_cue& cue = m_v_cues[c];
+
+		std::string sheet = sheet_path(cue.m_sheet);
+		sheet = sheet.substr(sheet.find_last_of('/') + 1);
+
+		file << "\n" << vtt_time(cue.m_start_time) << " --> " << vtt_time(cue.m_end_time) << "\n"
+			 << sheet << "#xywh=" << cue.m_x << "," << cue.m_y << "," << m_tile_width << "," << m_tile_height << "\n";
+	}
+
+	return bool(file);
+}
+
+void SpriteSheet::clear_sheet()
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(m_sheet->format));
+	bool yuv = not (desc->flags & AV_PIX_FMT_FLAG_RGB);
+
+	for(int p=0; p<av_pix_fmt_count_planes(AVPixelFormat(m_sheet->format)); p++)
+	{
+		bool chroma = yuv and (p == 1 or p == 2);
+		int height  = chroma ? -((-m_sheet->height) >> desc->log2_chroma_h) : m_sheet->height;
+
+		memset(m_sheet->data[p], chroma ? 128 : 0, size_t(m_sheet->linesize[p]) * height);
+	}
+
+	m_numof_sheet_tiles = 0;
+}
+
+int SpriteSheet::write_sheet()
+{
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.data = NULL;
+	packet.size = 0;
+
+	int got_packet   = 0;
+	m_sheet->pts     = m_numof_sheets;
+	m_sheet->quality = m_encoder->global_quality;
+
+	int ret = avcodec_encode_video2(m_encoder, &packet, m_sheet, &got_packet);
+	if(ret < 0)
+		return ret;
+
+	// Image encoders have no delay, every sheet comes out right away.
+	if(not got_packet)
+		return AVERROR_UNKNOWN;
+
+	std::ofstream file(sheet_path(m_numof_sheets).c_str(), std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(packet.data), packet.size);
+	av_free_packet(&packet);
+
+	if(not file)
+		return AVERROR(EIO);
+
+	m_numof_sheets++;
+	clear_sheet();
+	return 0;
+}
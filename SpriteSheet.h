@@ -0,0 +1,87 @@
+/*!
+**************************************************************************************
+ * \file SpriteSheet.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#include <string>
+#include <vector>
+
+/*!
+ * Packs equally sized thumbnails row by row into a grid of columns x rows tiles and writes each
+ * full grid as one JPEG or PNG image; tiles left over on the last sheet stay black. write_vtt()
+ * writes the WebVTT index players use for scrub previews, one cue per time range pointing at its
+ * tile with a "#xywh=" fragment. Sheets are named by a printf pattern such as "sprite_%03d.jpg",
+ * numbered from 1; a path without one is fine for a single sheet.
+ */
+
+class SpriteSheet
+{
+public:
+
+	//! quality is the JPEG qscale, from 2 (best) to 31; PNG ignores it.
+	SpriteSheet(const std::string& path_pattern, AVCodecID codec_id, int columns, int rows, int quality = 5);
+	~SpriteSheet();
+
+	//! Opens the encoder for sheets of tile_width x tile_height tiles. Both must be even.
+	int open(int tile_width, int tile_height);
+
+	//! Tiles must be in the encoder's pixel format and of the tile size.
+	AVCodecContext* encoder() const { return m_encoder; }
+
+	int add_tile(const AVFrame* tile, double start_time, double end_time);
+
+	//! Lets the last tile cover up to end_time too, for ranges which would show the same picture.
+	void extend_tile(double end_time);
+
+	//! Writes the sheet holding the last tiles.
+	int finish();
+
+	bool numbered_path() const;
+	std::string sheet_path(int sheet) const;
+	bool write_vtt(const std::string& path) const;
+
+	int numof_tiles() const { return int(m_v_cues.size()); }
+
+private:
+
+	struct st_cue
+	{
+		double m_start_time;
+		double m_end_time;
+		int m_sheet;
+		int m_x;
+		int m_y;
+	};
+
+	SpriteSheet(const SpriteSheet&);
+	SpriteSheet& operator=(const SpriteSheet&);
+
+	void clear_sheet();
+	int write_sheet();
+
+	std::string m_path_pattern;
+	AVCodecID m_codec_id;
+	int m_columns;
+	int m_rows;
+	int m_quality;
+	int m_tile_width;
+	int m_tile_height;
+
+	AVCodecContext* m_encoder;
+	AVFrame* m_sheet;
+	int m_numof_sheets;       // Sheets written so far.
+	int m_numof_sheet_tiles;  // Tiles on the sheet being filled.
+
+	std::vector<st_cue> m_v_cues;
+};
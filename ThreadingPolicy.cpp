@@ -0,0 +1,136 @@
+/*!
+**************************************************************************************
+ * \file ThreadingPolicy.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "ThreadingPolicy.h"
+
+#include <algorithm>
+#include <thread>
+
+static int hardware_cores()
+{
+	return std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+CoreBudget::CoreBudget(int cores, int expected_holders)
+{
+	m_cores            = (cores > 0) ? cores : hardware_cores();
+	m_expected_holders = std::max(1, expected_holders);
+	m_in_use           = 0;
+	m_holders          = 0;
+}
+
+int CoreBudget::acquire(int requested_cores)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	int available = m_cores - m_in_use;
+	int cores     = requested_cores;
+
+	if(cores <= 0 and m_holders < m_expected_holders)
+		cores = available / (m_expected_holders - m_holders);
+	else if(cores <= 0)
+		cores = m_cores / (m_holders + 1);
+
+	cores = std::max(1, std::min(cores, available));
+
+	m_in_use += cores;
+	m_holders++;
+
+	return cores;
+}
+
+void CoreBudget::release(int cores)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_in_use  = std::max(0, m_in_use - cores);
+	m_holders = std::max(0, m_holders - 1);
+}
+
+int CoreBudget::cores() const
+{
+	return m_cores;
+}
+
+int CoreBudget::available() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return std::max(0, m_cores - m_in_use);
+}
+
+ThreadingPolicy::ThreadingPolicy()
+{
+	m_budget          = NULL;
+	m_requested_cores = 0;
+}
+
+void ThreadingPolicy::set_threading(AVMediaType media_type, bool encoder, int thread_count, e_thread_type thread_type)
+{
+	st_codec_threading threading = {thread_count, thread_type};
+	m_media_threading[std::make_pair(int(media_type), encoder)] = threading;
+}
+
+void ThreadingPolicy::set_stream_threading(int stream_index, bool encoder, int thread_count, e_thread_type thread_type)
+{
+	st_codec_threading threading = {thread_count, thread_type};
+	m_stream_threading[std::make_pair(stream_index, encoder)] = threading;
+}
+
+void ThreadingPolicy::set_core_budget(CoreBudget* budget, int requested_cores)
+{
+	m_budget          = budget;
+	m_requested_cores = requested_cores;
+}
+
+int ThreadingPolicy::reserve_cores() const
+{
+	if(m_budget) return m_budget->acquire(m_requested_cores);
+
+	return (m_requested_cores > 0) ? m_requested_cores : hardware_cores();
+}
+
+void ThreadingPolicy::release_cores(int cores) const
+{
+	if(m_budget) m_budget->release(cores);
+}
+
+void ThreadingPolicy::apply(AVCodecContext* ctx, int stream_index, bool encoder, int cores) const
+{
+	st_codec_threading threading = this->threading(ctx->codec_type, stream_index, encoder);
+	int thread_count = threading.m_thread_count;
+
+	cores = std::max(1, cores);
+	if(thread_count <= 0)
+	{
+		// Decoding is cheap next to encoding, the encoder gets the larger part of the cores.
+		if(ctx->codec_type != AVMEDIA_TYPE_VIDEO) thread_count = 1;
+		else if(encoder)                          thread_count = std::max(1, cores - cores / 4);
+		else                                      thread_count = std::max(1, cores / 4);
+	}
+
+	ctx->thread_count = thread_count;
+
+	if(threading.m_thread_type == THREAD_FRAME)      ctx->thread_type = FF_THREAD_FRAME;
+	else if(threading.m_thread_type == THREAD_SLICE) ctx->thread_type = FF_THREAD_SLICE;
+	else                                             ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+ThreadingPolicy::st_codec_threading ThreadingPolicy::threading(AVMediaType media_type, int stream_index, bool encoder) const
+{
+	std::map<std::pair<int, bool>, st_codec_threading>::const_iterator it;
+
+	it = m_stream_threading.find(std::make_pair(stream_index, encoder));
+	if(it != m_stream_threading.end()) return it->second;
+
+	it = m_media_threading.find(std::make_pair(int(media_type), encoder));
+	if(it != m_media_threading.end()) return it->second;
+
+	st_codec_threading automatic = {0, THREAD_AUTO};
+	return automatic;
+}
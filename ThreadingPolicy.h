@@ -0,0 +1,97 @@
+/*!
+**************************************************************************************
+ * \file ThreadingPolicy.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+/*!
+ * A number of cores shared by every transcoder that runs at the same time in one process. Each
+ * transcoder takes its share when it starts and gives it back when it is done. A transcoder which
+ * doesn't ask for a fixed number gets a fair share of the free cores, split among the holders the
+ * budget still expects. Holders beyond those expected share the total with everyone holding cores.
+ * Nobody gets fewer than one core, so a budget which is used up is exceeded by one thread per
+ * transcoder rather than stalling it.
+ */
+
+class CoreBudget
+{
+public:
+
+	explicit CoreBudget(int cores = 0, int expected_holders = 1);
+
+	int acquire(int requested_cores = 0);
+	void release(int cores);
+
+	int cores() const;
+	int available() const;
+
+private:
+
+	mutable std::mutex m_mutex;
+	int m_cores;
+	int m_expected_holders;
+	int m_in_use;
+	int m_holders;
+};
+
+/*!
+ * Decides thread_count and thread_type of every decoder and encoder a transcoder opens. Settings
+ * can be given per media type and direction, and overridden per input stream. A thread count of
+ * zero lets the policy pick one from the cores the transcoder holds: audio codecs get a single
+ * thread, a video decoder a quarter of the cores and a video encoder the rest.
+ */
+
+class ThreadingPolicy
+{
+public:
+
+	enum e_thread_type
+	{
+		THREAD_AUTO,     // Frame and slice threading, libavcodec uses what the codec supports.
+		THREAD_FRAME,
+		THREAD_SLICE
+	};
+
+	struct st_codec_threading
+	{
+		int m_thread_count;
+		e_thread_type m_thread_type;
+	};
+
+	ThreadingPolicy();
+
+	void set_threading(AVMediaType media_type, bool encoder, int thread_count, e_thread_type thread_type = THREAD_AUTO);
+	void set_stream_threading(int stream_index, bool encoder, int thread_count, e_thread_type thread_type = THREAD_AUTO);
+
+	//! Cores are taken from the budget from now on, zero requested cores means a fair share.
+	void set_core_budget(CoreBudget* budget, int requested_cores = 0);
+
+	int reserve_cores() const;
+	void release_cores(int cores) const;
+
+	void apply(AVCodecContext* ctx, int stream_index, bool encoder, int cores) const;
+
+private:
+
+	st_codec_threading threading(AVMediaType media_type, int stream_index, bool encoder) const;
+
+	std::map<std::pair<int, bool>, st_codec_threading> m_media_threading;
+	std::map<std::pair<int, bool>, st_codec_threading> m_stream_threading;
+
+	CoreBudget* m_budget;
+	int m_requested_cores;
+};
@@ -0,0 +1,167 @@
+/*!
+**************************************************************************************
+ * \file TraceRecorder.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "TraceRecorder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+static std::atomic<uint64_t> g_next_generation(1);
+
+// Buffer of the recorder generation the calling thread recorded into last.
+struct st_thread_cache
+{
+	uint64_t m_generation;
+	void* m_buffer;
+};
+
+static thread_local st_thread_cache tl_cache = {0, NULL};
+
+static std::string microseconds(int64_t nanoseconds)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.3f", double(nanoseconds) * 1e-3);
+	return buffer;
+}
+
+static std::string escaped(const std::string& text)
+{
+	std::string result;
+	for(size_t i=0; i<text.size(); i++)
+	{
+		if(text[i] == '"' or text[i] == '\\') result += '\\';
+		if(static_cast<unsigned char>(text[i]) >= 0x20) result += text[i];
+	}
+	return result;
+}
+
+TraceRecorder::TraceRecorder(size_t events_per_thread)
+{
+	m_events_per_thread = std::max<size_t>(events_per_thread, 1);
+	m_epoch             = clock::now();
+	m_generation        = g_next_generation.fetch_add(1);
+}
+
+void TraceRecorder::begin()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Threads of the last job are gone, a new generation keeps their cached pointers from being used.
+	m_v_buffers.clear();
+	m_generation = g_next_generation.fetch_add(1);
+	m_epoch      = clock::now();
+}
+
+void TraceRecorder::record(const char* name, int stream_index, int64_t pts, clock::time_point start, clock::time_point end)
+{
+	st_thread_buffer* buffer = thread_buffer();
+
+	uint64_t written = buffer->m_written.load(std::memory_order_relaxed);
+	st_event& event  = buffer->m_v_events[written % m_events_per_thread];
+
+	event.m_name         = name;
+	event.m_stream_index = stream_index;
+	event.m_pts          = pts;
+	event.m_start        = std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_epoch).count();
+	event.m_duration     = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+	buffer->m_written.store(written + 1, std::memory_order_release);
+}
+
+void TraceRecorder::name_thread(const std::string& name)
+{
+	st_thread_buffer* buffer = thread_buffer();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	buffer->m_name = name;
+}
+
+TraceRecorder::st_thread_buffer* TraceRecorder::thread_buffer()
+{
+	if(tl_cache.m_generation == m_generation)
+		return static_cast<st_thread_buffer*>(tl_cache.m_buffer);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	st_thread_buffer* buffer = new st_thread_buffer;
+	buffer->m_tid = int(m_v_buffers.size()) + 1;
+	buffer->m_v_events.resize(m_events_per_thread);
+	buffer->m_written.store(0);
+	m_v_buffers.push_back(std::unique_ptr<st_thread_buffer>(buffer));
+
+	tl_cache.m_generation = m_generation;
+	tl_cache.m_buffer     = buffer;
+	return buffer;
+}
+
+std::string TraceRecorder::json() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::ostringstream text;
+	uint64_t numof_overwritten = 0;
+	bool first = true;
+
+	text << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+	for(size_t b=0; b<m_v_buffers.size(); b++)
+	{
+		const st_thread_buffer& buffer = *m_v_buffers[b];
+
+		if(not buffer.m_name.empty())
+		{
+			text << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer.m_tid
+			     << ",\"args\":{\"name\":\"" << escaped(buffer.m_name) << "\"}}";
+			first = false;
+		}
+
+		// Spans recorded while dumping may be torn, dump after the job for an exact timeline.
+		uint64_t written = buffer.m_written.load(std::memory_order_acquire);
+		uint64_t kept    = std::min<uint64_t>(written, m_events_per_thread);
+		numof_overwritten += written - kept;
+
+		for(uint64_t e=written-kept; e<written; e++)
+		{
+			const st_event& event = buffer.m_v_events[e % m_events_per_thread];
+
+			text << (first ? "" : ",") << "\n{\"name\":\"" << event.m_name << "\",\"cat\":\"transcode\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+			     << buffer.m_tid << ",\"ts\":" << microseconds(event.m_start) << ",\"dur\":" << microseconds(event.m_duration) << ",\"args\":{";
+
+			bool first_arg = true;
+			if(event.m_stream_index >= 0)
+			{
+				text << "\"stream\":" << event.m_stream_index;
+				first_arg = false;
+			}
+			if(event.m_pts != std::numeric_limits<int64_t>::min())
+				text << (first_arg ? "" : ",") << "\"pts\":" << event.m_pts;
+
+			text << "}}";
+			first = false;
+		}
+	}
+
+	text << "\n],\"otherData\":{\"overwritten_events\":" << numof_overwritten << "}}\n";
+	return text.str();
+}
+
+bool TraceRecorder::write(const std::string& path) const
+{
+	std::string text = json();
+
+	std::ofstream file(path.c_str(), std::ios::trunc);
+	if(not file)
+		return false;
+
+	file << text;
+	return bool(file);
+}
@@ -0,0 +1,105 @@
+/*!
+**************************************************************************************
+ * \file TraceRecorder.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*!
+ * Timeline of the work a transcode did, one span per packet or frame and pipeline step. Every
+ * thread writes into its own ring buffer, so recording takes no lock and only the newest spans of
+ * a long job are kept. write() dumps the spans in the Chrome trace event format, which
+ * chrome://tracing and ui.perfetto.dev open; spans of one thread nest, e.g. encode and mux within
+ * the filter step which called them.
+ */
+
+class TraceRecorder
+{
+public:
+
+	typedef std::chrono::steady_clock clock;
+
+	struct st_event
+	{
+		const char* m_name;      // A string literal, it isn't copied.
+		int m_stream_index;
+		int64_t m_pts;
+		int64_t m_start;         // Nanoseconds since begin().
+		int64_t m_duration;
+	};
+
+	explicit TraceRecorder(size_t events_per_thread = 65536);
+
+	//! Drops every span recorded so far. No thread may record while it runs.
+	void begin();
+
+	void record(const char* name, int stream_index, int64_t pts, clock::time_point start, clock::time_point end);
+
+	//! Labels the calling thread in the timeline.
+	void name_thread(const std::string& name);
+
+	std::string json() const;
+	bool write(const std::string& path) const;
+
+private:
+
+	struct st_thread_buffer
+	{
+		int m_tid;
+		std::string m_name;
+		std::vector<st_event> m_v_events;
+		std::atomic<uint64_t> m_written;
+	};
+
+	st_thread_buffer* thread_buffer();
+
+	size_t m_events_per_thread;
+	clock::time_point m_epoch;
+	uint64_t m_generation;   // Unique over all recorders, tells threads their cached buffer is stale.
+
+	mutable std::mutex m_mutex;
+	std::vector<std::unique_ptr<st_thread_buffer> > m_v_buffers;
+};
+
+/*!
+ * Records a span from its construction to the end of its scope. Does nothing without a recorder,
+ * which keeps untraced jobs at the cost of a pointer test.
+ */
+class TraceSpan
+{
+public:
+
+	TraceSpan(TraceRecorder* recorder, const char* name, int stream_index, int64_t pts)
+	: m_recorder(recorder), m_name(name), m_stream_index(stream_index), m_pts(pts)
+	{
+		if(m_recorder) m_start = TraceRecorder::clock::now();
+	}
+
+	~TraceSpan()
+	{
+		if(m_recorder) m_recorder->record(m_name, m_stream_index, m_pts, m_start, TraceRecorder::clock::now());
+	}
+
+private:
+
+	TraceSpan(const TraceSpan&);
+	TraceSpan& operator=(const TraceSpan&);
+
+	TraceRecorder* m_recorder;
+	const char* m_name;
+	int m_stream_index;
+	int64_t m_pts;
+	TraceRecorder::clock::time_point m_start;
+};
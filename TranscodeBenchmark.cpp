@@ -0,0 +1,702 @@
+/*!
+**************************************************************************************
+ * \file TranscodeBenchmark.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+/*!
+ * Benchmark executable. It generates synthetic inputs with lavfi's testsrc and sine sources,
+ * which are identical on every run and machine, and measures:
+ *   - end-to-end transcoding throughput of every execution mode, with per-stage times taken from
+ *     the transcoder's metrics,
+ *   - find_next_packet(), decode_packet() and filter_encode_write_frame() on their own.
+ * Results are written as JSON, one benchmark per line, and can be compared against an earlier
+ * result file. A benchmark whose score (higher is better) drops by more than the tolerance counts
+ * as a regression and makes the exit code non-zero. Pipelined mode runs the serial steps on more
+ * threads, so its output is also checked against the serial output byte for byte; a mismatch
+ * makes the exit code non-zero as well.
+ *
+ * Built as the TranscodeBenchmark target of CMakeLists.txt, which needs FFmpeg including
+ * libavdevice through pkg-config:
+ *   cmake -S . -B build && cmake --build build --target TranscodeBenchmark
+ *
+ * Usage: TranscodeBenchmark [--quick] [--repeat N] [--work-dir DIR] [--output FILE]
+ *                           [--baseline FILE] [--tolerance FRACTION]
+ */
+
+#include "VideoTranscoder.h"
+
+extern "C"
+{
+#include "libavdevice/avdevice.h"
+}
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+// Decoded frames held for the filter micro-benchmark, enough to fill the encoder's lookahead.
+static const int MICRO_FRAMES = 60;
+
+/*************************/
+/* Synthetic Inputs */
+/*************************/
+
+struct st_fixture
+{
+	const char* m_name;
+	const char* m_encoder;
+	int m_width;
+	int m_height;
+	int m_frame_rate;
+	int m_seconds;
+	int64_t m_bit_rate;
+	bool m_quick;          // Part of the --quick subset.
+};
+
+static const st_fixture FIXTURES[] =
+{
+	{"mpeg4_360p",  "mpeg4",      640,  360,  30, 10, 1000000,  true},
+	{"mpeg4_720p",  "mpeg4",      1280, 720,  30, 10, 4000000,  true},
+	{"mpeg2_1080p", "mpeg2video", 1920, 1080, 25, 5,  12000000, false},
+	{"h264_720p",   "libx264",    1280, 720,  30, 10, 3000000,  false}
+};
+
+static bool file_exists(const string& path)
+{
+	struct stat status;
+	return stat(path.c_str(), &status) == 0 and status.st_size > 0;
+}
+
+static string read_file(const string& path)
+{
+	ifstream file(path.c_str(), ios::binary);
+	return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+static int encode_write(AVFormatContext* ofmt_ctx, int stream_index, AVFrame* frame, bool& got_packet)
+{
+	AVCodecContext* enc_ctx = ofmt_ctx->streams[stream_index]->codec;
+
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.data = NULL;
+	packet.size = 0;
+
+	int got = 0;
+	int ret = (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_encode_video2(enc_ctx, &packet, frame, &got)
+	                                                      : avcodec_encode_audio2(enc_ctx, &packet, frame, &got);
+	got_packet = (ret >= 0 and got);
+	if(not got_packet) return ret;
+
+	packet.stream_index = stream_index;
+	av_packet_rescale_ts(&packet, enc_ctx->time_base, ofmt_ctx->streams[stream_index]->time_base);
+	return av_interleaved_write_frame(ofmt_ctx, &packet);
+}
+
+static int open_fixture_encoder(AVFormatContext* ofmt_ctx, AVCodecContext* dec_ctx, const st_fixture& fixture)
+{
+	AVCodec* encoder = avcodec_find_encoder_by_name(dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? fixture.m_encoder : "mp2");
+	if(not encoder) return AVERROR_ENCODER_NOT_FOUND;
+
+	AVStream* stream = avformat_new_stream(ofmt_ctx, encoder);
+	if(not stream) return AVERROR(ENOMEM);
+
+	AVCodecContext* enc_ctx = stream->codec;
+	if(dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+	{
+		enc_ctx->width        = fixture.m_width;
+		enc_ctx->height       = fixture.m_height;
+		enc_ctx->pix_fmt      = AV_PIX_FMT_YUV420P;
+		enc_ctx->time_base    = av_make_q(1, fixture.m_frame_rate);
+		enc_ctx->bit_rate     = fixture.m_bit_rate;
+		enc_ctx->max_b_frames = 2;
+
+		// One second GOPs give segmented mode something to split.
+		enc_ctx->gop_size = fixture.m_frame_rate;
+	}
+	else
+	{
+		enc_ctx->sample_rate    = dec_ctx->sample_rate;
+		enc_ctx->channels       = dec_ctx->channels;
+		enc_ctx->channel_layout = av_get_default_channel_layout(dec_ctx->channels);
+		enc_ctx->sample_fmt     = dec_ctx->sample_fmt;
+		enc_ctx->time_base      = av_make_q(1, dec_ctx->sample_rate);
+		enc_ctx->bit_rate       = 128000;
+	}
+
+	// The same fixture has to come out on every machine.
+	enc_ctx->thread_count = 1;
+	enc_ctx->flags |= CODEC_FLAG_BITEXACT;
+
+	if(ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		enc_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+	int ret = avcodec_open2(enc_ctx, encoder, NULL);
+	stream->time_base = enc_ctx->time_base;
+	return ret;
+}
+
+static int write_fixture(AVFormatContext* ifmt_ctx, AVFormatContext* ofmt_ctx)
+{
+	int ret = avformat_write_header(ofmt_ctx, NULL);
+	if(ret < 0) return ret;
+
+	AVFrame* frame = av_frame_alloc();
+	if(not frame) return AVERROR(ENOMEM);
+
+	vector<int64_t> v_next_pts(ifmt_ctx->nb_streams, 0);
+	bool got_packet;
+
+	AVPacket packet;
+	av_init_packet(&packet);
+	while(ret >= 0 and av_read_frame(ifmt_ctx, &packet) >= 0)
+	{
+		int stream_index        = packet.stream_index;
+		AVCodecContext* dec_ctx = ifmt_ctx->streams[stream_index]->codec;
+
+		int got_frame = 0;
+		ret = (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2(dec_ctx, frame, &got_frame, &packet)
+		                                                  : avcodec_decode_audio4(dec_ctx, frame, &got_frame, &packet);
+		av_free_packet(&packet);
+
+		if(ret >= 0 and got_frame)
+		{
+			// Generated sources have no gaps, counting frames and samples gives exact timestamps.
+			frame->pts = v_next_pts[stream_index];
+			v_next_pts[stream_index] += (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? 1 : frame->nb_samples;
+			frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+			ret = encode_write(ofmt_ctx, stream_index, frame, got_packet);
+		}
+		av_frame_unref(frame);
+	}
+
+	for(unsigned int i=0; ret >= 0 and i<ofmt_ctx->nb_streams; i++)
+	{
+		if(not (ofmt_ctx->streams[i]->codec->codec->capabilities & CODEC_CAP_DELAY)) continue;
+
+		do ret = encode_write(ofmt_ctx, int(i), NULL, got_packet);
+		while(ret >= 0 and got_packet);
+	}
+
+	av_frame_free(&frame);
+	if(ret >= 0) ret = av_write_trailer(ofmt_ctx);
+
+	return ret;
+}
+
+static bool generate_fixture(const st_fixture& fixture, const string& path)
+{
+	ostringstream graph;
+	graph << "testsrc=size=" << fixture.m_width << "x" << fixture.m_height << ":rate=" << fixture.m_frame_rate
+	      << ":duration=" << fixture.m_seconds << ",format=yuv420p[out0];"
+	      << "sine=frequency=440:sample_rate=48000:samples_per_frame=1152:duration=" << fixture.m_seconds << "[out1]";
+
+	AVFormatContext* ifmt_ctx = NULL;
+	AVFormatContext* ofmt_ctx = NULL;
+
+	int ret = avformat_open_input(&ifmt_ctx, graph.str().c_str(), av_find_input_format("lavfi"), NULL);
+	if(ret >= 0) ret = avformat_find_stream_info(ifmt_ctx, NULL);
+	if(ret >= 0) ret = avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, path.c_str());
+
+	for(unsigned int i=0; ret >= 0 and i<ifmt_ctx->nb_streams; i++)
+	{
+		AVCodecContext* dec_ctx = ifmt_ctx->streams[i]->codec;
+
+		ret = avcodec_open2(dec_ctx, avcodec_find_decoder(dec_ctx->codec_id), NULL);
+		if(ret >= 0) ret = open_fixture_encoder(ofmt_ctx, dec_ctx, fixture);
+	}
+
+	if(ret >= 0 and not (ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+		ret = avio_open(&ofmt_ctx->pb, path.c_str(), AVIO_FLAG_WRITE);
+
+	if(ret >= 0) ret = write_fixture(ifmt_ctx, ofmt_ctx);
+
+	if(ofmt_ctx)
+	{
+		for(unsigned int i=0; i<ofmt_ctx->nb_streams; i++) avcodec_close(ofmt_ctx->streams[i]->codec);
+		if(not (ofmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&ofmt_ctx->pb);
+		avformat_free_context(ofmt_ctx);
+	}
+	if(ifmt_ctx)
+	{
+		for(unsigned int i=0; i<ifmt_ctx->nb_streams; i++) avcodec_close(ifmt_ctx->streams[i]->codec);
+		avformat_close_input(&ifmt_ctx);
+	}
+
+	if(ret < 0) remove(path.c_str());
+	return ret >= 0;
+}
+
+/*************************/
+/* Benchmarks */
+/*************************/
+
+struct st_result
+{
+	string m_name;
+	double m_score;
+	string m_unit;
+	double m_seconds;
+	string m_details;      // JSON object.
+};
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static double median(vector<double> v_values)
+{
+	sort(v_values.begin(), v_values.end());
+	return v_values[v_values.size() / 2];
+}
+
+class TranscodeBenchmark
+{
+public:
+
+	static st_result end_to_end(const string& input, const string& output, const string& name,
+								VideoTranscoder::e_execution_mode mode, int repeat);
+	static st_result find_next_packet(const string& input, const string& output, const string& name, int repeat);
+	static st_result decode_packet(const string& input, const string& output, const string& name, int repeat);
+	static st_result filter_encode_write_frame(const string& input, const string& output, const string& name, int repeat);
+	static bool same_output(const string& input, const string& reference, const string& output, VideoTranscoder::e_execution_mode mode);
+
+private:
+
+	static void open_job(VideoTranscoder& transcoder, const string& input, const string& output);
+	static int video_stream(VideoTranscoder& transcoder);
+	static st_result micro_result(const string& name, const vector<double>& v_seconds, size_t numof_calls, const string& unit);
+};
+
+void TranscodeBenchmark::open_job(VideoTranscoder& transcoder, const string& input, const string& output)
+{
+	// The same steps transcode() takes before it runs a mode.
+	VideoTranscoder::register_all();
+	transcoder.reset();
+	transcoder.m_input_path = input;
+
+	if(transcoder.open_input_file(input) < 0)   throw Error("[TranscodeBenchmark] Input can't be opened: " + input);
+	transcoder.begin_instrumentation();
+	if(transcoder.open_output_file(output) < 0) throw Error("[TranscodeBenchmark] Output can't be opened: " + output);
+	if(transcoder.init_filters() < 0)           throw Error("[TranscodeBenchmark] Filters can't be allocated.");
+}
+
+int TranscodeBenchmark::video_stream(VideoTranscoder& transcoder)
+{
+	for(unsigned int i=0; i<transcoder.m_ifmt_ctx->nb_streams; i++)
+		if(transcoder.m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+			return int(i);
+
+	throw Error("[TranscodeBenchmark] Input has no video stream.");
+}
+
+st_result TranscodeBenchmark::micro_result(const string& name, const vector<double>& v_seconds, size_t numof_calls, const string& unit)
+{
+	st_result result;
+	result.m_name    = name;
+	result.m_seconds = median(v_seconds);
+	result.m_score   = result.m_seconds > 0 ? double(numof_calls) / result.m_seconds : 0;
+	result.m_unit    = unit;
+
+	ostringstream details;
+	details << "{\"calls\":" << numof_calls << ",\"nanoseconds_per_call\":"
+	        << (numof_calls ? result.m_seconds * 1e9 / double(numof_calls) : 0) << "}";
+	result.m_details = details.str();
+
+	return result;
+}
+
+st_result TranscodeBenchmark::end_to_end(const string& input, const string& output, const string& name,
+										 VideoTranscoder::e_execution_mode mode, int repeat)
+{
+	vector<double> v_seconds;
+	vector<TranscodeMetrics::st_snapshot> v_snapshots;
+
+	for(int r=0; r<repeat; r++)
+	{
+		VideoTranscoder transcoder;
+		transcoder.set_execution_mode(mode);
+		if(mode == VideoTranscoder::EXECUTION_SEGMENTED) transcoder.set_segmented_parallelism(int(thread::hardware_concurrency()), 2.0);
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		transcoder.transcode(input, output);
+		v_seconds.push_back(seconds_since(start));
+		v_snapshots.push_back(transcoder.metrics().snapshot());
+	}
+
+	// Details come from the run which took the median time.
+	double seconds = median(v_seconds);
+	size_t run     = size_t(find(v_seconds.begin(), v_seconds.end(), seconds) - v_seconds.begin());
+	const TranscodeMetrics::st_snapshot& snapshot = v_snapshots[run];
+
+	uint64_t numof_frames = 0, bytes_in = 0, bytes_out = 0;
+	double v_stage_seconds[TranscodeMetrics::NUMOF_STAGES] = {0};
+
+	for(size_t i=0; i<snapshot.m_v_streams.size(); i++)
+	{
+		const TranscodeMetrics::st_stream_snapshot& stream = snapshot.m_v_streams[i];
+		if(stream.m_type == "video") numof_frames += stream.m_counters[TranscodeMetrics::COUNTER_FRAMES_ENCODED];
+
+		bytes_in  += stream.m_counters[TranscodeMetrics::COUNTER_BYTES_IN];
+		bytes_out += stream.m_counters[TranscodeMetrics::COUNTER_BYTES_OUT];
+
+		for(int s=0; s<TranscodeMetrics::NUMOF_STAGES; s++)
+			v_stage_seconds[s] += stream.m_stages[s].m_sum;
+	}
+
+	st_result result;
+	result.m_name    = name;
+	result.m_seconds = seconds;
+	result.m_score   = seconds > 0 ? double(numof_frames) / seconds : 0;
+	result.m_unit    = "frames/s";
+
+	// Segment workers and stream workers overlap, so stage times may add up to more than the wall time.
+	ostringstream details;
+	details << "{\"frames\":" << numof_frames << ",\"bytes_in\":" << bytes_in << ",\"bytes_out\":" << bytes_out
+	        << ",\"busiest_stage\":\"" << TranscodeMetrics::stage_name(TranscodeMetrics::busiest_stage(snapshot)) << "\",\"stage_seconds\":{";
+	for(int s=0; s<TranscodeMetrics::NUMOF_STAGES; s++)
+		details << (s ? "," : "") << "\"" << TranscodeMetrics::stage_name(TranscodeMetrics::e_stage(s)) << "\":" << v_stage_seconds[s];
+	details << "}}";
+	result.m_details = details.str();
+
+	return result;
+}
+
+st_result TranscodeBenchmark::find_next_packet(const string& input, const string& output, const string& name, int repeat)
+{
+	vector<double> v_seconds;
+	size_t numof_packets = 0;
+
+	for(int r=0; r<repeat; r++)
+	{
+		VideoTranscoder transcoder;
+		open_job(transcoder, input, output);
+
+		AVPacket packet;
+		numof_packets = 0;
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		while(transcoder.find_next_packet(packet))
+		{
+			av_free_packet(&packet);
+			numof_packets++;
+		}
+		v_seconds.push_back(seconds_since(start));
+	}
+
+	return micro_result(name, v_seconds, numof_packets, "packets/s");
+}
+
+st_result TranscodeBenchmark::decode_packet(const string& input, const string& output, const string& name, int repeat)
+{
+	vector<double> v_seconds;
+	size_t numof_packets = 0;
+
+	for(int r=0; r<repeat; r++)
+	{
+		VideoTranscoder transcoder;
+		open_job(transcoder, input, output);
+		int stream_index = video_stream(transcoder);
+
+		// Demuxing stays out of the measurement, the whole stream is read up front.
+		vector<AVPacket> v_packets;
+		AVPacket packet;
+		while(transcoder.find_next_packet(packet))
+		{
+			if(packet.stream_index == stream_index and av_dup_packet(&packet) >= 0) v_packets.push_back(packet);
+			else                                                                  av_free_packet(&packet);
+		}
+
+		AVFrame* dec_frame = NULL;
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for(size_t p=0; p<v_packets.size(); p++)
+		{
+			// decode_packet() advances data and size, the copy keeps the buffer freeable.
+			AVPacket pending = v_packets[p];
+			transcoder.decode_packet(pending, dec_frame);
+		}
+		v_seconds.push_back(seconds_since(start));
+
+		transcoder.m_frame_pool.release_frame(dec_frame);
+		for(size_t p=0; p<v_packets.size(); p++) av_free_packet(&v_packets[p]);
+		numof_packets = v_packets.size();
+	}
+
+	return micro_result(name, v_seconds, numof_packets, "packets/s");
+}
+
+st_result TranscodeBenchmark::filter_encode_write_frame(const string& input, const string& output, const string& name, int repeat)
+{
+	vector<double> v_seconds;
+	size_t numof_frames = 0;
+
+	for(int r=0; r<repeat; r++)
+	{
+		VideoTranscoder transcoder;
+		open_job(transcoder, input, output);
+		int stream_index = video_stream(transcoder);
+
+		vector<AVFrame*> v_frames;
+		AVPacket packet;
+		while(int(v_frames.size()) < MICRO_FRAMES and transcoder.find_next_packet(packet))
+		{
+			AVFrame* dec_frame = NULL;
+			if(packet.stream_index == stream_index and transcoder.decode_packet(packet, dec_frame))
+			{
+				transcoder.prepare_frame(dec_frame, stream_index);
+				v_frames.push_back(dec_frame);
+			}
+			else
+			{
+				transcoder.m_frame_pool.release_frame(dec_frame);
+			}
+			av_free_packet(&packet);
+		}
+
+		// Encoding and muxing the frames is part of the call, and so is draining the encoder at the end.
+		double seconds = 0.0;
+		for(size_t f=0; f<v_frames.size(); f++)
+		{
+			// The filter graph takes the frame's references, so it gets a copy of them.
+			AVFrame* frame = av_frame_clone(v_frames[f]);
+
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			if(transcoder.filter_encode_write_frame(frame, stream_index) < 0)
+				throw Error("[TranscodeBenchmark] Frame can't be filtered and encoded.");
+			seconds += seconds_since(start);
+
+			av_frame_free(&frame);
+		}
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		if(transcoder.filter_encode_write_frame(NULL, stream_index) < 0 or transcoder.flush_encoder(stream_index) < 0)
+			throw Error("[TranscodeBenchmark] Encoder can't be flushed.");
+		seconds += seconds_since(start);
+
+		av_write_trailer(transcoder.m_ofmt_ctx);
+		transcoder.close_output_io();
+
+		for(size_t f=0; f<v_frames.size(); f++) transcoder.m_frame_pool.release_frame(v_frames[f]);
+
+		v_seconds.push_back(seconds);
+		numof_frames = v_frames.size();
+	}
+
+	return micro_result(name, v_seconds, numof_frames, "frames/s");
+}
+
+bool TranscodeBenchmark::same_output(const string& input, const string& reference, const string& output,
+									VideoTranscoder::e_execution_mode mode)
+{
+	VideoTranscoder serial;
+	serial.transcode(input, reference);
+
+	VideoTranscoder transcoder;
+	transcoder.set_execution_mode(mode);
+	transcoder.transcode(input, output);
+
+	string expected = read_file(reference);
+	bool same       = not expected.empty() and read_file(output) == expected;
+
+	remove(reference.c_str());
+	remove(output.c_str());
+	return same;
+}
+
+/*************************/
+/* Result Files */
+/*************************/
+
+static string result_line(const st_result& result)
+{
+	ostringstream line;
+	line << "{\"name\":\"" << result.m_name << "\",\"score\":" << result.m_score << ",\"unit\":\"" << result.m_unit
+	     << "\",\"seconds\":" << result.m_seconds << ",\"details\":" << result.m_details << "}";
+	return line.str();
+}
+
+// Reads the name and score of every benchmark line written by result_line().
+static map<string, double> read_scores(const string& path)
+{
+	map<string, double> scores;
+	ifstream file(path.c_str());
+	if(not file)
+		throw Error("[TranscodeBenchmark] Baseline can't be opened: " + path);
+
+	string line;
+	while(getline(file, line))
+	{
+		size_t name_begin = line.find("{\"name\":\"");
+		size_t score      = line.find("\"score\":");
+		if(name_begin == string::npos or score == string::npos) continue;
+
+		name_begin += 9;
+		size_t name_end = line.find('"', name_begin);
+		if(name_end == string::npos) continue;
+
+		scores[line.substr(name_begin, name_end - name_begin)] = strtod(line.c_str() + score + 8, NULL);
+	}
+
+	return scores;
+}
+
+static int compare(const vector<st_result>& v_results, const map<string, double>& baseline, double tolerance)
+{
+	int numof_regressions = 0;
+
+	for(size_t i=0; i<v_results.size(); i++)
+	{
+		map<string, double>::const_iterator it = baseline.find(v_results[i].m_name);
+		if(it == baseline.end() or it->second <= 0)
+		{
+			fprintf(stderr, "  new         %s\n", v_results[i].m_name.c_str());
+			continue;
+		}
+
+		double change   = v_results[i].m_score / it->second - 1.0;
+		bool regression = change < -tolerance;
+		numof_regressions += regression;
+
+		fprintf(stderr, "  %-10s  %s %+.1f%%\n", regression ? "REGRESSION" : "ok", v_results[i].m_name.c_str(), change * 100.0);
+	}
+
+	return numof_regressions;
+}
+
+/*************************/
+/* Main */
+/*************************/
+
+int main(int argc, char** argv)
+{
+	bool quick       = false;
+	int repeat       = 3;
+	string work_dir  = "benchmark_work";
+	string output;
+	string baseline;
+	double tolerance = 0.10;
+
+	for(int a=1; a<argc; a++)
+	{
+		string arg = argv[a];
+		bool has_value = (a + 1 < argc);
+
+		if(arg == "--quick")                          quick     = true;
+		else if(arg == "--repeat" and has_value)      repeat    = max(1, atoi(argv[++a]));
+		else if(arg == "--work-dir" and has_value)    work_dir  = argv[++a];
+		else if(arg == "--output" and has_value)      output    = argv[++a];
+		else if(arg == "--baseline" and has_value)    baseline  = argv[++a];
+		else if(arg == "--tolerance" and has_value)   tolerance = atof(argv[++a]);
+		else
+		{
+			fprintf(stderr, "Usage: %s [--quick] [--repeat N] [--work-dir DIR] [--output FILE] [--baseline FILE] [--tolerance FRACTION]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	av_log_set_level(AV_LOG_ERROR);
+	av_register_all();
+	avdevice_register_all();
+	mkdir(work_dir.c_str(), 0755);
+
+	static const struct { VideoTranscoder::e_execution_mode m_mode; const char* m_name; } MODES[] =
+	{
+		{VideoTranscoder::EXECUTION_SERIAL,         "serial"},
+		{VideoTranscoder::EXECUTION_PIPELINED,      "pipelined"},
+		{VideoTranscoder::EXECUTION_STREAM_WORKERS, "stream_workers"},
+		{VideoTranscoder::EXECUTION_SEGMENTED,      "segmented"}
+	};
+
+	vector<st_result> v_results;
+	int numof_mismatches = 0;
+
+	try
+	{
+		for(size_t f=0; f<sizeof(FIXTURES) / sizeof(FIXTURES[0]); f++)
+		{
+			const st_fixture& fixture = FIXTURES[f];
+			if(quick and not fixture.m_quick) continue;
+
+			string input  = work_dir + "/" + fixture.m_name + ".mkv";
+			string output = work_dir + "/" + fixture.m_name + "_out.mkv";
+
+			if(not file_exists(input) and not generate_fixture(fixture, input))
+			{
+				// Encoders such as libx264 are optional in FFmpeg builds.
+				fprintf(stderr, "Skipping %s, it can't be generated with this FFmpeg build.\n", fixture.m_name);
+				continue;
+			}
+
+			for(size_t m=0; m<sizeof(MODES) / sizeof(MODES[0]); m++)
+			{
+				string name = string("end_to_end/") + fixture.m_name + "/" + MODES[m].m_name;
+				fprintf(stderr, "%s\n", name.c_str());
+				v_results.push_back(TranscodeBenchmark::end_to_end(input, output, name, MODES[m].m_mode, repeat));
+			}
+
+			fprintf(stderr, "micro/%s\n", fixture.m_name);
+			v_results.push_back(TranscodeBenchmark::find_next_packet(input, output, string("find_next_packet/") + fixture.m_name, repeat));
+			v_results.push_back(TranscodeBenchmark::decode_packet(input, output, string("decode_packet/") + fixture.m_name, repeat));
+			v_results.push_back(TranscodeBenchmark::filter_encode_write_frame(input, output, string("filter_encode_write_frame/") + fixture.m_name, repeat));
+
+			remove(output.c_str());
+
+			// NUT writes no random identifiers, equal packets give equal files.
+			bool same = TranscodeBenchmark::same_output(input, work_dir + "/" + fixture.m_name + "_serial.nut",
+														work_dir + "/" + fixture.m_name + "_pipelined.nut", VideoTranscoder::EXECUTION_PIPELINED);
+			fprintf(stderr, "  %-10s  pipelined output of %s\n", same ? "same" : "MISMATCH", fixture.m_name);
+			numof_mismatches += !same;
+		}
+	}
+	catch(exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 2;
+	}
+
+	ostringstream text;
+	text << "{\"benchmarks\":[\n";
+	for(size_t i=0; i<v_results.size(); i++)
+		text << result_line(v_results[i]) << (i + 1 < v_results.size() ? ",\n" : "\n");
+	text << "]}\n";
+
+	if(output.empty())
+	{
+		fputs(text.str().c_str(), stdout);
+	}
+	else
+	{
+		ofstream file(output.c_str(), ios::trunc);
+		file << text.str();
+		if(not file)
+		{
+			fprintf(stderr, "Results can't be written to %s\n", output.c_str());
+			return 2;
+		}
+	}
+
+	int status = (numof_mismatches > 0) ? 1 : 0;
+	if(baseline.empty()) return status;
+
+	try
+	{
+		fprintf(stderr, "Compared with %s, tolerance %.0f%%:\n", baseline.c_str(), tolerance * 100.0);
+		return (compare(v_results, read_scores(baseline), tolerance) > 0) ? 1 : status;
+	}
+	catch(exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 2;
+	}
+}
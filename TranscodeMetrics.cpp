@@ -0,0 +1,392 @@
+/*!
+**************************************************************************************
+ * \file TranscodeMetrics.cpp
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#include "TranscodeMetrics.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+// Upper bound of the first histogram bucket, the following ones double it.
+static const uint64_t FIRST_BUCKET_NANOSECONDS = 1000;
+
+static const char* COUNTER_NAMES[TranscodeMetrics::NUMOF_COUNTERS] =
+{
+	"packets_read", "bytes_in", "packets_dropped", "frames_decoded",
+	"frames_encoded", "frames_dropped", "frames_duplicate", "packets_written", "bytes_out"
+};
+
+static const char* QUEUE_NAMES[TranscodeMetrics::NUMOF_QUEUES] =
+{
+	"packets", "frames", "mux", "streams"
+};
+
+static std::string number(double value)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.9g", value);
+	return buffer;
+}
+
+static double bucket_bound(int bucket)
+{
+	return double(FIRST_BUCKET_NANOSECONDS << bucket) * 1e-9;
+}
+
+TranscodeMetrics::TranscodeMetrics()
+{
+	m_numof_streams.store(0);
+	m_start           = clock::now();
+	m_export_format   = EXPORT_PROMETHEUS;
+	m_export_interval = 0;
+	m_export_stopping = false;
+
+	for(int q=0; q<NUMOF_QUEUES; q++)
+	{
+		m_queue_depth[q].store(0);
+		m_queue_high_water_mark[q].store(0);
+	}
+}
+
+TranscodeMetrics::~TranscodeMetrics()
+{
+	stop_export();
+}
+
+void TranscodeMetrics::begin(const std::vector<std::string>& v_stream_types)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_numof_streams.store(0);
+	m_streams.reset(new st_stream_metrics[v_stream_types.size()]);
+	m_v_stream_types = v_stream_types;
+
+	for(size_t i=0; i<v_stream_types.size(); i++)
+	{
+		st_stream_metrics& stream = m_streams[i];
+
+		for(int c=0; c<NUMOF_COUNTERS; c++)
+			stream.m_counters[c].store(0);
+
+		for(int s=0; s<NUMOF_STAGES; s++)
+		{
+			stream.m_stage_count[s].store(0);
+			stream.m_stage_nanoseconds[s].store(0);
+			for(int b=0; b<=NUMOF_BUCKETS; b++) stream.m_stage_buckets[s][b].store(0);
+		}
+	}
+
+	for(int q=0; q<NUMOF_QUEUES; q++)
+	{
+		m_queue_depth[q].store(0);
+		m_queue_high_water_mark[q].store(0);
+	}
+
+	m_start = clock::now();
+	m_numof_streams.store(int(v_stream_types.size()));
+}
+
+void TranscodeMetrics::record(e_stage stage, int stream_index, clock::time_point start)
+{
+	if(stream_index < 0 or stream_index >= m_numof_streams.load(std::memory_order_acquire))
+		return;
+
+	uint64_t nanoseconds = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+
+	int bucket = 0;
+	while(bucket < NUMOF_BUCKETS and (FIRST_BUCKET_NANOSECONDS << bucket) < nanoseconds)
+		bucket++;
+
+	st_stream_metrics& stream = m_streams[stream_index];
+	stream.m_stage_count[stage].fetch_add(1, std::memory_order_relaxed);
+	stream.m_stage_nanoseconds[stage].fetch_add(nanoseconds, std::memory_order_relaxed);
+	stream.m_stage_buckets[stage][bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void TranscodeMetrics::add(e_counter counter, int stream_index, uint64_t value)
+{
+	if(stream_index < 0 or stream_index >= m_numof_streams.load(std::memory_order_acquire))
+		return;
+
+	m_streams[stream_index].m_counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+void TranscodeMetrics::sample_queue(e_queue queue, size_t depth)
+{
+	m_queue_depth[queue].store(depth, std::memory_order_relaxed);
+
+	size_t high_water_mark = m_queue_high_water_mark[queue].load(std::memory_order_relaxed);
+	while(depth > high_water_mark and not m_queue_high_water_mark[queue].compare_exchange_weak(high_water_mark, depth, std::memory_order_relaxed));
+}
+
+TranscodeMetrics::st_snapshot TranscodeMetrics::snapshot() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	st_snapshot snapshot;
+	snapshot.m_elapsed_seconds = std::chrono::duration<double>(clock::now() - m_start).count();
+
+	for(int q=0; q<NUMOF_QUEUES; q++)
+	{
+		snapshot.m_queue_depth[q]           = m_queue_depth[q].load(std::memory_order_relaxed);
+		snapshot.m_queue_high_water_mark[q] = m_queue_high_water_mark[q].load(std::memory_order_relaxed);
+	}
+
+	int numof_streams = m_numof_streams.load();
+	snapshot.m_v_streams.resize(numof_streams);
+
+	for(int i=0; i<numof_streams; i++)
+	{
+		const st_stream_metrics& stream = m_streams[i];
+		st_stream_snapshot& stream_snapshot = snapshot.m_v_streams[i];
+
+		stream_snapshot.m_type = m_v_stream_types[i];
+
+		for(int c=0; c<NUMOF_COUNTERS; c++)
+			stream_snapshot.m_counters[c] = stream.m_counters[c].load(std::memory_order_relaxed);
+
+		for(int s=0; s<NUMOF_STAGES; s++)
+		{
+			st_histogram& histogram = stream_snapshot.m_stages[s];
+			histogram.m_count = stream.m_stage_count[s].load(std::memory_order_relaxed);
+			histogram.m_sum   = double(stream.m_stage_nanoseconds[s].load(std::memory_order_relaxed)) * 1e-9;
+
+			for(int b=0; b<=NUMOF_BUCKETS; b++)
+				histogram.m_buckets[b] = stream.m_stage_buckets[s][b].load(std::memory_order_relaxed);
+		}
+
+		stream_snapshot.m_frames_per_second = snapshot.m_elapsed_seconds > 0 ?
+			double(stream_snapshot.m_counters[COUNTER_FRAMES_ENCODED]) / snapshot.m_elapsed_seconds : 0;
+	}
+
+	return snapshot;
+}
+
+TranscodeMetrics::e_stage TranscodeMetrics::busiest_stage(const st_snapshot& snapshot)
+{
+	double v_totals[NUMOF_STAGES] = {0};
+
+	for(size_t i=0; i<snapshot.m_v_streams.size(); i++)
+		for(int s=0; s<NUMOF_STAGES; s++)
+			v_totals[s] += snapshot.m_v_streams[i].m_stages[s].m_sum;
+
+	int busiest = STAGE_DEMUX;
+	for(int s=1; s<NUMOF_STAGES; s++)
+		if(v_totals[s] > v_totals[busiest]) busiest = s;
+
+	return e_stage(busiest);
+}
+
+const char* TranscodeMetrics::stage_name(e_stage stage)
+{
+	switch(stage)
+	{
+		case STAGE_DEMUX:  return "demux";
+		case STAGE_DECODE: return "decode";
+		case STAGE_FILTER: return "filter";
+		case STAGE_ENCODE: return "encode";
+		case STAGE_MUX:    return "mux";
+		default:           return "unknown";
+	}
+}
+
+/*************************/
+/* Exposition Formats */
+/*************************/
+
+std::string TranscodeMetrics::prometheus_text() const
+{
+	st_snapshot snap = snapshot();
+	std::ostringstream text;
+
+	text << "# HELP videotranscoder_elapsed_seconds Time since the transcode started.\n";
+	text << "# TYPE videotranscoder_elapsed_seconds gauge\n";
+	text << "videotranscoder_elapsed_seconds " << number(snap.m_elapsed_seconds) << "\n";
+
+	for(int c=0; c<NUMOF_COUNTERS; c++)
+	{
+		text << "# TYPE videotranscoder_" << COUNTER_NAMES[c] << "_total counter\n";
+		for(size_t i=0; i<snap.m_v_streams.size(); i++)
+			text << "videotranscoder_" << COUNTER_NAMES[c] << "_total{stream=\"" << i << "\",type=\"" << snap.m_v_streams[i].m_type << "\"} "
+			     << snap.m_v_streams[i].m_counters[c] << "\n";
+	}
+
+	text << "# HELP videotranscoder_frames_per_second Encoded frames per second since the start.\n";
+	text << "# TYPE videotranscoder_frames_per_second gauge\n";
+	for(size_t i=0; i<snap.m_v_streams.size(); i++)
+		text << "videotranscoder_frames_per_second{stream=\"" << i << "\",type=\"" << snap.m_v_streams[i].m_type << "\"} "
+		     << number(snap.m_v_streams[i].m_frames_per_second) << "\n";
+
+	text << "# HELP videotranscoder_stage_seconds Time spent per call of a pipeline stage.\n";
+	text << "# TYPE videotranscoder_stage_seconds histogram\n";
+	for(size_t i=0; i<snap.m_v_streams.size(); i++)
+	{
+		for(int s=0; s<NUMOF_STAGES; s++)
+		{
+			const st_histogram& histogram = snap.m_v_streams[i].m_stages[s];
+			if(histogram.m_count == 0) continue;
+
+			std::ostringstream labels;
+			labels << "stream=\"" << i << "\",type=\"" << snap.m_v_streams[i].m_type << "\",stage=\"" << stage_name(e_stage(s)) << "\"";
+
+			uint64_t cumulative = 0;
+			for(int b=0; b<=NUMOF_BUCKETS; b++)
+			{
+				cumulative += histogram.m_buckets[b];
+				text << "videotranscoder_stage_seconds_bucket{" << labels.str() << ",le=\""
+				     << (b < NUMOF_BUCKETS ? number(bucket_bound(b)) : "+Inf") << "\"} " << cumulative << "\n";
+			}
+
+			text << "videotranscoder_stage_seconds_sum{" << labels.str() << "} " << number(histogram.m_sum) << "\n";
+			text << "videotranscoder_stage_seconds_count{" << labels.str() << "} " << histogram.m_count << "\n";
+		}
+	}
+
+	text << "# HELP videotranscoder_queue_depth Items waiting in a pipeline queue when last sampled.\n";
+	text << "# TYPE videotranscoder_queue_depth gauge\n";
+	for(int q=0; q<NUMOF_QUEUES; q++)
+		text << "videotranscoder_queue_depth{queue=\"" << QUEUE_NAMES[q] << "\"} " << snap.m_queue_depth[q] << "\n";
+
+	text << "# TYPE videotranscoder_queue_high_water_mark gauge\n";
+	for(int q=0; q<NUMOF_QUEUES; q++)
+		text << "videotranscoder_queue_high_water_mark{queue=\"" << QUEUE_NAMES[q] << "\"} " << snap.m_queue_high_water_mark[q] << "\n";
+
+	return text.str();
+}
+
+std::string TranscodeMetrics::json() const
+{
+	st_snapshot snap = snapshot();
+	std::ostringstream text;
+
+	text << "{\"elapsed_seconds\":" << number(snap.m_elapsed_seconds) << ",\"queues\":{";
+	for(int q=0; q<NUMOF_QUEUES; q++)
+		text << (q ? "," : "") << "\"" << QUEUE_NAMES[q] << "\":{\"depth\":" << snap.m_queue_depth[q]
+		     << ",\"high_water_mark\":" << snap.m_queue_high_water_mark[q] << "}";
+
+	text << "},\"streams\":[";
+	for(size_t i=0; i<snap.m_v_streams.size(); i++)
+	{
+		const st_stream_snapshot& stream = snap.m_v_streams[i];
+
+		text << (i ? "," : "") << "{\"index\":" << i << ",\"type\":\"" << stream.m_type << "\""
+		     << ",\"frames_per_second\":" << number(stream.m_frames_per_second) << ",\"counters\":{";
+		for(int c=0; c<NUMOF_COUNTERS; c++)
+			text << (c ? "," : "") << "\"" << COUNTER_NAMES[c] << "\":" << stream.m_counters[c];
+
+		text << "},\"stages\":{";
+		for(int s=0; s<NUMOF_STAGES; s++)
+		{
+			const st_histogram& histogram = stream.m_stages[s];
+
+			text << (s ? "," : "") << "\"" << stage_name(e_stage(s)) << "\":{\"count\":" << histogram.m_count
+			     << ",\"sum_seconds\":" << number(histogram.m_sum) << ",\"buckets\":[";
+			for(int b=0; b<=NUMOF_BUCKETS; b++)
+				text << (b ? "," : "") << histogram.m_buckets[b];
+			text << "]}";
+		}
+		text << "}}";
+	}
+	text << "]}\n";
+
+	return text.str();
+}
+
+bool TranscodeMetrics::write(const std::string& path, e_export_format format) const
+{
+	std::string text = (format == EXPORT_JSON) ? json() : prometheus_text();
+
+	// Reserve a temporary name of our own, several exporters may write the same path.
+	std::string pattern = path + ".XXXXXX";
+	std::vector<char> v_temporary(pattern.c_str(), pattern.c_str() + pattern.size() + 1);
+
+	int fd = mkstemp(&v_temporary[0]);
+	if(fd < 0)
+		return false;
+
+	// Scrapers run as other users.
+	fchmod(fd, 0644);
+	close(fd);
+
+	std::string pth_temporary(&v_temporary[0]);
+	{
+		std::ofstream file(pth_temporary.c_str(), std::ios::trunc);
+		if(not file)
+		{
+			remove(pth_temporary.c_str());
+			return false;
+		}
+
+		file << text;
+		if(not file)
+		{
+			file.close();
+			remove(pth_temporary.c_str());
+			return false;
+		}
+	}
+
+	if(rename(pth_temporary.c_str(), path.c_str()) != 0)
+	{
+		remove(pth_temporary.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+/*************************/
+/* Periodic Export */
+/*************************/
+
+void TranscodeMetrics::start_export(const std::string& path, e_export_format format, double interval_seconds)
+{
+	stop_export();
+
+	m_export_path     = path;
+	m_export_format   = format;
+	m_export_interval = interval_seconds > 0 ? interval_seconds : 1.0;
+	m_export_stopping = false;
+
+	m_export_thread = std::thread(&TranscodeMetrics::export_loop, this);
+}
+
+void TranscodeMetrics::stop_export()
+{
+	if(not m_export_thread.joinable()) return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_export_mutex);
+		m_export_stopping = true;
+	}
+	m_export_cond.notify_all();
+	m_export_thread.join();
+
+	write(m_export_path, m_export_format);
+}
+
+void TranscodeMetrics::export_loop()
+{
+	std::chrono::duration<double> interval(m_export_interval);
+	std::unique_lock<std::mutex> lock(m_export_mutex);
+
+	while(not m_export_stopping)
+	{
+		if(m_export_cond.wait_for(lock, interval, [this]{ return m_export_stopping; }))
+			break;
+
+		lock.unlock();
+		write(m_export_path, m_export_format);
+		lock.lock();
+	}
+}
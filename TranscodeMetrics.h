@@ -0,0 +1,156 @@
+/*!
+**************************************************************************************
+ * \file TranscodeMetrics.h
+
+ * \author
+ *    - Savas Ozkan
+ *************************************************************************************
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * Counters and latency histograms of a running transcode, kept per input stream. Recording only
+ * touches relaxed atomics, so the transcoding threads never wait for each other or for a reader.
+ * Stage histograms have power of two buckets from 1 us to 16.8 s. A snapshot can be taken at any
+ * time, rendered as Prometheus text exposition format or JSON, and written to a file periodically
+ * by a background thread, e.g. for node_exporter's textfile collector.
+ */
+
+class TranscodeMetrics
+{
+public:
+
+	typedef std::chrono::steady_clock clock;
+
+	enum e_stage
+	{
+		STAGE_DEMUX,
+		STAGE_DECODE,
+		STAGE_FILTER,
+		STAGE_ENCODE,
+		STAGE_MUX,
+		NUMOF_STAGES
+	};
+
+	enum e_counter
+	{
+		COUNTER_PACKETS_READ,
+		COUNTER_BYTES_IN,
+		COUNTER_PACKETS_DROPPED,   // Unusable input packets, e.g. without a valid pts.
+		COUNTER_FRAMES_DECODED,
+		COUNTER_FRAMES_ENCODED,
+		COUNTER_FRAMES_DROPPED,    // Frames decoded but not encoded, e.g. late live frames.
+		COUNTER_FRAMES_DUPLICATE,  // Frames found to repeat the previous one, whether dropped or not.
+		COUNTER_PACKETS_WRITTEN,
+		COUNTER_BYTES_OUT,
+		NUMOF_COUNTERS
+	};
+
+	enum e_queue
+	{
+		QUEUE_PACKETS,
+		QUEUE_FRAMES,
+		QUEUE_MUX,
+		QUEUE_STREAMS,
+		NUMOF_QUEUES
+	};
+
+	enum e_export_format
+	{
+		EXPORT_PROMETHEUS,
+		EXPORT_JSON
+	};
+
+	static const int NUMOF_BUCKETS = 25;
+
+	struct st_histogram
+	{
+		uint64_t m_count;
+		double m_sum;                            // Seconds.
+		uint64_t m_buckets[NUMOF_BUCKETS + 1];   // Not cumulative, the last one is unbounded.
+	};
+
+	struct st_stream_snapshot
+	{
+		std::string m_type;
+		uint64_t m_counters[NUMOF_COUNTERS];
+		st_histogram m_stages[NUMOF_STAGES];
+		double m_frames_per_second;              // Encoded frames over the elapsed time.
+	};
+
+	struct st_snapshot
+	{
+		double m_elapsed_seconds;
+		std::vector<st_stream_snapshot> m_v_streams;
+		size_t m_queue_depth[NUMOF_QUEUES];
+		size_t m_queue_high_water_mark[NUMOF_QUEUES];
+	};
+
+	TranscodeMetrics();
+	virtual ~TranscodeMetrics();
+
+	//! Starts over for a new job with one entry per input stream, named by its media type.
+	void begin(const std::vector<std::string>& v_stream_types);
+
+	static clock::time_point now() { return clock::now(); }
+	void record(e_stage stage, int stream_index, clock::time_point start);
+	void add(e_counter counter, int stream_index, uint64_t value = 1);
+	void sample_queue(e_queue queue, size_t depth);
+
+	st_snapshot snapshot() const;
+
+	//! Stage whose calls took the longest in total, i.e. what the job is bound by so far.
+	static e_stage busiest_stage(const st_snapshot& snapshot);
+	static const char* stage_name(e_stage stage);
+
+	std::string prometheus_text() const;
+	std::string json() const;
+
+	//! Replaces path in one step; collectors may read it at any moment.
+	bool write(const std::string& path, e_export_format format) const;
+
+	//! Rewrites the file every interval until stop_export(), which writes it a last time.
+	void start_export(const std::string& path, e_export_format format, double interval_seconds);
+	void stop_export();
+
+private:
+
+	struct st_stream_metrics
+	{
+		std::atomic<uint64_t> m_counters[NUMOF_COUNTERS];
+		std::atomic<uint64_t> m_stage_count[NUMOF_STAGES];
+		std::atomic<uint64_t> m_stage_nanoseconds[NUMOF_STAGES];
+		std::atomic<uint64_t> m_stage_buckets[NUMOF_STAGES][NUMOF_BUCKETS + 1];
+	};
+
+	void export_loop();
+
+	// begin() must not run while a transcode records, snapshots lock against it.
+	mutable std::mutex m_mutex;
+	std::unique_ptr<st_stream_metrics[]> m_streams;
+	std::atomic<int> m_numof_streams;
+	std::vector<std::string> m_v_stream_types;
+	clock::time_point m_start;
+
+	std::atomic<size_t> m_queue_depth[NUMOF_QUEUES];
+	std::atomic<size_t> m_queue_high_water_mark[NUMOF_QUEUES];
+
+	std::thread m_export_thread;
+	std::mutex m_export_mutex;
+	std::condition_variable m_export_cond;
+	std::string m_export_path;
+	e_export_format m_export_format;
+	double m_export_interval;
+	bool m_export_stopping;
+};
@@ -9,623 +9,4447 @@
 
 #include "VideoTranscoder.h"
 
+#include <cstring>
+
+// Probe window of live inputs unless configured otherwise.
+static const int64_t LIVE_PROBE_SIZE      = 32768;
+static const double  LIVE_ANALYZE_SECONDS = 0.5;
+
+// Read times of packets the decoder swallowed are forgotten after this many newer ones.
+static const size_t MAX_PENDING_ARRIVALS = 256;
+
+// Bytes of the buffers a frame references, whether or not other frames share them.
+static size_t frame_bytes(const AVFrame* frame)
+{
+	size_t bytes = 0;
+
+	for(int i=0; i<AV_NUM_DATA_POINTERS and frame->buf[i]; i++)
+		bytes += size_t(frame->buf[i]->size);
+
+	for(int i=0; i<frame->nb_extended_buf; i++)
+		bytes += size_t(frame->extended_buf[i]->size);
+
+	return bytes;
+}
+
+// Labelled open end of a filter graph, NULL when out of memory.
+static AVFilterInOut* filter_inout(const char* name, AVFilterContext* filter_ctx)
+{
+	AVFilterInOut* inout = avfilter_inout_alloc();
+	if(not inout) return NULL;
+
+	inout->name       = av_strdup(name);
+	inout->filter_ctx = filter_ctx;
+	inout->pad_idx    = 0;
+	inout->next       = NULL;
+
+	if(not inout->name) avfilter_inout_free(&inout);
+	return inout;
+}
+
 VideoTranscoder::VideoTranscoder()
 {
 	m_packet = auto_ptr<AVPacket>(new AVPacket()) ;
 	av_init_packet(m_packet.get()) ;
 
-	m_dec_frame = av_frame_alloc();
+	m_dec_frame = m_frame_pool.acquire_frame();
 	if(not m_dec_frame)
 		throw Error("[VideoTranscoder] AvFrame can't be allocated");
 
 	m_ifmt_ctx   = NULL;
 	m_ofmt_ctx   = NULL;
-	m_filter_ctx = NULL;
+	m_filter_ctx  = NULL;
+	m_fused_graph = NULL;
+
+	m_execution_mode  = EXECUTION_SERIAL;
+	m_queue_depth     = 8;
+	m_segment_workers = int(thread::hardware_concurrency());
+	m_segment_seconds = 10.0;
+	m_segment_sink    = NULL;
+	m_segment_pool    = NULL;
+	m_mux_shared      = false;
+	m_stream_copy     = false;
+
+	m_smart_stream_index = -1;
+	m_edit_origin        = 0;
+	m_smart_encoder      = NULL;
+	m_smart_run          = false;
+
+	m_ladder_stream_index = -1;
+	m_thread_cores        = 0;
+	m_reserved_cores      = 0;
+	m_split_stream_cores  = false;
+
+	m_trim_start  = AV_NOPTS_VALUE;
+	m_trim_end    = AV_NOPTS_VALUE;
+	m_trim_origin = 0;
+	m_trim_stop   = AV_NOPTS_VALUE;
+
+	m_index_cache   = false;
+	m_header_index  = false;
+	m_index_pending = false;
+
+	m_duplicates.m_enabled      = false;
+	m_duplicates.m_drop         = true;
+	m_duplicates.m_threshold    = 2;
+	m_duplicates.m_max_interval = 0.0;
+
+	m_draft        = false;
+	m_draft_lowres = 1;
+
+	m_media_io.m_mapped_input        = false;
+	m_media_io.m_readahead           = 0;
+	m_media_io.m_write_behind_output = false;
+	m_media_io.m_buffer_size         = 0;
+	m_media_io.m_numof_buffers       = 0;
+	m_media_io.m_fsync_policy        = WriteBehindOutput::FSYNC_ON_CLOSE;
+	m_media_io.m_fsync_interval      = 0;
+
+	m_streaming.m_format          = st_streaming_output::STREAMING_OFF;
+	m_streaming.m_segment_seconds = 0.0;
+	m_streaming.m_list_size       = 0;
+	m_streaming_stream_index      = -1;
+	m_streaming_segment           = -1;
+	m_streaming_origin            = 0.0;
+	m_streaming_segment_start     = 0.0;
+	m_streaming_end               = 0.0;
+
+	m_live.m_enabled         = false;
+	m_live.m_probe_size      = 0;
+	m_live.m_analyze_seconds = 0.0;
+	m_live.m_latency_budget  = 0.0;
+	m_live_latency_sum       = 0.0;
+	memset(&m_live_statistics, 0, sizeof(m_live_statistics));
+
+	m_metrics          = make_shared<TranscodeMetrics>();
+	m_memory_budget    = make_shared<MemoryBudget>();
+	m_interleave_bytes = 0;
+	m_metrics_format   = TranscodeMetrics::EXPORT_PROMETHEUS;
+	m_metrics_interval = 10.0;
+
+	m_pipeline_failed.store(false);
+
+	if(m_segment_workers < 1) m_segment_workers = 1;
 }
 
 VideoTranscoder::~VideoTranscoder()
 {
-	av_free_packet(m_packet.get());
-	avcodec_free_frame(&m_dec_frame);
-	free_transcode_buffer();
+	reset();
+	m_frame_pool.release_frame(m_dec_frame);
 }
 
-void VideoTranscoder::transcode(string pth_input_media, string pth_output_media)
+void VideoTranscoder::reset()
 {
-	av_register_all();
-	avfilter_register_all();
+	av_free_packet(m_packet.get());
+	av_init_packet(m_packet.get());
+	if(m_dec_frame) av_frame_unref(m_dec_frame);
 
-	if(open_input_file(pth_input_media) <0)   throw Error("Error occurred during input media opening.");
-	if(open_output_file(pth_output_media) <0) throw Error("Error occurred during output media opening.");
-	if(init_filters() <0)                     throw Error("Filter can't be allocated.");
+	free_transcode_buffer();
+	release_thread_cores();
+
+	m_v_duration.clear();
+	m_v_numof_frames.clear();
+	m_v_timestamps.clear();
+	m_v_keyframes.clear();
+	m_v_dts_splices.clear();
+	m_v_stream_copy.clear();
+
+	m_smart_stream_index  = -1;
+	m_edit_origin         = 0;
+	m_smart_run           = false;
+	m_ladder_stream_index = -1;
+	m_v_ladder_streams.clear();
+	m_split_stream_cores  = false;
+
+	m_trim_start  = AV_NOPTS_VALUE;
+	m_trim_end    = AV_NOPTS_VALUE;
+	m_trim_origin = 0;
+	m_trim_stop   = AV_NOPTS_VALUE;
+	m_v_trim_done.clear();
+
+	m_header_index  = false;
+	m_index_pending = false;
+
+	m_v_filter_held.clear();
+	clear_interleaved();
+	clear_duplicates();
+	clear_quality();
+
+	m_v_output_streams.clear();
+	m_v_input_streams.clear();
+	m_v_draft_sizes.clear();
+
+	m_v_segment_reports.clear();
+	m_v_keyframe_segment.clear();
+	m_v_keyframe_origin.clear();
+	m_streaming_stream_index = -1;
+	m_streaming_segment      = -1;
+	m_streaming_end          = 0.0;
 
-	while(true)
 	{
-		if(not find_next_packet(*m_packet)) break;
-
-		int stream_index = m_packet->stream_index;
-		AVMediaType type = m_ifmt_ctx->streams[stream_index]->codec->codec_type;
-
-		if(not decode_packet(*m_packet)) continue;
+		lock_guard<mutex> lock(m_live_mutex);
+		m_v_live_arrivals.clear();
+		memset(&m_live_statistics, 0, sizeof(m_live_statistics));
+		m_live_latency_sum = 0.0;
+	}
 
-		m_dec_frame->pts = av_rescale_q(av_frame_get_best_effort_timestamp(m_dec_frame),
-										m_ifmt_ctx->streams[stream_index]->codec->time_base,
-					 	                m_ofmt_ctx->streams[stream_index]->codec->time_base);
+	m_input_path.clear();
+	m_pipeline_failed.store(false);
+	m_pipeline_error.clear();
+}
 
-		//todo To make changes in avframe, append your code here.
+double VideoTranscoder::probe_duration(string pth_input_media)
+{
+	register_all();
+	reset();
 
-		if(not encode_frame(stream_index))
-			throw Error("Error occurred during encoding current frame.");
+	bool b_cached = false;
+	if(open_input_format(pth_input_media, b_cached) < 0)
+	{
+		reset();
+		throw Error("Error occurred during input media opening.");
 	}
 
-	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
-	{
-		if(not m_filter_ctx[i].m_filter_graph) continue;
-		AVMediaType type = m_ifmt_ctx->streams[i]->codec->codec_type;
+	input_video_properties();
 
-		while(decode_frame_in_buffer(i) == 1)
-		{
-			if(not encode_frame(i)) break;
-		}
+	if(m_index_cache and not b_cached and m_header_index)
+		IndexCache(pth_input_media, m_index_cache_directory).save(m_ifmt_ctx);
 
-		if(filter_encode_write_frame(NULL, i) < 0) break;
-		if(flush_encoder(i) < 0) break;
-	}
+	double duration = 0.0;
+	for(size_t s=0; s<m_v_duration.size(); s++)
+		duration = max(duration, m_v_duration[s]);
 
-	av_write_trailer(m_ofmt_ctx);
+	reset();
+	return duration;
 }
 
-int VideoTranscoder::open_input_file(string pth_media)
+void VideoTranscoder::extract_thumbnails(string pth_input_media, string pth_sprite, string pth_vtt, const st_thumbnail_settings& settings)
 {
-	int ret;
-	unsigned int i;
-	m_ifmt_ctx = NULL;
+	if(settings.m_interval <= 0.0)
+		throw Error("[VideoTranscoder] Thumbnail interval must be positive.");
 
-	if((ret = avformat_open_input(&m_ifmt_ctx, pth_media.c_str(), NULL, NULL)) < 0) return ret;
-	if((ret = avformat_find_stream_info(m_ifmt_ctx, NULL)) < 0)             return ret;
+	if(m_live.m_enabled)
+		throw Error("[VideoTranscoder] Live inputs can't be seeked, thumbnails need a file.");
 
-	for (i = 0; i < m_ifmt_ctx->nb_streams; i++)
-	{
-		AVStream* stream          = m_ifmt_ctx->streams[i];
-		AVCodecContext* codec_ctx = stream->codec;
+	register_all();
+	reset();
 
-		if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO or codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
-		{
-			ret = avcodec_open2(codec_ctx, avcodec_find_decoder(codec_ctx->codec_id), NULL);
-			if(ret < 0) return ret;
-		}
-	}
+	m_input_path = pth_input_media;
+	st_core_reservation cores(*this);
 
-	input_video_properties();
+	if(open_input_file(pth_input_media) <0)  throw Error("Error occurred during input media opening.");
+	begin_instrumentation();
 
-	return 0;
-}
+	int v = -1;
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams) and v < 0; i++)
+		if(m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO and is_selected(i)) v = i;
 
-int VideoTranscoder::open_output_file(string pth_media)
-{
-	AVStream *out_stream;
-	AVStream *in_stream;
-	AVCodecContext *dec_ctx;
-	AVCodec *encoder;
+	if(v < 0)
+		throw Error("[VideoTranscoder] Thumbnails need a video stream.");
 
-	int ret;
-	unsigned int i;
-	m_ofmt_ctx = NULL;
-	avformat_alloc_output_context2(&m_ofmt_ctx, NULL, NULL, pth_media.c_str());
+	AVStream* stream        = m_ifmt_ctx->streams[v];
+	AVCodecContext* dec_ctx = decoder(v);
 
-	if(!m_ofmt_ctx)
-		return AVERROR_UNKNOWN;
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+		if(i != v) m_ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+	// The demuxer drops the non-key packets the container flags, the decoder skips any others.
+	stream->discard     = AVDISCARD_NONKEY;
+	dec_ctx->skip_frame = AVDISCARD_NONKEY;
+
+	double duration = m_v_duration[v];
+	if(duration <= 0.0 and m_ifmt_ctx->duration != AV_NOPTS_VALUE)
+		duration = global_time_to_seconds(m_ifmt_ctx->duration);
+
+	int numof_thumbnails = max(1, int(ceil(duration / settings.m_interval)));
+	int columns          = max(settings.m_columns, 1);
+	int rows             = (settings.m_rows > 0) ? settings.m_rows : (numof_thumbnails + columns - 1) / columns;
+
+	SpriteSheet sheet(pth_sprite, settings.m_codec, columns, rows, (settings.m_quality > 0) ? settings.m_quality : 5);
+	if(numof_thumbnails > columns * rows and not sheet.numbered_path())
+		throw Error("[VideoTranscoder] Thumbnails fill several sheets, the sprite path needs a %d for the sheet number.");
+
+	int width, height;
+	thumbnail_size(v, settings, width, height);
 
-	for(i = 0; i < m_ifmt_ctx->nb_streams; i++)
+	if(sheet.open(width, height) < 0)
+		throw Error("[VideoTranscoder] Sprite sheet encoder can't be opened.");
+
+	m_filter_ctx = (st_filtering_context *)av_malloc_array(m_ifmt_ctx->nb_streams, sizeof(*m_filter_ctx));
+	if(not m_filter_ctx)
+		throw Error("Filter can't be allocated.");
+
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
 	{
-		out_stream = avformat_new_stream(m_ofmt_ctx, NULL);
-		if(!out_stream)
-			return AVERROR_UNKNOWN;
+		m_filter_ctx[i].m_buffersrc_ctx  = NULL;
+		m_filter_ctx[i].m_buffersink_ctx = NULL;
+		m_filter_ctx[i].m_filter_graph   = NULL;
+		m_filter_ctx[i].m_passthrough    = false;
+	}
 
-		in_stream = m_ifmt_ctx->streams[i];
-		dec_ctx   = in_stream->codec;
+	char spec[64];
+	snprintf(spec, sizeof(spec), "scale=%d:%d", width, height);
 
-		if(dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO or dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
-		{
-			encoder = avcodec_find_encoder(dec_ctx->codec_id); //
+	if(init_filter(&m_filter_ctx[v], dec_ctx, sheet.encoder(), spec) < 0)
+		throw Error("Filter can't be allocated.");
 
-			if(!encoder)
-				return AVERROR_INVALIDDATA;
+	const vector<int>& v_keyframes = m_v_keyframes[v];
+	int64_t base      = (m_ifmt_ctx->start_time != AV_NOPTS_VALUE) ? m_ifmt_ctx->start_time : 0;
+	int last_keyframe = -1;
+	int64_t last_pts  = AV_NOPTS_VALUE;
 
-			m_ofmt_ctx->streams[i]->codec = avcodec_alloc_context3(encoder);
+	for(int t=0; t<numof_thumbnails; t++)
+	{
+		double start_time = t * settings.m_interval;
+		double end_time   = start_time + settings.m_interval;
+		if(duration > 0.0) end_time = min(end_time, duration);
 
-			if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
-			{
-				out_stream->codec->height              = dec_ctx->height;
-				out_stream->codec->width               = dec_ctx->width;
-				out_stream->codec->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+		int ret;
+		if(not v_keyframes.empty())
+		{
+			int frame = frame_at_or_before(v, start_time);
+			int k     = max(0, int(upper_bound(v_keyframes.begin(), v_keyframes.end(), frame) - v_keyframes.begin()) - 1);
 
-				out_stream->codec->pix_fmt             = encoder->pix_fmts[0];
-				out_stream->codec->time_base           = dec_ctx->time_base;
-				out_stream->codec->qcompress           = dec_ctx->qcompress;
-				out_stream->codec->bit_rate            = dec_ctx->bit_rate;
-				out_stream->codec->gop_size            = dec_ctx->gop_size;
-			}
-			else
+			if(v_keyframes[k] == last_keyframe)
 			{
-				out_stream->codec->sample_rate    = dec_ctx->sample_rate;
-				out_stream->codec->channel_layout = dec_ctx->channel_layout;
-				out_stream->codec->channels       = av_get_channel_layout_nb_channels(out_stream->codec->channel_layout);
-
-				out_stream->codec->sample_fmt     = encoder->sample_fmts[0];
-				out_stream->codec->time_base      = dec_ctx->time_base;
+				sheet.extend_tile(end_time);
+				continue;
 			}
 
-			ret = avcodec_open2(m_ofmt_ctx->streams[i]->codec, encoder, NULL);
-			if(ret < 0)
-				return ret;
+			last_keyframe = v_keyframes[k];
+			ret = av_seek_frame(m_ifmt_ctx, v, stream->index_entries[last_keyframe].timestamp, AVSEEK_FLAG_BACKWARD);
 		}
 		else
 		{
-			throw Error("Unknown stream format.");
+			// Without an index, libavformat searches for the keyframe itself.
+			ret = av_seek_frame(m_ifmt_ctx, -1, base + seconds_to_global_time(start_time), AVSEEK_FLAG_BACKWARD);
 		}
 
-		if(m_ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-			m_ofmt_ctx->streams[i]->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
-	}
+		if(ret < 0)
+			throw Error("[VideoTranscoder] Thumbnail time can't be seeked.");
 
-	if(!(m_ofmt_ctx->oformat->flags & AVFMT_NOFILE))
-	{
-		ret = avio_open(&m_ofmt_ctx->pb, pth_media.c_str(), AVIO_FLAG_WRITE);
-		if (ret < 0)
-			return ret;
+		AVFrame* frame = decode_keyframe(v);
+		int64_t pts    = frame ? av_frame_get_best_effort_timestamp(frame) : AV_NOPTS_VALUE;
+
+		if(not frame or (pts != AV_NOPTS_VALUE and pts == last_pts))
+		{
+			sheet.extend_tile(end_time);
+			continue;
+		}
+		last_pts = pts;
+
+		TraceSpan span(m_trace.get(), "filter", v, pts);
+
+		if(av_buffersrc_add_frame_flags(m_filter_ctx[v].m_buffersrc_ctx, frame, 0) < 0)
+			throw Error("[VideoTranscoder] Error occurred during scaling thumbnail.");
+
+		AVFrame* tile = m_frame_pool.acquire_frame();
+		if(not tile)
+			throw Error("[VideoTranscoder] Thumbnail frame can't be allocated.");
+
+		ret = av_buffersink_get_frame(m_filter_ctx[v].m_buffersink_ctx, tile);
+		if(ret >= 0) ret = sheet.add_tile(tile, start_time, end_time);
+		m_frame_pool.release_frame(tile);
+
+		if(ret < 0)
+			throw Error("[VideoTranscoder] Error occurred during packing thumbnail.");
 	}
 
-	ret = avformat_write_header(m_ofmt_ctx, NULL);
-	if(ret < 0)
-		return ret;
+	if(sheet.finish() < 0)
+		throw Error("[VideoTranscoder] Error occurred during writing sprite sheet.");
 
-	return 0;
+	if(not sheet.write_vtt(pth_vtt))
+		throw Error("[VideoTranscoder] Error occurred during writing thumbnail index.");
+
+	release_thread_cores();
+
+	if(m_quality) m_quality->finish();
+	m_metrics->stop_export();
 }
 
-void VideoTranscoder::input_video_properties()
+void VideoTranscoder::register_all()
 {
-	m_v_duration.clear();     m_v_duration.resize(m_ifmt_ctx->nb_streams);
-	m_v_numof_frames.clear(); m_v_numof_frames.resize(m_ifmt_ctx->nb_streams);
-	m_v_timestamps.clear();   m_v_timestamps.resize(m_ifmt_ctx->nb_streams);
-
-	for(int s=0; s<int(m_ifmt_ctx->nb_streams); s++)
+	// Registration isn't thread safe in older FFmpeg versions and only needed once per process.
+	static once_flag registered;
+	call_once(registered, []()
 	{
-		AVStream* stream = m_ifmt_ctx->streams[s];
+		av_register_all();
+		avfilter_register_all();
+	});
+}
 
-		m_v_duration[s]     = global_time_to_seconds(stream_time_to_global_time(stream->time_base, stream->duration));
-		m_v_numof_frames[s] = stream->nb_frames;
+FramePool::st_statistics VideoTranscoder::frame_pool_statistics() const
+{
+	return m_frame_pool.statistics();
+}
 
-		for(int i=0; i<stream->nb_index_entries; i+=1)
-		{
-			m_v_timestamps[s].push_back( stream_time_to_global_time(stream->time_base, stream->index_entries[i].timestamp - stream->index_entries[0].timestamp) );
-		}
-	}
+void VideoTranscoder::set_memory_budget(size_t bytes)
+{
+	m_memory_budget->set_limit(bytes);
 }
 
-int VideoTranscoder::init_filters()
+MemoryBudget::st_usage VideoTranscoder::memory_usage() const
 {
-	const char *filter_spec;
-	unsigned int i;
-	int ret;
+	return m_memory_budget->usage();
+}
 
-	m_filter_ctx = (st_filtering_context *)av_malloc_array(m_ifmt_ctx->nb_streams, sizeof(*m_filter_ctx));
+void VideoTranscoder::set_execution_mode(e_execution_mode mode, size_t queue_depth)
+{
+	if(queue_depth == 0)
+		throw Error("[VideoTranscoder] Pipeline queue depth must be positive.");
 
-	if(!m_filter_ctx)
-		return -1;
+	m_execution_mode = mode;
+	m_queue_depth    = queue_depth;
+}
 
-	for(i = 0; i <m_ifmt_ctx->nb_streams; i++)
-	{
-		m_filter_ctx[i].m_buffersrc_ctx  = NULL;
-		m_filter_ctx[i].m_buffersink_ctx = NULL;
-		m_filter_ctx[i].m_filter_graph   = NULL;
-		if( not (m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO or
-			     m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) )
-			continue;
+void VideoTranscoder::set_segmented_parallelism(int workers, double segment_seconds)
+{
+	if(workers < 1 or segment_seconds <= 0.0)
+		throw Error("[VideoTranscoder] Segmented transcoding needs at least one worker and a positive segment length.");
+
+	m_segment_workers = workers;
+	m_segment_seconds = segment_seconds;
+}
 
-		if(m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) filter_spec = "null";
-		else filter_spec = "anull";
+void VideoTranscoder::set_stream_copy(bool enabled)
+{
+	m_stream_copy = enabled;
+}
 
-		ret = init_filter(&m_filter_ctx[i], m_ifmt_ctx->streams[i]->codec, m_ofmt_ctx->streams[i]->codec, filter_spec);
-		if(ret) return ret;
+void VideoTranscoder::set_smart_render(const vector<st_edit>& v_edits)
+{
+	for(size_t e=0; e<v_edits.size(); e++)
+	{
+		if(v_edits[e].m_start_time < 0.0 or v_edits[e].m_end_time <= v_edits[e].m_start_time)
+			throw Error("[VideoTranscoder] Edit ranges must be non-negative and non-empty.");
 	}
 
-	return 0;
+	m_v_edits = v_edits;
 }
 
-int VideoTranscoder::init_filter(st_filtering_context* f_ctx, AVCodecContext *dec_ctx,
-								 AVCodecContext *enc_ctx, const char *filter_spec)
+void VideoTranscoder::set_threading_policy(const ThreadingPolicy& policy)
 {
-	char args[512];
-	int ret = 0;
+	m_threading_policy = policy;
+}
 
-	AVFilter *buffersrc             = NULL;
-	AVFilter *buffersink            = NULL;
-	AVFilterContext *buffersrc_ctx  = NULL;
-	AVFilterContext *buffersink_ctx = NULL;
+void VideoTranscoder::set_duplicate_detection(const st_duplicate_detection& detection)
+{
+	if(detection.m_enabled and detection.m_threshold < 0)
+		throw Error("[VideoTranscoder] Duplicate threshold can't be negative.");
 
-	AVFilterInOut *outputs      = avfilter_inout_alloc();
-	AVFilterInOut *inputs       = avfilter_inout_alloc();
-	AVFilterGraph *filter_graph = avfilter_graph_alloc();
+	m_duplicates = detection;
+}
 
-	if((not outputs) or (not inputs) or (not filter_graph))
-	{
-		avfilter_inout_free(&inputs);
-		avfilter_inout_free(&outputs);
-		return AVERROR(ENOMEM);
-	}
+void VideoTranscoder::set_quality_measurement(bool enabled, QualityMeter::frame_callback on_frame)
+{
+	if(enabled) m_quality = make_shared<QualityMeter>(m_queue_depth);
+	else        m_quality.reset();
 
-	if(dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
-	{
-		buffersrc  = avfilter_get_by_name("buffer");
-		buffersink = avfilter_get_by_name("buffersink");
-		if( (not buffersrc) or (not buffersink) )
-		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
-			return AVERROR_UNKNOWN;
-		}
+	m_on_frame_quality = on_frame;
+}
 
-		snprintf(args, sizeof(args),
-		"video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-		dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-		dec_ctx->time_base.num, dec_ctx->time_base.den,
-		dec_ctx->sample_aspect_ratio.num,
-		dec_ctx->sample_aspect_ratio.den);
+vector<QualityMeter::st_summary> VideoTranscoder::quality_summary() const
+{
+	return m_quality ? m_quality->summary() : vector<QualityMeter::st_summary>();
+}
 
-		ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in", args, NULL, filter_graph);
-		if(ret < 0)
-		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
-			return ret;
-		}
+void VideoTranscoder::set_draft_mode(bool enabled, int lowres)
+{
+	if(enabled and (lowres < 1 or lowres > 3))
+		throw Error("[VideoTranscoder] Draft resolution must be reduced 1 to 3 times.");
 
-		ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, filter_graph);
-		if(ret < 0)
-		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
-			return ret;
-		}
+	m_draft        = enabled;
+	m_draft_lowres = lowres;
+}
 
-		ret = av_opt_set_bin(buffersink_ctx, "pix_fmts", (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt), AV_OPT_SEARCH_CHILDREN);
-		if(ret < 0)
-		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
-			return ret;
-		}
-	}
-	else if(dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
-	{
-		buffersrc  = avfilter_get_by_name("abuffer");
-		buffersink = avfilter_get_by_name("abuffersink");
-		if( (not buffersrc) or (not buffersink) )
-		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
-			return ret;
-		}
+void VideoTranscoder::set_index_cache(bool enabled, string directory)
+{
+	m_index_cache           = enabled;
+	m_index_cache_directory = directory;
+}
 
-		if(not dec_ctx->channel_layout)
-			dec_ctx->channel_layout = av_get_default_channel_layout(dec_ctx->channels);
+void VideoTranscoder::set_media_io(const st_media_io& media_io)
+{
+	m_media_io = media_io;
+}
 
-		snprintf(args, sizeof(args),
-		"time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
-		 dec_ctx->time_base.num, dec_ctx->time_base.den, dec_ctx->sample_rate,
-		 av_get_sample_fmt_name(dec_ctx->sample_fmt),
-		 dec_ctx->channel_layout);
+void VideoTranscoder::set_stream_map(const vector<st_stream_map>& v_map)
+{
+	for(size_t m=0; m<v_map.size(); m++)
+		if(v_map[m].m_index < 0)
+			throw Error("[VideoTranscoder] Stream map indices can't be negative.");
 
-		ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in", args, NULL, filter_graph);
-		if(ret < 0)
-		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
-			return ret;
-		}
+	m_v_stream_map = v_map;
+}
 
-		ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, filter_graph);
-		if(ret < 0)
-		{
-			avfilter_inout_free(&inputs);
+void VideoTranscoder::set_filter(int stream_index, string filter_spec)
+{
+	if(stream_index < 0)
+		throw Error("[VideoTranscoder] Filter stream index can't be negative.");
+
+	if(filter_spec.empty()) m_filter_specs.erase(stream_index);
+	else                    m_filter_specs[stream_index] = filter_spec;
+}
+
+void VideoTranscoder::set_streaming_output(const st_streaming_output& streaming, segment_callback on_segment_ready)
+{
+	if(streaming.m_format != st_streaming_output::STREAMING_OFF and streaming.m_segment_seconds <= 0.0)
+		throw Error("[VideoTranscoder] Streaming output needs a positive segment length.");
+
+	if(streaming.m_list_size < 0)
+		throw Error("[VideoTranscoder] Streaming playlist size can't be negative.");
+
+	m_streaming        = streaming;
+	m_on_segment_ready = on_segment_ready;
+}
+
+const vector<VideoTranscoder::st_segment_report>& VideoTranscoder::segment_reports() const
+{
+	return m_v_segment_reports;
+}
+
+void VideoTranscoder::set_live_input(const st_live_input& live, latency_callback on_frame)
+{
+	if(live.m_probe_size < 0 or live.m_analyze_seconds < 0.0)
+		throw Error("[VideoTranscoder] Live probe window can't be negative.");
+
+	m_live             = live;
+	m_on_frame_latency = on_frame;
+}
+
+VideoTranscoder::st_live_statistics VideoTranscoder::live_statistics() const
+{
+	lock_guard<mutex> lock(m_live_mutex);
+	return m_live_statistics;
+}
+
+void VideoTranscoder::add_frame_processor(shared_ptr<FrameProcessor> processor)
+{
+	if(not processor)
+		throw Error("[VideoTranscoder] Frame processor can't be empty.");
+
+	m_frame_processors.add(processor);
+}
+
+void VideoTranscoder::clear_frame_processors()
+{
+	m_frame_processors.clear();
+}
+
+void VideoTranscoder::set_frame_processor_threads(int numof_threads)
+{
+	m_frame_processors.set_threads(numof_threads);
+}
+
+TranscodeMetrics& VideoTranscoder::metrics()
+{
+	return *m_metrics;
+}
+
+void VideoTranscoder::set_metrics_export(string path, TranscodeMetrics::e_export_format format, double interval_seconds)
+{
+	if(not path.empty() and interval_seconds <= 0.0)
+		throw Error("[VideoTranscoder] Metrics export needs a positive interval.");
+
+	m_metrics_path     = path;
+	m_metrics_format   = format;
+	m_metrics_interval = interval_seconds;
+}
+
+void VideoTranscoder::set_tracing(bool enabled, size_t events_per_thread)
+{
+	if(enabled) m_trace = make_shared<TraceRecorder>(events_per_thread);
+	else        m_trace.reset();
+}
+
+bool VideoTranscoder::write_trace(string path) const
+{
+	return m_trace and m_trace->write(path);
+}
+
+void VideoTranscoder::name_trace_thread(const string& name)
+{
+	if(m_trace) m_trace->name_thread(name);
+}
+
+void VideoTranscoder::begin_instrumentation()
+{
+	vector<string> v_stream_types;
+	for(unsigned int i=0; i<m_ifmt_ctx->nb_streams; i++)
+	{
+		const char* type = av_get_media_type_string(m_ifmt_ctx->streams[i]->codec->codec_type);
+		v_stream_types.push_back(type ? type : "unknown");
+	}
+
+	m_metrics->stop_export();
+	m_metrics->begin(v_stream_types);
+
+	if(not m_metrics_path.empty())
+		m_metrics->start_export(m_metrics_path, m_metrics_format, m_metrics_interval);
+
+	if(m_trace) m_trace->begin();
+	name_trace_thread("transcode");
+
+	m_memory_budget->begin();
+
+	if(m_quality) m_quality->begin(m_on_frame_quality);
+}
+
+void VideoTranscoder::transcode(string pth_input_media, string pth_output_media, double start_time, double end_time)
+{
+	bool trimming = (start_time > 0.0 or end_time >= 0.0);
+
+	if(trimming and end_time >= 0.0 and end_time <= start_time)
+		throw Error("[VideoTranscoder] Clip end must be after its start.");
+
+	if(trimming and not m_v_edits.empty())
+		throw Error("[VideoTranscoder] Clips can't be combined with smart rendering, add them as cuts instead.");
+
+	if(m_live.m_enabled and (trimming or not m_v_edits.empty()))
+		throw Error("[VideoTranscoder] Live inputs can't be seeked, clips and smart rendering need a file.");
+
+	if(m_draft and not m_v_edits.empty())
+		throw Error("[VideoTranscoder] Smart rendering copies full size GOPs, it can't run in draft mode.");
+
+	register_all();
+	reset();
+
+	// Clips are short and start mid-stream, segmenting them isn't worth it. Segment workers reopen
+	// the input, which a live stream doesn't allow.
+	e_execution_mode mode = ((trimming or m_live.m_enabled) and m_execution_mode == EXECUTION_SEGMENTED) ? EXECUTION_SERIAL : m_execution_mode;
+
+	m_input_path = pth_input_media;
+	st_core_reservation cores(*this);
+	m_split_stream_cores = (m_v_edits.empty() and mode == EXECUTION_STREAM_WORKERS);
+	m_streaming_epoch = chrono::steady_clock::now();
+
+	if(open_input_file(pth_input_media) <0)   throw Error("Error occurred during input media opening.");
+	begin_instrumentation();
+
+	if(open_output_file(pth_output_media) <0) throw Error("Error occurred during output media opening.");
+	if(init_filters() <0)                     throw Error("Filter can't be allocated.");
+
+	if(trimming and seek_trim_start(start_time, end_time) < 0)
+		throw Error("[VideoTranscoder] Clip start can't be seeked.");
+
+	if(not m_v_edits.empty())                  transcode_smart();
+	else if(mode == EXECUTION_PIPELINED)       transcode_pipelined();
+	else if(mode == EXECUTION_SEGMENTED)       transcode_segmented();
+	else if(mode == EXECUTION_STREAM_WORKERS)  transcode_stream_workers();
+	else                                       transcode_serial();
+
+	// Clips stop early and segment workers read the video on inputs of their own. Demuxers drop the
+	// packets of discarded streams before indexing them, a stream map leaves their indexes empty.
+	bool whole_index = (m_index_pending and not trimming and (not m_v_edits.empty() or mode != EXECUTION_SEGMENTED));
+	for(unsigned int i=0; i<m_ifmt_ctx->nb_streams and whole_index; i++)
+		whole_index = (m_ifmt_ctx->streams[i]->discard != AVDISCARD_ALL);
+
+	if(whole_index)
+		IndexCache(pth_input_media, m_index_cache_directory).save(m_ifmt_ctx);
+
+	av_write_trailer(m_ofmt_ctx);
+	clear_interleaved();
+	release_thread_cores();
+
+	// Write-behind errors only show up once everything queued has been written.
+	if(close_output_io() < 0)
+		throw Error("Error occurred during output media writing.");
+
+	// The trailer wrote the last piece.
+	if(m_streaming_segment >= 0)
+		finish_streaming_segment(m_streaming_end);
+
+	// Scores are complete once the meter has caught up.
+	if(m_quality) m_quality->finish();
+
+	m_metrics->stop_export();
+}
+
+void VideoTranscoder::transcode(string pth_input_media, const vector<st_output_profile>& v_profiles)
+{
+	if(v_profiles.empty())
+		throw Error("[VideoTranscoder] Output ladder needs at least one profile.");
+
+	register_all();
+	reset();
+
+	m_input_path = pth_input_media;
+	st_core_reservation cores(*this);
+
+	if(open_input_file(pth_input_media) <0)  throw Error("Error occurred during input media opening.");
+	begin_instrumentation();
+
+	if(open_ladder_outputs(v_profiles) <0)   throw Error("Error occurred during output media opening.");
+
+	transcode_ladder();
+	release_thread_cores();
+
+	if(m_quality) m_quality->finish();
+	m_metrics->stop_export();
+}
+
+void VideoTranscoder::transcode_serial()
+{
+	while(true)
+	{
+		if(not find_next_packet(*m_packet)) break;
+
+		int stream_index = m_packet->stream_index;
+
+		if(m_v_stream_copy[stream_index])
+		{
+			if(copy_packet(*m_packet) < 0)
+				throw Error("[VideoTranscoder] Error occurred during copying packet.");
+			continue;
+		}
+
+		if(not decode_packet(*m_packet, m_dec_frame)) continue;
+
+		prepare_frame(m_dec_frame, stream_index);
+
+		if(not encode_frame(m_dec_frame, stream_index))
+			throw Error("Error occurred during encoding current frame.");
+	}
+
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		if(not is_transcoded(i)) continue;
+
+		while(decode_frame_in_buffer(i, m_dec_frame) == 1)
+		{
+			prepare_frame(m_dec_frame, i);
+			if(not encode_frame(m_dec_frame, i)) break;
+		}
+
+		if(filter_encode_write_frame(NULL, i) < 0) break;
+		if(flush_encoder(i) < 0) break;
+	}
+}
+
+void VideoTranscoder::transcode_pipelined()
+{
+	m_packet_queue = auto_ptr<pipeline_queue>(new pipeline_queue(m_queue_depth));
+	m_frame_queue  = auto_ptr<pipeline_queue>(new pipeline_queue(m_queue_depth));
+	m_mux_queue    = auto_ptr<pipeline_queue>(new pipeline_queue(m_queue_depth));
+
+	m_pipeline_failed.store(false);
+	m_pipeline_error.clear();
+
+	thread demuxer(&VideoTranscoder::run_stage, this, &VideoTranscoder::demux_stage);
+	thread decoder(&VideoTranscoder::run_stage, this, &VideoTranscoder::decode_stage);
+	thread encoder(&VideoTranscoder::run_stage, this, &VideoTranscoder::encode_stage);
+	thread muxer(&VideoTranscoder::run_stage, this, &VideoTranscoder::mux_stage);
+
+	demuxer.join();
+	decoder.join();
+	encoder.join();
+	muxer.join();
+
+	drain_pipeline_queue(m_packet_queue.get());
+	drain_pipeline_queue(m_frame_queue.get());
+	drain_pipeline_queue(m_mux_queue.get());
+
+	m_packet_queue.reset();
+	m_frame_queue.reset();
+	m_mux_queue.reset();
+
+	if(m_pipeline_failed.load())
+		throw Error(m_pipeline_error);
+}
+
+void VideoTranscoder::transcode_stream_workers()
+{
+	m_pipeline_failed.store(false);
+	m_pipeline_error.clear();
+
+	m_v_stream_queues.assign(m_ifmt_ctx->nb_streams, (pipeline_queue*)NULL);
+	vector<thread> v_workers;
+
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		if(not is_transcoded(i)) continue;
+		m_v_stream_queues[i] = new pipeline_queue(m_queue_depth);
+	}
+
+	m_mux_shared = true;
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		if(m_v_stream_queues[i])
+			v_workers.push_back(thread(&VideoTranscoder::stream_worker, this, i));
+	}
+
+	AVPacket packet;
+	while(not m_pipeline_failed.load() and find_next_packet(packet))
+	{
+		if(m_v_stream_copy[packet.stream_index])
+		{
+			if(copy_packet(packet) < 0)
+				fail_pipeline("[VideoTranscoder] Error occurred during copying packet.");
+			continue;
+		}
+
+		pipeline_queue* queue = m_v_stream_queues[packet.stream_index];
+
+		// The demuxer may reuse its internal buffer on the next read, so take our own copy.
+		if(not queue or av_dup_packet(&packet) < 0)
+		{
+			av_free_packet(&packet);
+			continue;
+		}
+
+		st_pipeline_item item = pipeline_item(st_pipeline_item::ITEM_PACKET, packet.stream_index);
+		item.m_packet  = m_frame_pool.acquire_packet();
+		*item.m_packet = packet;
+
+		if(not queue->push(item))
+		{
+			release_pipeline_item(item);
+			break;
+		}
+		m_metrics->sample_queue(TranscodeMetrics::QUEUE_STREAMS, queue->size());
+	}
+
+	for(size_t i=0; i<m_v_stream_queues.size(); i++)
+	{
+		if(m_v_stream_queues[i])
+			m_v_stream_queues[i]->push(pipeline_item(st_pipeline_item::ITEM_END, -1));
+	}
+
+	for(size_t w=0; w<v_workers.size(); w++)
+		v_workers[w].join();
+
+	m_mux_shared = false;
+	for(size_t i=0; i<m_v_stream_queues.size(); i++)
+	{
+		if(not m_v_stream_queues[i]) continue;
+
+		drain_pipeline_queue(m_v_stream_queues[i]);
+		delete m_v_stream_queues[i];
+	}
+	m_v_stream_queues.clear();
+
+	if(m_pipeline_failed.load())
+		throw Error(m_pipeline_error);
+}
+
+void VideoTranscoder::stream_worker(int stream_index)
+{
+	name_trace_thread("stream " + to_string(stream_index));
+
+	pipeline_queue* queue = m_v_stream_queues[stream_index];
+	AVFrame* dec_frame = NULL;
+
+	try
+	{
+		st_pipeline_item item;
+		while(queue->pop(item))
+		{
+			if(item.m_type == st_pipeline_item::ITEM_END) break;
+
+			bool b_frame = decode_packet(*item.m_packet, dec_frame);
+			release_pipeline_item(item);
+
+			if(not b_frame) continue;
+
+			prepare_frame(dec_frame, stream_index);
+			if(not encode_frame(dec_frame, stream_index))
+				throw Error("Error occurred during encoding current frame.");
+		}
+
+		if(not queue->aborted())
+		{
+			while(decode_frame_in_buffer(stream_index, dec_frame) == 1)
+			{
+				prepare_frame(dec_frame, stream_index);
+				if(not encode_frame(dec_frame, stream_index)) break;
+			}
+
+			if(filter_encode_write_frame(NULL, stream_index) >= 0)
+				flush_encoder(stream_index);
+		}
+	}
+	catch(exception& e)
+	{
+		fail_pipeline(e.what());
+	}
+
+	m_frame_pool.release_frame(dec_frame);
+}
+
+void VideoTranscoder::run_stage(void (VideoTranscoder::*stage)())
+{
+	try
+	{
+		(this->*stage)();
+	}
+	catch(exception& e)
+	{
+		fail_pipeline(e.what());
+	}
+}
+
+void VideoTranscoder::demux_stage()
+{
+	name_trace_thread("demux");
+
+	AVPacket packet;
+
+	while(find_next_packet(packet))
+	{
+		// The demuxer may reuse its internal buffer on the next read, so take our own copy.
+		if(av_dup_packet(&packet) < 0)
+		{
+			av_free_packet(&packet);
+			throw Error("[VideoTranscoder] Packet can't be duplicated.");
+		}
+
+		st_pipeline_item item = pipeline_item(st_pipeline_item::ITEM_PACKET, packet.stream_index);
+		item.m_packet  = m_frame_pool.acquire_packet();
+		*item.m_packet = packet;
+
+		if(not m_packet_queue->push(item))
+		{
+			release_pipeline_item(item);
+			return;
+		}
+		m_metrics->sample_queue(TranscodeMetrics::QUEUE_PACKETS, m_packet_queue->size());
+	}
+
+	m_packet_queue->push(pipeline_item(st_pipeline_item::ITEM_END, -1));
+}
+
+void VideoTranscoder::decode_stage()
+{
+	name_trace_thread("decode");
+
+	st_pipeline_item item;
+
+	while(m_packet_queue->pop(item))
+	{
+		if(item.m_type == st_pipeline_item::ITEM_END) break;
+
+		int stream_index = item.m_stream_index;
+		AVFrame* dec_frame = NULL;
+
+		// Copied packets pass through the encoder stage, the only producer of the mux queue.
+		if(m_v_stream_copy[stream_index])
+		{
+			if(not m_frame_queue->push(item))
+			{
+				release_pipeline_item(item);
+				return;
+			}
+			continue;
+		}
+
+		bool b_frame = decode_packet(*item.m_packet, dec_frame);
+		release_pipeline_item(item);
+
+		if(not b_frame)
+		{
+			m_frame_pool.release_frame(dec_frame);
+			continue;
+		}
+
+		prepare_frame(dec_frame, stream_index);
+
+		st_pipeline_item frame_item = pipeline_item(st_pipeline_item::ITEM_FRAME, stream_index);
+		frame_item.m_frame = dec_frame;
+
+		if(not push_frame_item(frame_item)) return;
+	}
+
+	if(m_packet_queue->aborted()) return;
+
+	// Same order as the flushing part of transcode_serial(): drain decoder, then filter and encoder.
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		if(not is_transcoded(i)) continue;
+
+		AVFrame* dec_frame = NULL;
+		while(decode_frame_in_buffer(i, dec_frame) == 1)
+		{
+			prepare_frame(dec_frame, i);
+
+			st_pipeline_item frame_item = pipeline_item(st_pipeline_item::ITEM_FRAME, i);
+			frame_item.m_frame   = dec_frame;
+			frame_item.m_drained = true;
+			dec_frame = NULL;
+
+			if(not push_frame_item(frame_item)) return;
+		}
+		m_frame_pool.release_frame(dec_frame);
+
+		if(not m_frame_queue->push(pipeline_item(st_pipeline_item::ITEM_FLUSH, i))) return;
+	}
+
+	m_frame_queue->push(pipeline_item(st_pipeline_item::ITEM_END, -1));
+}
+
+void VideoTranscoder::encode_stage()
+{
+	name_trace_thread("encode");
+
+	st_pipeline_item item;
+	bool flush_failed = false;
+	vector<bool> v_drain_failed(m_ifmt_ctx->nb_streams, false);
+
+	while(m_frame_queue->pop(item))
+	{
+		if(item.m_type == st_pipeline_item::ITEM_END) break;
+
+		if(item.m_type == st_pipeline_item::ITEM_FLUSH)
+		{
+			if(flush_failed) continue;
+
+			if(filter_encode_write_frame(NULL, item.m_stream_index) < 0 or
+			   flush_encoder(item.m_stream_index) < 0)
+				flush_failed = true;
+
+			continue;
+		}
+
+		if(item.m_type == st_pipeline_item::ITEM_PACKET)
+		{
+			int ret = copy_packet(*item.m_packet);
+			release_pipeline_item(item);
+
+			if(ret < 0)
+				throw Error("[VideoTranscoder] Error occurred during copying packet.");
+			continue;
+		}
+
+		// Filtering takes the frame's references, its size has to be known before.
+		size_t bytes = frame_bytes(item.m_frame);
+		int stream_index = item.m_stream_index;
+		bool drained     = item.m_drained;
+
+		// transcode_serial() stops draining a stream at its first failed frame and flushes nothing
+		// after a failed flush.
+		bool encoded = (drained and (flush_failed or v_drain_failed[stream_index])) or encode_frame(item.m_frame, stream_index);
+		release_pipeline_item(item);
+		m_memory_budget->release(MemoryBudget::STAGE_FRAME_QUEUES, bytes);
+
+		if(not encoded and drained)
+			v_drain_failed[stream_index] = true;
+		else if(not encoded)
+			throw Error("Error occurred during encoding current frame.");
+	}
+
+	if(m_frame_queue->aborted()) return;
+
+	m_mux_queue->push(pipeline_item(st_pipeline_item::ITEM_END, -1));
+}
+
+bool VideoTranscoder::push_frame_item(st_pipeline_item& item)
+{
+	// The decoder stage stops here while the queued frames and everything downstream use up the budget.
+	if(not m_memory_budget->acquire(MemoryBudget::STAGE_FRAME_QUEUES, frame_bytes(item.m_frame)) or
+	   not m_frame_queue->push(item))
+	{
+		release_pipeline_item(item);
+		return false;
+	}
+
+	m_metrics->sample_queue(TranscodeMetrics::QUEUE_FRAMES, m_frame_queue->size());
+	return true;
+}
+
+void VideoTranscoder::mux_stage()
+{
+	name_trace_thread("mux");
+
+	st_pipeline_item item;
+
+	while(m_mux_queue->pop(item))
+	{
+		if(item.m_type == st_pipeline_item::ITEM_END) break;
+
+		int ret = mux_packet(item.m_packet);
+
+		if(ret < 0)
+			throw Error("[VideoTranscoder] Error occurred during writing packet.");
+	}
+}
+
+void VideoTranscoder::fail_pipeline(const string& message)
+{
+	{
+		lock_guard<mutex> lock(m_pipeline_mutex);
+		if(not m_pipeline_failed.load()) m_pipeline_error = message;
+		m_pipeline_failed.store(true);
+	}
+
+	m_memory_budget->abort();
+	if(m_packet_queue.get()) m_packet_queue->abort();
+	if(m_frame_queue.get())  m_frame_queue->abort();
+	if(m_mux_queue.get())    m_mux_queue->abort();
+
+	for(size_t i=0; i<m_v_stream_queues.size(); i++)
+		if(m_v_stream_queues[i]) m_v_stream_queues[i]->abort();
+
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+		if(m_v_renditions[r].m_queue) m_v_renditions[r].m_queue->abort();
+}
+
+VideoTranscoder::st_pipeline_item VideoTranscoder::pipeline_item(st_pipeline_item::e_type type, int stream_index)
+{
+	st_pipeline_item item;
+	item.m_type         = type;
+	item.m_stream_index = stream_index;
+	item.m_packet       = NULL;
+	item.m_frame        = NULL;
+	item.m_drained      = false;
+
+	return item;
+}
+
+void VideoTranscoder::release_pipeline_item(st_pipeline_item& item)
+{
+	m_frame_pool.release_packet(item.m_packet);
+	m_frame_pool.release_frame(item.m_frame);
+}
+
+void VideoTranscoder::drain_pipeline_queue(pipeline_queue* queue)
+{
+	st_pipeline_item item;
+	while(queue->try_pop(item))
+		release_pipeline_item(item);
+}
+
+void VideoTranscoder::transcode_segmented()
+{
+	int video_index = -1;
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		if(m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO and m_v_keyframes[i].size() > 1 and
+		   is_selected(i) and not m_v_stream_copy[i])
+		{
+			video_index = i;
+			break;
+		}
+	}
+
+	st_segment_schedule schedule;
+	schedule.m_stream_index  = video_index;
+	schedule.m_next          = 0;
+	schedule.m_written       = 0;
+	schedule.m_max_in_flight = 2 * size_t(m_segment_workers);
+	schedule.m_failed        = false;
+
+	if(video_index >= 0)
+		build_segments(video_index, schedule.m_v_segments);
+
+	if(schedule.m_v_segments.size() < 2)
+	{
+		transcode_serial();
+		return;
+	}
+
+	// The calling thread only demuxes the remaining streams from now on.
+	m_ifmt_ctx->streams[video_index]->discard = AVDISCARD_ALL;
+	reset_dts_splices();
+
+	vector<thread> v_workers;
+	int numof_workers = min(m_segment_workers, int(schedule.m_v_segments.size()));
+	for(int w=0; w<numof_workers; w++)
+		v_workers.push_back(thread(&VideoTranscoder::segment_worker, this, &schedule));
+
+	bool more_packets = true;
+	string error;
+
+	for(size_t k=0; k<schedule.m_v_segments.size(); k++)
+	{
+		st_segment& segment = schedule.m_v_segments[k];
+
+		{
+			unique_lock<mutex> lock(schedule.m_mutex);
+			while(not segment.m_done and not schedule.m_failed)
+				schedule.m_cond.wait(lock);
+
+			if(schedule.m_failed)
+			{
+				error = schedule.m_error;
+				break;
+			}
+		}
+
+		// Keep the other streams roughly level with the video written so far.
+		if(more_packets and segment.m_end_ts != AV_NOPTS_VALUE)
+		{
+			AVRational time_base = m_ifmt_ctx->streams[video_index]->time_base;
+			more_packets = pump_streams_until(stream_time_to_global_time(time_base, segment.m_end_ts), video_index);
+		}
+
+		int ret = 0;
+		begin_dts_range(video_index);
+
+		for(size_t p=0; p<segment.m_v_packets.size(); p++)
+		{
+			AVPacket* packet = segment.m_v_packets[p];
+			enforce_monotonic_dts(*packet);
+
+			if(ret >= 0) ret = write_packet(packet);
+			else         m_frame_pool.release_packet(packet);
+		}
+		segment.m_v_packets.clear();
+
+		{
+			lock_guard<mutex> lock(schedule.m_mutex);
+			schedule.m_written = k + 1;
+			if(ret < 0 and not schedule.m_failed)
+			{
+				schedule.m_failed = true;
+				schedule.m_error  = "[VideoTranscoder] Error occurred during writing segment.";
+			}
+		}
+		schedule.m_cond.notify_all();
+
+		if(ret < 0)
+		{
+			error = schedule.m_error;
+			break;
+		}
+	}
+
+	for(size_t w=0; w<v_workers.size(); w++)
+		v_workers[w].join();
+
+	for(size_t k=0; k<schedule.m_v_segments.size(); k++)
+	{
+		vector<AVPacket*>& v_packets = schedule.m_v_segments[k].m_v_packets;
+		for(size_t p=0; p<v_packets.size(); p++)
+			m_frame_pool.release_packet(v_packets[p]);
+	}
+
+	if(not error.empty())
+		throw Error(error);
+
+	if(more_packets)
+		pump_streams_until(INT64_MAX, video_index);
+
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		if(i == video_index or not is_transcoded(i)) continue;
+
+		while(decode_frame_in_buffer(i, m_dec_frame) == 1)
+		{
+			prepare_frame(m_dec_frame, i);
+			if(not encode_frame(m_dec_frame, i)) break;
+		}
+
+		if(filter_encode_write_frame(NULL, i) < 0) break;
+		if(flush_encoder(i) < 0) break;
+	}
+}
+
+void VideoTranscoder::build_segments(int stream_index, vector<st_segment>& v_segments) const
+{
+	AVStream* stream = m_ifmt_ctx->streams[stream_index];
+	const vector<int>& v_keyframes = m_v_keyframes[stream_index];
+	int64_t min_length = seconds_to_global_time(m_segment_seconds);
+
+	v_segments.clear();
+	for(size_t k=0; k<v_keyframes.size(); k++)
+	{
+		int64_t timestamp = m_v_timestamps[stream_index][v_keyframes[k]];
+
+		// A new segment starts at the first keyframe which is at least min_length after the last start.
+		if(not v_segments.empty() and
+		   timestamp - m_v_timestamps[stream_index][v_keyframes[0]] < int64_t(v_segments.size()) * min_length)
+			continue;
+
+		st_segment segment;
+		segment.m_start_ts = stream->index_entries[v_keyframes[k]].timestamp;
+		segment.m_end_ts   = AV_NOPTS_VALUE;
+		segment.m_done     = false;
+
+		if(not v_segments.empty())
+			v_segments.back().m_end_ts = segment.m_start_ts;
+
+		v_segments.push_back(segment);
+	}
+}
+
+void VideoTranscoder::segment_worker(st_segment_schedule* schedule)
+{
+	name_trace_thread("segment worker");
+
+	VideoTranscoder worker;
+
+	// Workers run side by side, each one gets its part of the parent's cores. The parent holds the
+	// reservation, a worker never gives them back.
+	worker.m_threading_policy = m_threading_policy;
+	worker.m_thread_cores     = thread_cores(m_segment_workers);
+
+	worker.m_segment_pool          = &m_frame_pool;
+	worker.m_index_cache           = m_index_cache;
+	worker.m_index_cache_directory = m_index_cache_directory;
+	worker.m_media_io              = m_media_io;
+	worker.m_streaming             = m_streaming;
+	worker.m_frame_processors      = m_frame_processors;
+	worker.m_metrics               = m_metrics;
+	worker.m_trace                 = m_trace;
+	worker.m_memory_budget         = m_memory_budget;
+	worker.m_v_stream_map          = m_v_stream_map;
+	worker.m_draft                 = m_draft;
+	worker.m_draft_lowres          = m_draft_lowres;
+	worker.m_duplicates            = m_duplicates;
+	worker.m_quality               = m_quality;
+
+	try
+	{
+		if(worker.open_segment_worker(m_input_path, m_ofmt_ctx, schedule->m_stream_index) < 0)
+			throw Error("[VideoTranscoder] Segment worker can't open the input media.");
+
+		while(true)
+		{
+			size_t k;
+			{
+				unique_lock<mutex> lock(schedule->m_mutex);
+				while(not schedule->m_failed and schedule->m_next < schedule->m_v_segments.size() and
+					  schedule->m_next >= schedule->m_written + schedule->m_max_in_flight)
+					schedule->m_cond.wait(lock);
+
+				if(schedule->m_failed or schedule->m_next >= schedule->m_v_segments.size()) return;
+				k = schedule->m_next++;
+			}
+
+			worker.transcode_segment(schedule->m_v_segments[k], schedule->m_stream_index);
+
+			{
+				lock_guard<mutex> lock(schedule->m_mutex);
+				schedule->m_v_segments[k].m_done = true;
+			}
+			schedule->m_cond.notify_all();
+		}
+	}
+	catch(exception& e)
+	{
+		{
+			lock_guard<mutex> lock(schedule->m_mutex);
+			if(not schedule->m_failed) schedule->m_error = e.what();
+			schedule->m_failed = true;
+		}
+		schedule->m_cond.notify_all();
+	}
+}
+
+int VideoTranscoder::open_segment_worker(string pth_media, AVFormatContext* parent_ofmt_ctx, int stream_index)
+{
+	int ret;
+	m_input_path = pth_media;
+
+	if((ret = open_input_file(pth_media)) < 0) return ret;
+
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+		if(i != stream_index) m_ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+	// Encoders are configured exactly like the parent's, but packets are collected instead of muxed.
+	if((ret = open_output_streams(parent_ofmt_ctx->filename)) < 0) return ret;
+	output_stream(stream_index)->time_base = parent_ofmt_ctx->streams[m_v_output_streams[stream_index]]->time_base;
+
+	return init_filters();
+}
+
+void VideoTranscoder::transcode_segment(st_segment& segment, int stream_index)
+{
+	AVStream* stream = m_ifmt_ctx->streams[stream_index];
+
+	if(av_seek_frame(m_ifmt_ctx, stream_index, segment.m_start_ts, AVSEEK_FLAG_BACKWARD) < 0)
+		throw Error("[VideoTranscoder] Segment start can't be seeked.");
+
+	// Every segment starts with a fresh decoder, encoder and filter graph.
+	avcodec_flush_buffers(decoder(stream_index));
+	if(reopen_encoder(stream_index) < 0) throw Error("[VideoTranscoder] Segment encoder can't be opened.");
+	if(reset_filter(stream_index) < 0)   throw Error("Filter can't be allocated.");
+
+	// The last kept frame belongs to another segment, usually one which isn't adjacent.
+	reset_duplicates(stream_index);
+
+	m_segment_sink = &segment.m_v_packets;
+
+	AVPacket packet;
+	av_init_packet(&packet);
+	while(read_packet(packet) >= 0)
+	{
+		int64_t timestamp = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+
+		if(packet.stream_index != stream_index or packet.pts < 0)
+		{
+			if(packet.stream_index == stream_index)
+				m_metrics->add(TranscodeMetrics::COUNTER_PACKETS_DROPPED, stream_index);
+
+			av_free_packet(&packet);
+			continue;
+		}
+
+		if(segment.m_end_ts != AV_NOPTS_VALUE and timestamp >= segment.m_end_ts)
+		{
+			av_free_packet(&packet);
+			break;
+		}
+
+		av_packet_rescale_ts(&packet, stream->time_base, m_v_decode_time_bases[stream_index]);
+
+		// decode_packet() advances the data pointer, keep the original one to release the packet.
+		uint8_t* data = packet.data;
+		int size      = packet.size;
+		bool b_frame  = decode_packet(packet, m_dec_frame);
+		packet.data = data;
+		packet.size = size;
+		av_free_packet(&packet);
+
+		if(not b_frame) continue;
+
+		prepare_frame(m_dec_frame, stream_index);
+		if(not encode_frame(m_dec_frame, stream_index))
+			throw Error("Error occurred during encoding current frame.");
+	}
+
+	while(decode_frame_in_buffer(stream_index, m_dec_frame) == 1)
+	{
+		prepare_frame(m_dec_frame, stream_index);
+		if(not encode_frame(m_dec_frame, stream_index))
+			throw Error("Error occurred during encoding current frame.");
+	}
+
+	if(filter_encode_write_frame(NULL, stream_index) < 0 or flush_encoder(stream_index) < 0)
+		throw Error("[VideoTranscoder] Segment encoder can't be flushed.");
+
+	m_segment_sink = NULL;
+}
+
+bool VideoTranscoder::pump_streams_until(int64_t global_time, int skip_stream_index)
+{
+	while(find_next_packet(*m_packet))
+	{
+		int stream_index = m_packet->stream_index;
+		AVStream* stream = m_ifmt_ctx->streams[stream_index];
+		AVRational time_base = m_v_stream_copy[stream_index] ? stream->time_base : m_v_decode_time_bases[stream_index];
+		int64_t packet_time  = stream_time_to_global_time(time_base, m_packet->pts);
+
+		if(m_v_stream_copy[stream_index])
+		{
+			if(copy_packet(*m_packet) < 0)
+				throw Error("[VideoTranscoder] Error occurred during copying packet.");
+		}
+		else if(stream_index != skip_stream_index and decode_packet(*m_packet, m_dec_frame))
+		{
+			prepare_frame(m_dec_frame, stream_index);
+
+			if(not encode_frame(m_dec_frame, stream_index))
+				throw Error("Error occurred during encoding current frame.");
+		}
+
+		if(packet_time >= global_time) return true;
+	}
+
+	return false;
+}
+
+void VideoTranscoder::reset_dts_splices()
+{
+	st_dts_splice splice;
+	splice.m_last_dts    = AV_NOPTS_VALUE;
+	splice.m_delay       = AV_NOPTS_VALUE;
+	splice.m_offset      = 0;
+	splice.m_range_start = true;
+
+	m_v_dts_splices.assign(m_ifmt_ctx->nb_streams, splice);
+}
+
+void VideoTranscoder::begin_dts_range(int stream_index)
+{
+	m_v_dts_splices[stream_index].m_range_start = true;
+}
+
+void VideoTranscoder::enforce_monotonic_dts(AVPacket& packet)
+{
+	// Every segment encoder, and the smart rendering encoder next to copied GOPs, starts its dts with
+	// a reordering delay of its own. A range's dts are moved as a whole, so its keyframe gets the
+	// stream's delay as if one encoder had written everything. pts are never changed, B-frames would
+	// be shown out of order otherwise.
+	st_dts_splice& splice = m_v_dts_splices[packet.stream_index];
+
+	if(packet.dts == AV_NOPTS_VALUE)
+		return;
+
+	if(splice.m_range_start and packet.pts != AV_NOPTS_VALUE)
+	{
+		if(splice.m_delay == AV_NOPTS_VALUE)
+			splice.m_delay = packet.pts - packet.dts;
+
+		splice.m_offset      = (packet.pts - splice.m_delay) - packet.dts;
+		splice.m_range_start = false;
+	}
+
+	packet.dts += splice.m_offset;
+
+	// Ranges with a longer delay than the stream's can still overlap by a tick, never decode after presenting.
+	if(splice.m_last_dts != AV_NOPTS_VALUE and packet.dts <= splice.m_last_dts)
+		packet.dts = splice.m_last_dts + 1;
+
+	if(packet.pts != AV_NOPTS_VALUE and packet.dts > packet.pts)
+		packet.dts = packet.pts;
+
+	splice.m_last_dts = max(splice.m_last_dts, packet.dts);
+}
+
+int VideoTranscoder::reopen_encoder(int stream_index)
+{
+	return reopen_encoder(output_stream(stream_index)->codec);
+}
+
+int VideoTranscoder::reopen_encoder(AVCodecContext* enc_ctx)
+{
+	int flags = enc_ctx->flags;
+
+	avcodec_close(enc_ctx);
+
+	// open_output_file() raises the global header flag only after opening, do the same here.
+	enc_ctx->flags = flags & ~CODEC_FLAG_GLOBAL_HEADER;
+	int ret = avcodec_open2(enc_ctx, avcodec_find_encoder(enc_ctx->codec_id), NULL);
+	enc_ctx->flags = flags;
+
+	return ret;
+}
+
+void VideoTranscoder::transcode_smart()
+{
+	int v = m_smart_stream_index;
+	AVStream* stream = m_ifmt_ctx->streams[v];
+	const vector<int>& v_keyframes = m_v_keyframes[v];
+
+	vector<e_gop_state> v_gop_states;
+	classify_gops(v_gop_states);
+	reset_dts_splices();
+
+	int gop = -1;
+	while(find_next_packet(*m_packet))
+	{
+		int stream_index = m_packet->stream_index;
+		AVStream* in_stream = m_ifmt_ctx->streams[stream_index];
+
+		if(stream_index == v)
+		{
+			int64_t timestamp = (m_packet->pts != AV_NOPTS_VALUE) ? m_packet->pts : m_packet->dts;
+
+			// Follow the GOP structure through the keyframes of the index. Only a keyframe starts a GOP,
+			// and its presentation time is at or after its index time whether the index holds pts or
+			// dts. The reordered frames following it in decoding order belong to it as well.
+			bool keyframe = (m_packet->flags & AV_PKT_FLAG_KEY);
+			while(keyframe and gop + 1 < int(v_keyframes.size()) and stream->index_entries[v_keyframes[gop + 1]].timestamp <= timestamp)
+				gop++;
+
+			e_gop_state state = (gop < 0) ? GOP_DROPPED : v_gop_states[gop];
+
+			if(state != GOP_DIRTY and m_smart_run)
+				finish_smart_run();
+
+			if(state == GOP_DROPPED)
+			{
+				av_free_packet(m_packet.get());
+				continue;
+			}
+
+			if(state == GOP_CLEAN)
+			{
+				shift_packet(*m_packet, stream->time_base);
+
+				AVPacket* out_pkt = prepare_copy_packet(*m_packet);
+				if(not out_pkt or (enforce_monotonic_dts(*out_pkt), write_packet(out_pkt)) < 0)
+					throw Error("[VideoTranscoder] Error occurred during copying packet.");
+				continue;
+			}
+
+			if(not m_smart_run)
+				start_smart_run();
+
+			av_packet_rescale_ts(m_packet.get(), stream->time_base, m_v_decode_time_bases[stream_index]);
+			if(decode_packet(*m_packet, m_dec_frame))
+				smart_encode_frame(m_dec_frame);
+
+			continue;
+		}
+
+		AVRational time_base = m_v_stream_copy[stream_index] ? in_stream->time_base : m_v_decode_time_bases[stream_index];
+		if(in_cut(av_rescale_q(m_packet->pts, time_base, AV_TIME_BASE_Q)))
+		{
+			av_free_packet(m_packet.get());
+			continue;
+		}
+
+		if(m_v_stream_copy[stream_index])
+		{
+			shift_packet(*m_packet, time_base);
+			if(copy_packet(*m_packet) < 0)
+				throw Error("[VideoTranscoder] Error occurred during copying packet.");
+			continue;
+		}
+
+		if(not decode_packet(*m_packet, m_dec_frame)) continue;
+
+		prepare_frame(m_dec_frame, stream_index);
+		m_dec_frame->pts -= av_rescale_q(cut_offset(av_rescale_q(m_dec_frame->pts, time_base, AV_TIME_BASE_Q)),
+										 AV_TIME_BASE_Q, time_base);
+
+		if(not encode_frame(m_dec_frame, stream_index))
+			throw Error("Error occurred during encoding current frame.");
+	}
+
+	if(m_smart_run)
+		finish_smart_run();
+
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		if(not is_transcoded(i)) continue;
+
+		while(decode_frame_in_buffer(i, m_dec_frame) == 1)
+		{
+			prepare_frame(m_dec_frame, i);
+			if(not encode_frame(m_dec_frame, i)) break;
+		}
+
+		if(filter_encode_write_frame(NULL, i) < 0) break;
+		if(flush_encoder(i) < 0) break;
+	}
+}
+
+int VideoTranscoder::open_smart_encoder()
+{
+	m_smart_stream_index = -1;
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		if(m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO and m_v_stream_copy[i] and
+		   not m_v_keyframes[i].empty())
+		{
+			m_smart_stream_index = i;
+			break;
+		}
+	}
+
+	if(m_smart_stream_index < 0)
+		throw Error("[VideoTranscoder] Smart rendering needs an indexed video stream which the output container can carry.");
+
+	AVStream* stream        = m_ifmt_ctx->streams[m_smart_stream_index];
+	AVCodecContext* dec_ctx = decoder(m_smart_stream_index);
+	AVCodec* encoder        = avcodec_find_encoder(dec_ctx->codec_id);
+
+	if(not encoder)
+		return AVERROR_INVALIDDATA;
+
+	// Re-encoded GOPs are spliced between copied ones, so the picture format has to stay the same.
+	bool supported = false;
+	for(int f=0; encoder->pix_fmts and encoder->pix_fmts[f] != AV_PIX_FMT_NONE; f++)
+		supported = supported or (encoder->pix_fmts[f] == dec_ctx->pix_fmt);
+
+	if(not supported)
+		throw Error("[VideoTranscoder] Smart rendering needs an encoder for the input pixel format.");
+
+	m_smart_encoder = avcodec_alloc_context3(encoder);
+	if(not m_smart_encoder)
+		return AVERROR(ENOMEM);
+
+	m_smart_encoder->height              = dec_ctx->height;
+	m_smart_encoder->width               = dec_ctx->width;
+	m_smart_encoder->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+	m_smart_encoder->pix_fmt             = dec_ctx->pix_fmt;
+	m_smart_encoder->time_base           = dec_ctx->time_base;
+	m_smart_encoder->qcompress           = dec_ctx->qcompress;
+	m_smart_encoder->bit_rate            = dec_ctx->bit_rate;
+	m_smart_encoder->gop_size            = dec_ctx->gop_size;
+
+	m_threading_policy.apply(m_smart_encoder, m_smart_stream_index, true, thread_cores());
+
+	m_edit_origin = stream_time_to_global_time(stream->time_base, stream->index_entries[0].timestamp);
+
+	// Opened for real at the start of every re-encoded run, with parameter sets kept in-band.
+	return 0;
+}
+
+void VideoTranscoder::classify_gops(vector<e_gop_state>& v_gop_states) const
+{
+	int v = m_smart_stream_index;
+	AVStream* stream = m_ifmt_ctx->streams[v];
+	const vector<int>& v_keyframes = m_v_keyframes[v];
+
+	v_gop_states.assign(v_keyframes.size(), GOP_CLEAN);
+
+	for(size_t k=0; k<v_keyframes.size(); k++)
+	{
+		int64_t gop_start = stream_time_to_global_time(stream->time_base, stream->index_entries[v_keyframes[k]].timestamp);
+		int64_t gop_end   = (k + 1 < v_keyframes.size()) ?
+							stream_time_to_global_time(stream->time_base, stream->index_entries[v_keyframes[k + 1]].timestamp) :
+							INT64_MAX;
+
+		bool dirty   = false;
+		bool dropped = false;
+
+		for(size_t e=0; e<m_v_edits.size(); e++)
+		{
+			int64_t edit_start = edit_time(m_v_edits[e].m_start_time);
+			int64_t edit_end   = edit_time(m_v_edits[e].m_end_time);
+
+			if(m_v_edits[e].m_type == st_edit::EDIT_MODIFY)
+			{
+				dirty = dirty or (edit_start < gop_end and edit_end > gop_start);
+			}
+			else
+			{
+				dropped = dropped or (edit_start <= gop_start and edit_end >= gop_end);
+				dirty   = dirty or (edit_start > gop_start and edit_start < gop_end) or
+								   (edit_end > gop_start and edit_end < gop_end);
+			}
+		}
+
+		v_gop_states[k] = dropped ? GOP_DROPPED : (dirty ? GOP_DIRTY : GOP_CLEAN);
+	}
+}
+
+int64_t VideoTranscoder::edit_time(double seconds) const
+{
+	return m_edit_origin + seconds_to_global_time(seconds);
+}
+
+bool VideoTranscoder::in_cut(int64_t global_time) const
+{
+	for(size_t e=0; e<m_v_edits.size(); e++)
+	{
+		if(m_v_edits[e].m_type == st_edit::EDIT_CUT and
+		   global_time >= edit_time(m_v_edits[e].m_start_time) and global_time < edit_time(m_v_edits[e].m_end_time))
+			return true;
+	}
+
+	return false;
+}
+
+int64_t VideoTranscoder::cut_offset(int64_t global_time) const
+{
+	int64_t offset = 0;
+
+	for(size_t e=0; e<m_v_edits.size(); e++)
+	{
+		if(m_v_edits[e].m_type == st_edit::EDIT_CUT and global_time >= edit_time(m_v_edits[e].m_end_time))
+			offset += edit_time(m_v_edits[e].m_end_time) - edit_time(m_v_edits[e].m_start_time);
+	}
+
+	return offset;
+}
+
+void VideoTranscoder::shift_packet(AVPacket& packet, AVRational time_base) const
+{
+	int64_t reference = (packet.pts != AV_NOPTS_VALUE) ? packet.pts : packet.dts;
+	int64_t offset    = av_rescale_q(cut_offset(av_rescale_q(reference, time_base, AV_TIME_BASE_Q)), AV_TIME_BASE_Q, time_base);
+
+	if(packet.pts != AV_NOPTS_VALUE) packet.pts -= offset;
+	if(packet.dts != AV_NOPTS_VALUE) packet.dts -= offset;
+}
+
+void VideoTranscoder::start_smart_run()
+{
+	// A dirty run always begins on a keyframe, so decoding starts from a clean state as well.
+	avcodec_flush_buffers(decoder(m_smart_stream_index));
+
+	if(reopen_encoder(m_smart_encoder) < 0)
+		throw Error("[VideoTranscoder] Smart rendering encoder can't be opened.");
+
+	reset_duplicates(m_smart_stream_index);
+	begin_dts_range(m_smart_stream_index);
+	m_smart_run = true;
+}
+
+void VideoTranscoder::finish_smart_run()
+{
+	while(decode_frame_in_buffer(m_smart_stream_index, m_dec_frame) == 1)
+		smart_encode_frame(m_dec_frame);
+
+	// Drain the encoder so the run ends with complete GOPs before copying resumes.
+	smart_encode_frame(NULL);
+	begin_dts_range(m_smart_stream_index);
+	m_smart_run = false;
+}
+
+void VideoTranscoder::smart_encode_frame(AVFrame* frame)
+{
+	int v = m_smart_stream_index;
+	AVCodecContext* dec_ctx = decoder(v);
+	AVStream* out_stream    = output_stream(v);
+
+	if(frame)
+	{
+		prepare_frame(frame, v);
+
+		int64_t frame_time = av_rescale_q(frame->pts, m_smart_encoder->time_base, AV_TIME_BASE_Q);
+		if(in_cut(frame_time)) return;
+
+		frame->pts      -= av_rescale_q(cut_offset(frame_time), AV_TIME_BASE_Q, m_smart_encoder->time_base);
+		frame->pict_type = AV_PICTURE_TYPE_NONE;
+		process_frame(frame, v);
+	}
+
+	while(true)
+	{
+		int b_frame = 0;
+		AVPacket* enc_pkt = m_frame_pool.acquire_packet();
+
+		if(avcodec_encode_video2(m_smart_encoder, enc_pkt, frame, &b_frame) < 0)
+		{
+			m_frame_pool.release_packet(enc_pkt);
+			throw Error("[VideoTranscoder] Error occurred during smart rendering a frame.");
+		}
+
+		if(not b_frame)
+		{
+			m_frame_pool.release_packet(enc_pkt);
+			return;
+		}
+
+		enc_pkt->stream_index = v;
+		av_packet_rescale_ts(enc_pkt, m_smart_encoder->time_base, out_stream->time_base);
+
+		// Copied packets of mp4 style inputs are length prefixed, re-encoded ones have to match. The
+		// size of the length field is in the avcC or hvcC header.
+		int length_offset = (dec_ctx->codec_id == AV_CODEC_ID_HEVC) ? 21 : 4;
+		bool length_prefixed = (dec_ctx->extradata_size > length_offset and dec_ctx->extradata[0] == 1);
+
+		if(length_prefixed and annexb_to_length_prefixed(enc_pkt, (dec_ctx->extradata[length_offset] & 3) + 1) < 0)
+		{
+			m_frame_pool.release_packet(enc_pkt);
+			throw Error("[VideoTranscoder] Re-encoded packet can't be converted.");
+		}
+
+		enforce_monotonic_dts(*enc_pkt);
+		if(write_packet(enc_pkt) < 0)
+			throw Error("[VideoTranscoder] Error occurred during writing packet.");
+
+		// One packet per submitted frame, only a flush keeps draining.
+		if(frame) return;
+	}
+}
+
+int VideoTranscoder::annexb_to_length_prefixed(AVPacket* packet, int length_size)
+{
+	const uint8_t* data = packet->data;
+	int size = packet->size;
+
+	vector<uint8_t> v_output;
+	v_output.reserve(size + 16);
+
+	int nal_start = -1;
+	for(int p=0; p<=size; p++)
+	{
+		bool start_code = (p + 3 <= size and data[p] == 0 and data[p + 1] == 0 and data[p + 2] == 1);
+
+		if(start_code or p == size)
+		{
+			if(nal_start >= 0)
+			{
+				// Trailing zero bytes belong to the next start code.
+				int nal_end = p;
+				while(nal_end > nal_start and data[nal_end - 1] == 0 and p != size) nal_end--;
+
+				int nal_size = nal_end - nal_start;
+				if(length_size < 4 and nal_size >= (1 << (8 * length_size)))
+					return AVERROR_INVALIDDATA;
+
+				for(int b=length_size-1; b>=0; b--)
+					v_output.push_back(uint8_t(nal_size >> (8 * b)));
+				v_output.insert(v_output.end(), data + nal_start, data + nal_end);
+			}
+
+			if(p == size) break;
+
+			nal_start = p + 3;
+			p += 2;
+		}
+	}
+
+	if(nal_start < 0)
+		return 0;
+
+	AVPacket converted;
+	if(av_new_packet(&converted, int(v_output.size())) < 0)
+		return AVERROR(ENOMEM);
+
+	copy(v_output.begin(), v_output.end(), converted.data);
+
+	av_buffer_unref(&packet->buf);
+	packet->buf  = converted.buf;
+	packet->data = converted.data;
+	packet->size = converted.size;
+
+	return 0;
+}
+
+void VideoTranscoder::transcode_ladder()
+{
+	m_pipeline_failed.store(false);
+	m_pipeline_error.clear();
+
+	vector<thread> v_workers;
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+		m_v_renditions[r].m_queue = new pipeline_queue(m_queue_depth);
+
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+		v_workers.push_back(thread(&VideoTranscoder::rendition_worker, this, &m_v_renditions[r]));
+
+	try
+	{
+		while(not m_pipeline_failed.load() and find_next_packet(*m_packet))
+		{
+			int stream_index = m_packet->stream_index;
+
+			if(m_v_ladder_streams[stream_index] < 0)
+			{
+				av_free_packet(m_packet.get());
+				continue;
+			}
+
+			if(not decode_packet(*m_packet, m_dec_frame)) continue;
+
+			prepare_frame(m_dec_frame, stream_index);
+
+			if(stream_index == m_ladder_stream_index) fan_out_video(m_dec_frame);
+			else                                      fan_out_audio(m_dec_frame, stream_index);
+		}
+
+		for(int i=0; i<int(m_ifmt_ctx->nb_streams) and not m_pipeline_failed.load(); i++)
+		{
+			if(m_v_ladder_streams[i] < 0) continue;
+
+			while(decode_frame_in_buffer(i, m_dec_frame) == 1)
+			{
+				prepare_frame(m_dec_frame, i);
+
+				if(i == m_ladder_stream_index) fan_out_video(m_dec_frame);
+				else                           fan_out_audio(m_dec_frame, i);
+			}
+
+			if(i == m_ladder_stream_index) fan_out_video(NULL);
+			else                           fan_out_audio(NULL, i);
+		}
+	}
+	catch(exception& e)
+	{
+		fail_pipeline(e.what());
+	}
+
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+	{
+		st_pipeline_item item = pipeline_item(st_pipeline_item::ITEM_END, -1);
+		m_v_renditions[r].m_queue->push(item);
+	}
+
+	for(size_t w=0; w<v_workers.size(); w++)
+		v_workers[w].join();
+
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+	{
+		drain_pipeline_queue(m_v_renditions[r].m_queue);
+		delete m_v_renditions[r].m_queue;
+		m_v_renditions[r].m_queue = NULL;
+	}
+
+	if(m_pipeline_failed.load())
+		throw Error(m_pipeline_error);
+}
+
+int VideoTranscoder::open_ladder_outputs(const vector<st_output_profile>& v_profiles)
+{
+	int ret;
+	int numof_streams = int(m_ifmt_ctx->nb_streams);
+
+	m_ladder_stream_index = -1;
+	for(size_t o=0; o<m_v_input_streams.size() and m_ladder_stream_index < 0; o++)
+		if(m_ifmt_ctx->streams[m_v_input_streams[o]]->codec->codec_type == AVMEDIA_TYPE_VIDEO) m_ladder_stream_index = m_v_input_streams[o];
+
+	if(m_ladder_stream_index < 0)
+		throw Error("[VideoTranscoder] Output ladder needs a video stream.");
+
+	m_v_stream_copy.assign(numof_streams, false);
+	m_v_ladder_streams.assign(numof_streams, -1);
+	m_v_ladder_audio_enc.assign(numof_streams, (AVCodecContext*)NULL);
+
+	m_filter_ctx = (st_filtering_context *)av_malloc_array(numof_streams, sizeof(*m_filter_ctx));
+	if(not m_filter_ctx)
+		return AVERROR(ENOMEM);
+
+	for(int i=0; i<numof_streams; i++)
+	{
+		m_filter_ctx[i].m_buffersrc_ctx  = NULL;
+		m_filter_ctx[i].m_buffersink_ctx = NULL;
+		m_filter_ctx[i].m_filter_graph   = NULL;
+		m_filter_ctx[i].m_passthrough    = false;
+	}
+
+	AVCodecContext* dec_ctx = decoder(m_ladder_stream_index);
+	AVCodec* encoder        = avcodec_find_encoder(dec_ctx->codec_id);
+
+	if(not encoder)
+		return AVERROR_INVALIDDATA;
+
+	m_v_renditions.resize(v_profiles.size());
+	for(size_t r=0; r<v_profiles.size(); r++)
+	{
+		st_rendition& rendition = m_v_renditions[r];
+		rendition.m_profile        = v_profiles[r];
+		rendition.m_ofmt_ctx       = NULL;
+		rendition.m_buffersink_ctx = NULL;
+		rendition.m_queue          = NULL;
+
+		avformat_alloc_output_context2(&rendition.m_ofmt_ctx, NULL, NULL, v_profiles[r].m_path.c_str());
+		if(not rendition.m_ofmt_ctx)
+			return AVERROR_UNKNOWN;
+
+		AVStream* out_stream = avformat_new_stream(rendition.m_ofmt_ctx, NULL);
+		if(not out_stream)
+			return AVERROR_UNKNOWN;
+
+		// Size is known once the scaler is configured, see below.
+		out_stream->codec = avcodec_alloc_context3(encoder);
+		out_stream->codec->pix_fmt   = encoder->pix_fmts[0];
+		out_stream->codec->time_base = dec_ctx->time_base;
+		out_stream->codec->qcompress = dec_ctx->qcompress;
+		out_stream->codec->bit_rate  = v_profiles[r].m_bit_rate > 0 ? v_profiles[r].m_bit_rate : dec_ctx->bit_rate;
+		out_stream->codec->gop_size  = dec_ctx->gop_size;
+	}
+
+	m_v_ladder_streams[m_ladder_stream_index] = 0;
+
+	if((ret = init_ladder_filter()) < 0)
+		return ret;
+
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+	{
+		st_rendition& rendition = m_v_renditions[r];
+		AVCodecContext* enc_ctx = rendition.m_ofmt_ctx->streams[0]->codec;
+		AVFilterLink* link      = rendition.m_buffersink_ctx->inputs[0];
+
+		enc_ctx->width               = link->w;
+		enc_ctx->height              = link->h;
+		enc_ctx->sample_aspect_ratio = link->sample_aspect_ratio;
+
+		if(rendition.m_ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+			enc_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+		m_threading_policy.apply(enc_ctx, m_ladder_stream_index, true, thread_cores(int(m_v_renditions.size())));
+
+		if((ret = avcodec_open2(enc_ctx, encoder, NULL)) < 0)
+			return ret;
+	}
+
+	bool global_header = (m_v_renditions[0].m_ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+	int output_index   = 1;
+
+	// Other streams of the map are left out, renditions carry only video and audio.
+	for(size_t o=0; o<m_v_input_streams.size(); o++)
+	{
+		int i = m_v_input_streams[o];
+		if(m_ifmt_ctx->streams[i]->codec->codec_type != AVMEDIA_TYPE_AUDIO) continue;
+
+		if((ret = open_ladder_audio(i, output_index++, global_header)) < 0)
+			return ret;
+	}
+
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+	{
+		AVFormatContext* ofmt_ctx = m_v_renditions[r].m_ofmt_ctx;
+
+		if(!(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+		{
+			ret = avio_open(&ofmt_ctx->pb, m_v_renditions[r].m_profile.m_path.c_str(), AVIO_FLAG_WRITE);
+			if(ret < 0)
+				return ret;
+		}
+
+		if((ret = avformat_write_header(ofmt_ctx, NULL)) < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+int VideoTranscoder::open_ladder_audio(int stream_index, int output_index, bool global_header)
+{
+	int ret;
+	AVCodecContext* dec_ctx = decoder(stream_index);
+	AVCodec* encoder        = avcodec_find_encoder(dec_ctx->codec_id);
+
+	if(not encoder)
+		return AVERROR_INVALIDDATA;
+
+	AVCodecContext* enc_ctx = avcodec_alloc_context3(encoder);
+	if(not enc_ctx)
+		return AVERROR(ENOMEM);
+
+	m_v_ladder_audio_enc[stream_index] = enc_ctx;
+
+	enc_ctx->sample_rate    = dec_ctx->sample_rate;
+	enc_ctx->channel_layout = dec_ctx->channel_layout;
+	enc_ctx->channels       = av_get_channel_layout_nb_channels(enc_ctx->channel_layout);
+	enc_ctx->sample_fmt     = encoder->sample_fmts[0];
+	enc_ctx->time_base      = dec_ctx->time_base;
+
+	if(global_header)
+		enc_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+	m_threading_policy.apply(enc_ctx, stream_index, true, thread_cores());
+
+	if((ret = avcodec_open2(enc_ctx, encoder, NULL)) < 0)
+		return ret;
+
+	if((ret = init_filter(&m_filter_ctx[stream_index], dec_ctx, enc_ctx, "anull")) < 0)
+		return ret;
+
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+	{
+		AVStream* out_stream = avformat_new_stream(m_v_renditions[r].m_ofmt_ctx, NULL);
+		if(not out_stream)
+			return AVERROR_UNKNOWN;
+
+		if((ret = avcodec_copy_context(out_stream->codec, enc_ctx)) < 0)
+			return ret;
+
+		out_stream->codec->codec_tag = 0;
+		out_stream->time_base        = enc_ctx->time_base;
+	}
+
+	m_v_ladder_streams[stream_index] = output_index;
+	return 0;
+}
+
+int VideoTranscoder::init_ladder_filter()
+{
+	int v = m_ladder_stream_index;
+	int numof_renditions = int(m_v_renditions.size());
+	char spec[128];
+
+	vector<AVCodecContext*> v_enc_ctx;
+	vector<AVFilterContext*> v_buffersink_ctx;
+
+	snprintf(spec, sizeof(spec), "split=%d", numof_renditions);
+	string filter_spec = spec;
+
+	for(int r=0; r<numof_renditions; r++)
+	{
+		snprintf(spec, sizeof(spec), "[s%d]", r);
+		filter_spec += spec;
+	}
+
+	for(int r=0; r<numof_renditions; r++)
+	{
+		const st_output_profile& profile = m_v_renditions[r].m_profile;
+		string sink_label = (numof_renditions == 1) ? "out" : "out" + to_string(r);
+
+		// -2 keeps the aspect ratio with an even size, which is what most encoders want.
+		if(profile.m_width <= 0 and profile.m_height <= 0)
+			snprintf(spec, sizeof(spec), ";[s%d]null[%s]", r, sink_label.c_str());
+		else
+			snprintf(spec, sizeof(spec), ";[s%d]scale=%d:%d[%s]", r,
+					 profile.m_width > 0 ? profile.m_width : -2,
+					 profile.m_height > 0 ? profile.m_height : -2, sink_label.c_str());
+
+		filter_spec += spec;
+		v_enc_ctx.push_back(m_v_renditions[r].m_ofmt_ctx->streams[0]->codec);
+	}
+
+	int ret = init_filter(&m_filter_ctx[v], decoder(v), v_enc_ctx, filter_spec.c_str(), v_buffersink_ctx);
+	if(ret < 0)
+		return ret;
+
+	for(int r=0; r<numof_renditions; r++)
+		m_v_renditions[r].m_buffersink_ctx = v_buffersink_ctx[r];
+
+	return 0;
+}
+
+void VideoTranscoder::fan_out_video(AVFrame* frame)
+{
+	if(frame) process_frame(frame, m_ladder_stream_index);
+
+	TraceSpan span(m_trace.get(), "filter", m_ladder_stream_index, frame ? frame->pts : AV_NOPTS_VALUE);
+	TranscodeMetrics::clock::time_point filter_start = TranscodeMetrics::now();
+
+	// The split filter hands the same buffer to every branch, only scaled branches get new ones.
+	if(av_buffersrc_add_frame_flags(m_filter_ctx[m_ladder_stream_index].m_buffersrc_ctx, frame, 0) < 0)
+		throw Error("[VideoTranscoder] Error occurred during filtering ladder frame.");
+
+	m_metrics->record(TranscodeMetrics::STAGE_FILTER, m_ladder_stream_index, filter_start);
+
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+	{
+		while(true)
+		{
+			AVFrame* filt_frame = m_frame_pool.acquire_frame();
+			if(not filt_frame)
+				throw Error("[VideoTranscoder] Ladder frame can't be allocated.");
+
+			int ret = av_buffersink_get_frame(m_v_renditions[r].m_buffersink_ctx, filt_frame);
+			if(ret < 0)
+			{
+				m_frame_pool.release_frame(filt_frame);
+				if(ret != AVERROR(EAGAIN) and ret != AVERROR_EOF)
+					throw Error("[VideoTranscoder] Error occurred during filtering ladder frame.");
+				break;
+			}
+
+			filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+			st_pipeline_item item = pipeline_item(st_pipeline_item::ITEM_FRAME, m_ladder_stream_index);
+			item.m_frame = filt_frame;
+			push_rendition_item(m_v_renditions[r], item);
+		}
+
+		if(not frame)
+		{
+			st_pipeline_item item = pipeline_item(st_pipeline_item::ITEM_FLUSH, m_ladder_stream_index);
+			push_rendition_item(m_v_renditions[r], item);
+		}
+	}
+}
+
+void VideoTranscoder::fan_out_audio(AVFrame* frame, int stream_index)
+{
+	TranscodeMetrics::clock::time_point filter_start = TranscodeMetrics::now();
+
+	if(av_buffersrc_add_frame_flags(m_filter_ctx[stream_index].m_buffersrc_ctx, frame, 0) < 0)
+		throw Error("[VideoTranscoder] Error occurred during filtering ladder audio.");
+
+	m_metrics->record(TranscodeMetrics::STAGE_FILTER, stream_index, filter_start);
+
+	while(true)
+	{
+		AVFrame* filt_frame = m_frame_pool.acquire_frame();
+		if(not filt_frame)
+			throw Error("[VideoTranscoder] Ladder frame can't be allocated.");
+
+		int ret = av_buffersink_get_frame(m_filter_ctx[stream_index].m_buffersink_ctx, filt_frame);
+		if(ret < 0)
+		{
+			m_frame_pool.release_frame(filt_frame);
+			if(ret != AVERROR(EAGAIN) and ret != AVERROR_EOF)
+				throw Error("[VideoTranscoder] Error occurred during filtering ladder audio.");
+			break;
+		}
+
+		share_audio_packet(filt_frame, stream_index);
+		m_frame_pool.release_frame(filt_frame);
+	}
+
+	if(not frame and (m_v_ladder_audio_enc[stream_index]->codec->capabilities & CODEC_CAP_DELAY))
+		while(share_audio_packet(NULL, stream_index));
+}
+
+bool VideoTranscoder::share_audio_packet(AVFrame* frame, int stream_index)
+{
+	int b_frame = 0;
+	AVPacket* enc_pkt = m_frame_pool.acquire_packet();
+
+	TranscodeMetrics::clock::time_point encode_start = TranscodeMetrics::now();
+	if(avcodec_encode_audio2(m_v_ladder_audio_enc[stream_index], enc_pkt, frame, &b_frame) < 0)
+	{
+		m_frame_pool.release_packet(enc_pkt);
+		throw Error("[VideoTranscoder] Error occurred during encoding ladder audio.");
+	}
+
+	m_metrics->record(TranscodeMetrics::STAGE_ENCODE, stream_index, encode_start);
+	if(b_frame) m_metrics->add(TranscodeMetrics::COUNTER_FRAMES_ENCODED, stream_index);
+
+	// Encoded once, written by every rendition's own thread.
+	for(size_t r=0; b_frame and r<m_v_renditions.size(); r++)
+	{
+		st_pipeline_item item = pipeline_item(st_pipeline_item::ITEM_PACKET, stream_index);
+		item.m_packet = m_frame_pool.acquire_packet();
+
+		if(av_copy_packet(item.m_packet, enc_pkt) < 0)
+		{
+			release_pipeline_item(item);
+			m_frame_pool.release_packet(enc_pkt);
+			throw Error("[VideoTranscoder] Ladder audio packet can't be copied.");
+		}
+
+		item.m_packet->stream_index = m_v_ladder_streams[stream_index];
+		push_rendition_item(m_v_renditions[r], item);
+	}
+
+	m_frame_pool.release_packet(enc_pkt);
+	return b_frame;
+}
+
+void VideoTranscoder::push_rendition_item(st_rendition& rendition, st_pipeline_item& item)
+{
+	// Fails only once the ladder has been aborted.
+	if(not rendition.m_queue->push(item))
+		release_pipeline_item(item);
+}
+
+void VideoTranscoder::rendition_worker(st_rendition* rendition)
+{
+	name_trace_thread("rendition " + to_string(rendition - &m_v_renditions[0]));
+
+	AVFormatContext* ofmt_ctx = rendition->m_ofmt_ctx;
+
+	try
+	{
+		st_pipeline_item item;
+		while(rendition->m_queue->pop(item))
+		{
+			if(item.m_type == st_pipeline_item::ITEM_END) break;
+
+			if(item.m_type == st_pipeline_item::ITEM_FLUSH)
+			{
+				AVFrame* frame = NULL;
+				int ret;
+				while((ret = encode_rendition_frame(rendition, frame)) > 0);
+
+				if(ret < 0)
+					throw Error("[VideoTranscoder] Error occurred during flushing rendition encoder.");
+				continue;
+			}
+
+			if(item.m_type == st_pipeline_item::ITEM_FRAME)
+			{
+				if(encode_rendition_frame(rendition, item.m_frame) < 0)
+					throw Error("[VideoTranscoder] Error occurred during encoding rendition frame.");
+				continue;
+			}
+
+			AVRational time_base = m_v_ladder_audio_enc[item.m_stream_index]->time_base;
+			av_packet_rescale_ts(item.m_packet, time_base, ofmt_ctx->streams[item.m_packet->stream_index]->time_base);
+
+			int ret = av_interleaved_write_frame(ofmt_ctx, item.m_packet);
+			release_pipeline_item(item);
+
+			if(ret < 0)
+				throw Error("[VideoTranscoder] Error occurred during writing rendition packet.");
+		}
+
+		if(not m_pipeline_failed.load())
+			av_write_trailer(ofmt_ctx);
+	}
+	catch(exception& e)
+	{
+		fail_pipeline(e.what());
+	}
+}
+
+int VideoTranscoder::encode_rendition_frame(st_rendition* rendition, AVFrame*& frame)
+{
+	AVFormatContext* ofmt_ctx = rendition->m_ofmt_ctx;
+	AVCodecContext* enc_ctx   = ofmt_ctx->streams[0]->codec;
+
+	int b_frame = 0;
+	AVPacket* enc_pkt = m_frame_pool.acquire_packet();
+
+	// Renditions are all accounted to the input video stream they come from.
+	TranscodeMetrics::clock::time_point start = TranscodeMetrics::now();
+	int64_t pts = frame ? frame->pts : AV_NOPTS_VALUE;
+
+	int ret = avcodec_encode_video2(enc_ctx, enc_pkt, frame, &b_frame);
+	m_frame_pool.release_frame(frame);
+	m_metrics->record(TranscodeMetrics::STAGE_ENCODE, m_ladder_stream_index, start);
+	if(m_trace) m_trace->record("encode", m_ladder_stream_index, pts, start, TranscodeMetrics::now());
+
+	if(ret < 0 or not b_frame)
+	{
+		m_frame_pool.release_packet(enc_pkt);
+		return (ret < 0) ? ret : 0;
+	}
+
+	m_metrics->add(TranscodeMetrics::COUNTER_FRAMES_ENCODED, m_ladder_stream_index);
+	m_metrics->add(TranscodeMetrics::COUNTER_PACKETS_WRITTEN, m_ladder_stream_index);
+	m_metrics->add(TranscodeMetrics::COUNTER_BYTES_OUT, m_ladder_stream_index, uint64_t(enc_pkt->size));
+
+	enc_pkt->stream_index = 0;
+	av_packet_rescale_ts(enc_pkt, enc_ctx->time_base, ofmt_ctx->streams[0]->time_base);
+
+	start = TranscodeMetrics::now();
+	pts   = enc_pkt->pts;
+
+	ret = av_interleaved_write_frame(ofmt_ctx, enc_pkt);
+	m_frame_pool.release_packet(enc_pkt);
+	m_metrics->record(TranscodeMetrics::STAGE_MUX, m_ladder_stream_index, start);
+	if(m_trace) m_trace->record("mux", m_ladder_stream_index, pts, start, TranscodeMetrics::now());
+
+	return (ret < 0) ? ret : 1;
+}
+
+void VideoTranscoder::free_ladder()
+{
+	for(size_t r=0; r<m_v_renditions.size(); r++)
+	{
+		AVFormatContext* ofmt_ctx = m_v_renditions[r].m_ofmt_ctx;
+		if(not ofmt_ctx) continue;
+
+		if(ofmt_ctx->nb_streams > 0 and ofmt_ctx->streams[0]->codec)
+			avcodec_close(ofmt_ctx->streams[0]->codec);
+
+		if(!(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+			avio_closep(&ofmt_ctx->pb);
+
+		avformat_free_context(ofmt_ctx);
+	}
+	m_v_renditions.clear();
+
+	for(size_t i=0; i<m_v_ladder_audio_enc.size(); i++)
+	{
+		if(not m_v_ladder_audio_enc[i]) continue;
+
+		avcodec_close(m_v_ladder_audio_enc[i]);
+		av_freep(&m_v_ladder_audio_enc[i]);
+	}
+	m_v_ladder_audio_enc.clear();
+}
+
+int VideoTranscoder::reset_filter(int stream_index)
+{
+	st_filtering_context& f_ctx = m_filter_ctx[stream_index];
+
+	// A chain of the fused graph can't be rebuilt without the others.
+	if(f_ctx.m_buffersrc_ctx and not f_ctx.m_filter_graph)
+		return AVERROR(EINVAL);
+
+	if(f_ctx.m_filter_graph)
+		avfilter_graph_free(&f_ctx.m_filter_graph);
+
+	release_filtered(stream_index, true);
+
+	f_ctx.m_buffersrc_ctx  = NULL;
+	f_ctx.m_buffersink_ctx = NULL;
+	f_ctx.m_passthrough    = false;
+
+	return init_stream_filter(stream_index);
+}
+
+int VideoTranscoder::open_input_file(string pth_media)
+{
+	int ret;
+	unsigned int i;
+	bool b_cached = false;
+
+	if((ret = open_input_format(pth_media, b_cached)) < 0) return ret;
+	if((ret = select_streams()) < 0) return ret;
+
+	m_v_draft_sizes.assign(m_ifmt_ctx->nb_streams, make_pair(0, 0));
+
+	close_decoders();
+	m_v_decoders.assign(m_ifmt_ctx->nb_streams, (AVCodecContext*)NULL);
+	m_v_decode_time_bases.assign(m_ifmt_ctx->nb_streams, av_make_q(0, 1));
+
+	for (i = 0; i < m_ifmt_ctx->nb_streams; i++)
+	{
+		AVStream* stream = m_ifmt_ctx->streams[i];
+
+		if(not is_selected(int(i))) continue;
+
+		if(stream->codec->codec_type == AVMEDIA_TYPE_VIDEO or stream->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+		{
+			AVCodec* decoder = avcodec_find_decoder(stream->codec->codec_id);
+
+			// av_read_frame() keeps updating the stream's own context, so decoding on another thread
+			// than the demuxer needs a context of its own.
+			AVCodecContext* codec_ctx = avcodec_alloc_context3(decoder);
+			if(not codec_ctx)
+				return AVERROR(ENOMEM);
+
+			m_v_decoders[i] = codec_ctx;
+			if((ret = avcodec_copy_context(codec_ctx, stream->codec)) < 0)
+				return ret;
+
+			// Decoded frames own their buffers, so they stay valid when handed over to another stage.
+			// Those buffers come from the frame pool and are recycled once the last reference is gone.
+			codec_ctx->refcounted_frames = 1;
+			codec_ctx->opaque            = &m_frame_pool;
+			codec_ctx->get_buffer2       = FramePool::get_buffer2;
+
+			// The pool is locked internally, so frame threads may call it directly.
+			codec_ctx->thread_safe_callbacks = 1;
+			m_threading_policy.apply(codec_ctx, int(i), false, stream_cores());
+
+			// Frame threading delays every frame by one frame per thread.
+			if(m_live.m_enabled)
+			{
+				codec_ctx->flags      |= CODEC_FLAG_LOW_DELAY;
+				codec_ctx->thread_type = FF_THREAD_SLICE;
+			}
+
+			int width  = codec_ctx->width;
+			int height = codec_ctx->height;
+
+			if(m_draft and codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+			{
+				// Reference frames keep their IDCT, so the skipped work doesn't build up over a GOP.
+				codec_ctx->skip_loop_filter = AVDISCARD_ALL;
+				codec_ctx->skip_idct        = AVDISCARD_NONREF;
+				codec_ctx->flags2          |= CODEC_FLAG2_FAST;
+
+				if(decoder) av_codec_set_lowres(codec_ctx, min(m_draft_lowres, av_codec_get_max_lowres(decoder)));
+
+				m_v_draft_sizes[i] = make_pair(max(2, (width >> m_draft_lowres) & ~1), max(2, (height >> m_draft_lowres) & ~1));
+			}
+
+			ret = avcodec_open2(codec_ctx, decoder, NULL);
+			if(ret < 0) return ret;
+
+			// Some decoders only shrink the size with the first frame, the encoders are set up before.
+			int lowres = av_codec_get_lowres(codec_ctx);
+			if(lowres > 0 and codec_ctx->width == width and codec_ctx->height == height)
+			{
+				codec_ctx->width  = -((-width) >> lowres);
+				codec_ctx->height = -((-height) >> lowres);
+			}
+
+			m_v_decode_time_bases[i] = codec_ctx->time_base;
+		}
+	}
+
+	input_video_properties();
+	m_v_live_arrivals.assign(m_ifmt_ctx->nb_streams, arrival_map());
+
+	// Written after the decoders are open, they may still refine parameters the probe left open. An
+	// index the demuxer builds while reading is only complete at the end of the input.
+	m_index_pending = (m_index_cache and not b_cached and not m_live.m_enabled);
+	if(m_index_pending and m_header_index)
+	{
+		IndexCache(pth_media, m_index_cache_directory).save(m_ifmt_ctx);
+		m_index_pending = false;
+	}
+
+	return 0;
+}
+
+int VideoTranscoder::select_streams()
+{
+	int numof_streams = int(m_ifmt_ctx->nb_streams);
+
+	m_v_output_streams.assign(numof_streams, -1);
+	m_v_input_streams.clear();
+
+	for(size_t m=0; m<m_v_stream_map.size(); m++)
+	{
+		const st_stream_map& map = m_v_stream_map[m];
+
+		int input = -1;
+		for(int i=0, n=0; i<numof_streams and input < 0; i++)
+		{
+			if(map.m_type != AVMEDIA_TYPE_UNKNOWN and m_ifmt_ctx->streams[i]->codec->codec_type != map.m_type) continue;
+			if(n++ == map.m_index) input = i;
+		}
+
+		if(input < 0 or m_v_output_streams[input] >= 0)
+		{
+			av_log(NULL, AV_LOG_ERROR, "Stream map entry %d picks no input stream or one picked before.\n", int(m));
+			return AVERROR_STREAM_NOT_FOUND;
+		}
+
+		m_v_output_streams[input] = int(m_v_input_streams.size());
+		m_v_input_streams.push_back(input);
+	}
+
+	for(int i=0; i<numof_streams and m_v_stream_map.empty(); i++)
+	{
+		AVMediaType type = m_ifmt_ctx->streams[i]->codec->codec_type;
+		if(type != AVMEDIA_TYPE_VIDEO and type != AVMEDIA_TYPE_AUDIO) continue;
+
+		m_v_output_streams[i] = int(m_v_input_streams.size());
+		m_v_input_streams.push_back(i);
+	}
+
+	if(m_v_input_streams.empty())
+		return AVERROR_STREAM_NOT_FOUND;
+
+	// Demuxers skip the packets of discarded streams instead of handing them out.
+	for(int i=0; i<numof_streams; i++)
+		if(not is_selected(i)) m_ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+	return 0;
+}
+
+bool VideoTranscoder::is_selected(int stream_index) const
+{
+	return stream_index < int(m_v_output_streams.size()) and m_v_output_streams[stream_index] >= 0;
+}
+
+AVStream* VideoTranscoder::output_stream(int stream_index) const
+{
+	return m_ofmt_ctx->streams[m_v_output_streams[stream_index]];
+}
+
+AVCodecContext* VideoTranscoder::decoder(int stream_index) const
+{
+	return m_v_decoders[stream_index];
+}
+
+void VideoTranscoder::close_decoders()
+{
+	for(size_t i=0; i<m_v_decoders.size(); i++)
+		avcodec_free_context(&m_v_decoders[i]);
+
+	m_v_decoders.clear();
+}
+
+int VideoTranscoder::open_input_format(string pth_media, bool& b_cached)
+{
+	int ret;
+	m_ifmt_ctx = NULL;
+	b_cached   = false;
+
+	if(m_live.m_enabled)
+	{
+		if(pth_media == "-") pth_media = "pipe:0";
+
+		m_ifmt_ctx = avformat_alloc_context();
+		if(not m_ifmt_ctx)
+			return AVERROR(ENOMEM);
+
+		int64_t probe_size     = m_live.m_probe_size > 0 ? m_live.m_probe_size : LIVE_PROBE_SIZE;
+		double analyze_seconds = m_live.m_analyze_seconds > 0.0 ? m_live.m_analyze_seconds : LIVE_ANALYZE_SECONDS;
+
+		m_ifmt_ctx->probesize             = (unsigned int)probe_size;
+		m_ifmt_ctx->probesize2            = probe_size;
+		m_ifmt_ctx->max_analyze_duration  = int(analyze_seconds * AV_TIME_BASE);
+		m_ifmt_ctx->max_analyze_duration2 = int64_t(analyze_seconds * AV_TIME_BASE);
+		m_ifmt_ctx->flags                |= AVFMT_FLAG_NOBUFFER;
+
+		AVInputFormat* format = NULL;
+		if(not m_live.m_format.empty() and not (format = av_find_input_format(m_live.m_format.c_str())))
+			return AVERROR_DEMUXER_NOT_FOUND;
+
+		// Neither memory mapping nor a sidecar index makes sense for a stream.
+		if((ret = avformat_open_input(&m_ifmt_ctx, pth_media.c_str(), format, NULL)) < 0) return ret;
+		return avformat_find_stream_info(m_ifmt_ctx, NULL);
+	}
+
+	if(m_media_io.m_mapped_input)
+	{
+		if((ret = m_mapped_input.open(pth_media, m_media_io.m_readahead)) < 0) return ret;
+
+		m_ifmt_ctx = avformat_alloc_context();
+		if(not m_ifmt_ctx)
+			return AVERROR(ENOMEM);
+
+		m_ifmt_ctx->pb = m_mapped_input.context();
+	}
+
+	if((ret = avformat_open_input(&m_ifmt_ctx, pth_media.c_str(), NULL, NULL)) < 0) return ret;
+
+	// Probing reads packets, which already adds to indexes built while reading.
+	m_header_index = false;
+	for(unsigned int i=0; i<m_ifmt_ctx->nb_streams; i++)
+		m_header_index = m_header_index or m_ifmt_ctx->streams[i]->nb_index_entries > 0;
+
+	if(m_index_cache)
+		b_cached = IndexCache(pth_media, m_index_cache_directory).load(m_ifmt_ctx);
+
+	if(not b_cached and (ret = avformat_find_stream_info(m_ifmt_ctx, NULL)) < 0) return ret;
+
+	return 0;
+}
+
+int VideoTranscoder::open_output_file(string pth_media)
+{
+	int ret;
+
+	if(pth_media == "-") pth_media = "pipe:1";
+	bool pipe = (pth_media.compare(0, 5, "pipe:") == 0);
+
+	// Playlists and manifests refer to segment files, they can't be piped.
+	if(pipe and m_streaming.m_format != st_streaming_output::STREAMING_FRAGMENTED_MP4)
+		return AVERROR(EINVAL);
+
+	if((ret = open_output_streams(pth_media)) < 0)
+		return ret;
+
+	if(!(m_ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+	{
+		// Write-behind output writes at file offsets, which a pipe doesn't have.
+		if(m_media_io.m_write_behind_output and not pipe)
+		{
+			ret = m_write_behind_output.open(pth_media, m_media_io.m_buffer_size, m_media_io.m_numof_buffers,
+											 m_media_io.m_fsync_policy, m_media_io.m_fsync_interval);
+			m_ofmt_ctx->pb = m_write_behind_output.context();
+		}
+		else
+		{
+			ret = avio_open(&m_ofmt_ctx->pb, pth_media.c_str(), AVIO_FLAG_WRITE);
+		}
+
+		if (ret < 0)
+			return ret;
+	}
+
+	if(m_live.m_enabled)
+	{
+		// Packets leave the muxer right away and no stream waits long for another to interleave.
+		m_ofmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+		if(m_live.m_latency_budget > 0.0)
+			m_ofmt_ctx->max_interleave_delta = int64_t(m_live.m_latency_budget * AV_TIME_BASE);
+	}
+
+	AVDictionary* options = NULL;
+	streaming_options(&options);
+
+	ret = avformat_write_header(m_ofmt_ctx, &options);
+	av_dict_free(&options);
+	if(ret < 0)
+		return ret;
+
+	if(m_streaming.m_format != st_streaming_output::STREAMING_OFF)
+	{
+		// Pieces start on video keyframes; audio only outputs are cut on their first stream.
+		m_streaming_stream_index = m_v_input_streams[0];
+		for(int o=int(m_v_input_streams.size()) - 1; o>=0; o--)
+			if(m_ofmt_ctx->streams[o]->codec->codec_type == AVMEDIA_TYPE_VIDEO) m_streaming_stream_index = m_v_input_streams[o];
+	}
+
+	return 0;
+}
+
+int VideoTranscoder::close_output_io()
+{
+	if(not m_ofmt_ctx or (m_ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+		return 0;
+
+	if(m_write_behind_output.is_open())
+	{
+		m_ofmt_ctx->pb = NULL;
+		return m_write_behind_output.close();
+	}
+
+	return avio_closep(&m_ofmt_ctx->pb);
+}
+
+int VideoTranscoder::open_output_streams(string pth_media)
+{
+	AVStream *out_stream;
+	AVStream *in_stream;
+	AVCodecContext *dec_ctx;
+	AVCodec *encoder;
+
+	int ret;
+	unsigned int i;
+	m_ofmt_ctx = NULL;
+	avformat_alloc_output_context2(&m_ofmt_ctx, NULL, streaming_format_name(), pth_media.c_str());
+
+	if(!m_ofmt_ctx)
+		return AVERROR_UNKNOWN;
+
+	m_v_keyframe_segment.assign(m_ifmt_ctx->nb_streams, -1);
+	m_v_keyframe_origin.assign(m_ifmt_ctx->nb_streams, AV_NOPTS_VALUE);
+
+	st_duplicate_state duplicate_state;
+	duplicate_state.m_kept_pts = AV_NOPTS_VALUE;
+	duplicate_state.m_held     = NULL;
+
+	clear_duplicates();
+	m_v_duplicates.assign(m_ifmt_ctx->nb_streams, duplicate_state);
+
+	st_quality_state quality_state;
+	quality_state.m_decoder     = NULL;
+	quality_state.m_unavailable = false;
+
+	clear_quality();
+	m_v_quality.assign(m_ifmt_ctx->nb_streams, quality_state);
+
+	m_v_stream_copy.assign(m_ifmt_ctx->nb_streams, false);
+	m_v_copy_filters.assign(m_ifmt_ctx->nb_streams, (AVBitStreamFilterContext*)NULL);
+
+	for(size_t o = 0; o < m_v_input_streams.size(); o++)
+	{
+		out_stream = avformat_new_stream(m_ofmt_ctx, NULL);
+		if(!out_stream)
+			return AVERROR_UNKNOWN;
+
+		i         = unsigned(m_v_input_streams[o]);
+		in_stream = m_ifmt_ctx->streams[i];
+		dec_ctx   = in_stream->codec;
+
+		// Smart rendering copies whatever it can, the video stream in particular. Draft video is
+		// always scaled down, only audio can be copied into a proxy.
+		bool draft_video = (m_draft and dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO);
+
+		if((m_stream_copy or not m_v_edits.empty()) and not draft_video and can_stream_copy(i))
+		{
+			m_v_stream_copy[i] = true;
+
+			ret = open_copy_stream(out_stream, in_stream);
+			if(ret < 0)
+				return ret;
+		}
+		else if(dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO or dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
+		{
+			dec_ctx = decoder(i);
+			encoder = avcodec_find_encoder(dec_ctx->codec_id); //
+
+			if(!encoder)
+				return AVERROR_INVALIDDATA;
+
+			out_stream->codec = avcodec_alloc_context3(encoder);
+
+			if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+			{
+				out_stream->codec->height              = dec_ctx->height;
+				out_stream->codec->width               = dec_ctx->width;
+				out_stream->codec->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+
+				out_stream->codec->pix_fmt             = encoder->pix_fmts[0];
+				out_stream->codec->time_base           = dec_ctx->time_base;
+				out_stream->codec->qcompress           = dec_ctx->qcompress;
+				out_stream->codec->bit_rate            = dec_ctx->bit_rate;
+				out_stream->codec->gop_size            = dec_ctx->gop_size;
+
+				if(m_draft)
+				{
+					out_stream->codec->width     = m_v_draft_sizes[i].first;
+					out_stream->codec->height    = m_v_draft_sizes[i].second;
+					out_stream->codec->bit_rate >>= 2 * m_draft_lowres;
+					out_stream->codec->flags2   |= CODEC_FLAG2_FAST;
+				}
+			}
+			else
+			{
+				out_stream->codec->sample_rate    = dec_ctx->sample_rate;
+				out_stream->codec->channel_layout = dec_ctx->channel_layout;
+				out_stream->codec->channels       = av_get_channel_layout_nb_channels(out_stream->codec->channel_layout);
+
+				out_stream->codec->sample_fmt     = encoder->sample_fmts[0];
+				out_stream->codec->time_base      = dec_ctx->time_base;
+			}
+
+			m_threading_policy.apply(out_stream->codec, int(i), true, stream_cores());
+
+			// Live encoders emit every frame as soon as it is encoded. The tune option is understood
+			// by x264 and x265 and ignored by other encoders.
+			AVDictionary* options = NULL;
+			if(m_live.m_enabled and dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+			{
+				out_stream->codec->max_b_frames = 0;
+				out_stream->codec->thread_type  = FF_THREAD_SLICE;
+				av_dict_set(&options, "tune", "zerolatency", 0);
+			}
+
+			// Understood by x264 and x265 like the tune above.
+			if(m_draft and dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+				av_dict_set(&options, "preset", "ultrafast", 0);
+
+			ret = avcodec_open2(out_stream->codec, encoder, &options);
+			av_dict_free(&options);
+			if(ret < 0)
+				return ret;
+		}
+		else if(avformat_query_codec(m_ofmt_ctx->oformat, dec_ctx->codec_id, FF_COMPLIANCE_NORMAL) == 1)
+		{
+			// Subtitles, data and the like have no encoder here, they can only be copied.
+			m_v_stream_copy[i] = true;
+
+			ret = open_copy_stream(out_stream, in_stream);
+			if(ret < 0)
+				return ret;
+		}
+		else
+		{
+			throw Error("[VideoTranscoder] Output container can't carry input stream " + to_string(i) + ", leave it out of the stream map.");
+		}
+
+		if(m_ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+			out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	}
+
+	if(not m_v_edits.empty())
+		return open_smart_encoder();
+
+	return 0;
+}
+
+int VideoTranscoder::open_copy_stream(AVStream* out_stream, AVStream* in_stream)
+{
+	int ret = avcodec_copy_context(out_stream->codec, in_stream->codec);
+	if(ret < 0)
+		return ret;
+
+	// Let the muxer pick the tag which suits its container.
+	out_stream->codec->codec_tag    = 0;
+	out_stream->time_base           = in_stream->time_base;
+	out_stream->sample_aspect_ratio = in_stream->sample_aspect_ratio;
+
+	const char* filter_name = copy_bitstream_filter(in_stream->index);
+	if(filter_name)
+	{
+		m_v_copy_filters[in_stream->index] = av_bitstream_filter_init(filter_name);
+		if(not m_v_copy_filters[in_stream->index])
+			return AVERROR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+bool VideoTranscoder::can_stream_copy(int stream_index) const
+{
+	AVCodecContext* dec_ctx = m_ifmt_ctx->streams[stream_index]->codec;
+
+	if(dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO and dec_ctx->codec_type != AVMEDIA_TYPE_AUDIO)
+		return false;
+
+	// Output streams are otherwise configured like the input, so a matching container is enough.
+	return avformat_query_codec(m_ofmt_ctx->oformat, dec_ctx->codec_id, FF_COMPLIANCE_NORMAL) == 1;
+}
+
+const char* VideoTranscoder::copy_bitstream_filter(int stream_index) const
+{
+	AVCodecContext* dec_ctx = m_ifmt_ctx->streams[stream_index]->codec;
+	string output_format    = m_ofmt_ctx->oformat->name;
+
+	bool annexb_output = (output_format == "mpegts" or output_format == "hls" or
+						  output_format == "h264"   or output_format == "hevc");
+	bool mp4_input     = (dec_ctx->extradata_size > 0 and dec_ctx->extradata[0] == 1);
+
+	if(annexb_output and mp4_input and dec_ctx->codec_id == AV_CODEC_ID_H264) return "h264_mp4toannexb";
+	if(annexb_output and mp4_input and dec_ctx->codec_id == AV_CODEC_ID_HEVC) return "hevc_mp4toannexb";
+
+	// ADTS headers are detected per packet, see copy_packet().
+	bool asc_output = (output_format == "mp4" or output_format == "mov" or output_format == "ipod" or
+					   output_format == "3gp" or output_format == "ismv" or output_format == "flv" or
+					   output_format == "matroska");
+
+	if(asc_output and dec_ctx->codec_id == AV_CODEC_ID_AAC) return "aac_adtstoasc";
+
+	return NULL;
+}
+
+void VideoTranscoder::input_video_properties()
+{
+	m_v_duration.clear();     m_v_duration.resize(m_ifmt_ctx->nb_streams);
+	m_v_numof_frames.clear(); m_v_numof_frames.resize(m_ifmt_ctx->nb_streams);
+	m_v_timestamps.clear();   m_v_timestamps.resize(m_ifmt_ctx->nb_streams);
+	m_v_keyframes.clear();    m_v_keyframes.resize(m_ifmt_ctx->nb_streams);
+
+	for(int s=0; s<int(m_ifmt_ctx->nb_streams); s++)
+	{
+		AVStream* stream = m_ifmt_ctx->streams[s];
+
+		// Live streams have no duration.
+		if(stream->duration != AV_NOPTS_VALUE)
+			m_v_duration[s] = global_time_to_seconds(stream_time_to_global_time(stream->time_base, stream->duration));
+
+		m_v_numof_frames[s] = stream->nb_frames;
+
+		for(int i=0; i<stream->nb_index_entries; i+=1)
+		{
+			m_v_timestamps[s].push_back( stream_time_to_global_time(stream->time_base, stream->index_entries[i].timestamp - stream->index_entries[0].timestamp) );
+
+			if(stream->index_entries[i].flags & AVINDEX_KEYFRAME)
+				m_v_keyframes[s].push_back(i);
+		}
+	}
+}
+
+int VideoTranscoder::init_filters()
+{
+	unsigned int i;
+	int ret;
+
+	m_filter_ctx = (st_filtering_context *)av_malloc_array(m_ifmt_ctx->nb_streams, sizeof(*m_filter_ctx));
+
+	if(!m_filter_ctx)
+		return -1;
+
+	if(not m_filter_specs.empty() and m_filter_specs.rbegin()->first >= int(m_ifmt_ctx->nb_streams))
+		return AVERROR(EINVAL);
+
+	m_v_filter_held.assign(m_ifmt_ctx->nb_streams, deque<size_t>());
+
+	// Stream workers filter their streams at the same time, which one shared graph doesn't allow.
+	bool fuse = (m_execution_mode != EXECUTION_STREAM_WORKERS);
+	vector<int> v_fused;
+
+	for(i = 0; i <m_ifmt_ctx->nb_streams; i++)
+	{
+		m_filter_ctx[i].m_buffersrc_ctx  = NULL;
+		m_filter_ctx[i].m_buffersink_ctx = NULL;
+		m_filter_ctx[i].m_filter_graph   = NULL;
+		m_filter_ctx[i].m_passthrough    = false;
+
+		// Segment workers discard every stream except the one they transcode.
+		if( not (m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO or
+			     m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) or
+			m_v_stream_copy[i] or m_ifmt_ctx->streams[i]->discard == AVDISCARD_ALL )
+			continue;
+
+		if(identity_filter(i, filter_spec(i)))
+		{
+			m_filter_ctx[i].m_passthrough = true;
+			continue;
+		}
+
+		if(fuse)
+		{
+			v_fused.push_back(i);
+			continue;
+		}
+
+		ret = init_stream_filter(i);
+		if(ret) return ret;
+	}
+
+	if(v_fused.size() == 1) return init_stream_filter(v_fused[0]);
+	if(v_fused.size() > 1)  return init_fused_filters(v_fused);
+
+	return 0;
+}
+
+int VideoTranscoder::init_stream_filter(int stream_index)
+{
+	string spec = filter_spec(stream_index);
+
+	if(identity_filter(stream_index, spec))
+	{
+		m_filter_ctx[stream_index].m_passthrough = true;
+		return 0;
+	}
+
+	return init_filter(&m_filter_ctx[stream_index], decoder(stream_index),
+					   output_stream(stream_index)->codec, spec.c_str());
+}
+
+int VideoTranscoder::init_fused_filters(const vector<int>& v_streams)
+{
+	AVFilterInOut* outputs = NULL;
+	AVFilterInOut* inputs  = NULL;
+	AVFilterInOut** last_output = &outputs;
+	AVFilterInOut** last_input  = &inputs;
+
+	string graph_spec;
+	int ret = 0;
+
+	m_fused_graph = avfilter_graph_alloc();
+	if(not m_fused_graph)
+		return AVERROR(ENOMEM);
+
+	for(size_t k=0; k<v_streams.size() and ret >= 0; k++)
+	{
+		int i = v_streams[k];
+		st_filtering_context& f_ctx = m_filter_ctx[i];
+
+		char src_name[32], sink_name[32];
+		snprintf(src_name, sizeof(src_name), "in%d", i);
+		snprintf(sink_name, sizeof(sink_name), "out%d", i);
+
+		if((ret = create_buffersrc(m_fused_graph, decoder(i), src_name, &f_ctx.m_buffersrc_ctx)) < 0 or
+		   (ret = create_buffersink(m_fused_graph, output_stream(i)->codec, sink_name, &f_ctx.m_buffersink_ctx)) < 0)
+			break;
+
+		*last_output = filter_inout(src_name, f_ctx.m_buffersrc_ctx);
+		*last_input  = filter_inout(sink_name, f_ctx.m_buffersink_ctx);
+		if(not *last_output or not *last_input)
+		{
+			ret = AVERROR(ENOMEM);
+			break;
+		}
+
+		last_output = &(*last_output)->next;
+		last_input  = &(*last_input)->next;
+
+		// Chains are labelled by stream, so the whole graph is parsed and its formats negotiated once.
+		if(not graph_spec.empty()) graph_spec += ";";
+		graph_spec += string("[") + src_name + "]" + filter_spec(i) + "[" + sink_name + "]";
+	}
+
+	if(ret >= 0) ret = avfilter_graph_parse_ptr(m_fused_graph, graph_spec.c_str(), &inputs, &outputs, NULL);
+	if(ret >= 0) ret = avfilter_graph_config(m_fused_graph, NULL);
+
+	avfilter_inout_free(&inputs);
+	avfilter_inout_free(&outputs);
+	return ret;
+}
+
+string VideoTranscoder::filter_spec(int stream_index) const
+{
+	AVCodecContext* dec_ctx = decoder(stream_index);
+
+	map<int, string>::const_iterator it = m_filter_specs.find(stream_index);
+	string spec = (it != m_filter_specs.end()) ? it->second : (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? "null" : "anull";
+
+	// Draft frames the decoder couldn't shrink, or not to an even size.
+	if(m_draft and dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO and
+	   (dec_ctx->width != m_v_draft_sizes[stream_index].first or dec_ctx->height != m_v_draft_sizes[stream_index].second))
+	{
+		char scale[64];
+		snprintf(scale, sizeof(scale), ",scale=%d:%d:flags=fast_bilinear", m_v_draft_sizes[stream_index].first, m_v_draft_sizes[stream_index].second);
+		spec += scale;
+	}
+
+	return spec;
+}
+
+bool VideoTranscoder::identity_filter(int stream_index, const string& filter_spec) const
+{
+	if(filter_spec != "null" and filter_spec != "anull")
+		return false;
+
+	AVCodecContext* dec_ctx = decoder(stream_index);
+	AVCodecContext* enc_ctx = output_stream(stream_index)->codec;
+
+	if(dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+		return dec_ctx->pix_fmt == enc_ctx->pix_fmt and dec_ctx->width == enc_ctx->width and dec_ctx->height == enc_ctx->height;
+
+	uint64_t channel_layout = dec_ctx->channel_layout ? dec_ctx->channel_layout : av_get_default_channel_layout(dec_ctx->channels);
+
+	return dec_ctx->sample_fmt == enc_ctx->sample_fmt and dec_ctx->sample_rate == enc_ctx->sample_rate and
+		   channel_layout == enc_ctx->channel_layout;
+}
+
+bool VideoTranscoder::is_transcoded(int stream_index) const
+{
+	return m_filter_ctx[stream_index].m_buffersrc_ctx or m_filter_ctx[stream_index].m_passthrough;
+}
+
+int VideoTranscoder::init_filter(st_filtering_context* f_ctx, AVCodecContext *dec_ctx,
+								 AVCodecContext *enc_ctx, const char *filter_spec)
+{
+	vector<AVCodecContext*> v_enc_ctx(1, enc_ctx);
+	vector<AVFilterContext*> v_buffersink_ctx;
+
+	return init_filter(f_ctx, dec_ctx, v_enc_ctx, filter_spec, v_buffersink_ctx);
+}
+
+int VideoTranscoder::init_filter(st_filtering_context* f_ctx, AVCodecContext *dec_ctx,
+								 const vector<AVCodecContext*>& v_enc_ctx, const char *filter_spec,
+								 vector<AVFilterContext*>& v_buffersink_ctx)
+{
+	int ret = 0;
+
+	AVFilterContext *buffersrc_ctx  = NULL;
+
+	AVFilterInOut *outputs      = avfilter_inout_alloc();
+	AVFilterInOut *inputs       = NULL;
+	AVFilterGraph *filter_graph = avfilter_graph_alloc();
+
+	v_buffersink_ctx.clear();
+
+	if((not outputs) or (not filter_graph))
+	{
+		avfilter_inout_free(&outputs);
+		return AVERROR(ENOMEM);
+	}
+
+	ret = create_buffersrc(filter_graph, dec_ctx, "in", &buffersrc_ctx);
+	if(ret < 0)
+	{
+		avfilter_inout_free(&outputs);
+		return ret;
+	}
+
+	// A single sink keeps the plain "out" label, several ones are labelled out0, out1, ...
+	AVFilterInOut** last_input = &inputs;
+	for(size_t s=0; s<v_enc_ctx.size(); s++)
+	{
+		char name[32];
+		if(v_enc_ctx.size() == 1) snprintf(name, sizeof(name), "out");
+		else                      snprintf(name, sizeof(name), "out%d", int(s));
+
+		AVFilterContext* buffersink_ctx = NULL;
+		ret = create_buffersink(filter_graph, v_enc_ctx[s], name, &buffersink_ctx);
+
+		AVFilterInOut* input = (ret < 0) ? NULL : avfilter_inout_alloc();
+		if(not input)
+		{
+			avfilter_inout_free(&inputs);
+			avfilter_inout_free(&outputs);
+			return (ret < 0) ? ret : AVERROR(ENOMEM);
+		}
+
+		input->name       = av_strdup(name);
+		input->filter_ctx = buffersink_ctx;
+		input->pad_idx    = 0;
+		input->next       = NULL;
+
+		*last_input = input;
+		last_input  = &input->next;
+
+		v_buffersink_ctx.push_back(buffersink_ctx);
+
+		if(not input->name)
+		{
+			avfilter_inout_free(&inputs);
 			avfilter_inout_free(&outputs);
+			return AVERROR(ENOMEM);
+		}
+	}
+
+	outputs->name       = av_strdup("in");
+	outputs->filter_ctx = buffersrc_ctx;
+	outputs->pad_idx    = 0;
+	outputs->next       = NULL;
+
+	if(not outputs->name)
+	{
+		avfilter_inout_free(&inputs);
+		avfilter_inout_free(&outputs);
+		return AVERROR(ENOMEM);
+	}
+
+	if((ret = avfilter_graph_parse_ptr(filter_graph, filter_spec, &inputs, &outputs, NULL)) < 0 or
+	   (ret = avfilter_graph_config(filter_graph, NULL)) < 0)
+	{
+		avfilter_inout_free(&inputs);
+		avfilter_inout_free(&outputs);
+		return ret;
+	}
+
+	f_ctx->m_buffersrc_ctx  = buffersrc_ctx;
+	f_ctx->m_buffersink_ctx = v_buffersink_ctx.empty() ? NULL : v_buffersink_ctx[0];
+	f_ctx->m_filter_graph   = filter_graph;
+
+	avfilter_inout_free(&inputs);
+	avfilter_inout_free(&outputs);
+	return 0;
+}
+
+int VideoTranscoder::create_buffersrc(AVFilterGraph* filter_graph, AVCodecContext* dec_ctx,
+									  const char* name, AVFilterContext** buffersrc_ctx)
+{
+	char args[512];
+	AVFilter* buffersrc = NULL;
+
+	if(dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+	{
+		buffersrc = avfilter_get_by_name("buffer");
+
+		snprintf(args, sizeof(args),
+		"video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+		dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
+		dec_ctx->time_base.num, dec_ctx->time_base.den,
+		dec_ctx->sample_aspect_ratio.num,
+		dec_ctx->sample_aspect_ratio.den);
+	}
+	else if(dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
+	{
+		buffersrc = avfilter_get_by_name("abuffer");
+
+		if(not dec_ctx->channel_layout)
+			dec_ctx->channel_layout = av_get_default_channel_layout(dec_ctx->channels);
+
+		snprintf(args, sizeof(args),
+		"time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%" PRIx64,
+		 dec_ctx->time_base.num, dec_ctx->time_base.den, dec_ctx->sample_rate,
+		 av_get_sample_fmt_name(dec_ctx->sample_fmt),
+		 dec_ctx->channel_layout);
+	}
+	else
+	{
+		return AVERROR(EINVAL);
+	}
+
+	if(not buffersrc)
+		return AVERROR_UNKNOWN;
+
+	return avfilter_graph_create_filter(buffersrc_ctx, buffersrc, name, args, NULL, filter_graph);
+}
+
+int VideoTranscoder::create_buffersink(AVFilterGraph* filter_graph, AVCodecContext* enc_ctx,
+									   const char* name, AVFilterContext** buffersink_ctx)
+{
+	int ret;
+
+	if(enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+	{
+		AVFilter* buffersink = avfilter_get_by_name("buffersink");
+		if(not buffersink)
+			return AVERROR_UNKNOWN;
+
+		ret = avfilter_graph_create_filter(buffersink_ctx, buffersink, name, NULL, NULL, filter_graph);
+		if(ret < 0)
 			return ret;
+
+		return av_opt_set_bin(*buffersink_ctx, "pix_fmts", (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt), AV_OPT_SEARCH_CHILDREN);
+	}
+
+	AVFilter* buffersink = avfilter_get_by_name("abuffersink");
+	if(not buffersink)
+		return AVERROR_UNKNOWN;
+
+	ret = avfilter_graph_create_filter(buffersink_ctx, buffersink, name, NULL, NULL, filter_graph);
+	if(ret < 0)
+		return ret;
+
+	ret = av_opt_set_bin(*buffersink_ctx, "sample_fmts", (uint8_t*)&enc_ctx->sample_fmt, sizeof(enc_ctx->sample_fmt), AV_OPT_SEARCH_CHILDREN);
+	if(ret < 0)
+		return ret;
+
+	ret = av_opt_set_bin(*buffersink_ctx, "channel_layouts", (uint8_t*)&enc_ctx->channel_layout, sizeof(enc_ctx->channel_layout), AV_OPT_SEARCH_CHILDREN);
+	if(ret < 0)
+		return ret;
+
+	return av_opt_set_bin(*buffersink_ctx, "sample_rates", (uint8_t*)&enc_ctx->sample_rate, sizeof(enc_ctx->sample_rate), AV_OPT_SEARCH_CHILDREN);
+}
+
+int VideoTranscoder::seek_trim_start(double start_time, double end_time)
+{
+	int video_index = -1;
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams) and video_index < 0; i++)
+	{
+		if(m_ifmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO and not m_v_keyframes[i].empty() and is_selected(i))
+			video_index = i;
+	}
+
+	// Clip times count from the first index entry, like the timestamps of time_to_frame().
+	int64_t base = (m_ifmt_ctx->start_time != AV_NOPTS_VALUE) ? m_ifmt_ctx->start_time : 0;
+	if(video_index >= 0)
+	{
+		AVStream* stream = m_ifmt_ctx->streams[video_index];
+		base = stream_time_to_global_time(stream->time_base, stream->index_entries[0].timestamp);
+	}
+
+	m_trim_start  = base + seconds_to_global_time(max(0.0, start_time));
+	m_trim_end    = (end_time >= 0.0) ? base + seconds_to_global_time(end_time) : AV_NOPTS_VALUE;
+	m_trim_origin = m_trim_start;
+	m_trim_stop   = AV_NOPTS_VALUE;
+	m_v_trim_done.assign(m_ifmt_ctx->nb_streams, false);
+
+	// Every stream is interleaved past the clip's end once the demuxer reaches the keyframe after it.
+	if(video_index >= 0 and m_trim_end != AV_NOPTS_VALUE)
+	{
+		AVStream* stream = m_ifmt_ctx->streams[video_index];
+		const vector<int>& v_keyframes = m_v_keyframes[video_index];
+
+		for(size_t k=0; k<v_keyframes.size() and m_trim_stop == AV_NOPTS_VALUE; k++)
+		{
+			int64_t keyframe_time = stream_time_to_global_time(stream->time_base, stream->index_entries[v_keyframes[k]].timestamp);
+			if(keyframe_time > m_trim_end)
+				m_trim_stop = keyframe_time;
+		}
+	}
+
+	if(start_time <= 0.0)
+		return 0;
+
+	if(video_index < 0)
+		return av_seek_frame(m_ifmt_ctx, -1, m_trim_start, AVSEEK_FLAG_BACKWARD);
+
+	AVStream* stream = m_ifmt_ctx->streams[video_index];
+	const vector<int>& v_keyframes = m_v_keyframes[video_index];
+
+	int frame = frame_at_or_before(video_index, start_time);
+	int k     = max(0, int(upper_bound(v_keyframes.begin(), v_keyframes.end(), frame) - v_keyframes.begin()) - 1);
+	int64_t keyframe_ts = stream->index_entries[v_keyframes[k]].timestamp;
+
+	if(m_v_stream_copy[video_index])
+		m_trim_origin = stream_time_to_global_time(stream->time_base, keyframe_ts);
+
+	return av_seek_frame(m_ifmt_ctx, video_index, keyframe_ts, AVSEEK_FLAG_BACKWARD);
+}
+
+bool VideoTranscoder::trim_packet(AVPacket& packet)
+{
+	if(m_trim_start == AV_NOPTS_VALUE) return true;
+
+	int stream_index     = packet.stream_index;
+	AVRational time_base = m_ifmt_ctx->streams[stream_index]->time_base;
+	int64_t timestamp    = (packet.dts != AV_NOPTS_VALUE) ? packet.dts : packet.pts;
+
+	// Frames are presented no earlier than they are decoded, nothing after this packet is in the clip.
+	if(m_trim_end != AV_NOPTS_VALUE and timestamp != AV_NOPTS_VALUE and stream_time_to_global_time(time_base, timestamp) >= m_trim_end)
+	{
+		m_v_trim_done[stream_index] = true;
+		return false;
+	}
+
+	// Decoded streams drop their frames in encode_frame(), copied ones can only drop packets. They
+	// are cut in decoding order, B-frames after the first keyframe are presented before it.
+	if(m_v_stream_copy[stream_index])
+	{
+		if(timestamp != AV_NOPTS_VALUE and stream_time_to_global_time(time_base, timestamp) < m_trim_origin)
+			return false;
+
+		int64_t offset = av_rescale_q(m_trim_origin, AV_TIME_BASE_Q, time_base);
+		if(packet.pts != AV_NOPTS_VALUE) packet.pts -= offset;
+		if(packet.dts != AV_NOPTS_VALUE) packet.dts -= offset;
+	}
+
+	return true;
+}
+
+bool VideoTranscoder::trim_finished(int64_t global_time) const
+{
+	if(m_trim_end == AV_NOPTS_VALUE) return false;
+
+	// Streams which end before the clip does never report done, stop once the demuxer is past it.
+	if(m_trim_stop != AV_NOPTS_VALUE and global_time >= m_trim_stop) return true;
+
+	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	{
+		AVStream* stream = m_ifmt_ctx->streams[i];
+		bool media = (stream->codec->codec_type == AVMEDIA_TYPE_VIDEO or stream->codec->codec_type == AVMEDIA_TYPE_AUDIO);
+
+		if(media and stream->discard != AVDISCARD_ALL and not m_v_trim_done[i])
+			return false;
+	}
+
+	return true;
+}
+
+bool VideoTranscoder::in_trim_range(AVFrame* frame, int stream_index) const
+{
+	if(m_trim_start == AV_NOPTS_VALUE) return true;
+
+	AVRational time_base = output_stream(stream_index)->codec->time_base;
+	int64_t global_time  = av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q) + m_trim_origin;
+
+	return global_time >= m_trim_start and (m_trim_end == AV_NOPTS_VALUE or global_time < m_trim_end);
+}
+
+int VideoTranscoder::read_packet(AVPacket& packet)
+{
+	TranscodeMetrics::clock::time_point start = TranscodeMetrics::now();
+
+	int ret = av_read_frame(m_ifmt_ctx, &packet);
+	if(ret < 0) return ret;
+
+	m_metrics->record(TranscodeMetrics::STAGE_DEMUX, packet.stream_index, start);
+	if(m_trace) m_trace->record("demux", packet.stream_index, packet.pts, start, TranscodeMetrics::now());
+	m_metrics->add(TranscodeMetrics::COUNTER_PACKETS_READ, packet.stream_index);
+	m_metrics->add(TranscodeMetrics::COUNTER_BYTES_IN, packet.stream_index, uint64_t(packet.size));
+
+	return ret;
+}
+
+bool VideoTranscoder::find_next_packet(AVPacket& packet)
+{
+	av_init_packet(&packet);
+	while(read_packet(packet) >= 0)
+	{
+		// Not every demuxer honours the discard flag.
+		if(not is_selected(packet.stream_index))
+		{
+			av_free_packet(&packet);
+			av_init_packet(&packet);
+			continue;
+		}
+
+		// Copied packets go out as they are, with missing or negative timestamps of reordered
+		// frames and edit list preroll too.
+		bool b_timed = (packet.pts >= 0 or m_v_stream_copy[packet.stream_index]);
+
+		if(b_timed and not trim_packet(packet))
+		{
+			int64_t timestamp   = (packet.dts != AV_NOPTS_VALUE) ? packet.dts : packet.pts;
+			int64_t global_time = stream_time_to_global_time(m_ifmt_ctx->streams[packet.stream_index]->time_base, timestamp);
+
+			av_free_packet(&packet);
+			av_init_packet(&packet);
+
+			if(trim_finished(global_time)) return false;
+			continue;
+		}
+
+		if(b_timed)
+		{
+			// Copied streams keep their stream time base, copy_packet() rescales them for the muxer.
+			if(not m_v_stream_copy[packet.stream_index])
+				av_packet_rescale_ts(&packet, m_ifmt_ctx->streams[packet.stream_index]->time_base,
+									 m_v_decode_time_bases[packet.stream_index]);
+
+			if(m_live.m_enabled and not m_v_stream_copy[packet.stream_index])
+				stamp_arrival(packet);
+
+			return true;
+		}
+
+		m_metrics->add(TranscodeMetrics::COUNTER_PACKETS_DROPPED, packet.stream_index);
+
+		av_free_packet(&packet) ;
+		av_init_packet(&packet) ;
+	}
+
+	return false;
+}
+
+bool VideoTranscoder::decode_packet(AVPacket& packet, AVFrame*& dec_frame)
+{
+	int bytes_decoded = 0;
+	int b_frame = 0;
+
+	// Get rid of old one.
+	m_frame_pool.release_frame(dec_frame);
+
+	while (packet.size > 0)
+	{
+		// Take a recycled av_frame.
+		if(dec_frame) av_frame_unref(dec_frame);
+		else          dec_frame = m_frame_pool.acquire_frame();
+
+		bytes_decoded = decode_media(m_ifmt_ctx, packet, dec_frame, b_frame);
+
+	    if(bytes_decoded < 0)
+	        throw Error("[VideoTrancoders]This is an unusual case. So, please contact with the developer.");
+
+	    packet.size -= bytes_decoded;
+	    packet.data += bytes_decoded;
+
+
+	    if(b_frame) return true;
+	}
+
+	return false;
+}
+
+int VideoTranscoder::decode_media(AVFormatContext* context, AVPacket& packet, AVFrame* dec_frame, int& b_frame)
+{
+	int bytes_decoded = 0;
+	int stream_index  = packet.stream_index;
+
+	TraceSpan span(m_trace.get(), "decode", stream_index, packet.pts);
+	TranscodeMetrics::clock::time_point start = TranscodeMetrics::now();
+
+	try
+	{
+		switch(context->streams[stream_index]->codec->codec_type)
+		{
+		case AVMEDIA_TYPE_VIDEO:
+		{
+			bytes_decoded = avcodec_decode_video2(decoder(stream_index), dec_frame, &b_frame, &packet);
+			break;
+		}
+		case AVMEDIA_TYPE_AUDIO:
+		{
+			bytes_decoded = avcodec_decode_audio4(decoder(stream_index), dec_frame, &b_frame, &packet);
+			break;
+		}
+		default:
+			throw Error("[VideoTrancoder] VideoTranscoder only decodes video and audio formats.");
 		}
+	}
+	catch(Error& e)
+	{
+		b_frame = false;
+		bytes_decoded = 0;
+	}
 
-		ret = av_opt_set_bin(buffersink_ctx, "sample_fmts", (uint8_t*)&enc_ctx->sample_fmt, sizeof(enc_ctx->sample_fmt), AV_OPT_SEARCH_CHILDREN);
-		if(ret < 0)
+	m_metrics->record(TranscodeMetrics::STAGE_DECODE, stream_index, start);
+	if(b_frame) m_metrics->add(TranscodeMetrics::COUNTER_FRAMES_DECODED, stream_index);
+
+	return bytes_decoded;
+}
+
+void VideoTranscoder::prepare_frame(AVFrame* dec_frame, int stream_index)
+{
+	// Ladder encoders have no single output context, they use the decoder time base.
+	AVRational dec_time_base = m_v_decode_time_bases[stream_index];
+	AVRational enc_time_base = m_ofmt_ctx ? output_stream(stream_index)->codec->time_base : dec_time_base;
+
+	dec_frame->pts = av_rescale_q(av_frame_get_best_effort_timestamp(dec_frame), dec_time_base, enc_time_base);
+
+	if(m_trim_start != AV_NOPTS_VALUE)
+		dec_frame->pts -= av_rescale_q(m_trim_origin, AV_TIME_BASE_Q, enc_time_base);
+}
+
+void VideoTranscoder::process_frame(AVFrame* frame, int stream_index)
+{
+	if(m_ifmt_ctx->streams[stream_index]->codec->codec_type != AVMEDIA_TYPE_VIDEO or m_frame_processors.empty())
+		return;
+
+	TraceSpan span(m_trace.get(), "process", stream_index, frame->pts);
+	if(m_frame_processors.process(frame, stream_index) < 0)
+		throw Error("[VideoTranscoder] Frame can't be made writable for its processors.");
+}
+
+bool VideoTranscoder::encode_frame(AVFrame* dec_frame, int stream_index)
+{
+	// Leading frames of the clip's first GOP and anything past its end are only decoded.
+	if(dec_frame and not in_trim_range(dec_frame, stream_index)) return true;
+
+	if(dec_frame and m_live.m_enabled and late_frame(dec_frame, stream_index)) return true;
+
+	if(dec_frame and m_duplicates.m_enabled and duplicate_frame(dec_frame, stream_index)) return true;
+
+	if(dec_frame) process_frame(dec_frame, stream_index);
+
+	if( filter_encode_write_frame(dec_frame, stream_index) < 0 ) return false;
+
+	return true;
+}
+
+int VideoTranscoder::encode_media(AVFormatContext* context, AVPacket& packet, AVFrame* dec_frame, int stream_index, int& b_frame)
+{
+	int bytes_decoded = 0;
+
+	TraceSpan span(m_trace.get(), "encode", stream_index, dec_frame ? dec_frame->pts : AV_NOPTS_VALUE);
+	TranscodeMetrics::clock::time_point start = TranscodeMetrics::now();
+
+	try
+	{
+		switch(context->streams[stream_index]->codec->codec_type)
 		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
+		case AVMEDIA_TYPE_VIDEO:
+		{
+			bytes_decoded = avcodec_encode_video2(context->streams[stream_index]->codec, &packet, dec_frame, &b_frame);
+			break;
+		}
+		case AVMEDIA_TYPE_AUDIO:
+		{
+			bytes_decoded = avcodec_encode_audio2(context->streams[stream_index]->codec, &packet, dec_frame, &b_frame);
+			break;
+		}
+		default:
+			throw Error("[VideoTrancoder] VideoTranscoder only encode video and audio formats.");
+		}
+	}
+	catch(Error& e)
+	{
+		b_frame = false;
+		bytes_decoded = 0;
+	}
+
+	m_metrics->record(TranscodeMetrics::STAGE_ENCODE, stream_index, start);
+	if(b_frame) m_metrics->add(TranscodeMetrics::COUNTER_FRAMES_ENCODED, stream_index);
+
+	return bytes_decoded;
+}
+
+int VideoTranscoder::filter_encode_write_frame(AVFrame *frame, unsigned int stream_index)
+{
+	int ret, b_frame;
+	AVFrame *filt_frame;
+
+	if(not frame and stream_index < m_v_duplicates.size() and m_v_duplicates[stream_index].m_held)
+	{
+		AVFrame* held = m_v_duplicates[stream_index].m_held;
+		m_v_duplicates[stream_index].m_held = NULL;
+
+		process_frame(held, int(stream_index));
+		ret = filter_encode_write_frame(held, stream_index);
+		m_frame_pool.release_frame(held);
+		if(ret < 0) return ret;
+	}
+
+	// Encoding and muxing of the filtered frames show up nested in this span.
+	TraceSpan span(m_trace.get(), "filter", int(stream_index), frame ? frame->pts : AV_NOPTS_VALUE);
+
+	if(m_filter_ctx[stream_index].m_passthrough)
+	{
+		// Nothing is buffered on this path, so there is nothing to flush either.
+		if(not frame) return 0;
+
+		filt_frame = m_frame_pool.acquire_frame();
+		if(not filt_frame)
+			return AVERROR(ENOMEM);
+
+		if((ret = av_frame_ref(filt_frame, frame)) < 0)
+		{
+			m_frame_pool.release_frame(filt_frame);
 			return ret;
 		}
 
-		ret = av_opt_set_bin(buffersink_ctx, "channel_layouts", (uint8_t*)&enc_ctx->channel_layout, sizeof(enc_ctx->channel_layout), AV_OPT_SEARCH_CHILDREN);
+		filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
+		force_segment_keyframe(filt_frame, stream_index);
+
+		return encode_write_frame(filt_frame, stream_index, b_frame);
+	}
+
+	TranscodeMetrics::clock::time_point filter_start = TranscodeMetrics::now();
+
+	if(frame) hold_filtered(stream_index, frame);
+
+	ret = av_buffersrc_add_frame_flags(m_filter_ctx[stream_index].m_buffersrc_ctx, frame, 0);
+	m_metrics->record(TranscodeMetrics::STAGE_FILTER, stream_index, filter_start);
+	if(ret < 0)
+		return ret;
+
+	while(true)
+	{
+		filt_frame = m_frame_pool.acquire_frame();
+		if(!filt_frame)
+		{
+			ret = AVERROR(ENOMEM);
+			break;
+		}
+
+		filter_start = TranscodeMetrics::now();
+		ret = av_buffersink_get_frame(m_filter_ctx[stream_index].m_buffersink_ctx, filt_frame);
 		if(ret < 0)
 		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
-			return ret;
+			if(ret == AVERROR(EAGAIN) or ret == AVERROR_EOF) ret = 0;
+
+			m_frame_pool.release_frame(filt_frame);
+			break;
 		}
+		m_metrics->record(TranscodeMetrics::STAGE_FILTER, stream_index, filter_start);
+		release_filtered(stream_index, false);
+
+		filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
+		force_segment_keyframe(filt_frame, stream_index);
+
+		ret = encode_write_frame(filt_frame, stream_index, b_frame);
+		if(ret < 0) break;
+	}
+
+	// A drained graph holds nothing, whatever the frame counts in and out were.
+	if(not frame) release_filtered(stream_index, true);
+
+	return ret;
+}
+
+void VideoTranscoder::hold_filtered(int stream_index, AVFrame* frame)
+{
+	size_t bytes = frame_bytes(frame);
+
+	m_v_filter_held[stream_index].push_back(bytes);
+	m_memory_budget->charge(MemoryBudget::STAGE_FILTERS, bytes);
+}
+
+void VideoTranscoder::release_filtered(int stream_index, bool all)
+{
+	if(stream_index >= int(m_v_filter_held.size())) return;
+
+	// Filters which change the frame rate or audio frame size don't pass frames one for one,
+	// the oldest frame in is taken to be the one coming out.
+	deque<size_t>& held = m_v_filter_held[stream_index];
+	while(not held.empty())
+	{
+		m_memory_budget->release(MemoryBudget::STAGE_FILTERS, held.front());
+		held.pop_front();
+
+		if(not all) break;
+	}
+}
+
+int VideoTranscoder::encode_write_frame(AVFrame *filt_frame, int stream_index, int& b_frame)
+{
+	int ret;
+	AVPacket* enc_pkt = m_frame_pool.acquire_packet();
+
+	if(m_quality and filt_frame)
+		keep_quality_reference(filt_frame, stream_index);
+
+	ret = encode_media(m_ofmt_ctx, *enc_pkt, filt_frame, stream_index, b_frame);
+	m_frame_pool.release_frame(filt_frame);
+
+	if (ret < 0 or !(b_frame))
+	{
+		m_frame_pool.release_packet(enc_pkt);
+		return (ret < 0) ? ret : 0;
+	}
+
+	enc_pkt->stream_index = stream_index;
+
+	chrono::steady_clock::time_point arrival;
+	if(m_live.m_enabled and arrival_time(stream_index, enc_pkt->pts, true, arrival))
+		report_latency(stream_index, enc_pkt->pts, chrono::duration<double>(chrono::steady_clock::now() - arrival).count(), false);
+
+	// Still in the encoder's time base, which the references are in too.
+	if(m_quality)
+		measure_packet(enc_pkt, stream_index);
+
+	av_packet_rescale_ts(enc_pkt, output_stream(stream_index)->codec->time_base,
+						 output_stream(stream_index)->time_base);
+
+	if(output_stream(stream_index)->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+		aac_packet_filter(stream_index, *enc_pkt);
+
+	return write_packet(enc_pkt);
+}
+
+void VideoTranscoder::aac_packet_filter(int stream_index, AVPacket& packet)
+{
+	if(m_ifmt_ctx->streams[stream_index]->codec->codec_id != AV_CODEC_ID_AAC) return;
 
-		ret = av_opt_set_bin(buffersink_ctx, "sample_rates", (uint8_t*)&enc_ctx->sample_rate, sizeof(enc_ctx->sample_rate), AV_OPT_SEARCH_CHILDREN);
+	AVBitStreamFilterContext* bsfc = av_bitstream_filter_init("aac_adtstoasc");
+
+    int err_val = av_bitstream_filter_filter(bsfc, output_stream(stream_index)->codec,
+    										 NULL, &packet.data, &packet.size,
+											 packet.data, packet.size,
+											 0);
+
+    if(err_val < 0)
+    	throw Error("[VideoTranscoder] Error occurred during filtering audio packet with aac.");
+
+    av_bitstream_filter_close(bsfc);
+}
+
+int VideoTranscoder::copy_packet(AVPacket& packet)
+{
+	AVPacket* out_pkt = prepare_copy_packet(packet);
+	if(not out_pkt)
+		return AVERROR_UNKNOWN;
+
+	return write_packet(out_pkt);
+}
+
+AVPacket* VideoTranscoder::prepare_copy_packet(AVPacket& packet)
+{
+	int stream_index = packet.stream_index;
+	AVStream* in_stream  = m_ifmt_ctx->streams[stream_index];
+	AVStream* out_stream = output_stream(stream_index);
+
+	if(av_dup_packet(&packet) < 0)
+		return NULL;
+
+	// The copy takes over the buffer of the demuxed packet.
+	AVPacket* out_pkt = m_frame_pool.acquire_packet();
+	*out_pkt = packet;
+	av_init_packet(&packet);
+	packet.data = NULL;
+	packet.size = 0;
+
+	av_packet_rescale_ts(out_pkt, in_stream->time_base, out_stream->time_base);
+	out_pkt->pos = -1;
+
+	AVBitStreamFilterContext* bsfc = m_v_copy_filters[stream_index];
+	bool adts = (out_pkt->size >= 2 and out_pkt->data[0] == 0xff and (out_pkt->data[1] & 0xf0) == 0xf0);
+
+	if(bsfc and (in_stream->codec->codec_id != AV_CODEC_ID_AAC or adts))
+	{
+		uint8_t* data = NULL;
+		int size      = 0;
+		int ret = av_bitstream_filter_filter(bsfc, out_stream->codec, NULL, &data, &size,
+											 out_pkt->data, out_pkt->size, out_pkt->flags & AV_PKT_FLAG_KEY);
 		if(ret < 0)
 		{
-			avfilter_inout_free(&inputs);
-			avfilter_inout_free(&outputs);
-			return ret;
+			m_frame_pool.release_packet(out_pkt);
+			return NULL;
+		}
+
+		// A positive result means the filter allocated a new buffer for the packet.
+		if(ret > 0)
+		{
+			AVBufferRef* buffer = av_buffer_create(data, size, av_buffer_default_free, NULL, 0);
+			if(not buffer)
+			{
+				av_free(data);
+				m_frame_pool.release_packet(out_pkt);
+				return NULL;
+			}
+
+			av_buffer_unref(&out_pkt->buf);
+			out_pkt->buf = buffer;
+		}
+
+		out_pkt->data = data;
+		out_pkt->size = size;
+	}
+
+	return out_pkt;
+}
+
+int VideoTranscoder::write_packet(AVPacket* packet)
+{
+	if(m_segment_sink)
+	{
+		// Segment worker: the parent stitches the packets into its own output. It releases them to
+		// its own pool, so the payload moves into one of that pool's packets.
+		AVPacket* handed = m_segment_pool->acquire_packet();
+		*handed = *packet;
+
+		av_init_packet(packet);
+		packet->data = NULL;
+		packet->size = 0;
+		m_frame_pool.release_packet(packet);
+
+		m_segment_sink->push_back(handed);
+		return 0;
+	}
+
+	if(m_mux_queue.get())
+	{
+		// Pipelined mode: the muxer stage takes over the packet and its buffer.
+		st_pipeline_item item = pipeline_item(st_pipeline_item::ITEM_PACKET, packet->stream_index);
+		item.m_packet = packet;
+
+		if(not m_mux_queue->push(item))
+		{
+			release_pipeline_item(item);
+			return AVERROR_EXIT;
+		}
+		m_metrics->sample_queue(TranscodeMetrics::QUEUE_MUX, m_mux_queue->size());
+
+		return 0;
+	}
+
+	// Stream workers share the muxer, which is the only serialized part of that mode.
+	unique_lock<mutex> lock(m_mux_mutex, defer_lock);
+	if(m_mux_shared) lock.lock();
+
+	return mux_packet(packet);
+}
+
+int VideoTranscoder::mux_packet(AVPacket* packet)
+{
+	bool boundary    = false;
+	double time      = 0.0;
+	int stream_index = packet->stream_index;
+
+	TraceSpan span(m_trace.get(), "mux", stream_index, packet->pts);
+	TranscodeMetrics::clock::time_point start = TranscodeMetrics::now();
+	m_metrics->add(TranscodeMetrics::COUNTER_PACKETS_WRITTEN, stream_index);
+	m_metrics->add(TranscodeMetrics::COUNTER_BYTES_OUT, stream_index, uint64_t(packet->size));
+
+	// Packets carry their input stream index up to here.
+	packet->stream_index = m_v_output_streams[stream_index];
+
+	if(m_streaming_stream_index == stream_index and packet->pts != AV_NOPTS_VALUE)
+	{
+		AVRational time_base = m_ofmt_ctx->streams[packet->stream_index]->time_base;
+		time = packet->pts * av_q2d(time_base);
+
+		if(m_streaming_segment < 0)
+		{
+			m_streaming_segment        = 0;
+			m_streaming_origin         = time;
+			m_streaming_segment_start  = time;
+			m_streaming_segment_opened = chrono::steady_clock::now();
+		}
+		else if(packet->flags & AV_PKT_FLAG_KEY)
+		{
+			// Same cut rule as the HLS and DASH muxers, with some slack for rounded timestamps.
+			double cut_time = m_streaming_origin + (m_streaming_segment + 1) * m_streaming.m_segment_seconds;
+			boundary = (time >= cut_time - 0.001);
+		}
+
+		m_streaming_end = max(m_streaming_end, time + packet->duration * av_q2d(time_base));
+	}
+
+	if(not boundary)
+	{
+		int ret = interleave_packet(packet);
+		m_frame_pool.release_packet(packet);
+		m_metrics->record(TranscodeMetrics::STAGE_MUX, stream_index, start);
+		return ret;
+	}
+
+	// Everything held back for interleaving belongs to the piece which ends here.
+	int ret = av_interleaved_write_frame(m_ofmt_ctx, NULL);
+	clear_interleaved();
+
+	if(m_streaming.m_format == st_streaming_output::STREAMING_FRAGMENTED_MP4)
+	{
+		if(ret >= 0) ret = av_write_frame(m_ofmt_ctx, NULL);
+		if(ret >= 0 and m_ofmt_ctx->pb) avio_flush(m_ofmt_ctx->pb);
+		if(ret >= 0) finish_streaming_segment(time);
+		if(ret >= 0) ret = interleave_packet(packet);
+	}
+	else
+	{
+		// The segmenting muxers close a segment when the next keyframe reaches them.
+		if(ret >= 0) ret = av_write_frame(m_ofmt_ctx, packet);
+		if(ret >= 0) finish_streaming_segment(time);
+	}
+
+	m_frame_pool.release_packet(packet);
+	m_metrics->record(TranscodeMetrics::STAGE_MUX, stream_index, start);
+	return ret;
+}
+
+int VideoTranscoder::interleave_packet(AVPacket* packet)
+{
+	// libavformat doesn't tell how much it holds back. It releases the packet with the lowest dts
+	// whenever every stream has one waiting, which is mirrored here to estimate it.
+	if(m_v_interleave_held.size() < m_ofmt_ctx->nb_streams)
+		m_v_interleave_held.resize(m_ofmt_ctx->nb_streams);
+
+	int64_t timestamp = (packet->dts != AV_NOPTS_VALUE) ? packet->dts : packet->pts;
+	if(timestamp != AV_NOPTS_VALUE)
+	{
+		double time = timestamp * av_q2d(m_ofmt_ctx->streams[packet->stream_index]->time_base);
+		size_t size = size_t(max(packet->size, 0));
+
+		m_v_interleave_held[packet->stream_index].push_back(make_pair(time, size));
+		m_interleave_bytes += size;
+		m_memory_budget->charge(MemoryBudget::STAGE_MUX_INTERLEAVE, size);
+	}
+
+	int ret = av_interleaved_write_frame(m_ofmt_ctx, packet);
+
+	while(true)
+	{
+		int lowest = -1;
+		for(size_t i=0; i<m_v_interleave_held.size(); i++)
+		{
+			if(m_v_interleave_held[i].empty()) { lowest = -1; break; }
+			if(lowest < 0 or m_v_interleave_held[i].front().first < m_v_interleave_held[lowest].front().first) lowest = int(i);
 		}
+		if(lowest < 0) break;
+
+		size_t size = m_v_interleave_held[lowest].front().second;
+		m_v_interleave_held[lowest].pop_front();
+		m_interleave_bytes -= size;
+		m_memory_budget->release(MemoryBudget::STAGE_MUX_INTERLEAVE, size);
 	}
-	else
+
+	// A stream which fell silent, such as sparse audio, would otherwise hold everything else back.
+	// Only worth it when the muxer itself holds the memory, flushing wouldn't free what queues and
+	// filter graphs hold and would only cost the interleaving.
+	if(ret >= 0 and m_interleave_bytes > m_memory_budget->stage_share() and m_memory_budget->over_limit())
 	{
-		avfilter_inout_free(&inputs);
-		avfilter_inout_free(&outputs);
-		return ret;
+		ret = av_interleaved_write_frame(m_ofmt_ctx, NULL);
+		clear_interleaved();
+		m_memory_budget->count_mux_flush();
 	}
 
-	outputs->name       = av_strdup("in");
-	outputs->filter_ctx = buffersrc_ctx;
-	outputs->pad_idx    = 0;
-	outputs->next       = NULL;
-	inputs->name        = av_strdup("out");
-	inputs->filter_ctx  = buffersink_ctx;
-	inputs->pad_idx     = 0;
-	inputs->next        = NULL;
+	return ret;
+}
+
+void VideoTranscoder::clear_interleaved()
+{
+	m_memory_budget->release(MemoryBudget::STAGE_MUX_INTERLEAVE, m_interleave_bytes);
+	m_interleave_bytes = 0;
+
+	for(size_t i=0; i<m_v_interleave_held.size(); i++)
+		m_v_interleave_held[i].clear();
+}
 
-	if( (not outputs->name) or (not inputs->name) )
+const char* VideoTranscoder::streaming_format_name() const
+{
+	switch(m_streaming.m_format)
 	{
-		avfilter_inout_free(&inputs);
-		avfilter_inout_free(&outputs);
-		return ret;
+	case st_streaming_output::STREAMING_FRAGMENTED_MP4: return "mp4";
+	case st_streaming_output::STREAMING_HLS:            return "hls";
+	case st_streaming_output::STREAMING_DASH:           return "dash";
+	default:                                            return NULL;
 	}
+}
 
-	if(avfilter_graph_parse_ptr(filter_graph, filter_spec, &inputs, &outputs, NULL) < 0 or
-	   avfilter_graph_config(filter_graph, NULL) < 0)
+void VideoTranscoder::streaming_options(AVDictionary** options) const
+{
+	char value[32];
+
+	if(m_streaming.m_format == st_streaming_output::STREAMING_FRAGMENTED_MP4)
 	{
-		avfilter_inout_free(&inputs);
-		avfilter_inout_free(&outputs);
-		return ret;
+		// Fragments are cut by mux_packet(), so that they can be flushed right away.
+		av_dict_set(options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
 	}
+	else if(m_streaming.m_format == st_streaming_output::STREAMING_HLS)
+	{
+		snprintf(value, sizeof(value), "%g", m_streaming.m_segment_seconds);
+		av_dict_set(options, "hls_time", value, 0);
 
-	f_ctx->m_buffersrc_ctx  = buffersrc_ctx;
-	f_ctx->m_buffersink_ctx = buffersink_ctx;
-	f_ctx->m_filter_graph   = filter_graph;
+		snprintf(value, sizeof(value), "%d", m_streaming.m_list_size);
+		av_dict_set(options, "hls_list_size", value, 0);
 
-	avfilter_inout_free(&inputs);
-	avfilter_inout_free(&outputs);
-	return ret;
+		if(m_streaming.m_list_size > 0)
+			av_dict_set(options, "hls_flags", "delete_segments", 0);
+	}
+	else if(m_streaming.m_format == st_streaming_output::STREAMING_DASH)
+	{
+		snprintf(value, sizeof(value), "%" PRId64, int64_t(m_streaming.m_segment_seconds * AV_TIME_BASE));
+		av_dict_set(options, "min_seg_duration", value, 0);
+
+		snprintf(value, sizeof(value), "%d", m_streaming.m_list_size);
+		av_dict_set(options, "window_size", value, 0);
+	}
 }
 
-bool VideoTranscoder::find_next_packet(AVPacket& packet)
+void VideoTranscoder::force_segment_keyframe(AVFrame* frame, int stream_index)
 {
-	av_init_packet(&packet);
-	while(av_read_frame(m_ifmt_ctx, &packet) >= 0)
-	{
-		if(packet.pts >= 0)
-		{
-			av_packet_rescale_ts(&packet, m_ifmt_ctx->streams[packet.stream_index]->time_base,
-								 m_ifmt_ctx->streams[packet.stream_index]->codec->time_base);
+	if(m_streaming.m_format == st_streaming_output::STREAMING_OFF or frame->pts == AV_NOPTS_VALUE)
+		return;
 
-			return true;
-		}
+	AVCodecContext* enc_ctx = output_stream(stream_index)->codec;
+	if(enc_ctx->codec_type != AVMEDIA_TYPE_VIDEO)
+		return;
 
-		av_free_packet(&packet) ;
-		av_init_packet(&packet) ;
+	// The first frame at or after every multiple of the segment length becomes a keyframe. Lengths
+	// count from the first frame, whose packet is the origin mux_packet() cuts from.
+	int64_t& origin = m_v_keyframe_origin[stream_index];
+	if(origin == AV_NOPTS_VALUE)
+		origin = frame->pts;
+
+	int64_t segment = int64_t(floor((frame->pts - origin) * av_q2d(enc_ctx->time_base) / m_streaming.m_segment_seconds + 1e-6));
+	if(segment > m_v_keyframe_segment[stream_index])
+	{
+		frame->pict_type = AV_PICTURE_TYPE_I;
+		m_v_keyframe_segment[stream_index] = segment;
 	}
+}
 
-	return false;
+void VideoTranscoder::stamp_arrival(const AVPacket& packet)
+{
+	lock_guard<mutex> lock(m_live_mutex);
+	arrival_map& arrivals = m_v_live_arrivals[packet.stream_index];
+
+	arrivals.insert(make_pair(packet.pts, chrono::steady_clock::now()));
+	if(arrivals.size() > MAX_PENDING_ARRIVALS) arrivals.erase(arrivals.begin());
 }
 
-bool VideoTranscoder::decode_packet(AVPacket& packet)
+bool VideoTranscoder::arrival_time(int stream_index, int64_t pts, bool consume, chrono::steady_clock::time_point& arrival)
 {
-	int bytes_decoded = 0;
-	int b_frame = 0;
+	lock_guard<mutex> lock(m_live_mutex);
+	arrival_map& arrivals = m_v_live_arrivals[stream_index];
 
-	// Get rid of old one.
-	avcodec_free_frame(&m_dec_frame);
+	// Encoders use the decoder's time base, in which the packets were stamped. Audio encoders may
+	// regroup samples into other frame sizes, so a frame belongs to the latest packet at or before it.
+	arrival_map::iterator it = arrivals.upper_bound(pts);
+	if(it == arrivals.begin()) return false;
 
-	while (packet.size > 0)
-	{
-		// Allocate new av_frame.
-		m_dec_frame = av_frame_alloc();
-		bytes_decoded = decode_media(m_ifmt_ctx, packet, m_dec_frame, b_frame);
+	--it;
+	arrival = it->second;
 
-	    if(bytes_decoded < 0)
-	        throw Error("[VideoTrancoders]This is an unusual case. So, please contact with the developer.");
+	if(consume) arrivals.erase(arrivals.begin(), it);
+	return true;
+}
 
-	    packet.size -= bytes_decoded;
-	    packet.data += bytes_decoded;
+bool VideoTranscoder::late_frame(AVFrame* frame, int stream_index)
+{
+	// Audio is cheap to encode and gaps in it are far more noticeable than a skipped video frame.
+	if(m_live.m_latency_budget <= 0.0 or m_ifmt_ctx->streams[stream_index]->codec->codec_type != AVMEDIA_TYPE_VIDEO)
+		return false;
 
+	chrono::steady_clock::time_point arrival;
+	if(not arrival_time(stream_index, frame->pts, false, arrival))
+		return false;
 
-	    if(b_frame) return true;
-	}
+	double latency = chrono::duration<double>(chrono::steady_clock::now() - arrival).count();
+	if(latency <= m_live.m_latency_budget)
+		return false;
 
-	return false;
+	report_latency(stream_index, frame->pts, latency, true);
+	m_metrics->add(TranscodeMetrics::COUNTER_FRAMES_DROPPED, stream_index);
+	return true;
 }
 
-int VideoTranscoder::decode_media(AVFormatContext* context, AVPacket& packet, AVFrame* dec_frame, int& b_frame)
+bool VideoTranscoder::duplicate_frame(AVFrame* frame, int stream_index)
 {
-	int bytes_decoded = 0;
-	int stream_index  = packet.stream_index;
+	if(m_ifmt_ctx->streams[stream_index]->codec->codec_type != AVMEDIA_TYPE_VIDEO or
+	   not LumaSignature::supports(AVPixelFormat(frame->format)))
+		return false;
 
-	try
+	st_duplicate_state& state = m_v_duplicates[stream_index];
+	state.m_current.compute(frame);
+
+	int difference = state.m_reference.max_difference(state.m_current);
+	bool duplicate = (difference >= 0 and difference <= m_duplicates.m_threshold);
+
+	if(duplicate and m_duplicates.m_max_interval > 0.0 and frame->pts != AV_NOPTS_VALUE and state.m_kept_pts != AV_NOPTS_VALUE)
 	{
-		switch(context->streams[stream_index]->codec->codec_type)
-		{
-		case AVMEDIA_TYPE_VIDEO:
-		{
-			bytes_decoded = avcodec_decode_video2(context->streams[stream_index]->codec, dec_frame, &b_frame, &packet);
-			break;
-		}
-		case AVMEDIA_TYPE_AUDIO:
-		{
-			bytes_decoded = avcodec_decode_audio4(context->streams[stream_index]->codec, dec_frame, &b_frame, &packet);
-			break;
-		}
-		default:
-			throw Error("[VideoTrancoder] VideoTranscoder only decodes video and audio formats.");
-		}
+		AVRational time_base = output_stream(stream_index)->codec->time_base;
+		duplicate = (frame->pts - state.m_kept_pts) * av_q2d(time_base) < m_duplicates.m_max_interval;
 	}
-	catch(Error& e)
+
+	if(not duplicate)
 	{
-		b_frame = false;
-		bytes_decoded = 0;
+		// Repeats are measured against the kept frame, so a slow fade can't creep by unnoticed.
+		swap(state.m_reference, state.m_current);
+		state.m_kept_pts = frame->pts;
+		m_frame_pool.release_frame(state.m_held);
+		state.m_held = NULL;
+		return false;
 	}
 
-	return bytes_decoded;
+	m_metrics->add(TranscodeMetrics::COUNTER_FRAMES_DUPLICATE, stream_index);
+	if(not m_duplicates.m_drop)
+		return false;
+
+	// Only the newest repeat is held, the stream's last frame needs it if nothing follows.
+	if(not state.m_held)
+		state.m_held = m_frame_pool.acquire_frame();
+	else
+		av_frame_unref(state.m_held);
+
+	if(state.m_held and av_frame_ref(state.m_held, frame) < 0)
+	{
+		m_frame_pool.release_frame(state.m_held);
+		state.m_held = NULL;
+	}
+
+	m_metrics->add(TranscodeMetrics::COUNTER_FRAMES_DROPPED, stream_index);
+	return true;
 }
 
-bool VideoTranscoder::encode_frame(int stream_index)
+void VideoTranscoder::reset_duplicates(int stream_index)
 {
-	if( filter_encode_write_frame(m_dec_frame, stream_index) < 0 ) return false;
+	st_duplicate_state& state = m_v_duplicates[stream_index];
+	m_frame_pool.release_frame(state.m_held);
 
-	return true;
+	state.m_reference.clear();
+	state.m_current.clear();
+	state.m_kept_pts = AV_NOPTS_VALUE;
+	state.m_held     = NULL;
 }
 
-int VideoTranscoder::encode_media(AVFormatContext* context, AVPacket& packet, AVFrame* dec_frame, int stream_index, int& b_frame)
+void VideoTranscoder::clear_duplicates()
 {
-	int bytes_decoded = 0;
+	for(size_t i=0; i<m_v_duplicates.size(); i++)
+		m_frame_pool.release_frame(m_v_duplicates[i].m_held);
 
-	try
+	m_v_duplicates.clear();
+}
+
+void VideoTranscoder::keep_quality_reference(AVFrame* frame, int stream_index)
+{
+	if(stream_index >= int(m_v_quality.size()) or m_v_quality[stream_index].m_unavailable)
+		return;
+
+	st_quality_state& state = m_v_quality[stream_index];
+	AVCodecContext* enc_ctx = output_stream(stream_index)->codec;
+
+	if(enc_ctx->codec_type != AVMEDIA_TYPE_VIDEO or m_v_stream_copy[stream_index] or not QualityMeter::supports(AVPixelFormat(frame->format)))
 	{
-		switch(context->streams[stream_index]->codec->codec_type)
-		{
-		case AVMEDIA_TYPE_VIDEO:
-		{
-			bytes_decoded = avcodec_encode_video2(context->streams[stream_index]->codec, &packet, dec_frame, &b_frame);
-			break;
-		}
-		case AVMEDIA_TYPE_AUDIO:
-		{
-			bytes_decoded = avcodec_encode_audio2(context->streams[stream_index]->codec, &packet, dec_frame, &b_frame);
-			break;
-		}
-		default:
-			throw Error("[VideoTrancoder] VideoTranscoder only encode video and audio formats.");
-		}
+		state.m_unavailable = true;
+		return;
 	}
-	catch(Error& e)
+
+	AVFrame* reference = m_frame_pool.acquire_frame();
+	if(av_frame_ref(reference, frame) < 0)
 	{
-		b_frame = false;
-		bytes_decoded = 0;
+		m_frame_pool.release_frame(reference);
+		return;
 	}
 
-	return bytes_decoded;
+	state.m_references.push_back(reference);
 }
 
-int VideoTranscoder::filter_encode_write_frame(AVFrame *frame, unsigned int stream_index)
+void VideoTranscoder::measure_packet(const AVPacket* packet, int stream_index)
 {
-	int ret, b_frame;
-	AVFrame *filt_frame;
+	if(stream_index >= int(m_v_quality.size()))
+		return;
 
-	ret = av_buffersrc_add_frame_flags(m_filter_ctx[stream_index].m_buffersrc_ctx, frame, 0);
-	if(ret < 0)
-		return ret;
+	st_quality_state& state = m_v_quality[stream_index];
+	if(state.m_references.empty() and not state.m_decoder)
+		return;
 
-	while(true)
+	if(not state.m_decoder and not open_quality_decoder(stream_index))
 	{
-		filt_frame = av_frame_alloc();
-		if(!filt_frame)
+		while(not state.m_references.empty())
 		{
-			ret = AVERROR(ENOMEM);
+			m_frame_pool.release_frame(state.m_references.front());
+			state.m_references.pop_front();
+		}
+		return;
+	}
+
+	TraceSpan span(m_trace.get(), "measure", stream_index, packet ? packet->pts : AV_NOPTS_VALUE);
+
+	AVPacket flush_packet;
+	av_init_packet(&flush_packet);
+	flush_packet.data = NULL;
+	flush_packet.size = 0;
+
+	AVFrame* decoded = m_frame_pool.acquire_frame();
+	int got_frame;
+
+	// A packet holds one picture; draining returns the held back ones one call at a time.
+	do
+	{
+		got_frame = 0;
+		if(avcodec_decode_video2(state.m_decoder, decoded, &got_frame, packet ? packet : &flush_packet) < 0 or not got_frame)
 			break;
+
+		int64_t pts = av_frame_get_best_effort_timestamp(decoded);
+
+		// References older than the decoded picture were dropped by the encoder.
+		while(not state.m_references.empty() and pts != AV_NOPTS_VALUE and
+			  state.m_references.front()->pts != AV_NOPTS_VALUE and state.m_references.front()->pts < pts)
+		{
+			m_frame_pool.release_frame(state.m_references.front());
+			state.m_references.pop_front();
 		}
 
-		ret = av_buffersink_get_frame(m_filter_ctx[stream_index].m_buffersink_ctx, filt_frame);
-		if(ret < 0)
+		// A reference newer than the picture, e.g. one queued after the encoder was reopened, waits
+		// for its own picture. Pictures without a matching reference aren't scored.
+		if(not state.m_references.empty() and pts != AV_NOPTS_VALUE and state.m_references.front()->pts == pts)
 		{
-			if(ret == AVERROR(EAGAIN) or ret == AVERROR_EOF) ret = 0;
+			AVFrame* reference = state.m_references.front();
+			state.m_references.pop_front();
 
-			av_frame_free(&filt_frame);
-			break;
+			m_quality->push(reference, decoded, stream_index, reference->pts);
+			m_frame_pool.release_frame(reference);
 		}
 
-		filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
-		ret = encode_write_frame(filt_frame, stream_index, b_frame);
-		if(ret < 0) break;
+		av_frame_unref(decoded);
 	}
+	while(not packet);
 
-	return ret;
+	m_frame_pool.release_frame(decoded);
+
+	// Segment encoders are reopened for every segment, their decoder goes with them.
+	if(not packet)
+	{
+		avcodec_close(state.m_decoder);
+		av_freep(&state.m_decoder->extradata);
+		av_freep(&state.m_decoder);
+
+		while(not state.m_references.empty())
+		{
+			m_frame_pool.release_frame(state.m_references.front());
+			state.m_references.pop_front();
+		}
+	}
 }
 
-int VideoTranscoder::encode_write_frame(AVFrame *filt_frame, int stream_index, int& b_frame)
+bool VideoTranscoder::open_quality_decoder(int stream_index)
 {
-	int ret;
-	AVPacket enc_pkt;
+	st_quality_state& state = m_v_quality[stream_index];
+	AVCodecContext* enc_ctx = output_stream(stream_index)->codec;
+	AVCodec* decoder        = avcodec_find_decoder(enc_ctx->codec_id);
 
-	enc_pkt.data = NULL;
-	enc_pkt.size = 0;
+	state.m_unavailable = true;
+	if(not decoder or not (state.m_decoder = avcodec_alloc_context3(decoder)))
+		return false;
 
-	av_init_packet(&enc_pkt);
-	ret = encode_media(m_ofmt_ctx, enc_pkt, filt_frame, stream_index, b_frame);
-	av_frame_free(&filt_frame);
+	state.m_decoder->width     = enc_ctx->width;
+	state.m_decoder->height    = enc_ctx->height;
+	state.m_decoder->pix_fmt   = enc_ctx->pix_fmt;
+	state.m_decoder->time_base = enc_ctx->time_base;
 
-	if (ret < 0) return ret;
-	if (!(b_frame)) return 0;
+	// Global headers stay with the encoder, the packets don't repeat them.
+	if(enc_ctx->extradata_size > 0)
+	{
+		state.m_decoder->extradata = (uint8_t*)av_mallocz(enc_ctx->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+		if(state.m_decoder->extradata)
+		{
+			memcpy(state.m_decoder->extradata, enc_ctx->extradata, enc_ctx->extradata_size);
+			state.m_decoder->extradata_size = enc_ctx->extradata_size;
+		}
+	}
 
-	enc_pkt.stream_index = stream_index;
-	av_packet_rescale_ts(&enc_pkt, m_ofmt_ctx->streams[stream_index]->codec->time_base,
-						 m_ofmt_ctx->streams[stream_index]->time_base);
+	if(avcodec_open2(state.m_decoder, decoder, NULL) < 0)
+	{
+		av_freep(&state.m_decoder->extradata);
+		av_freep(&state.m_decoder);
+		return false;
+	}
+
+	state.m_unavailable = false;
+	return true;
+}
 
-	if(m_ofmt_ctx->streams[stream_index]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
-		aac_packet_filter(stream_index, enc_pkt);
+void VideoTranscoder::clear_quality()
+{
+	for(size_t i=0; i<m_v_quality.size(); i++)
+	{
+		st_quality_state& state = m_v_quality[i];
+		if(state.m_decoder)
+		{
+			avcodec_close(state.m_decoder);
+			av_freep(&state.m_decoder->extradata);
+			av_freep(&state.m_decoder);
+		}
 
-	ret = av_interleaved_write_frame(m_ofmt_ctx, &enc_pkt);
-	av_free_packet(&enc_pkt);
+		for(size_t k=0; k<state.m_references.size(); k++)
+			m_frame_pool.release_frame(state.m_references[k]);
+	}
 
-	return ret;
+	m_v_quality.clear();
 }
 
-void VideoTranscoder::aac_packet_filter(int stream_index, AVPacket& packet)
+void VideoTranscoder::report_latency(int stream_index, int64_t pts, double latency, bool dropped)
 {
-	if(m_ifmt_ctx->streams[stream_index]->codec->codec_id != AV_CODEC_ID_AAC) return;
+	{
+		lock_guard<mutex> lock(m_live_mutex);
 
-	AVBitStreamFilterContext* bsfc = av_bitstream_filter_init("aac_adtstoasc");
+		if(dropped)
+		{
+			m_live_statistics.m_numof_dropped++;
+		}
+		else
+		{
+			m_live_statistics.m_numof_frames++;
+			m_live_latency_sum += latency;
+			m_live_statistics.m_mean_latency = m_live_latency_sum / m_live_statistics.m_numof_frames;
+			m_live_statistics.m_max_latency  = max(m_live_statistics.m_max_latency, latency);
+		}
+	}
 
-    int err_val = av_bitstream_filter_filter(bsfc, m_ofmt_ctx->streams[stream_index]->codec,
-    										 NULL, &packet.data, &packet.size,
-											 packet.data, packet.size,
-											 0);
+	if(m_on_frame_latency)
+	{
+		st_frame_latency report = {stream_index, pts, latency, dropped};
+		m_on_frame_latency(report);
+	}
+}
 
-    if(err_val < 0)
-    	throw Error("[VideoTranscoder] Error occurred during filtering audio packet with aac.");
+void VideoTranscoder::finish_streaming_segment(double end_time)
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
 
-    av_bitstream_filter_close(bsfc);
+	st_segment_report report;
+	report.m_index         = m_streaming_segment;
+	report.m_start_time    = m_streaming_segment_start - m_streaming_origin;
+	report.m_duration      = end_time - m_streaming_segment_start;
+	report.m_ready_time    = chrono::duration<double>(now - m_streaming_epoch).count();
+	report.m_ready_latency = chrono::duration<double>(now - m_streaming_segment_opened).count();
+
+	m_v_segment_reports.push_back(report);
+	if(m_on_segment_ready) m_on_segment_ready(report);
+
+	m_streaming_segment++;
+	m_streaming_segment_start  = end_time;
+	m_streaming_segment_opened = now;
 }
 
 int VideoTranscoder::flush_encoder(unsigned int stream_index)
 {
-	int err_val, b_frame;
-
-	if(!(m_ofmt_ctx->streams[stream_index]->codec->codec->capabilities & CODEC_CAP_DELAY))
-		return 0;
+	int err_val = 0, b_frame;
 
-	while(true)
+	while(output_stream(stream_index)->codec->codec->capabilities & CODEC_CAP_DELAY)
 	{
 		err_val = encode_write_frame(NULL, stream_index, b_frame);
-		if(err_val < 0) break;
-		if(!b_frame) return 0;
+		if(err_val < 0 or !b_frame) break;
 	}
 
+	// The check decoder holds frames back as well.
+	if(m_quality and err_val >= 0)
+		measure_packet(NULL, stream_index);
+
 	return err_val;
 }
 
-int VideoTranscoder::decode_frame_in_buffer(int stream_index)
+int VideoTranscoder::decode_frame_in_buffer(int stream_index, AVFrame*& dec_frame)
 {
-	m_packet->data = NULL;
-	m_packet->size = 0;
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.data         = NULL;
+	packet.size         = 0;
+	packet.stream_index = stream_index;
 	int b_frame = 0;
 
-	avcodec_free_frame(&m_dec_frame);
-	m_dec_frame = av_frame_alloc();
-	decode_media(m_ifmt_ctx, *m_packet, m_dec_frame, b_frame);
+	m_frame_pool.release_frame(dec_frame);
+	dec_frame = m_frame_pool.acquire_frame();
+	decode_media(m_ifmt_ctx, packet, dec_frame, b_frame);
 
-	if(b_frame and m_dec_frame->pkt_size >= 0) return 1;
+	if(b_frame and dec_frame->pkt_size >= 0) return 1;
 
 	return -1;
 }
 
+AVFrame* VideoTranscoder::decode_keyframe(int stream_index)
+{
+	avcodec_flush_buffers(decoder(stream_index));
+
+	while(read_packet(*m_packet) >= 0)
+	{
+		bool key = (m_packet->stream_index == stream_index and (m_packet->flags & AV_PKT_FLAG_KEY));
+		bool got = (m_packet->stream_index == stream_index and decode_packet(*m_packet, m_dec_frame));
+
+		av_free_packet(m_packet.get());
+		if(got) return m_dec_frame;
+
+		// Frame threads hold the keyframe back, draining them beats decoding the next keyframes.
+		if(key) break;
+	}
+
+	return (decode_frame_in_buffer(stream_index, m_dec_frame) == 1) ? m_dec_frame : NULL;
+}
+
+void VideoTranscoder::thumbnail_size(int stream_index, const st_thumbnail_settings& settings, int& width, int& height) const
+{
+	AVCodecContext* dec_ctx = decoder(stream_index);
+
+	// Sheets have square pixels, anamorphic video is scaled to its display aspect ratio.
+	double sar          = (dec_ctx->sample_aspect_ratio.num > 0) ? av_q2d(dec_ctx->sample_aspect_ratio) : 1.0;
+	double aspect_ratio = dec_ctx->width * sar / max(dec_ctx->height, 1);
+
+	width  = settings.m_width;
+	height = settings.m_height;
+
+	if(width <= 0 and height <= 0) width = 160;
+	if(width <= 0)  width  = int(lrint(height * aspect_ratio));
+	if(height <= 0) height = int(lrint(width / aspect_ratio));
+
+	// Chroma is subsampled on JPEG sheets, tiles have to start and end on even pixels.
+	width  = max(2, width & ~1);
+	height = max(2, height & ~1);
+}
+
 int VideoTranscoder::time_to_frame(int stream_index, double time)
 {
 	if(time < 0.0) return 0 ;
@@ -643,12 +4467,21 @@ int VideoTranscoder::time_to_frame(int stream_index, double time)
 		if(v_timestamp[m] <= global_time) a = m ;
 	}
 
-	if(global_time - v_timestamp[a] < v_timestamp[b] - global_time and b < int(v_timestamp.size()) )
+	if(b >= int(v_timestamp.size()) or global_time - v_timestamp[a] < v_timestamp[b] - global_time)
 		return a ;
 	else
 		return b ;
 }
 
+int VideoTranscoder::frame_at_or_before(int stream_index, double time) const
+{
+	const vector<int64_t>& v_timestamp = m_v_timestamps[stream_index];
+	int64_t global_time = seconds_to_global_time(max(0.0, time));
+
+	int frame = int(upper_bound(v_timestamp.begin(), v_timestamp.end(), global_time) - v_timestamp.begin()) - 1;
+	return max(0, frame);
+}
+
 double VideoTranscoder::global_time_to_seconds(int64_t global_time) const
 {
 	return double(global_time) / double(AV_TIME_BASE);
@@ -664,13 +4497,60 @@ int64_t VideoTranscoder::seconds_to_global_time(double seconds) const
 	return seconds*double(AV_TIME_BASE);
 }
 
-void VideoTranscoder::free_transcode_buffer()
+VideoTranscoder::st_core_reservation::st_core_reservation(VideoTranscoder& transcoder)
+: m_transcoder(transcoder)
 {
-	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
+	m_transcoder.m_thread_cores   = m_transcoder.m_threading_policy.reserve_cores();
+	m_transcoder.m_reserved_cores = m_transcoder.m_thread_cores;
+	m_transcoder.m_frame_processors.set_core_limit(m_transcoder.m_thread_cores);
+}
+
+VideoTranscoder::st_core_reservation::~st_core_reservation()
+{
+	m_transcoder.release_thread_cores();
+}
+
+int VideoTranscoder::thread_cores(int parts) const
+{
+	return max(1, m_thread_cores / max(1, parts));
+}
+
+int VideoTranscoder::stream_cores() const
+{
+	if(not m_split_stream_cores)
+		return thread_cores();
+
+	// Every selected audio and video stream may get a worker. Copied ones don't, but they are only
+	// known once the outputs are opened, after the decoders.
+	int numof_streams = 0;
+	for(unsigned int i=0; i<m_ifmt_ctx->nb_streams; i++)
 	{
-		if(m_ifmt_ctx)
-			avcodec_close(m_ifmt_ctx->streams[i]->codec);
+		AVMediaType type = m_ifmt_ctx->streams[i]->codec->codec_type;
+		if(is_selected(int(i)) and (type == AVMEDIA_TYPE_VIDEO or type == AVMEDIA_TYPE_AUDIO))
+			numof_streams++;
+	}
+
+	return thread_cores(numof_streams);
+}
+
+void VideoTranscoder::release_thread_cores()
+{
+	if(m_reserved_cores > 0)
+		m_threading_policy.release_cores(m_reserved_cores);
 
+	m_thread_cores   = 0;
+	m_reserved_cores = 0;
+}
+
+void VideoTranscoder::free_transcode_buffer()
+{
+	// Segment workers which failed to open their input get here without any context.
+	int numof_streams = m_ifmt_ctx ? int(m_ifmt_ctx->nb_streams) : 0;
+
+	close_decoders();
+
+	for(int i=0; i<numof_streams; i++)
+	{
 		if(m_ofmt_ctx)
 		{
 			if( (int(m_ofmt_ctx->nb_streams) > i) and
@@ -686,19 +4566,36 @@ void VideoTranscoder::free_transcode_buffer()
 		}
 	}
 
-	if(m_filter_ctx) av_free(m_filter_ctx);
+	for(size_t i=0; i<m_v_copy_filters.size(); i++)
+		if(m_v_copy_filters[i]) av_bitstream_filter_close(m_v_copy_filters[i]);
+	m_v_copy_filters.clear();
+
+	if(m_smart_encoder)
+	{
+		avcodec_close(m_smart_encoder);
+		av_freep(&m_smart_encoder);
+	}
+
+	free_ladder();
+
+	if(m_filter_ctx)  av_freep(&m_filter_ctx);
+	if(m_fused_graph) avfilter_graph_free(&m_fused_graph);
 	if(m_ifmt_ctx)   avformat_close_input(&m_ifmt_ctx);
-	if(m_ofmt_ctx and !(m_ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+	if(m_ofmt_ctx)
 	{
-		avio_closep(&m_ofmt_ctx->pb);
+		close_output_io();
+
 		avformat_free_context(m_ofmt_ctx);
+		m_ofmt_ctx = NULL;
 	}
+
+	// Custom I/O contexts are left alone by libavformat and go after the contexts using them.
+	m_mapped_input.close();
+	m_write_behind_output.close();
 }
 
 void VideoTranscoder::free_open_buffer()
 {
-	for(int i=0; i<int(m_ifmt_ctx->nb_streams); i++)
-		avcodec_close(m_ifmt_ctx->streams[i]->codec);
-
+	close_decoders();
 	avformat_close_input(&m_ifmt_ctx);
 }
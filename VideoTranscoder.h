@@ -27,7 +27,27 @@ extern "C"
 #include <string>
 #include <vector>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+
+#include "BoundedQueue.h"
+#include "FrameKernels.h"
+#include "FramePool.h"
+#include "IndexCache.h"
+#include "MediaIO.h"
+#include "MemoryBudget.h"
+#include "QualityMeter.h"
+#include "SpriteSheet.h"
+#include "ThreadingPolicy.h"
+#include "TraceRecorder.h"
+#include "TranscodeMetrics.h"
 
 /*!
  * This class mainly comprises an algorithm which transcodes an input media to an output media by
@@ -71,47 +91,614 @@ public:
 	{
 		AVFilterContext *m_buffersink_ctx;
 		AVFilterContext *m_buffersrc_ctx;
-		AVFilterGraph *m_filter_graph;
+		AVFilterGraph *m_filter_graph;     // NULL when the stream is part of the fused graph.
+		bool m_passthrough;                // Formats match the encoder, frames skip filtering.
+	};
+
+	/*!
+	 * EXECUTION_SERIAL runs demuxing, decoding, filtering/encoding and muxing one after another on
+	 * the calling thread. EXECUTION_PIPELINED runs each of these stages on its own thread, connected
+	 * by bounded queues. Every stage still handles its items in input order, so both modes make the
+	 * same codec and muxer calls in the same order and produce identical output.
+	 * EXECUTION_SEGMENTED splits the video stream at keyframes into GOP aligned segments which are
+	 * transcoded by several workers, each with its own demuxer, decoder and encoder, and stitched
+	 * back in order. Audio is transcoded by the calling thread meanwhile. Segments are assumed to be
+	 * closed GOPs; inputs without a keyframe index fall back to serial transcoding.
+	 * EXECUTION_STREAM_WORKERS gives every transcoded stream its own worker thread which decodes,
+	 * filters and encodes it. The calling thread demuxes and dispatches packets to the workers and
+	 * only the muxer is shared, so cheap audio packets never wait behind video encodes.
+	 */
+	enum e_execution_mode
+	{
+		EXECUTION_SERIAL,
+		EXECUTION_PIPELINED,
+		EXECUTION_SEGMENTED,
+		EXECUTION_STREAM_WORKERS
+	};
+
+	/*!
+	 * An edit on the input timeline, in seconds from the start of the media. EDIT_MODIFY marks frames
+	 * which the per-frame hook changes, EDIT_CUT removes the range from the output.
+	 */
+	struct st_edit
+	{
+		enum e_type
+		{
+			EDIT_MODIFY,
+			EDIT_CUT
+		};
+
+		e_type m_type;
+		double m_start_time;
+		double m_end_time;
+	};
+
+	/*!
+	 * One rendition of an adaptive bitrate ladder. A zero width or height follows the input's aspect
+	 * ratio (both zero keep the input size) and a zero bit rate keeps the input's bit rate.
+	 */
+	struct st_output_profile
+	{
+		string m_path;
+		int m_width;
+		int m_height;
+		int64_t m_bit_rate;
+	};
+
+	/*!
+	 * I/O layer of the input and output files. Zero sizes and counts pick the defaults of
+	 * MappedInput and WriteBehindOutput. Outputs of a bitrate ladder always use libavformat's own
+	 * file protocol.
+	 */
+	struct st_media_io
+	{
+		bool m_mapped_input;
+		size_t m_readahead;
+
+		bool m_write_behind_output;
+		size_t m_buffer_size;
+		size_t m_numof_buffers;
+		WriteBehindOutput::e_fsync_policy m_fsync_policy;
+		uint64_t m_fsync_interval;
+	};
+
+	/*!
+	 * Streaming output writes the output as a series of self-contained pieces while the transcode
+	 * runs: fragments of a fragmented MP4 file, or rolling HLS/DASH segments next to the playlist
+	 * or manifest named by the output path. Fragmented MP4 can also go to stdout with "-" or to any
+	 * "pipe:" URL. Video keyframes are forced every m_segment_seconds and a piece is flushed as soon
+	 * as the keyframe which starts the next one reaches the muxer. m_list_size bounds the number of
+	 * HLS/DASH segments kept, zero keeps all of them.
+	 */
+	struct st_streaming_output
+	{
+		enum e_format
+		{
+			STREAMING_OFF,
+			STREAMING_FRAGMENTED_MP4,
+			STREAMING_HLS,
+			STREAMING_DASH
+		};
+
+		e_format m_format;
+		double m_segment_seconds;
+		int m_list_size;
+	};
+
+	/*!
+	 * A fragment or segment which became readable. Times are in seconds: m_start_time and
+	 * m_duration on the output timeline, m_ready_time since transcode() started, and
+	 * m_ready_latency from the piece's first packet reaching the muxer until it was readable.
+	 */
+	struct st_segment_report
+	{
+		int m_index;
+		double m_start_time;
+		double m_duration;
+		double m_ready_time;
+		double m_ready_latency;
+	};
+
+	typedef function<void(const st_segment_report&)> segment_callback;
+
+	/*!
+	 * Live input reads a stream which can't be seeked or indexed, such as stdin ("-"), a FIFO or a
+	 * "pipe:" URL. Only m_probe_size bytes and m_analyze_seconds of it are probed; zero picks a
+	 * small default and an empty m_format lets libavformat guess the demuxer. Decoders and encoders
+	 * run without frame threading, B-frames or lookahead. A decoded video frame which is already
+	 * m_latency_budget seconds old is dropped instead of encoded, zero or less never drops.
+	 */
+	struct st_live_input
+	{
+		bool m_enabled;
+		string m_format;
+		int64_t m_probe_size;
+		double m_analyze_seconds;
+		double m_latency_budget;
+	};
+
+	/*!
+	 * Time a frame spent in the transcoder, from its packet being read to its encoded packet being
+	 * handed to the muxer, or to being dropped. Upstream capture and network delays aren't included.
+	 */
+	struct st_frame_latency
+	{
+		int m_stream_index;
+		int64_t m_pts;         // In the output codec's time base.
+		double m_latency;
+		bool m_dropped;
+	};
+
+	struct st_live_statistics
+	{
+		size_t m_numof_frames;
+		size_t m_numof_dropped;
+		double m_mean_latency;
+		double m_max_latency;
+	};
+
+	typedef function<void(const st_frame_latency&)> latency_callback;
+
+	/*!
+	 * Compares every decoded video frame with the last kept frame of its stream. It is a repeat when
+	 * no 8x8 block's mean luma moved by more than m_threshold levels and the kept frame is less than
+	 * m_max_interval seconds old (zero or less for no limit). With m_drop, repeats skip filtering
+	 * and encoding and the kept frame lasts until the next one, which gives the output a variable
+	 * frame rate; otherwise they are only counted. Screen recordings and slides gain the most.
+	 */
+	struct st_duplicate_detection
+	{
+		bool m_enabled;
+		bool m_drop;
+		int m_threshold;
+		double m_max_interval;
+	};
+
+	/*!
+	 * One thumbnail every m_interval seconds, scaled to m_width x m_height and packed into sheets of
+	 * m_columns x m_rows tiles; zero rows puts every thumbnail on one sheet. A zero width or height
+	 * follows the input's aspect ratio and both zero make 160 pixel wide tiles. m_codec is
+	 * AV_CODEC_ID_MJPEG or AV_CODEC_ID_PNG, m_quality the JPEG qscale.
+	 */
+	struct st_thumbnail_settings
+	{
+		double m_interval;
+		int m_width;
+		int m_height;
+		int m_columns;
+		int m_rows;
+		AVCodecID m_codec;
+		int m_quality;
 	};
 
 	VideoTranscoder();
 	virtual ~VideoTranscoder();
 
-	void transcode(string pth_input_media, string pth_output_media);
+	void set_execution_mode(e_execution_mode mode, size_t queue_depth = 8);
+	void set_segmented_parallelism(int workers, double segment_seconds = 10.0);
+
+	/*!
+	 * When enabled, audio and video streams whose codec the output container accepts are copied
+	 * packet by packet instead of being decoded and encoded again. Only timestamps are rescaled and
+	 * the bitstream filters needed between container flavours (mp4toannexb, adtstoasc) are applied.
+	 */
+	void set_stream_copy(bool enabled);
+
+	/*!
+	 * Smart rendering re-encodes only the GOPs of the video stream which contain a modified frame or
+	 * a cut point and copies every other GOP bit-exactly. Other streams are copied (or transcoded when
+	 * the container can't carry them) with the cut ranges removed. The output container must accept
+	 * the input video codec and GOPs are assumed to be closed. An empty list disables it.
+	 */
+	void set_smart_render(const vector<st_edit>& v_edits);
+
+	/*!
+	 * Threading of every decoder and encoder this transcoder opens. Cores are reserved when a
+	 * transcode starts and released when it ends; segment workers and ladder renditions split
+	 * the reserved cores among themselves.
+	 */
+	void set_threading_policy(const ThreadingPolicy& policy);
+
+	/*!
+	 * Draft mode is for editing proxies and previews. Video is decoded at 1/2^lowres of its size
+	 * without the loop filter, with the IDCT skipped on non-reference frames, and encoded at that
+	 * size with a fast preset and a bit rate scaled down by the pixel count. Decoders which can't
+	 * decode at a lower resolution (H.264 among them) are followed by a fast scaler instead. Copied
+	 * streams keep their size, so stream copy leaves draft video alone and smart rendering can't run
+	 * in draft mode.
+	 */
+	void set_draft_mode(bool enabled, int lowres = 1);
+
+	/*!
+	 * Keeps the stream parameters and indexes of every input in a sidecar file, so the next open of
+	 * an unchanged input skips avformat_find_stream_info(). An empty directory puts the sidecar
+	 * next to the input.
+	 */
+	void set_index_cache(bool enabled, string directory = "");
+
+	void set_media_io(const st_media_io& media_io);
+
+	/*!
+	 * Picks an input stream for the output. m_index counts the streams of m_type, or all streams
+	 * when m_type is AVMEDIA_TYPE_UNKNOWN; {AVMEDIA_TYPE_AUDIO, 1} is the second audio stream.
+	 */
+	struct st_stream_map
+	{
+		AVMediaType m_type;
+		int m_index;
+	};
+
+	/*!
+	 * Output streams in order, each from the input stream its entry picks. Streams left out are
+	 * discarded by the demuxer and never decoded. Video and audio are transcoded, other streams
+	 * such as subtitles or data are copied if the output container can carry them. Without a map,
+	 * every video and audio stream is transcoded in input order and the other streams are dropped.
+	 */
+	void set_stream_map(const vector<st_stream_map>& v_map);
+
+	/*!
+	 * Filter chain of one input stream, in libavfilter syntax, e.g. "hqdn3d,eq=gamma=1.2". Its output
+	 * is converted to the encoder's pixel or sample format but must keep the frame size. Streams
+	 * without a chain whose format already matches their encoder skip filtering, and the chains of
+	 * all other streams are parsed and configured as one graph, except in EXECUTION_STREAM_WORKERS
+	 * mode. An empty spec removes the stream's chain.
+	 */
+	void set_filter(int stream_index, string filter_spec);
+
+	/*!
+	 * Applies to transcode() into a single output. on_segment_ready is called on the muxing thread
+	 * as soon as each piece is readable, segment_reports() has all of them once the job is done.
+	 */
+	void set_streaming_output(const st_streaming_output& streaming, segment_callback on_segment_ready = segment_callback());
+	const vector<st_segment_report>& segment_reports() const;
+
+	/*!
+	 * Applies to transcode() into a single output, which then always runs serially or pipelined.
+	 * on_frame is called from the encoding thread for every encoded or dropped frame.
+	 */
+	void set_live_input(const st_live_input& live, latency_callback on_frame = latency_callback());
+	st_live_statistics live_statistics() const;
+
+	/*!
+	 * Frame processors run in registration order on every decoded video frame before it is filtered
+	 * and encoded, including the frames smart rendering re-encodes. Frames dropped by a clip, as late
+	 * or as repeats are never processed. Row bands of a frame are spread over a pool of numof_threads
+	 * threads; zero uses the cores the job takes from its threading policy.
+	 */
+	void add_frame_processor(shared_ptr<FrameProcessor> processor);
+	void clear_frame_processors();
+	void set_frame_processor_threads(int numof_threads);
+
+	//! Compares decoded frames, before the frame processors run on the ones which are kept.
+	void set_duplicate_detection(const st_duplicate_detection& detection);
+
+	/*!
+	 * Scores every encoded video frame against the filtered frame the encoder was given. The
+	 * encoder's packets are decoded again as they are written, so there's no second pass over the
+	 * output. on_frame gets each frame's scores on the meter's thread; quality_summary() has the
+	 * totals per input stream once the job ends. Output ladders and smart rendering aren't measured.
+	 */
+	void set_quality_measurement(bool enabled, QualityMeter::frame_callback on_frame = QualityMeter::frame_callback());
+	vector<QualityMeter::st_summary> quality_summary() const;
+
+	/*!
+	 * Live counters and stage timings of the running or last job, per input stream. Segment workers
+	 * record into the same instance. With a path set, every job rewrites it each interval_seconds and
+	 * once more when it ends; an empty path turns the export off.
+	 */
+	TranscodeMetrics& metrics();
+	void set_metrics_export(string path, TranscodeMetrics::e_export_format format = TranscodeMetrics::EXPORT_PROMETHEUS,
+							double interval_seconds = 10.0);
+
+	/*!
+	 * Records a timeline of every demux, decode, frame processing, filter, encode and mux call of the
+	 * following jobs, keeping the newest events_per_thread spans of each thread. write_trace() saves
+	 * the last job's timeline as Chrome trace JSON.
+	 */
+	void set_tracing(bool enabled, size_t events_per_thread = 65536);
+	bool write_trace(string path) const;
+
+	/*!
+	 * start_time and end_time select a clip, in seconds from the start of the media; a negative
+	 * end_time runs to the end. Demuxing starts at the keyframe preceding start_time and stops after
+	 * end_time, so only the clip and its leading GOP are decoded. Frames before start_time are
+	 * dropped and the clip's timestamps start at zero. A copied video stream can only start on a
+	 * keyframe, so then the clip starts at that keyframe. Segmented mode runs clips serially and
+	 * smart rendering expresses clips as cuts instead.
+	 */
+	void transcode(string pth_input_media, string pth_output_media, double start_time = 0.0, double end_time = -1.0);
+
+	/*!
+	 * Transcodes the input into one output per profile while decoding it only once. Decoded video
+	 * frames go through a single split/scale filter graph whose outputs feed one encoder thread per
+	 * rendition, so renditions of the input size share the decoded buffers. Audio streams are decoded
+	 * and encoded once as well and the encoded packets are written to every output. Audio encoders
+	 * follow the global header needs of the first profile's container.
+	 */
+	void transcode(string pth_input_media, const vector<st_output_profile>& v_profiles);
+
+	/*!
+	 * Releases everything the last job opened and clears its per-media state so the same instance
+	 * can run another job. Settings made through the set_* calls are kept. transcode() resets on its
+	 * own, calling it right after a job only closes the files earlier.
+	 */
+	void reset();
+
+	/*!
+	 * Writes the thumbnail sprite sheets of the first selected video stream and their WebVTT index.
+	 * Each thumbnail shows the keyframe at or before its time, found in the stream index, which is
+	 * seeked to and decoded alone; non-key frames are never read or decoded, so long media take
+	 * about one seek and one intra decode per thumbnail. Times which share a keyframe share a tile.
+	 * Sheets after the first need a numbered sprite path, see SpriteSheet.
+	 */
+	void extract_thumbnails(string pth_input_media, string pth_sprite, string pth_vtt, const st_thumbnail_settings& settings);
+
+	//! Longest stream duration of the media in seconds, from its header and index only.
+	double probe_duration(string pth_input_media);
+
+	FramePool::st_statistics frame_pool_statistics() const;
+
+	/*!
+	 * Caps the bytes held in the pipelined mode's decoded frame queue, inside filter graphs and in
+	 * the muxer's interleaving queue; zero only measures them. Over the budget, the decoder stage
+	 * waits for the encoder stage, and a muxer holding more than its share of the budget writes out
+	 * what it holds back for interleaving, which trades some interleaving for bounded memory when
+	 * streams drift apart. Filter bytes are estimated from the frames which went in and haven't come
+	 * out yet. Only the pipelined mode has a queue to hold back; the other modes decode a frame only
+	 * once the previous one is encoded, so for them the budget just bounds the muxer.
+	 */
+	void set_memory_budget(size_t bytes);
+	MemoryBudget::st_usage memory_usage() const;
 
 private:
 
+	// Micro-benchmarks drive the demux, decode and filter steps directly.
+	friend class TranscodeBenchmark;
+
+	struct st_pipeline_item
+	{
+		enum e_type
+		{
+			ITEM_PACKET,
+			ITEM_FRAME,
+			ITEM_FLUSH,
+			ITEM_END
+		};
+
+		e_type m_type;
+		int m_stream_index;
+		AVPacket* m_packet;
+		AVFrame* m_frame;
+		bool m_drained;        // A frame the decoder held back until the input ended.
+	};
+
+	typedef BoundedQueue<st_pipeline_item> pipeline_queue;
+
+	struct st_duplicate_state
+	{
+		LumaSignature m_reference;   // Of the last kept frame.
+		LumaSignature m_current;
+		int64_t m_kept_pts;
+		AVFrame* m_held;             // Last dropped repeat, encoded when the stream ends with it.
+	};
+
+	struct st_quality_state
+	{
+		AVCodecContext* m_decoder;      // Decodes the encoder's packets again.
+		bool m_unavailable;             // No decoder for the codec, or a format the meter can't score.
+		deque<AVFrame*> m_references;   // Frames given to the encoder, not matched with a decoded one yet.
+	};
+
+	struct st_rendition
+	{
+		st_output_profile m_profile;
+		AVFormatContext* m_ofmt_ctx;         // Video is output stream 0, audio streams follow.
+		AVFilterContext* m_buffersink_ctx;
+		pipeline_queue* m_queue;
+	};
+
+	struct st_segment
+	{
+		int64_t m_start_ts;              // Keyframe timestamp in stream time base.
+		int64_t m_end_ts;                // Next segment's keyframe or AV_NOPTS_VALUE for the last one.
+		vector<AVPacket*> m_v_packets;   // Encoded packets in output stream time base.
+		bool m_done;
+	};
+
+	//! Holds the cores of one job, and gives them back when the job throws.
+	struct st_core_reservation
+	{
+		explicit st_core_reservation(VideoTranscoder& transcoder);
+		~st_core_reservation();
+
+		VideoTranscoder& m_transcoder;
+	};
+
+	struct st_dts_splice
+	{
+		int64_t m_last_dts;
+		int64_t m_delay;         // pts - dts of the stream's first keyframe, its reordering delay.
+		int64_t m_offset;        // Added to every dts of the current range.
+		bool m_range_start;      // The next packet is the keyframe which starts a new range.
+	};
+
+	struct st_segment_schedule
+	{
+		vector<st_segment> m_v_segments;
+		int m_stream_index;
+		size_t m_next;
+		size_t m_written;
+		size_t m_max_in_flight;
+		bool m_failed;
+		string m_error;
+
+		mutex m_mutex;
+		condition_variable m_cond;
+	};
+
+	void transcode_serial();
+	void transcode_pipelined();
+	void transcode_segmented();
+	void transcode_stream_workers();
+	void transcode_smart();
+	void transcode_ladder();
+
+	void run_stage(void (VideoTranscoder::*stage)());
+	void demux_stage();
+	void decode_stage();
+	void encode_stage();
+	void mux_stage();
+	void fail_pipeline(const string& message);
+
+	void stream_worker(int stream_index);
+
+	static st_pipeline_item pipeline_item(st_pipeline_item::e_type type, int stream_index);
+	void release_pipeline_item(st_pipeline_item& item);
+	void drain_pipeline_queue(pipeline_queue* queue);
+
+	void build_segments(int stream_index, vector<st_segment>& v_segments) const;
+	void segment_worker(st_segment_schedule* schedule);
+	int open_segment_worker(string pth_media, AVFormatContext* parent_ofmt_ctx, int stream_index);
+	void transcode_segment(st_segment& segment, int stream_index);
+	bool pump_streams_until(int64_t global_time, int skip_stream_index);
+	void reset_dts_splices();
+	void begin_dts_range(int stream_index);
+	void enforce_monotonic_dts(AVPacket& packet);
+	int reopen_encoder(int stream_index);
+	int reopen_encoder(AVCodecContext* enc_ctx);
+
+	enum e_gop_state
+	{
+		GOP_CLEAN,
+		GOP_DIRTY,
+		GOP_DROPPED
+	};
+
+	int open_smart_encoder();
+	void classify_gops(vector<e_gop_state>& v_gop_states) const;
+	int64_t edit_time(double seconds) const;
+	bool in_cut(int64_t global_time) const;
+	int64_t cut_offset(int64_t global_time) const;
+	void shift_packet(AVPacket& packet, AVRational time_base) const;
+	void start_smart_run();
+	void finish_smart_run();
+	void smart_encode_frame(AVFrame* frame);
+	static int annexb_to_length_prefixed(AVPacket* packet, int length_size);
+	int reset_filter(int stream_index);
+	void begin_instrumentation();
+	void name_trace_thread(const string& name);
+
+	int open_ladder_outputs(const vector<st_output_profile>& v_profiles);
+	int open_ladder_audio(int stream_index, int output_index, bool global_header);
+	int init_ladder_filter();
+	void fan_out_video(AVFrame* frame);
+	void fan_out_audio(AVFrame* frame, int stream_index);
+	bool share_audio_packet(AVFrame* frame, int stream_index);
+	void push_rendition_item(st_rendition& rendition, st_pipeline_item& item);
+	void rendition_worker(st_rendition* rendition);
+	int encode_rendition_frame(st_rendition* rendition, AVFrame*& frame);
+	void free_ladder();
+
 	int open_input_file(string pth_media);
+	int open_input_format(string pth_media, bool& b_cached);
 	int open_output_file(string pth_media);
+	int close_output_io();
+	int open_output_streams(string pth_media);
+	int open_copy_stream(AVStream* out_stream, AVStream* in_stream);
+	bool can_stream_copy(int stream_index) const;
+	const char* copy_bitstream_filter(int stream_index) const;
 	void input_video_properties();
 
 	int init_filters();
+	int init_stream_filter(int stream_index);
+	int init_fused_filters(const vector<int>& v_streams);
+	string filter_spec(int stream_index) const;
+	bool identity_filter(int stream_index, const string& filter_spec) const;
+	bool is_transcoded(int stream_index) const;
+	int select_streams();
+	bool is_selected(int stream_index) const;
+	AVStream* output_stream(int stream_index) const;
+	AVCodecContext* decoder(int stream_index) const;
+	void close_decoders();
+	void hold_filtered(int stream_index, AVFrame* frame);
+	void release_filtered(int stream_index, bool all);
 	int init_filter(st_filtering_context* f_ctx, AVCodecContext *dec_ctx, AVCodecContext *enc_ctx, const char *filter_spec);
+	int init_filter(st_filtering_context* f_ctx, AVCodecContext *dec_ctx, const vector<AVCodecContext*>& v_enc_ctx,
+					const char *filter_spec, vector<AVFilterContext*>& v_buffersink_ctx);
+	int create_buffersrc(AVFilterGraph* filter_graph, AVCodecContext* dec_ctx, const char* name, AVFilterContext** buffersrc_ctx);
+	int create_buffersink(AVFilterGraph* filter_graph, AVCodecContext* enc_ctx, const char* name, AVFilterContext** buffersink_ctx);
 
+	int read_packet(AVPacket& packet);
 	bool find_next_packet(AVPacket& packet);
-	bool decode_packet(AVPacket& packet);
+	bool decode_packet(AVPacket& packet, AVFrame*& dec_frame);
 	int decode_media(AVFormatContext* context, AVPacket& packet, AVFrame* dec_frame, int& b_frame);
+	void prepare_frame(AVFrame* dec_frame, int stream_index);
+	void process_frame(AVFrame* frame, int stream_index);
 
-	bool encode_frame(int stream_index);
+	bool encode_frame(AVFrame* dec_frame, int stream_index);
 	int encode_media(AVFormatContext* context, AVPacket& packet, AVFrame* dec_frame, int stream_index, int& b_frame);
 	int filter_encode_write_frame(AVFrame *frame, unsigned int stream_index);
 	int encode_write_frame(AVFrame *filt_frame, int stream_index, int& b_frame);
 	void aac_packet_filter(int stream_index, AVPacket& packet);
+	int copy_packet(AVPacket& packet);
+	AVPacket* prepare_copy_packet(AVPacket& packet);
+	int write_packet(AVPacket* packet);
+	int mux_packet(AVPacket* packet);
+	int interleave_packet(AVPacket* packet);
+	void clear_interleaved();
+	bool push_frame_item(st_pipeline_item& item);
+
+	const char* streaming_format_name() const;
+	void streaming_options(AVDictionary** options) const;
+	void force_segment_keyframe(AVFrame* frame, int stream_index);
+	void finish_streaming_segment(double end_time);
+
+	void stamp_arrival(const AVPacket& packet);
+	bool arrival_time(int stream_index, int64_t pts, bool consume, chrono::steady_clock::time_point& arrival);
+	bool late_frame(AVFrame* frame, int stream_index);
+	bool duplicate_frame(AVFrame* frame, int stream_index);
+	void reset_duplicates(int stream_index);
+	void clear_duplicates();
+	void keep_quality_reference(AVFrame* frame, int stream_index);
+	void measure_packet(const AVPacket* packet, int stream_index);
+	bool open_quality_decoder(int stream_index);
+	void clear_quality();
+	void report_latency(int stream_index, int64_t pts, double latency, bool dropped);
 
 	int flush_encoder(unsigned int stream_index);
-	int decode_frame_in_buffer(int stream_index);
+	int decode_frame_in_buffer(int stream_index, AVFrame*& dec_frame);
 
 	int time_to_frame(int stream_index, double time);
+	int frame_at_or_before(int stream_index, double time) const;
+	AVFrame* decode_keyframe(int stream_index);
+	void thumbnail_size(int stream_index, const st_thumbnail_settings& settings, int& width, int& height) const;
 	double global_time_to_seconds(int64_t global_time) const;
 	int64_t stream_time_to_global_time(AVRational time_base, int64_t nStreamTime) const;
 	int64_t seconds_to_global_time(double seconds) const;
 
+	static void register_all();
+
+	int seek_trim_start(double start_time, double end_time);
+	bool trim_packet(AVPacket& packet);
+	bool trim_finished(int64_t global_time) const;
+	bool in_trim_range(AVFrame* frame, int stream_index) const;
+
+	int thread_cores(int parts = 1) const;
+	int stream_cores() const;
+	void release_thread_cores();
+
 	void free_transcode_buffer();
 	void free_open_buffer();
 
 	AVFormatContext* m_ifmt_ctx;
 	AVFormatContext* m_ofmt_ctx;
+	vector<AVCodecContext*> m_v_decoders;        // Per input stream, NULL unless it is decoded.
+	vector<AVRational> m_v_decode_time_bases;    // Decoded packets are rescaled to it, fixed when the decoder opens.
 	st_filtering_context* m_filter_ctx;
+	AVFilterGraph* m_fused_graph;
+	map<int, string> m_filter_specs;
+
+	FramePool m_frame_pool;
 
 	auto_ptr<AVPacket> m_packet;
 	AVFrame* m_dec_frame;
@@ -119,4 +706,113 @@ private:
 	vector<double> m_v_duration;
 	vector<int> m_v_numof_frames;
 	vector<vector<int64_t> > m_v_timestamps;
+	vector<vector<int> > m_v_keyframes;
+	vector<st_dts_splice> m_v_dts_splices;       // Of packets written from separately encoded or copied ranges.
+
+	bool m_stream_copy;
+	vector<bool> m_v_stream_copy;
+	vector<AVBitStreamFilterContext*> m_v_copy_filters;
+
+	vector<st_edit> m_v_edits;
+	int m_smart_stream_index;
+	int64_t m_edit_origin;
+	AVCodecContext* m_smart_encoder;
+	bool m_smart_run;
+
+	vector<st_rendition> m_v_renditions;
+	int m_ladder_stream_index;
+	vector<int> m_v_ladder_streams;                 // Output stream index in every rendition, -1 if dropped.
+	vector<AVCodecContext*> m_v_ladder_audio_enc;   // Shared audio encoders by input stream index.
+
+	int64_t m_trim_start;      // Global time, AV_NOPTS_VALUE when the whole media is transcoded.
+	int64_t m_trim_end;
+	int64_t m_trim_origin;     // Global time which becomes zero in the output.
+	int64_t m_trim_stop;       // Global time of the first keyframe after the clip, where reading stops.
+	vector<bool> m_v_trim_done;
+
+	bool m_index_cache;
+	string m_index_cache_directory;
+	bool m_header_index;       // The demuxer read a complete index with the header.
+	bool m_index_pending;      // The index is cached once the whole input has been read.
+
+	st_media_io m_media_io;
+	MappedInput m_mapped_input;
+	WriteBehindOutput m_write_behind_output;
+
+	st_streaming_output m_streaming;
+	segment_callback m_on_segment_ready;
+	vector<st_segment_report> m_v_segment_reports;
+	vector<int64_t> m_v_keyframe_segment;        // Last segment a keyframe was forced for, per stream.
+	vector<int64_t> m_v_keyframe_origin;         // Encoder pts of the first frame, where segment 0 starts.
+	int m_streaming_stream_index;                // Stream whose keyframes start new pieces.
+	int m_streaming_segment;                     // Index of the open piece, -1 before the first packet.
+	double m_streaming_origin;                   // Time of the first packet, cuts are counted from it.
+	double m_streaming_segment_start;
+	double m_streaming_end;
+	chrono::steady_clock::time_point m_streaming_epoch;
+	chrono::steady_clock::time_point m_streaming_segment_opened;
+
+	typedef map<int64_t, chrono::steady_clock::time_point> arrival_map;
+
+	st_live_input m_live;
+	latency_callback m_on_frame_latency;
+	vector<arrival_map> m_v_live_arrivals;       // Read time of pending packets by pts, per stream.
+	st_live_statistics m_live_statistics;
+	double m_live_latency_sum;
+	mutable mutex m_live_mutex;
+
+	ThreadingPolicy m_threading_policy;
+	int m_thread_cores;
+	int m_reserved_cores;                        // Taken from the budget by this transcoder, 0 for segment workers.
+	bool m_split_stream_cores;                   // Stream workers run side by side, each gets a share.
+
+	bool m_draft;
+	int m_draft_lowres;
+	vector<pair<int, int> > m_v_draft_sizes;     // Encoded width and height of each video stream.
+
+	FrameProcessorChain m_frame_processors;
+
+	st_duplicate_detection m_duplicates;
+	vector<st_duplicate_state> m_v_duplicates;
+
+	shared_ptr<QualityMeter> m_quality;          // NULL unless measuring.
+	QualityMeter::frame_callback m_on_frame_quality;
+	vector<st_quality_state> m_v_quality;
+
+	shared_ptr<TranscodeMetrics> m_metrics;
+	string m_metrics_path;
+	TranscodeMetrics::e_export_format m_metrics_format;
+	double m_metrics_interval;
+
+	shared_ptr<TraceRecorder> m_trace;           // NULL unless tracing.
+
+	vector<st_stream_map> m_v_stream_map;
+	vector<int> m_v_output_streams;              // Output index per input stream, -1 if not selected.
+	vector<int> m_v_input_streams;               // Input index per output stream.
+
+	shared_ptr<MemoryBudget> m_memory_budget;
+	vector<deque<size_t> > m_v_filter_held;      // Bytes of the frames inside each stream's filters.
+	vector<deque<pair<double, size_t> > > m_v_interleave_held;   // Time and size of packets the muxer holds.
+	size_t m_interleave_bytes;
+
+	string m_input_path;
+
+	e_execution_mode m_execution_mode;
+	size_t m_queue_depth;
+	int m_segment_workers;
+	double m_segment_seconds;
+	vector<AVPacket*>* m_segment_sink;
+	FramePool* m_segment_pool;                   // The parent's pool, which releases the sink's packets.
+
+	auto_ptr<pipeline_queue> m_packet_queue;
+	auto_ptr<pipeline_queue> m_frame_queue;
+	auto_ptr<pipeline_queue> m_mux_queue;
+	vector<pipeline_queue*> m_v_stream_queues;
+
+	mutex m_mux_mutex;
+	bool m_mux_shared;
+
+	mutex m_pipeline_mutex;
+	atomic<bool> m_pipeline_failed;
+	string m_pipeline_error;
 };